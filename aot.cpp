@@ -0,0 +1,751 @@
+#include "aot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(KAREL_AOT)
+#include <dlfcn.h>
+#endif
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstdlib>
+#include <type_traits>
+
+#include "logging.h"
+#include "util.h"
+
+namespace karel {
+
+namespace {
+
+// Bump whenever the generated code changes, so that stale shared objects in
+// the cache are not picked up.
+constexpr uint64_t kGeneratorVersion = 4;
+
+constexpr const char kEntryPointName[] = "karel_aot_run";
+
+// Runtime fields that the generated code keeps in locals for the duration of
+// the run and writes back when it ends.
+constexpr struct {
+  const char* name;
+  const char* type;
+  size_t offset;
+} kCachedFields[] = {
+    {"orientation", "size_t", offsetof(Runtime, orientation)},
+    {"x", "size_t", offsetof(Runtime, x)},
+    {"y", "size_t", offsetof(Runtime, y)},
+    {"bag", "size_t", offsetof(Runtime, bag)},
+    {"line", "size_t", offsetof(Runtime, line)},
+    {"column", "size_t", offsetof(Runtime, column)},
+    {"forward_count", "size_t", offsetof(Runtime, forward_count)},
+    {"left_count", "size_t", offsetof(Runtime, left_count)},
+    {"leavebuzzer_count", "size_t", offsetof(Runtime, leavebuzzer_count)},
+    {"pickbuzzer_count", "size_t", offsetof(Runtime, pickbuzzer_count)},
+    {"stack_memory", "size_t", offsetof(Runtime, stack_memory)},
+    {"ret", "int32_t", offsetof(Runtime, ret)},
+};
+
+// Runtime fields that do not change during the run.
+constexpr struct {
+  const char* name;
+  const char* type;
+  size_t offset;
+} kConstantFields[] = {
+    {"instruction_limit", "size_t", offsetof(Runtime, instruction_limit)},
+    {"stack_limit", "size_t", offsetof(Runtime, stack_limit)},
+    {"stack_memory_limit", "size_t", offsetof(Runtime, stack_memory_limit)},
+    {"call_param_limit", "size_t", offsetof(Runtime, call_param_limit)},
+    {"forward_limit", "size_t", offsetof(Runtime, forward_limit)},
+    {"left_limit", "size_t", offsetof(Runtime, left_limit)},
+    {"pickbuzzer_limit", "size_t", offsetof(Runtime, pickbuzzer_limit)},
+    {"leavebuzzer_limit", "size_t", offsetof(Runtime, leavebuzzer_limit)},
+    {"width", "size_t", offsetof(Runtime, width)},
+    {"buzzers", "uint32_t*", offsetof(Runtime, buzzers)},
+    {"walls", "uint8_t*", offsetof(Runtime, walls)},
+};
+
+constexpr const char kPrologue[] = R"(// Generated by karel. Do not edit.
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+namespace {
+
+struct Frame {
+  int32_t ret;
+  int64_t param_sp;
+  int64_t sp;
+};
+
+// Owned by the caller, which frees them, so that the runs that share them
+// only pay for the allocations once.
+template <typename T>
+struct Stack {
+  T* data = nullptr;
+  size_t capacity = 0;
+
+  [[gnu::noinline]] void Grow() {
+    capacity = capacity ? capacity * 2 : 1024;
+    data = static_cast<T*>(realloc(data, capacity * sizeof(T)));
+    if (!data)
+      abort();
+  }
+};
+
+struct Stacks {
+  Stack<int32_t> expression;
+  Stack<Frame> frames;
+};
+
+template <typename T>
+inline T& Field(char* runtime, size_t offset) {
+  return *reinterpret_cast<T*>(runtime + offset);
+}
+
+constexpr int32_t dx[] = {-1, 0, 1, 0};
+constexpr int32_t dy[] = {0, 1, 0, -1};
+
+}  // namespace
+
+#define EXIT(r)     \
+  do {              \
+    result = (r);   \
+    goto done;      \
+  } while (0)
+#define PUSH(v)                                      \
+  do {                                               \
+    int32_t value_ = (v);                            \
+    if (__builtin_expect(sp == es_capacity, 0)) {    \
+      expression.Grow();                             \
+      es = expression.data;                          \
+      es_capacity = expression.capacity;             \
+    }                                                \
+    es[sp++] = value_;                               \
+  } while (0)
+#define TOP es[sp - 1]
+#define CELL (y * width + x)
+#define BLOCKED(rotation) (walls[CELL] & (1 << ((orientation + (rotation)) & 3)))
+)";
+
+class SourceGenerator {
+ public:
+  explicit SourceGenerator(ProgramView program)
+      : program_(program), end_(program.size()) {}
+
+  std::string Generate();
+
+ private:
+  void EmitInstruction(int32_t pc);
+  // Continues at |next| after a counted instruction, checking the
+  // instruction limit on behalf of |next| first.
+  void EmitContinue(int64_t next, bool fallthrough);
+  void EmitForward();
+  void EmitPickBuzzer();
+  void EmitLeaveBuzzer();
+  void EmitBranch(int32_t pc, const char* condition, int64_t length);
+  void EmitLoop(int32_t pc);
+  void EmitReturn();
+
+  int64_t Resolve(int64_t target) const {
+    return (target < 0 || target >= end_) ? end_ : target;
+  }
+  std::string Label(int64_t pc) const {
+    return pc >= end_ ? "L_end" : StringPrintf("L%" PRId64, pc);
+  }
+  static std::string Result(RunResult result) {
+    return StringPrintf("%uu", static_cast<uint32_t>(result));
+  }
+
+  void Line(const std::string& line) {
+    source_ += "  ";
+    source_ += line;
+    source_ += '\n';
+  }
+
+  const ProgramView program_;
+  const int64_t end_;
+  std::vector<int64_t> return_sites_;
+  std::string source_;
+};
+
+void SourceGenerator::EmitContinue(int64_t next, bool fallthrough) {
+  if (next >= end_) {
+    Line("EXIT(" + Result(RunResult::OK) + ");");
+    return;
+  }
+  Line("if (__builtin_expect(ic >= instruction_limit, 0)) EXIT(" +
+       Result(RunResult::INSTRUCTION) + ");");
+  if (!fallthrough)
+    Line("goto " + Label(next) + ";");
+}
+
+void SourceGenerator::EmitForward() {
+  Line("ic++;");
+  Line("x += dx[orientation];");
+  Line("y += dy[orientation];");
+  Line("if (++forward_count > forward_limit) EXIT(" +
+       Result(RunResult::INSTRUCTION_FORWARD) + ");");
+}
+
+void SourceGenerator::EmitPickBuzzer() {
+  Line("ic++;");
+  Line(StringPrintf("if (buzzers[CELL] != %d) buzzers[CELL]--;", kInfinity));
+  Line(StringPrintf("if (bag != %d) {", kInfinity));
+  Line(StringPrintf("  if (bag + 1 > %d) EXIT(%s);", kMaxInt,
+                    Result(RunResult::BAGOVERFLOW).c_str()));
+  Line("  bag++;");
+  Line("}");
+  Line("if (++pickbuzzer_count > pickbuzzer_limit) EXIT(" +
+       Result(RunResult::INSTRUCTION_PICK) + ");");
+}
+
+void SourceGenerator::EmitLeaveBuzzer() {
+  Line("ic++;");
+  Line(StringPrintf("if (buzzers[CELL] != %d) {", kInfinity));
+  Line(StringPrintf("  if (buzzers[CELL] + 1 > %d) EXIT(%s);", kMaxInt,
+                    Result(RunResult::WORLDOVERFLOW).c_str()));
+  Line("  buzzers[CELL]++;");
+  Line("}");
+  Line(StringPrintf("if (bag != %d) bag--;", kInfinity));
+  Line("if (++leavebuzzer_count > leavebuzzer_limit) EXIT(" +
+       Result(RunResult::INSTRUCTION_LEAVE) + ");");
+}
+
+void SourceGenerator::EmitBranch(int32_t pc,
+                                 const char* condition,
+                                 int64_t length) {
+  Line("ic++;");
+  Line(StringPrintf("if (%s) {", condition));
+  EmitContinue(Resolve(pc + program_[pc].arg + 1), false);
+  Line("}");
+  EmitContinue(pc + length, false);
+}
+
+void SourceGenerator::EmitLoop(int32_t pc) {
+  const Instruction& curr = program_[pc];
+  const bool forward = curr.opcode == Opcode::FORWARD_UNTIL_WALL;
+  // Whole iterations that fit in the limits, 3 instructions each.
+  Line("{");
+  Line("  size_t n = (instruction_limit - ic) / 3;");
+  if (forward) {
+    Line("  if (forward_limit - forward_count < n) n = forward_limit - "
+         "forward_count;");
+    Line("  const uint8_t wall = 1 << orientation;");
+    Line("  const ptrdiff_t stride = dy[orientation] * "
+         "static_cast<ptrdiff_t>(width) + dx[orientation];");
+    Line("  const uint8_t* cell = walls + CELL;");
+    Line("  size_t steps = 0;");
+    Line("  while (steps < n && !(*cell & wall)) {");
+    Line("    cell += stride;");
+    Line("    steps++;");
+    Line("  }");
+    Line("  x += steps * dx[orientation];");
+    Line("  y += steps * dy[orientation];");
+    Line("  forward_count += steps;");
+    Line("  n = steps;");
+  } else {
+    Line("  if (pickbuzzer_limit - pickbuzzer_count < n) n = pickbuzzer_limit - "
+         "pickbuzzer_count;");
+    Line("  uint32_t& cell = buzzers[CELL];");
+    Line(StringPrintf("  if (cell != %d && cell < n) n = cell;", kInfinity));
+    Line(StringPrintf("  if (bag != %d) {", kInfinity));
+    Line(StringPrintf("    const size_t room = bag < %d ? %d - bag : 0;",
+                      kMaxInt, kMaxInt));
+    Line("    if (room < n) n = room;");
+    Line("    bag += n;");
+    Line("  }");
+    Line(StringPrintf("  if (cell != %d) cell -= n;", kInfinity));
+    Line("  pickbuzzer_count += n;");
+  }
+  Line("  if (n != 0) {");
+  Line("    ic += 3 * n;");
+  const Instruction& body = program_[pc + curr.arg2];
+  if (body.opcode == Opcode::LINE) {
+    Line(StringPrintf("    line = %d;", body.arg));
+    Line(StringPrintf("    column = %d;", body.arg2));
+  }
+  Line("    if (ic >= instruction_limit) EXIT(" +
+       Result(RunResult::INSTRUCTION) + ");");
+  Line("  }");
+  Line("}");
+  EmitBranch(pc, forward ? "BLOCKED(0)" : "buzzers[CELL] == 0", curr.arg2);
+}
+
+void SourceGenerator::EmitInstruction(int32_t pc) {
+  const Instruction& curr = program_[pc];
+  switch (curr.opcode) {
+    case Opcode::HALT:
+      Line("EXIT(" + Result(RunResult::OK) + ");");
+      break;
+
+    case Opcode::LINE:
+      Line(StringPrintf("line = %d;", curr.arg));
+      Line(StringPrintf("column = %d;", curr.arg2));
+      break;
+
+    case Opcode::LEFT:
+      Line("ic++;");
+      Line("orientation = (orientation + 3) & 3;");
+      Line("if (++left_count > left_limit) EXIT(" +
+           Result(RunResult::INSTRUCTION_LEFT) + ");");
+      EmitContinue(pc + 1, true);
+      break;
+
+    case Opcode::LOAD:
+      Line(StringPrintf("PUSH(%d);", curr.arg));
+      break;
+
+    case Opcode::CALL: {
+      int64_t return_site = pc + 1;
+      if (return_site < end_)
+        return_sites_.push_back(return_site);
+      Line("ic++;");
+      Line("{");
+      Line("  size_t param_count = TOP;");
+      Line("  if (param_count > call_param_limit) EXIT(" +
+           Result(RunResult::CALLSIZE) + ");");
+      Line("  sp--;");
+      Line("  if (__builtin_expect(depth == fs_capacity, 0)) {");
+      Line("    frames.Grow();");
+      Line("    fs = frames.data;");
+      Line("    fs_capacity = frames.capacity;");
+      Line("  }");
+      Line(StringPrintf("  fs[depth++] = Frame{%" PRId64
+                        ", param_sp, static_cast<int64_t>(sp - param_count)};",
+                        return_site));
+      Line("  param_sp = sp - 1;");
+      Line("  stack_memory += param_count == 0 ? 1 : param_count;");
+      Line("  if (stack_memory > stack_memory_limit) EXIT(" +
+           Result(RunResult::STACKMEMORY) + ");");
+      Line("  if (depth >= stack_limit) EXIT(" + Result(RunResult::STACK) +
+           ");");
+      Line("}");
+      EmitContinue(Resolve(curr.arg), false);
+      break;
+    }
+
+    case Opcode::RET:
+      Line("goto do_return;");
+      break;
+
+    case Opcode::WORLDWALLS:
+      Line("PUSH(walls[CELL]);");
+      break;
+
+    case Opcode::ORIENTATION:
+      Line("PUSH(orientation);");
+      break;
+
+    case Opcode::ROTL:
+      Line("TOP = (TOP + 3) & 3;");
+      break;
+
+    case Opcode::ROTR:
+      Line("TOP = (TOP + 1) & 3;");
+      break;
+
+    case Opcode::MASK:
+      Line("TOP = 1 << (TOP & 31);");
+      break;
+
+    case Opcode::NOT:
+      Line("TOP = TOP == 0;");
+      break;
+
+    case Opcode::AND:
+      Line("sp--;");
+      Line("TOP = (TOP & es[sp]) != 0;");
+      break;
+
+    case Opcode::OR:
+      Line("sp--;");
+      Line("TOP = (TOP | es[sp]) != 0;");
+      break;
+
+    case Opcode::EQ:
+      Line("sp--;");
+      Line("TOP = TOP == es[sp];");
+      break;
+
+    case Opcode::LT:
+      Line("sp--;");
+      Line("TOP = TOP < es[sp];");
+      break;
+
+    case Opcode::LTE:
+      Line("sp--;");
+      Line("TOP = TOP <= es[sp];");
+      break;
+
+    case Opcode::JZ:
+      EmitBranch(pc, "es[--sp] == 0", 1);
+      break;
+
+    case Opcode::JNZ:
+      EmitBranch(pc, "es[--sp] != 0", 1);
+      break;
+
+    case Opcode::WORLDBUZZERS:
+      Line("PUSH(buzzers[CELL]);");
+      break;
+
+    case Opcode::FORWARD:
+      EmitForward();
+      EmitContinue(pc + 1, true);
+      break;
+
+    case Opcode::BAGBUZZERS:
+      Line("PUSH(bag);");
+      break;
+
+    case Opcode::JMP:
+      Line(StringPrintf("ic += %d;", 1 + curr.arg2));
+      EmitContinue(Resolve(pc + curr.arg + 1), false);
+      break;
+
+    case Opcode::PICKBUZZER:
+      EmitPickBuzzer();
+      EmitContinue(pc + 1, true);
+      break;
+
+    case Opcode::LEAVEBUZZER:
+      EmitLeaveBuzzer();
+      EmitContinue(pc + 1, true);
+      break;
+
+    case Opcode::EZ:
+      Line(StringPrintf("if (TOP == 0) EXIT(%du);", curr.arg));
+      Line("sp--;");
+      break;
+
+    case Opcode::POP:
+      Line("sp--;");
+      break;
+
+    case Opcode::DUP:
+      Line("PUSH(TOP);");
+      break;
+
+    case Opcode::DEC:
+    case Opcode::INC:
+      Line(StringPrintf("if (TOP <= %d) {", kMaxInt));
+      Line(StringPrintf(
+          "  TOP = static_cast<int32_t>(static_cast<uint32_t>(TOP) %c %uu);",
+          curr.opcode == Opcode::INC ? '+' : '-',
+          static_cast<uint32_t>(curr.arg)));
+      Line(StringPrintf("  if (TOP > %d) EXIT(%s);", kMaxInt,
+                        Result(RunResult::INTEGEROVERFLOW).c_str()));
+      Line(StringPrintf("  if (TOP < %d) EXIT(%s);", kMinInt,
+                        Result(RunResult::INTEGERUNDERFLOW).c_str()));
+      Line("}");
+      break;
+
+    case Opcode::PARAM:
+      Line(StringPrintf("PUSH(es[param_sp - %d]);", curr.arg));
+      break;
+
+    case Opcode::SRET:
+      Line("ret = es[--sp];");
+      break;
+
+    case Opcode::LRET:
+      Line("PUSH(ret);");
+      break;
+
+    case Opcode::COLUMN:
+      Line("PUSH(x + 1);");
+      break;
+
+    case Opcode::ROW:
+      Line("PUSH(y + 1);");
+      break;
+
+    case Opcode::CHECKED_FORWARD:
+      Line(StringPrintf("if (BLOCKED(0)) EXIT(%du);", curr.arg));
+      EmitForward();
+      EmitContinue(pc + 7, false);
+      break;
+
+    case Opcode::CHECKED_PICK:
+      Line(StringPrintf("if (buzzers[CELL] == 0) EXIT(%du);", curr.arg));
+      EmitPickBuzzer();
+      EmitContinue(pc + 3, false);
+      break;
+
+    case Opcode::CHECKED_LEAVE:
+      Line(StringPrintf("if (bag == 0) EXIT(%du);", curr.arg));
+      EmitLeaveBuzzer();
+      EmitContinue(pc + 3, false);
+      break;
+
+    case Opcode::FRONT_CLEAR_JZ:
+      EmitBranch(pc, "BLOCKED(0)", curr.arg2);
+      break;
+
+    case Opcode::LEFT_CLEAR_JZ:
+      EmitBranch(pc, "BLOCKED(3)", curr.arg2);
+      break;
+
+    case Opcode::RIGHT_CLEAR_JZ:
+      EmitBranch(pc, "BLOCKED(1)", curr.arg2);
+      break;
+
+    case Opcode::FORWARD_UNTIL_WALL:
+    case Opcode::PICK_ALL:
+      EmitLoop(pc);
+      break;
+  }
+}
+
+void SourceGenerator::EmitReturn() {
+  source_ += "do_return:\n";
+  Line("if (depth == 0) EXIT(" + Result(RunResult::OK) + ");");
+  Line("{");
+  Line("  const Frame& frame = fs[--depth];");
+  Line("  size_t param_count = (param_sp + 1) - frame.sp;");
+  Line("  stack_memory -= param_count == 0 ? 1 : param_count;");
+  Line("  if (sp > static_cast<size_t>(frame.sp)) sp = frame.sp;");
+  Line("  param_sp = frame.param_sp;");
+  Line("  switch (frame.ret) {");
+  for (int64_t site : return_sites_) {
+    Line(StringPrintf("    case %" PRId64 ": goto %s;", site,
+                      Label(site).c_str()));
+  }
+  Line("  }");
+  Line("}");
+  Line("EXIT(" + Result(RunResult::OK) + ");");
+}
+
+std::string SourceGenerator::Generate() {
+  source_ = kPrologue;
+  source_ += "\nextern \"C\" uint32_t ";
+  source_ += kEntryPointName;
+  source_ += "(void* runtime_ptr, void* stacks_ptr) {\n";
+  Line("char* const runtime = static_cast<char*>(runtime_ptr);");
+  Line("Stacks& stacks = *static_cast<Stacks*>(stacks_ptr);");
+  Line("Stack<int32_t>& expression = stacks.expression;");
+  Line("Stack<Frame>& frames = stacks.frames;");
+  for (const auto& field : kCachedFields) {
+    Line(StringPrintf("%s %s = Field<%s>(runtime, %zu);", field.type,
+                      field.name, field.type, field.offset));
+  }
+  for (const auto& field : kConstantFields) {
+    Line(StringPrintf("%s const %s = Field<%s>(runtime, %zu);", field.type,
+                      field.name, field.type, field.offset));
+  }
+  Line("int32_t* es = expression.data;");
+  Line("size_t es_capacity = expression.capacity;");
+  Line("size_t sp = 0;");
+  Line("Frame* fs = frames.data;");
+  Line("size_t fs_capacity = frames.capacity;");
+  Line("size_t depth = 0;");
+  Line("int64_t param_sp = -1;");
+  Line("size_t ic = 0;");
+  Line("uint32_t result = " + Result(RunResult::OK) + ";");
+  if (end_ > 0) {
+    Line("if (instruction_limit == 0) EXIT(" + Result(RunResult::INSTRUCTION) +
+         ");");
+  }
+
+  for (int32_t pc = 0; pc < end_; ++pc) {
+    source_ += Label(pc) + ":\n";
+    EmitInstruction(pc);
+  }
+  source_ += "L_end:\n";
+  Line("EXIT(" + Result(RunResult::OK) + ");");
+  EmitReturn();
+
+  source_ += "done:\n";
+  for (const auto& field : kCachedFields) {
+    Line(StringPrintf("Field<%s>(runtime, %zu) = %s;", field.type,
+                      field.offset, field.name));
+  }
+  Line("return result;");
+  source_ += "}\n";
+  return std::move(source_);
+}
+
+#if defined(KAREL_AOT)
+
+// Creates a new file from |path|, a mkstemps() template that ends in
+// |suffix_length| characters after its XXXXXX, and writes |contents| into it.
+// |path| gets the name of the file.
+bool WriteTempFile(std::string* path,
+                   int suffix_length,
+                   std::string_view contents) {
+  ScopedFD fd(mkstemps(&(*path)[0], suffix_length));
+  if (!fd) {
+    PLOG(ERROR) << "Failed to create " << *path;
+    return false;
+  }
+  // mkstemps() only lets the owner read the file.
+  if (fchmod(fd.get(), 0644) == -1 ||
+      !WriteFileDescriptor(fd.get(), contents)) {
+    PLOG(ERROR) << "Failed to write " << *path;
+    unlink(path->c_str());
+    return false;
+  }
+  return true;
+}
+
+bool CompileSharedObject(const std::string& source_path,
+                         const std::string& output_path) {
+  const char* compiler = getenv("CXX");
+  if (!compiler || !*compiler)
+    compiler = "c++";
+  const char* const argv[] = {
+      compiler, "-O2",  "-std=c++17",         "-shared", "-fPIC", "-w",
+      "-o",     output_path.c_str(), source_path.c_str(), nullptr,
+  };
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    PLOG(ERROR) << "Failed to fork";
+    return false;
+  }
+  if (pid == 0) {
+    execvp(compiler, const_cast<char* const*>(argv));
+    PLOG(ERROR) << "Failed to run " << compiler;
+    _exit(127);
+  }
+  int status;
+  if (HANDLE_EINTR(waitpid(pid, &status, 0)) == -1) {
+    PLOG(ERROR) << "Failed to wait for " << compiler;
+    return false;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG(ERROR) << compiler << " failed to compile " << source_path;
+    return false;
+  }
+  return true;
+}
+
+// Builds the shared object for |program| at |path|. The object is built
+// under a unique temporary name and renamed into place, like the rest of the
+// cache, so that concurrent runs never load a partially written file.
+bool BuildSharedObject(ProgramView program, const std::string& path) {
+  constexpr std::string_view kSourceSuffix(".cpp");
+  std::string source_path = path + ".XXXXXX" + std::string(kSourceSuffix);
+  if (!WriteTempFile(&source_path, kSourceSuffix.size(),
+                     GenerateNativeSource(program))) {
+    return false;
+  }
+  std::string temp_path = path + ".XXXXXX";
+  if (!WriteTempFile(&temp_path, 0, std::string_view())) {
+    unlink(source_path.c_str());
+    return false;
+  }
+  bool compiled = CompileSharedObject(source_path, temp_path);
+  unlink(source_path.c_str());
+  if (!compiled) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif  // defined(KAREL_AOT)
+
+}  // namespace
+
+std::string GenerateNativeSource(ProgramView program) {
+  return SourceGenerator(program).Generate();
+}
+
+uint64_t NativeProgramKey(ProgramView program) {
+  std::string layout = StringPrintf("%" PRIu64, kGeneratorVersion);
+  for (const auto& field : kCachedFields)
+    layout += StringPrintf(" %s:%zu", field.name, field.offset);
+  for (const auto& field : kConstantFields)
+    layout += StringPrintf(" %s:%zu", field.name, field.offset);
+  uint64_t key = Fingerprint(layout);
+  for (const auto& instruction : program) {
+    const int32_t fields[] = {static_cast<int32_t>(instruction.opcode),
+                              instruction.arg, instruction.arg2};
+    key = Fingerprint(
+        std::string_view(reinterpret_cast<const char*>(fields), sizeof(fields)),
+        key);
+  }
+  return key;
+}
+
+std::string DefaultNativeCacheDir() {
+  const char* cache_home = getenv("XDG_CACHE_HOME");
+  if (cache_home && *cache_home)
+    return std::string(cache_home) + "/karel";
+  const char* home = getenv("HOME");
+  if (home && *home)
+    return std::string(home) + "/.cache/karel";
+  return "/tmp/karel";
+}
+
+static_assert(std::is_standard_layout<NativeStacks>::value,
+              "NativeStacks is handed to the generated code as its Stacks");
+
+NativeStacks::~NativeStacks() {
+  free(expression_.data);
+  free(frames_.data);
+}
+
+NativeProgram::NativeProgram(void* handle, EntryPoint entry_point)
+    : handle_(handle), entry_point_(entry_point) {}
+
+NativeProgram::~NativeProgram() {
+#if defined(KAREL_AOT)
+  dlclose(handle_);
+#endif
+}
+
+// static
+std::unique_ptr<NativeProgram> NativeProgram::Load(
+    ProgramView program,
+    const std::string& cache_dir) {
+#if defined(KAREL_AOT)
+  const std::string path = StringPrintf(
+      "%s/%016" PRIx64 ".so", cache_dir.c_str(), NativeProgramKey(program));
+  if (access(path.c_str(), R_OK) == -1) {
+    if (!MakeDirectories(cache_dir) || !BuildSharedObject(program, path))
+      return nullptr;
+  }
+
+  void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    LOG(ERROR) << "Failed to load " << path << ": " << dlerror();
+    return nullptr;
+  }
+  void* entry_point = dlsym(handle, kEntryPointName);
+  if (!entry_point) {
+    LOG(ERROR) << "Failed to find " << kEntryPointName << " in " << path;
+    dlclose(handle);
+    return nullptr;
+  }
+  return std::unique_ptr<NativeProgram>(
+      new NativeProgram(handle, reinterpret_cast<EntryPoint>(entry_point)));
+#else
+  LOG(ERROR) << "Ahead-of-time compilation requires the dynamic build";
+  return nullptr;
+#endif
+}
+
+RunResult NativeProgram::Run(Runtime* runtime) const {
+  NativeStacks stacks;
+  return Run(runtime, &stacks);
+}
+
+RunResult NativeProgram::Run(Runtime* runtime, NativeStacks* stacks) const {
+  // The native code writes the buzzers directly.
+  if (runtime->dirty)
+    runtime->dirty->MarkAll();
+  return static_cast<RunResult>(entry_point_(runtime, stacks));
+}
+
+}  // namespace karel
@@ -0,0 +1,102 @@
+#ifndef AOT_H_
+#define AOT_H_
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "karel.h"
+#include "macros.h"
+
+namespace karel {
+
+/**
+ * Translates |program| into a standalone C++ translation unit that exports
+ *
+ *   extern "C" uint32_t karel_aot_run(void* runtime, void* stacks);
+ *
+ * with the same semantics and limits as Run(), where |stacks| is a
+ * NativeStacks. The Runtime is accessed
+ * through the field offsets of this build, so the result is only valid for
+ * binaries with the same Runtime layout.
+ */
+std::string GenerateNativeSource(ProgramView program);
+
+/**
+ * Returns the cache key of the native code for |program|. It covers the
+ * bytecode, the code generator and the Runtime layout.
+ */
+uint64_t NativeProgramKey(ProgramView program);
+
+/**
+ * The stacks of native runs, which the generated code grows as it needs to.
+ * Keeping an instance around and passing it to every NativeProgram::Run()
+ * lets batch runs allocate them only once. An instance must only be used by
+ * one run at a time.
+ */
+class NativeStacks {
+ public:
+  NativeStacks() = default;
+  ~NativeStacks();
+
+ private:
+  // Laid out like the stacks of the generated code, which reallocs them.
+  struct Buffer {
+    void* data = nullptr;
+    size_t capacity = 0;
+  };
+
+  Buffer expression_;
+  Buffer frames_;
+
+  DISALLOW_COPY_AND_ASSIGN(NativeStacks);
+};
+
+/**
+ * A program that was compiled ahead of time into a shared object.
+ *
+ * Only available in the dynamic build (KAREL_AOT). The static build has no
+ * usable dlopen, so Load() always fails there.
+ */
+class NativeProgram {
+ public:
+  ~NativeProgram();
+
+  /**
+   * Loads the shared object for |program| from |cache_dir|, building it with
+   * the system C++ compiler ($CXX, or c++) first if it is not there yet.
+   */
+  static std::unique_ptr<NativeProgram> Load(
+      ProgramView program,
+      const std::string& cache_dir);
+
+  /**
+   * Runs the program on |runtime|. The native code indexes |buzzers| and
+   * |walls| directly, so the world must be in the FLAT layout, and it does
+   * not track the cells it changes: Runtime::dirty ends up with all of them.
+   */
+  RunResult Run(Runtime* runtime) const;
+
+  RunResult Run(Runtime* runtime, NativeStacks* stacks) const;
+
+ private:
+  using EntryPoint = uint32_t (*)(Runtime*, NativeStacks*);
+
+  NativeProgram(void* handle, EntryPoint entry_point);
+
+  void* handle_;
+  EntryPoint entry_point_;
+
+  DISALLOW_COPY_AND_ASSIGN(NativeProgram);
+};
+
+/**
+ * Returns the default directory for compiled programs:
+ * $XDG_CACHE_HOME/karel, or ~/.cache/karel.
+ */
+std::string DefaultNativeCacheDir();
+
+}  // namespace karel
+
+#endif  // AOT_H_
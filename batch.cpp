@@ -0,0 +1,227 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cinttypes>
+#include <memory>
+#include <string_view>
+
+#include "expect.h"
+#include "logging.h"
+#include "util.h"
+#include "xml.h"
+
+namespace karel {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+int64_t MicrosecondsSince(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                               start)
+      .count();
+}
+
+bool EndsWith(std::string_view str, std::string_view suffix) {
+  return str.size() >= suffix.size() &&
+         str.substr(str.size() - suffix.size()) == suffix;
+}
+
+// Sends the output of a case to its file and to its comparator, whichever
+// of them it has.
+class CaseSink : public xml::Sink {
+ public:
+  CaseSink(int fd, OutputComparator* comparator)
+      : fd_(fd), comparator_(comparator) {}
+
+  void Write(std::string_view data) override {
+    if (fd_ != -1 && !WriteFileDescriptor(fd_, data))
+      failed_ = true;
+    if (comparator_)
+      comparator_->Write(data);
+  }
+
+  bool failed() const { return failed_; }
+
+ private:
+  const int fd_;
+  OutputComparator* const comparator_;
+  bool failed_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(CaseSink);
+};
+
+bool SameFile(const std::string& a, const std::string& b) {
+  struct stat a_stat, b_stat;
+  return stat(a.c_str(), &a_stat) == 0 && stat(b.c_str(), &b_stat) == 0 &&
+         a_stat.st_dev == b_stat.st_dev && a_stat.st_ino == b_stat.st_ino;
+}
+
+std::optional<World> LoadWorld(const std::string& path,
+                               const WorldOptions& options) {
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return std::nullopt;
+  }
+  return World::Parse(fd.get(), options);
+}
+
+}  // namespace
+
+std::optional<std::vector<std::string>> ListBatchCases(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return std::nullopt;
+  }
+  std::vector<std::string> cases;
+  if (S_ISDIR(st.st_mode)) {
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(path.c_str()), closedir);
+    if (!dir) {
+      PLOG(ERROR) << "Failed to open " << path;
+      return std::nullopt;
+    }
+    while (const dirent* entry = readdir(dir.get())) {
+      if (EndsWith(entry->d_name, ".in"))
+        cases.push_back(path + "/" + entry->d_name);
+    }
+    std::sort(cases.begin(), cases.end());
+    return cases;
+  }
+
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return std::nullopt;
+  }
+  const std::vector<uint8_t> contents = ReadFully(fd.get());
+  const size_t slash = path.rfind('/');
+  const std::string dir =
+      slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+  std::string_view list(reinterpret_cast<const char*>(contents.data()),
+                        contents.size());
+  while (!list.empty()) {
+    std::string_view line = list.substr(0, list.find('\n'));
+    list.remove_prefix(std::min(line.size() + 1, list.size()));
+    while (!line.empty() && isspace(static_cast<unsigned char>(line.back())))
+      line.remove_suffix(1);
+    while (!line.empty() && isspace(static_cast<unsigned char>(line.front())))
+      line.remove_prefix(1);
+    if (line.empty() || line.front() == '#')
+      continue;
+    if (line.front() == '/')
+      cases.emplace_back(line);
+    else
+      cases.push_back(dir + std::string(line));
+  }
+  return cases;
+}
+
+int RunBatch(const std::vector<std::string>& cases,
+             const BatchOptions& options,
+             const std::function<RunResult(Runtime*)>& run,
+             int report_fd) {
+  int status = 0;
+  for (const std::string& path : cases) {
+    std::string report("{\"case\":");
+    AppendJsonString(&report, path);
+    auto fail = [&report, report_fd, &status](std::string_view error) {
+      report.append(",\"error\":");
+      AppendJsonString(&report, error);
+      report.append("}\n");
+      WriteFileDescriptor(report_fd, report);
+      status = 2;
+    };
+
+    Clock::time_point start = Clock::now();
+    std::optional<World> world = LoadWorld(path, options.world_options);
+    if (!world) {
+      fail("Failed to load the world");
+      continue;
+    }
+    const int64_t load_us = MicrosecondsSince(start);
+
+    start = Clock::now();
+    const RunResult result = run(world->runtime());
+    const int64_t run_us = MicrosecondsSince(start);
+
+    start = Clock::now();
+    const std::string base =
+        EndsWith(path, ".in") ? path.substr(0, path.size() - 3) : path;
+    const std::string expected_path = base + ".out";
+    std::optional<Expectation> expectation;
+    if (access(expected_path.c_str(), F_OK) == 0) {
+      expectation = Expectation::Load(expected_path);
+      if (!expectation) {
+        fail("Failed to load the expected output");
+        continue;
+      }
+    }
+    ScopedFD output_fd;
+    if (!options.output_dir.empty()) {
+      const size_t slash = base.rfind('/');
+      const std::string output_path =
+          options.output_dir + "/" +
+          (slash == std::string::npos ? base : base.substr(slash + 1)) +
+          ".out";
+      // Writing the output over the expected one would destroy it while
+      // it is being compared.
+      if (expectation && SameFile(output_path, expected_path)) {
+        fail("The output would overwrite the expected output");
+        continue;
+      }
+      output_fd.reset(
+          open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+      if (!output_fd) {
+        PLOG(ERROR) << "Failed to open " << output_path;
+        fail("Failed to write the output");
+        continue;
+      }
+    }
+    std::optional<OutputComparator> comparator;
+    if (expectation)
+      comparator.emplace(expectation->output());
+    CaseSink sink(output_fd ? output_fd.get() : -1,
+                  comparator ? &comparator.value() : nullptr);
+    if (output_fd || comparator) {
+      if (options.dump_result)
+        world->DumpResult(result, &sink);
+      else
+        world->Dump(&sink);
+    }
+    if (sink.failed()) {
+      fail("Failed to write the output");
+      continue;
+    }
+    std::optional<Verdict> verdict;
+    Mismatch mismatch;
+    if (expectation)
+      verdict = expectation->Judge(result, &comparator.value(), &mismatch);
+    const int64_t output_us = MicrosecondsSince(start);
+
+    report.append(StringPrintf(",\"exit_code\":%" PRId32,
+                               static_cast<int32_t>(result)));
+    if (verdict) {
+      report.push_back(',');
+      report.append(VerdictJson(verdict.value(), mismatch));
+      if (verdict.value() != Verdict::OK)
+        status = std::max(status, 1);
+    }
+    report.append(StringPrintf(
+        ",\"load_us\":%" PRId64 ",\"run_us\":%" PRId64 ",\"output_us\":%" PRId64
+        "}\n",
+        load_us, run_us, output_us));
+    WriteFileDescriptor(report_fd, report);
+  }
+  return status;
+}
+
+}  // namespace karel
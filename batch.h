@@ -0,0 +1,49 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "karel.h"
+#include "world.h"
+
+namespace karel {
+
+/**
+ * Returns the worlds of a batch, in order. If |path| is a directory, these
+ * are the .in files in it, sorted by name. Otherwise |path| lists them, one
+ * per line, relative to its own directory, and blank lines and lines that
+ * start with '#' are skipped.
+ */
+std::optional<std::vector<std::string>> ListBatchCases(const std::string& path);
+
+struct BatchOptions {
+  WorldOptions world_options;
+  // Whether to dump the result of each run, as opposed to the world.
+  bool dump_result = true;
+  // Where to write the output of each case, as <name>.out, or empty.
+  std::string output_dir;
+};
+
+/**
+ * Loads each world in |cases| and runs the program on it with |run|. Cases
+ * with a .out file next to their .in file are judged against it, along
+ * with its .stderr and .signal files, as --expect does.
+ *
+ * Writes one line of JSON per case into |report_fd|, with its path, exit
+ * code and verdict, if it had one, and how long it took to load the world,
+ * to run the program and to produce the output, in microseconds.
+ *
+ * Returns 0 if all the cases ran and matched, 1 if any did not match, and
+ * 2 if any could not be loaded or written.
+ */
+int RunBatch(const std::vector<std::string>& cases,
+             const BatchOptions& options,
+             const std::function<RunResult(Runtime*)>& run,
+             int report_fd);
+
+}  // namespace karel
+
+#endif  // BATCH_H_
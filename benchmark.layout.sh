@@ -0,0 +1,66 @@
+#!/bin/bash
+# Compares the flat, tiled and packed world layouts on walks that touch every
+# cell of 1000x1000 and 2000x2000 worlds: a snake along the rows, a snake
+# along the columns, which is the worst case for the flat layout, and a spiral
+# towards the center. Each walk leaves a buzzer in every cell it visits.
+#
+# Usage: ./benchmark.layout.sh [path/to/karel]
+echo ====== BENCHMARK LAYOUT ======
+
+ROOT="$(git rev-parse --show-toplevel)"
+KAREL="${1:-${ROOT}/bin/karel}"
+RUNS=3
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "${work_dir}"' EXIT
+
+printf '%s' '[["LEAVEBUZZER"], ["WORLDWALLS"], ["ORIENTATION"], ["MASK"], ["AND"], ["NOT"], ["JZ", 2], ["FORWARD"], ["JMP", -9], ["ORIENTATION"], ["LOAD", 2], ["EQ"], ["JZ", 10], ["LEFT"], ["WORLDWALLS"], ["ORIENTATION"], ["MASK"], ["AND"], ["NOT"], ["JZ", 17], ["FORWARD"], ["LEFT"], ["JMP", -23], ["LEFT"], ["LEFT"], ["LEFT"], ["WORLDWALLS"], ["ORIENTATION"], ["MASK"], ["AND"], ["NOT"], ["JZ", 5], ["FORWARD"], ["LEFT"], ["LEFT"], ["LEFT"], ["JMP", -37], ["HALT"]]' \
+    >"${work_dir}/rows.kx"
+printf '%s' '[["LEAVEBUZZER"], ["WORLDWALLS"], ["ORIENTATION"], ["MASK"], ["AND"], ["NOT"], ["JZ", 2], ["FORWARD"], ["JMP", -9], ["ORIENTATION"], ["LOAD", 1], ["EQ"], ["JZ", 14], ["LEFT"], ["LEFT"], ["LEFT"], ["WORLDWALLS"], ["ORIENTATION"], ["MASK"], ["AND"], ["NOT"], ["JZ", 15], ["FORWARD"], ["LEFT"], ["LEFT"], ["LEFT"], ["JMP", -27], ["LEFT"], ["WORLDWALLS"], ["ORIENTATION"], ["MASK"], ["AND"], ["NOT"], ["JZ", 3], ["FORWARD"], ["LEFT"], ["JMP", -37], ["HALT"]]' \
+    >"${work_dir}/columns.kx"
+# Turns right when the cell in front is a wall or already has a buzzer, and
+# stops after two turns in a row.
+printf '%s' '[["LOAD", 0], ["LEAVEBUZZER"], ["WORLDWALLS"], ["ORIENTATION"], ["MASK"], ["AND"], ["NOT"], ["JZ", 13], ["FORWARD"], ["WORLDBUZZERS"], ["JZ", 6], ["LEFT"], ["LEFT"], ["FORWARD"], ["LEFT"], ["LEFT"], ["JMP", 4], ["POP"], ["LOAD", 0], ["LEAVEBUZZER"], ["JMP", -19], ["LEFT"], ["LEFT"], ["LEFT"], ["INC", 1], ["DUP"], ["LOAD", 2], ["EQ"], ["JZ", -27], ["HALT"]]' \
+    >"${work_dir}/spiral.kx"
+
+# Runs the given command RUNS times and prints the best time in milliseconds.
+best_time() {
+    local best=""
+    for _ in $(seq "${RUNS}"); do
+        local start_time=$(date +%s%N)
+        "$@" >/dev/null
+        local elapsed_time=$(( ($(date +%s%N) - start_time) / 1000000 ))
+        if [ -z "${best}" ] || [ "${elapsed_time}" -lt "${best}" ]; then
+            best=${elapsed_time}
+        fi
+    done
+    echo "${best}"
+}
+
+for size in 1000 2000; do
+    for walk in rows:ESTE columns:NORTE spiral:NORTE; do
+        program=${walk%%:*}
+        world="${work_dir}/${program}-${size}.in"
+        cat >"${world}" <<EOF
+<ejecucion>
+	<condiciones instruccionesMaximasAEjecutar="1000000000" longitudStack="65000"/>
+	<mundos>
+		<mundo nombre="mundo_0" ancho="${size}" alto="${size}"/>
+	</mundos>
+	<programas tipoEjecucion="CONTINUA" intruccionesCambioContexto="1" milisegundosParaPasoAutomatico="0">
+		<programa nombre="p1" ruta="{\$2\$}" mundoDeEjecucion="mundo_0" xKarel="1" yKarel="1" direccionKarel="${walk##*:}" mochilaKarel="INFINITO">
+			<despliega tipo="POSICION"/>
+		</programa>
+	</programas>
+</ejecucion>
+EOF
+        for engine in switch threaded; do
+            for layout in flat tiled packed; do
+                printf '%4dx%-4d  %-8s %-9s %-6s %6d ms\n' "${size}" "${size}" \
+                    "${program}" "${engine}" "${layout}" \
+                    "$(best_time "${KAREL}" "${work_dir}/${program}.kx" -i "${world}" \
+                        --engine "${engine}" --world-layout "${layout}")"
+            done
+        done
+    done
+done
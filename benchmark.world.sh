@@ -0,0 +1,69 @@
+#!/bin/bash
+# Measures how fast worlds of 1, 10 and 100 MB are loaded, both from a file
+# given with -i, which is mapped, and from a pipe, which is streamed with the
+# default and with the old 4 KiB read buffer. The worlds start with an XML
+# declaration so that all of them go through expat.
+#
+# Usage: ./benchmark.world.sh [path/to/karel]
+echo ====== BENCHMARK WORLD ======
+
+ROOT="$(git rev-parse --show-toplevel)"
+KAREL="${1:-${ROOT}/bin/karel}"
+RUNS=3
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "${work_dir}"' EXIT
+printf '[["HALT"]]' >"${work_dir}/halt.kx"
+
+# Runs the given command RUNS times and prints the best time in milliseconds.
+best_time() {
+    local best=""
+    for _ in $(seq "${RUNS}"); do
+        local start_time=$(date +%s%N)
+        "$@" >/dev/null
+        local elapsed_time=$(( ($(date +%s%N) - start_time) / 1000000 ))
+        if [ -z "${best}" ] || [ "${elapsed_time}" -lt "${best}" ]; then
+            best=${elapsed_time}
+        fi
+    done
+    echo "${best}"
+}
+
+report() {
+    local size_mb=$1 label=$2 elapsed_time=$3
+    printf '%4d MB  %-22s %6d ms  %8.1f MB/s\n' "${size_mb}" "${label}" \
+        "${elapsed_time}" "$(echo "${size_mb} ${elapsed_time}" | awk '{ print $1 * 1000 / ($2 > 0 ? $2 : 1) }')"
+}
+
+for size_mb in 1 10 100; do
+    world="${work_dir}/${size_mb}mb.in"
+    awk -v bytes=$(( size_mb * 1024 * 1024 )) 'BEGIN {
+        print "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        print "<ejecucion>"
+        print "\t<condiciones instruccionesMaximasAEjecutar=\"10000000\" longitudStack=\"65000\"/>"
+        print "\t<mundos>"
+        print "\t\t<mundo nombre=\"mundo_0\" ancho=\"2000\" alto=\"2000\">"
+        size = 0
+        for (i = 0; size < bytes; ++i) {
+            line = sprintf("\t\t\t<monton x=\"%d\" y=\"%d\" zumbadores=\"%d\"/>",
+                           i % 2000 + 1, int(i / 2000) % 2000 + 1, i % 100 + 1)
+            print line
+            size += length(line) + 1
+        }
+        print "\t\t</mundo>"
+        print "\t</mundos>"
+        print "\t<programas tipoEjecucion=\"CONTINUA\" intruccionesCambioContexto=\"1\" milisegundosParaPasoAutomatico=\"0\">"
+        print "\t\t<programa nombre=\"p1\" ruta=\"{$2$}\" mundoDeEjecucion=\"mundo_0\" xKarel=\"1\" yKarel=\"1\" direccionKarel=\"NORTE\" mochilaKarel=\"0\">"
+        print "\t\t\t<despliega tipo=\"MUNDO\"/>"
+        print "\t\t</programa>"
+        print "\t</programas>"
+        print "</ejecucion>"
+    }' >"${world}"
+
+    report "${size_mb}" "mapped (-i)" \
+        "$(best_time "${KAREL}" "${work_dir}/halt.kx" -i "${world}")"
+    report "${size_mb}" "pipe" \
+        "$(best_time sh -c 'cat "$2" | "$1" "$3"' _ "${KAREL}" "${world}" "${work_dir}/halt.kx")"
+    report "${size_mb}" "pipe, 4 KiB reads" \
+        "$(best_time sh -c 'cat "$2" | "$1" "$3" --read-buffer 4096' _ "${KAREL}" "${world}" "${work_dir}/halt.kx")"
+done
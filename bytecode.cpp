@@ -0,0 +1,162 @@
+#include "bytecode.h"
+
+#include <sys/stat.h>
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "logging.h"
+
+namespace karel {
+
+namespace {
+
+constexpr char kBytecodeMagic[4] = {'K', 'X', 'B', '\0'};
+
+// Bump whenever Instruction or the meaning of any Opcode changes, so that
+// stale files are rejected instead of misread.
+constexpr uint32_t kBytecodeVersion = 1;
+
+static_assert(std::is_trivially_copyable<Instruction>::value,
+              "Instructions are stored as raw bytes");
+static_assert(sizeof(Instruction) == 12, "Unexpected Instruction layout");
+static_assert(sizeof(BytecodeHeader) % alignof(Instruction) == 0,
+              "The instructions must stay aligned after the header");
+
+// Identifies the build of the running binary, which includes the optimizer
+// and the fuser that produced the cached instructions. The executable changes
+// whenever they do; if it cannot be found, the time this file was compiled
+// stands in for it.
+const std::string& BuildFingerprint() {
+  static const std::string fingerprint = []() {
+    struct stat st;
+    if (stat("/proc/self/exe", &st) == 0) {
+      return StringPrintf("%ju:%ju:%jd:%jd.%09ld",
+                          static_cast<uintmax_t>(st.st_dev),
+                          static_cast<uintmax_t>(st.st_ino),
+                          static_cast<intmax_t>(st.st_size),
+                          static_cast<intmax_t>(st.st_mtim.tv_sec),
+                          static_cast<long>(st.st_mtim.tv_nsec));
+    }
+    return std::string(__DATE__ " " __TIME__);
+  }();
+  return fingerprint;
+}
+
+}  // namespace
+
+bool IsBytecode(std::string_view data) {
+  return data.size() >= sizeof(kBytecodeMagic) &&
+         memcmp(data.data(), kBytecodeMagic, sizeof(kBytecodeMagic)) == 0;
+}
+
+std::string SerializeBytecode(ProgramView program,
+                              const std::vector<std::string>& function_names) {
+  std::string names;
+  for (const auto& name : function_names) {
+    const uint32_t length = name.size();
+    names.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    names.append(name);
+  }
+
+  BytecodeHeader header = {};
+  memcpy(header.magic, kBytecodeMagic, sizeof(kBytecodeMagic));
+  header.version = kBytecodeVersion;
+  header.instruction_count = program.size();
+  header.names_size = names.size();
+
+  std::string image(reinterpret_cast<const char*>(&header), sizeof(header));
+  image.append(reinterpret_cast<const char*>(program.begin()),
+               program.size() * sizeof(Instruction));
+  image.append(names);
+  header.checksum = Fingerprint(std::string_view(image).substr(sizeof(header)));
+  memcpy(&image[0], &header, sizeof(header));
+  return image;
+}
+
+std::optional<Bytecode> ParseBytecode(std::string_view data) {
+  BytecodeHeader header;
+  if (!IsBytecode(data) || data.size() < sizeof(header)) {
+    LOG(ERROR) << "Not a .kxb file";
+    return std::nullopt;
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  if (header.version != kBytecodeVersion) {
+    LOG(ERROR) << "Unsupported .kxb version " << header.version;
+    return std::nullopt;
+  }
+  const uint64_t expected_size =
+      sizeof(header) +
+      static_cast<uint64_t>(header.instruction_count) * sizeof(Instruction) +
+      header.names_size;
+  if (data.size() != expected_size) {
+    LOG(ERROR) << "Wrong .kxb size " << data.size() << ", expected "
+               << expected_size;
+    return std::nullopt;
+  }
+  if (Fingerprint(data.substr(sizeof(header))) != header.checksum) {
+    LOG(ERROR) << "Corrupted .kxb file";
+    return std::nullopt;
+  }
+  if (reinterpret_cast<uintptr_t>(data.data()) % alignof(Instruction) != 0) {
+    LOG(ERROR) << "Misaligned .kxb image";
+    return std::nullopt;
+  }
+
+  Bytecode bytecode;
+  bytecode.program = ProgramView(
+      reinterpret_cast<const Instruction*>(data.data() + sizeof(header)),
+      header.instruction_count);
+  // The checksum is easy to forge, so the stacks are proven safe again.
+  if (!VerifyInstructions(bytecode.program))
+    return std::nullopt;
+
+  std::string_view names = data.substr(
+      sizeof(header) + header.instruction_count * sizeof(Instruction));
+  while (!names.empty()) {
+    uint32_t length;
+    if (names.size() < sizeof(length)) {
+      LOG(ERROR) << "Truncated .kxb function name table";
+      return std::nullopt;
+    }
+    memcpy(&length, names.data(), sizeof(length));
+    names.remove_prefix(sizeof(length));
+    if (names.size() < length) {
+      LOG(ERROR) << "Truncated .kxb function name table";
+      return std::nullopt;
+    }
+    bytecode.function_names.push_back(names.substr(0, length));
+    names.remove_prefix(length);
+  }
+  return bytecode;
+}
+
+std::string BytecodeCachePath(const std::string& cache_dir,
+                              std::string_view source,
+                              std::string_view version) {
+  const uint64_t key = Fingerprint(
+      source,
+      Fingerprint(StringPrintf("%" PRIu32 " ", kBytecodeVersion) +
+                  std::string(version) + " " + BuildFingerprint()));
+  return StringPrintf("%s/%016" PRIx64 ".kxb", cache_dir.c_str(), key);
+}
+
+BytecodeFile::BytecodeFile(ScopedMmap mapping, Bytecode bytecode)
+    : mapping_(std::move(mapping)), bytecode_(std::move(bytecode)) {}
+
+// static
+std::unique_ptr<BytecodeFile> BytecodeFile::Load(ScopedMmap mapping) {
+  if (!mapping)
+    return nullptr;
+  auto bytecode = ParseBytecode(std::string_view(
+      static_cast<const char*>(mapping.get()), mapping.size()));
+  if (!bytecode)
+    return nullptr;
+  return std::unique_ptr<BytecodeFile>(
+      new BytecodeFile(std::move(mapping), std::move(bytecode.value())));
+}
+
+}  // namespace karel
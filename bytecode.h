@@ -0,0 +1,96 @@
+#ifndef BYTECODE_H_
+#define BYTECODE_H_
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "karel.h"
+#include "macros.h"
+#include "util.h"
+
+namespace karel {
+
+/**
+ * Header of the .kxb binary bytecode format. A file is laid out as
+ *
+ *   BytecodeHeader
+ *   Instruction[instruction_count], exactly as laid out in memory
+ *   the function name table, names_size bytes
+ *
+ * The instructions are the ready to run stream, already optimized and fused,
+ * so loading a file is just mapping it and verifying it again. Everything is in the byte
+ * order of the machine that wrote it; files from a machine with the other
+ * order fail the version check.
+ */
+struct BytecodeHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t instruction_count;
+  // Each entry is a uint32_t length followed by the bytes of the name, in
+  // the order used by the arg2 of CALL.
+  uint32_t names_size;
+  // Fingerprint() of everything after the header. It catches truncated or
+  // corrupted files, not malicious ones, which ParseBytecode() rejects by
+  // verifying the instructions.
+  uint64_t checksum;
+};
+
+/** A .kxb image, with views into the memory that holds it. */
+struct Bytecode {
+  ProgramView program;
+  std::vector<std::string_view> function_names;
+};
+
+/** Returns whether |data| starts like a .kxb image. */
+bool IsBytecode(std::string_view data);
+
+/**
+ * Serializes |program| into a .kxb image. |program| must have gone through
+ * VerifyInstructions(), and usually OptimizeInstructions() and
+ * FuseInstructions() too.
+ */
+std::string SerializeBytecode(ProgramView program,
+                              const std::vector<std::string>& function_names);
+
+/**
+ * Validates the .kxb image in |data|, runs VerifyInstructions() on its
+ * program, and returns views into it, which are only valid as long as |data|
+ * is. |data| must be aligned like an
+ * Instruction, which mapped files and heap buffers are.
+ */
+std::optional<Bytecode> ParseBytecode(std::string_view data);
+
+/**
+ * Returns the path of the .kxb file that caches the compiled form of the .kx
+ * program in |source| inside |cache_dir|. The name is a hash of |source|,
+ * the .kxb format version, the interpreter |version| and the build of the
+ * running binary, so entries are never invalidated, just left behind when any
+ * of them changes.
+ */
+std::string BytecodeCachePath(const std::string& cache_dir,
+                              std::string_view source,
+                              std::string_view version);
+
+/** A .kxb file mapped into memory, whose instructions are used in place. */
+class BytecodeFile {
+ public:
+  /** Takes over the |mapping| of a .kxb file, if it is a valid one. */
+  static std::unique_ptr<BytecodeFile> Load(ScopedMmap mapping);
+
+  const Bytecode& bytecode() const { return bytecode_; }
+
+ private:
+  BytecodeFile(ScopedMmap mapping, Bytecode bytecode);
+
+  ScopedMmap mapping_;
+  Bytecode bytecode_;
+
+  DISALLOW_COPY_AND_ASSIGN(BytecodeFile);
+};
+
+}  // namespace karel
+
+#endif  // BYTECODE_H_
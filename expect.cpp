@@ -0,0 +1,356 @@
+#include "expect.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include "logging.h"
+
+namespace karel {
+
+namespace {
+
+// What diff -w ignores: every kind of whitespace but the newline.
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Strips the whitespace and the newlines around |str|.
+std::string_view Trim(std::string_view str) {
+  while (!str.empty() && (IsSpace(str.front()) || str.front() == '\n'))
+    str.remove_prefix(1);
+  while (!str.empty() && (IsSpace(str.back()) || str.back() == '\n'))
+    str.remove_suffix(1);
+  return str;
+}
+
+// A row of a world in the output:
+//
+//   <linea fila="3" compresionDeCeros="true">(2) 5 1 (7) 3 </linea>
+struct Linea {
+  size_t fila;
+  std::string_view cells;
+};
+
+std::optional<Linea> ParseLinea(std::string_view line) {
+  constexpr std::string_view kStart("<linea");
+  constexpr std::string_view kFila("fila=\"");
+  constexpr std::string_view kEnd("</linea>");
+  if (line.substr(0, kStart.size()) != kStart)
+    return std::nullopt;
+  const size_t tag_end = line.find('>');
+  const size_t fila = line.find(kFila);
+  const size_t end = line.rfind(kEnd);
+  if (tag_end == std::string_view::npos || fila == std::string_view::npos ||
+      fila > tag_end || end == std::string_view::npos || end < tag_end) {
+    return std::nullopt;
+  }
+  const size_t fila_start = fila + kFila.size();
+  auto value = ParseDecimal<size_t>(
+      line.substr(fila_start, line.find('"', fila_start) - fila_start));
+  if (!value)
+    return std::nullopt;
+  return Linea{value.value(), line.substr(tag_end + 1, end - tag_end - 1)};
+}
+
+// Walks the cells of a <linea> with compresionDeCeros: "(x)" moves to
+// columna x, and each number is the buzzers of a columna, left to right.
+class CellReader {
+ public:
+  explicit CellReader(std::string_view cells) : cells_(cells) {}
+
+  // Moves to the next cell with buzzers. Returns false at the end, and on
+  // anything that does not look like a cell.
+  bool Next(size_t* columna, uint32_t* buzzers) {
+    while (true) {
+      while (!cells_.empty() && IsSpace(cells_.front()))
+        cells_.remove_prefix(1);
+      if (cells_.empty())
+        return false;
+      if (cells_.front() == '(') {
+        const size_t close = cells_.find(')');
+        auto value = ParseDecimal<size_t>(cells_.substr(1, close - 1));
+        if (close == std::string_view::npos || !value)
+          return false;
+        columna_ = value.value();
+        cells_.remove_prefix(close + 1);
+        continue;
+      }
+      size_t length = 0;
+      while (length < cells_.size() && cells_[length] >= '0' &&
+             cells_[length] <= '9') {
+        ++length;
+      }
+      auto value = ParseDecimal<uint32_t>(cells_.substr(0, length));
+      if (!value)
+        return false;
+      cells_.remove_prefix(length);
+      if (value.value() == 0) {
+        ++columna_;
+        continue;
+      }
+      *columna = columna_++;
+      *buzzers = value.value();
+      return true;
+    }
+  }
+
+ private:
+  std::string_view cells_;
+  size_t columna_ = 1;
+};
+
+// Finds the first cell that differs between two versions of the same
+// <linea>, if both lines are one.
+void CompareCells(Mismatch* mismatch) {
+  auto expected = ParseLinea(mismatch->expected);
+  auto actual = ParseLinea(mismatch->actual);
+  if (!expected || !actual || expected->fila != actual->fila)
+    return;
+  mismatch->fila = expected->fila;
+
+  CellReader expected_reader(expected->cells), actual_reader(actual->cells);
+  size_t expected_columna = 0, actual_columna = 0;
+  uint32_t expected_buzzers = 0, actual_buzzers = 0;
+  bool has_expected = expected_reader.Next(&expected_columna, &expected_buzzers);
+  bool has_actual = actual_reader.Next(&actual_columna, &actual_buzzers);
+  while (has_expected || has_actual) {
+    if (has_expected && (!has_actual || expected_columna < actual_columna)) {
+      mismatch->columna = expected_columna;
+      mismatch->expected_buzzers = expected_buzzers;
+      return;
+    }
+    if (has_actual && (!has_expected || actual_columna < expected_columna)) {
+      mismatch->columna = actual_columna;
+      mismatch->actual_buzzers = actual_buzzers;
+      return;
+    }
+    if (expected_buzzers != actual_buzzers) {
+      mismatch->columna = expected_columna;
+      mismatch->expected_buzzers = expected_buzzers;
+      mismatch->actual_buzzers = actual_buzzers;
+      return;
+    }
+    has_expected = expected_reader.Next(&expected_columna, &expected_buzzers);
+    has_actual = actual_reader.Next(&actual_columna, &actual_buzzers);
+  }
+}
+
+std::optional<std::vector<uint8_t>> ReadFile(const std::string& path) {
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return std::nullopt;
+  }
+  return ReadFully(fd.get());
+}
+
+}  // namespace
+
+std::string_view VerdictName(Verdict verdict) {
+  switch (verdict) {
+    case Verdict::OK:
+      return "OK";
+    case Verdict::WRONG_OUTPUT:
+      return "WRONG_OUTPUT";
+    case Verdict::WRONG_STDERR:
+      return "WRONG_STDERR";
+    case Verdict::WRONG_SIGNAL:
+      return "WRONG_SIGNAL";
+  }
+  return "";
+}
+
+OutputComparator::OutputComparator(std::string_view expected)
+    : expected_(expected) {}
+
+void OutputComparator::Write(std::string_view data) {
+  if (done_)
+    return;
+  for (char c : data) {
+    if (c == '\n') {
+      EndActualLine();
+      if (done_)
+        return;
+      continue;
+    }
+    actual_.push_back(c);
+    if (mismatch_ || IsSpace(c))
+      continue;
+    actual_has_text_ = true;
+    if (NextExpected() != static_cast<unsigned char>(c))
+      mismatch_ = true;
+  }
+}
+
+std::optional<Mismatch> OutputComparator::Finish() {
+  if (!done_) {
+    // A last line without a newline still counts.
+    if (actual_has_text_)
+      EndActualLine();
+    if (!mismatch_ && NextExpected() != kEnd)
+      mismatch_ = true;
+    done_ = true;
+  }
+  if (!mismatch_)
+    return std::nullopt;
+
+  Mismatch mismatch;
+  mismatch.expected_line = expected_line_;
+  mismatch.actual_line = actual_line_;
+  std::string_view expected_line = expected_.substr(expected_line_start_);
+  expected_line = expected_line.substr(0, expected_line.find('\n'));
+  mismatch.expected = std::string(Trim(expected_line));
+  mismatch.actual = std::string(Trim(actual_));
+  CompareCells(&mismatch);
+  return mismatch;
+}
+
+int OutputComparator::NextExpected() {
+  while (true) {
+    if (expected_line_ended_) {
+      expected_line_start_ = expected_pos_;
+      ++expected_line_;
+      expected_has_text_ = false;
+      expected_line_ended_ = false;
+    }
+    if (expected_pos_ == expected_.size()) {
+      if (!expected_has_text_)
+        return kEnd;
+      // A last line without a newline still counts.
+      expected_line_ended_ = true;
+      return '\n';
+    }
+    const char c = expected_[expected_pos_++];
+    if (c == '\n') {
+      expected_line_ended_ = true;
+      if (expected_has_text_)
+        return '\n';
+      continue;
+    }
+    if (IsSpace(c))
+      continue;
+    expected_has_text_ = true;
+    return static_cast<unsigned char>(c);
+  }
+}
+
+void OutputComparator::EndActualLine() {
+  if (mismatch_) {
+    done_ = true;
+    return;
+  }
+  if (actual_has_text_ && NextExpected() != '\n') {
+    mismatch_ = true;
+    done_ = true;
+    return;
+  }
+  actual_.clear();
+  ++actual_line_;
+  actual_has_text_ = false;
+}
+
+// static
+std::optional<Expectation> Expectation::Load(const std::string& output_path) {
+  Expectation expectation;
+  ScopedFD fd(open(output_path.c_str(), O_RDONLY));
+  if (!fd) {
+    PLOG(ERROR) << "Failed to open " << output_path;
+    return std::nullopt;
+  }
+  expectation.output_mapping_ = MapFile(fd.get());
+  if (!expectation.output_mapping_)
+    expectation.output_bytes_ = ReadFully(fd.get());
+
+  constexpr std::string_view kOutputSuffix(".out");
+  std::string base = output_path;
+  if (base.size() >= kOutputSuffix.size() &&
+      std::string_view(base).substr(base.size() - kOutputSuffix.size()) ==
+          kOutputSuffix) {
+    base.resize(base.size() - kOutputSuffix.size());
+  }
+  const std::string stderr_path = base + ".stderr";
+  if (access(stderr_path.c_str(), F_OK) == 0) {
+    expectation.stderr_ = ReadFile(stderr_path);
+    if (!expectation.stderr_)
+      return std::nullopt;
+  }
+  const std::string signal_path = base + ".signal";
+  if (access(signal_path.c_str(), F_OK) == 0) {
+    auto signal = ReadFile(signal_path);
+    if (!signal)
+      return std::nullopt;
+    expectation.signal_ = std::string(Trim(std::string_view(
+        reinterpret_cast<const char*>(signal->data()), signal->size())));
+  }
+  return expectation;
+}
+
+std::string_view Expectation::output() const {
+  if (output_mapping_) {
+    return std::string_view(static_cast<const char*>(output_mapping_.get()),
+                            output_mapping_.size());
+  }
+  return std::string_view(reinterpret_cast<const char*>(output_bytes_.data()),
+                          output_bytes_.size());
+}
+
+Verdict Expectation::Judge(RunResult result,
+                           OutputComparator* comparator,
+                           Mismatch* mismatch) const {
+  if (auto output_mismatch = comparator->Finish()) {
+    *mismatch = std::move(output_mismatch.value());
+    return Verdict::WRONG_OUTPUT;
+  }
+  if (stderr_) {
+    OutputComparator stderr_comparator(std::string_view(
+        reinterpret_cast<const char*>(stderr_->data()), stderr_->size()));
+    if (result != RunResult::OK)
+      stderr_comparator.Write(RunResultMessage(result));
+    if (auto stderr_mismatch = stderr_comparator.Finish()) {
+      *mismatch = std::move(stderr_mismatch.value());
+      return Verdict::WRONG_STDERR;
+    }
+  }
+  if (signal_) {
+    // What the shell sees of the exit code.
+    const std::string signal =
+        std::to_string(static_cast<int32_t>(result) & 0xFF);
+    if (signal != signal_.value()) {
+      mismatch->expected = signal_.value();
+      mismatch->actual = signal;
+      return Verdict::WRONG_SIGNAL;
+    }
+  }
+  return Verdict::OK;
+}
+
+std::string VerdictJson(Verdict verdict, const Mismatch& mismatch) {
+  std::string json("\"verdict\":");
+  AppendJsonString(&json, VerdictName(verdict));
+  if (verdict == Verdict::OK)
+    return json;
+  auto append_number = [&json](std::string_view name, uint64_t value) {
+    json.append(",\"").append(name).append("\":");
+    json.append(std::to_string(value));
+  };
+  if (mismatch.expected_line != 0) {
+    append_number("expected_line", mismatch.expected_line);
+    append_number("actual_line", mismatch.actual_line);
+  }
+  if (mismatch.fila != 0)
+    append_number("fila", mismatch.fila);
+  if (mismatch.columna != 0) {
+    append_number("columna", mismatch.columna);
+    append_number("expected_buzzers", mismatch.expected_buzzers);
+    append_number("actual_buzzers", mismatch.actual_buzzers);
+  }
+  json.append(",\"expected\":");
+  AppendJsonString(&json, mismatch.expected);
+  json.append(",\"actual\":");
+  AppendJsonString(&json, mismatch.actual);
+  return json;
+}
+
+}  // namespace karel
@@ -0,0 +1,133 @@
+#ifndef EXPECT_H_
+#define EXPECT_H_
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "karel.h"
+#include "macros.h"
+#include "util.h"
+#include "xml.h"
+
+namespace karel {
+
+/** How a run compares to what was expected of it. */
+enum class Verdict : uint8_t {
+  OK,
+  WRONG_OUTPUT,
+  WRONG_STDERR,
+  WRONG_SIGNAL,
+};
+
+std::string_view VerdictName(Verdict verdict);
+
+/** The first difference between an expected and an actual output. */
+struct Mismatch {
+  // Line numbers, from 1, in each of the outputs.
+  size_t expected_line = 0;
+  size_t actual_line = 0;
+  // The lines themselves without their surrounding whitespace, or empty past
+  // the end of an output. For WRONG_SIGNAL, the exit codes instead.
+  std::string expected;
+  std::string actual;
+  // When both lines are the same <linea> of a world, its fila and the
+  // columna of the first cell that differs, from 1 as in the output, and the
+  // buzzers on each side. Zero otherwise.
+  size_t fila = 0;
+  size_t columna = 0;
+  uint32_t expected_buzzers = 0;
+  uint32_t actual_buzzers = 0;
+};
+
+/**
+ * Compares the output that is written into it against |expected| the way
+ * diff -w --ignore-blank-lines does: whitespace and blank lines don't count.
+ * Nothing but the current line of the output is kept, and the comparison
+ * stops at the first difference.
+ */
+class OutputComparator : public xml::Sink {
+ public:
+  explicit OutputComparator(std::string_view expected);
+
+  void Write(std::string_view data) override;
+
+  /** Ends the output. Returns where it differs from |expected|, if it does. */
+  std::optional<Mismatch> Finish();
+
+ private:
+  // Returns the next character of |expected_| that counts, with a '\n' only
+  // at the end of the lines that are not blank, or kEnd.
+  int NextExpected();
+  void EndActualLine();
+
+  static constexpr int kEnd = -1;
+
+  const std::string_view expected_;
+  size_t expected_pos_ = 0;
+  size_t expected_line_ = 1;
+  size_t expected_line_start_ = 0;
+  bool expected_has_text_ = false;
+  // Set once the current line of |expected_| has been consumed.
+  bool expected_line_ended_ = false;
+
+  // The current line of the output, as it was written.
+  std::string actual_;
+  size_t actual_line_ = 1;
+  bool actual_has_text_ = false;
+
+  // Set at the first difference. The rest of that line of the output is
+  // still collected, and then everything else is ignored.
+  bool mismatch_ = false;
+  bool done_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(OutputComparator);
+};
+
+/**
+ * What a run is expected to produce, as test.rte.sh has it: the .out file
+ * with the output, and next to it, when they exist, the .stderr file with
+ * the message of the run and the .signal file with its exit code.
+ */
+class Expectation {
+ public:
+  Expectation(Expectation&&) = default;
+  Expectation& operator=(Expectation&&) = default;
+
+  /** Reads |output_path| and its siblings. Returns nullopt on errors. */
+  static std::optional<Expectation> Load(const std::string& output_path);
+
+  std::string_view output() const;
+
+  /**
+   * Finishes |comparator|, which got the output of a run that ended with
+   * |result|, and judges the run. When it is not OK, |mismatch| gets the
+   * first difference.
+   */
+  Verdict Judge(RunResult result,
+                OutputComparator* comparator,
+                Mismatch* mismatch) const;
+
+ private:
+  Expectation() = default;
+
+  ScopedMmap output_mapping_;
+  std::vector<uint8_t> output_bytes_;
+  std::optional<std::vector<uint8_t>> stderr_;
+  std::optional<std::string> signal_;
+
+  DISALLOW_COPY_AND_ASSIGN(Expectation);
+};
+
+/**
+ * Formats |verdict| as the members of a JSON object, without the braces, so
+ * that callers can add their own: "verdict":"OK", plus the fields of
+ * |mismatch| when it is not OK.
+ */
+std::string VerdictJson(Verdict verdict, const Mismatch& mismatch);
+
+}  // namespace karel
+
+#endif  // EXPECT_H_
@@ -0,0 +1,291 @@
+#ifndef GRID_H_
+#define GRID_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "macros.h"
+
+namespace karel {
+
+/** How the cells of a world are laid out in memory. */
+enum class WorldLayout : uint8_t {
+  /** Row-major arrays of buzzers and walls, the |buzzers| and |walls| of Runtime. */
+  FLAT,
+  /** Buzzers and walls together in one record per cell, in 8x8 tiles. */
+  TILED,
+  /** Only the cells with buzzers or inner walls, in hash maps. */
+  SPARSE,
+  /** 4-bit walls and buzzers that take one byte unless they need four. */
+  PACKED,
+};
+
+/**
+ * Storage for the cells of a world in any layout other than FLAT. The
+ * engines look at |layout| once per run and then use the accessors of the
+ * concrete class, so no cell access goes through a virtual call.
+ */
+class Grid {
+ public:
+  virtual ~Grid() = default;
+
+  const WorldLayout layout;
+
+ protected:
+  explicit Grid(WorldLayout layout) : layout(layout) {}
+};
+
+/**
+ * Accessors for the cells of a world. There is one class like this per
+ * layout, and the engines and World are templates over them. All of them
+ * have the same interface and are cheap to copy.
+ */
+class FlatCells {
+ public:
+  FlatCells(uint32_t* buzzers, uint8_t* walls, size_t width)
+      : buzzers_(buzzers), walls_(walls), width_(width) {}
+
+  uint8_t walls(size_t x, size_t y) const { return walls_[index(x, y)]; }
+  void set_walls(size_t x, size_t y, uint8_t walls) {
+    walls_[index(x, y)] = walls;
+  }
+  uint32_t buzzers(size_t x, size_t y) const { return buzzers_[index(x, y)]; }
+  void set_buzzers(size_t x, size_t y, uint32_t count) {
+    buzzers_[index(x, y)] = count;
+  }
+
+ private:
+  size_t index(size_t x, size_t y) const { return y * width_ + x; }
+
+  uint32_t* buzzers_;
+  uint8_t* walls_;
+  size_t width_;
+};
+
+/**
+ * The TILED layout. Moving north or south in a wide FLAT world jumps a whole
+ * row of buzzers and another one of walls. Here each row of a tile is one
+ * 64-byte line of 8-byte cell records, so reading the walls and the buzzers
+ * of a cell touches a single line, and the cells above and below are in the
+ * lines next to it.
+ */
+class TiledGrid : public Grid {
+ public:
+  static constexpr size_t kTileShift = 3;
+  static constexpr size_t kTileSize = 1 << kTileShift;
+
+  struct Cell {
+    uint32_t buzzers;
+    uint8_t walls;
+  };
+  struct alignas(64) Tile {
+    Cell cells[kTileSize * kTileSize];
+  };
+  static_assert(sizeof(Cell) * kTileSize == 64,
+                "Each row of a tile must be a cache line");
+
+  /** Creates an empty world: no buzzers and no walls at all. */
+  TiledGrid(size_t width, size_t height)
+      : Grid(WorldLayout::TILED),
+        tiles_per_row_((width + kTileSize - 1) >> kTileShift),
+        tiles_(std::make_unique<Tile[]>(
+            tiles_per_row_ * ((height + kTileSize - 1) >> kTileShift))) {}
+
+  class Cells {
+   public:
+    uint8_t walls(size_t x, size_t y) const { return at(x, y).walls; }
+    void set_walls(size_t x, size_t y, uint8_t walls) { at(x, y).walls = walls; }
+    uint32_t buzzers(size_t x, size_t y) const { return at(x, y).buzzers; }
+    void set_buzzers(size_t x, size_t y, uint32_t count) {
+      at(x, y).buzzers = count;
+    }
+
+   private:
+    friend class TiledGrid;
+    Cells(Tile* tiles, size_t tiles_per_row)
+        : tiles_(tiles), tiles_per_row_(tiles_per_row) {}
+
+    Cell& at(size_t x, size_t y) const {
+      constexpr size_t kMask = kTileSize - 1;
+      return tiles_[(y >> kTileShift) * tiles_per_row_ + (x >> kTileShift)]
+          .cells[((y & kMask) << kTileShift) | (x & kMask)];
+    }
+
+    Tile* tiles_;
+    size_t tiles_per_row_;
+  };
+
+  Cells cells() { return Cells(tiles_.get(), tiles_per_row_); }
+
+ private:
+  const size_t tiles_per_row_;
+  std::unique_ptr<Tile[]> tiles_;
+
+  DISALLOW_COPY_AND_ASSIGN(TiledGrid);
+};
+
+/**
+ * The SPARSE layout, for huge worlds with few buzzers and walls, where the
+ * other layouts would need several bytes for every cell before the program
+ * runs at all. The outer walls are implied by the size of the world, so
+ * only the cells that have buzzers and the cells whose walls differ from
+ * that take any memory.
+ */
+class SparseGrid : public Grid {
+ public:
+  SparseGrid(size_t width, size_t height)
+      : Grid(WorldLayout::SPARSE), width_(width), height_(height) {}
+
+  class Cells {
+   public:
+    uint8_t walls(size_t x, size_t y) const {
+      if (!grid_->walls_.empty()) {
+        auto it = grid_->walls_.find(grid_->key(x, y));
+        if (it != grid_->walls_.end())
+          return it->second;
+      }
+      return grid_->outer_walls(x, y);
+    }
+    void set_walls(size_t x, size_t y, uint8_t walls) {
+      if (walls == grid_->outer_walls(x, y))
+        grid_->walls_.erase(grid_->key(x, y));
+      else
+        grid_->walls_[grid_->key(x, y)] = walls;
+    }
+    uint32_t buzzers(size_t x, size_t y) const {
+      auto it = grid_->buzzers_.find(grid_->key(x, y));
+      return it == grid_->buzzers_.end() ? 0 : it->second;
+    }
+    void set_buzzers(size_t x, size_t y, uint32_t count) {
+      if (count)
+        grid_->buzzers_[grid_->key(x, y)] = count;
+      else
+        grid_->buzzers_.erase(grid_->key(x, y));
+    }
+
+   private:
+    friend class SparseGrid;
+    explicit Cells(SparseGrid* grid) : grid_(grid) {}
+
+    SparseGrid* grid_;
+  };
+
+  Cells cells() { return Cells(this); }
+
+  // The cells with buzzers and the cells whose walls are not just the outer
+  // ones, keyed by key(), in no particular order.
+  const std::unordered_map<uint64_t, uint32_t>& buzzers() const {
+    return buzzers_;
+  }
+  const std::unordered_map<uint64_t, uint8_t>& walls() const { return walls_; }
+
+  uint64_t key(size_t x, size_t y) const {
+    return static_cast<uint64_t>(y) * width_ + x;
+  }
+  size_t x(uint64_t key) const { return key % width_; }
+  size_t y(uint64_t key) const { return key / width_; }
+
+ private:
+  uint8_t outer_walls(size_t x, size_t y) const {
+    return (x == 0 ? 1 << 0 : 0) | (y + 1 == height_ ? 1 << 1 : 0) |
+           (x + 1 == width_ ? 1 << 2 : 0) | (y == 0 ? 1 << 3 : 0);
+  }
+
+  const size_t width_;
+  const size_t height_;
+  std::unordered_map<uint64_t, uint32_t> buzzers_;
+  std::unordered_map<uint64_t, uint8_t> walls_;
+
+  DISALLOW_COPY_AND_ASSIGN(SparseGrid);
+};
+
+/**
+ * The PACKED layout, for holding many large worlds at once. Walls take 4
+ * bits per cell. Buzzers take one byte per cell, and each run of kTileSize
+ * cells in row-major order gets its own array of uint32_t the first time
+ * one of them needs more than that, as with kInfinity. A world takes about
+ * 1.6 bytes per cell instead of 5.
+ */
+class PackedGrid : public Grid {
+ public:
+  static constexpr size_t kTileShift = 6;
+  static constexpr size_t kTileSize = 1 << kTileShift;
+
+  /** Creates an empty world: no buzzers and no walls at all. */
+  PackedGrid(size_t width, size_t height)
+      : Grid(WorldLayout::PACKED),
+        width_(width),
+        cell_count_(width * height),
+        narrow_buzzers_(std::make_unique<uint8_t[]>(width * height)),
+        walls_(std::make_unique<uint8_t[]>((width * height + 1) / 2)),
+        wide_buzzers_(std::make_unique<std::unique_ptr<uint32_t[]>[]>(
+            (width * height + kTileSize - 1) >> kTileShift)) {}
+
+  class Cells {
+   public:
+    uint8_t walls(size_t x, size_t y) const {
+      const size_t i = grid_->index(x, y);
+      return (grid_->walls_[i >> 1] >> ((i & 1) << 2)) & 0xF;
+    }
+    void set_walls(size_t x, size_t y, uint8_t walls) {
+      const size_t i = grid_->index(x, y);
+      const int shift = (i & 1) << 2;
+      uint8_t& pair = grid_->walls_[i >> 1];
+      pair = (pair & ~(0xF << shift)) | ((walls & 0xF) << shift);
+    }
+    uint32_t buzzers(size_t x, size_t y) const {
+      const size_t i = grid_->index(x, y);
+      if (const uint32_t* wide = grid_->wide_buzzers_[i >> kTileShift].get())
+        return wide[i & (kTileSize - 1)];
+      return grid_->narrow_buzzers_[i];
+    }
+    void set_buzzers(size_t x, size_t y, uint32_t count) {
+      const size_t i = grid_->index(x, y);
+      auto& wide = grid_->wide_buzzers_[i >> kTileShift];
+      if (!wide) {
+        if (count <= UINT8_MAX) {
+          grid_->narrow_buzzers_[i] = count;
+          return;
+        }
+        grid_->Widen(i >> kTileShift);
+      }
+      wide[i & (kTileSize - 1)] = count;
+    }
+
+   private:
+    friend class PackedGrid;
+    explicit Cells(PackedGrid* grid) : grid_(grid) {}
+
+    PackedGrid* grid_;
+  };
+
+  Cells cells() { return Cells(this); }
+
+ private:
+  size_t index(size_t x, size_t y) const { return y * width_ + x; }
+
+  // Moves the buzzers of |tile| into a new array of uint32_t.
+  void Widen(size_t tile) {
+    auto wide = std::make_unique<uint32_t[]>(kTileSize);
+    const size_t begin = tile << kTileShift;
+    const size_t end = std::min(begin + kTileSize, cell_count_);
+    for (size_t i = begin; i < end; ++i)
+      wide[i - begin] = narrow_buzzers_[i];
+    wide_buzzers_[tile] = std::move(wide);
+  }
+
+  const size_t width_;
+  const size_t cell_count_;
+  std::unique_ptr<uint8_t[]> narrow_buzzers_;
+  std::unique_ptr<uint8_t[]> walls_;
+  std::unique_ptr<std::unique_ptr<uint32_t[]>[]> wide_buzzers_;
+
+  DISALLOW_COPY_AND_ASSIGN(PackedGrid);
+};
+
+}  // namespace karel
+
+#endif  // GRID_H_
@@ -1,14 +1,19 @@
 #include "karel.h"
 
+#include <array>
+#include <initializer_list>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
 #include <optional>
 #include <sstream>
-#include <stack>
 #include <string>
+#include <type_traits>
 
 #include "json.h"
 #include "logging.h"
+#include "macros.h"
 #include "util.h"
 
 namespace karel {
@@ -17,7 +22,7 @@ namespace {
 
 constexpr bool kDebug = false;
 
-std::string Stringify(const std::vector<int32_t>& expression_stack) {
+std::string Stringify(const FlatStack<int32_t>& expression_stack) {
   std::ostringstream buffer;
   buffer << "[";
   bool first = true;
@@ -32,80 +37,138 @@ std::string Stringify(const std::vector<int32_t>& expression_stack) {
   return buffer.str();
 }
 
+// The operands that follow each mnemonic in the JSON format.
+enum class Operands : uint8_t {
+  NONE,
+  // An integer.
+  INT,
+  // The line and column.
+  LINE,
+  // The name of a RunResult.
+  RESULT,
+  // The parameter count and the name of the function.
+  CALL,
+};
+
+struct Mnemonic {
+  std::string_view name;
+  Opcode opcode;
+  Operands operands;
+};
+
+constexpr Mnemonic kMnemonics[] = {
+    {"HALT", Opcode::HALT, Operands::NONE},
+    {"LINE", Opcode::LINE, Operands::LINE},
+    {"LEFT", Opcode::LEFT, Operands::NONE},
+    {"WORLDWALLS", Opcode::WORLDWALLS, Operands::NONE},
+    {"ORIENTATION", Opcode::ORIENTATION, Operands::NONE},
+    {"ROTL", Opcode::ROTL, Operands::NONE},
+    {"ROTR", Opcode::ROTR, Operands::NONE},
+    {"MASK", Opcode::MASK, Operands::NONE},
+    {"NOT", Opcode::NOT, Operands::NONE},
+    {"AND", Opcode::AND, Operands::NONE},
+    {"OR", Opcode::OR, Operands::NONE},
+    {"EQ", Opcode::EQ, Operands::NONE},
+    {"EZ", Opcode::EZ, Operands::RESULT},
+    {"JZ", Opcode::JZ, Operands::INT},
+    {"JMP", Opcode::JMP, Operands::INT},
+    {"FORWARD", Opcode::FORWARD, Operands::NONE},
+    {"WORLDBUZZERS", Opcode::WORLDBUZZERS, Operands::NONE},
+    {"BAGBUZZERS", Opcode::BAGBUZZERS, Operands::NONE},
+    {"PICKBUZZER", Opcode::PICKBUZZER, Operands::NONE},
+    {"LEAVEBUZZER", Opcode::LEAVEBUZZER, Operands::NONE},
+    {"LOAD", Opcode::LOAD, Operands::INT},
+    {"POP", Opcode::POP, Operands::NONE},
+    {"DUP", Opcode::DUP, Operands::NONE},
+    {"DEC", Opcode::DEC, Operands::INT},
+    {"INC", Opcode::INC, Operands::INT},
+    {"CALL", Opcode::CALL, Operands::CALL},
+    {"RET", Opcode::RET, Operands::NONE},
+    {"PARAM", Opcode::PARAM, Operands::INT},
+    {"SRET", Opcode::SRET, Operands::NONE},
+    {"LRET", Opcode::LRET, Operands::NONE},
+    {"LT", Opcode::LT, Operands::NONE},
+    {"LTE", Opcode::LTE, Operands::NONE},
+    {"COLUMN", Opcode::COLUMN, Operands::NONE},
+    {"ROW", Opcode::ROW, Operands::NONE},
+};
+
+// Slots in the mnemonic hash table. The hash below has been chosen so that
+// all the mnemonics land on a different slot.
+constexpr size_t kMnemonicSlots = 64;
+
+constexpr size_t HashMnemonic(std::string_view name) {
+  return (16 * name.front() + 11 * name[1] + 10 * name.back() +
+          3 * name.size()) % kMnemonicSlots;
+}
+
+constexpr std::array<int8_t, kMnemonicSlots> BuildMnemonicTable() {
+  std::array<int8_t, kMnemonicSlots> table{};
+  for (size_t slot = 0; slot < kMnemonicSlots; ++slot)
+    table[slot] = -1;
+  for (size_t i = 0; i < std::size(kMnemonics); ++i)
+    table[HashMnemonic(kMnemonics[i].name)] = i;
+  return table;
+}
+
+constexpr std::array<int8_t, kMnemonicSlots> kMnemonicTable =
+    BuildMnemonicTable();
+
+constexpr bool IsPerfectMnemonicTable() {
+  for (size_t i = 0; i < std::size(kMnemonics); ++i) {
+    if (kMnemonicTable[HashMnemonic(kMnemonics[i].name)] !=
+        static_cast<int8_t>(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static_assert(IsPerfectMnemonicTable(), "Two mnemonics share a hash slot");
+
+const Mnemonic* FindMnemonic(std::string_view name) {
+  // Every mnemonic has at least two characters.
+  if (name.size() < 2)
+    return nullptr;
+  int8_t index = kMnemonicTable[HashMnemonic(name)];
+  if (index == -1 || kMnemonics[index].name != name)
+    return nullptr;
+  return &kMnemonics[index];
+}
+
 std::optional<Opcode> ParseOpcode(std::string_view name) {
-  if (name == "HALT")
-    return Opcode::HALT;
-  if (name == "LINE")
-    return Opcode::LINE;
-  if (name == "LEFT")
-    return Opcode::LEFT;
-  if (name == "WORLDWALLS")
-    return Opcode::WORLDWALLS;
-  if (name == "ORIENTATION")
-    return Opcode::ORIENTATION;
-  if (name == "ROTL")
-    return Opcode::ROTL;
-  if (name == "ROTR")
-    return Opcode::ROTR;
-  if (name == "MASK")
-    return Opcode::MASK;
-  if (name == "NOT")
-    return Opcode::NOT;
-  if (name == "AND")
-    return Opcode::AND;
-  if (name == "OR")
-    return Opcode::OR;
-  if (name == "EQ")
-    return Opcode::EQ;
-  if (name == "EZ")
-    return Opcode::EZ;
-  if (name == "JZ")
-    return Opcode::JZ;
-  if (name == "JMP")
-    return Opcode::JMP;
-  if (name == "FORWARD")
-    return Opcode::FORWARD;
-  if (name == "WORLDBUZZERS")
-    return Opcode::WORLDBUZZERS;
-  if (name == "BAGBUZZERS")
-    return Opcode::BAGBUZZERS;
-  if (name == "PICKBUZZER")
-    return Opcode::PICKBUZZER;
-  if (name == "LEAVEBUZZER")
-    return Opcode::LEAVEBUZZER;
-  if (name == "LOAD")
-    return Opcode::LOAD;
-  if (name == "POP")
-    return Opcode::POP;
-  if (name == "DUP")
-    return Opcode::DUP;
-  if (name == "DEC")
-    return Opcode::DEC;
-  if (name == "INC")
-    return Opcode::INC;
-  if (name == "CALL")
-    return Opcode::CALL;
-  if (name == "RET")
-    return Opcode::RET;
-  if (name == "PARAM")
-    return Opcode::PARAM;
-  if (name == "SRET")
-    return Opcode::SRET;
-  if (name == "LRET")
-    return Opcode::LRET;
-  if (name == "LT")
-    return Opcode::LT;
-  if (name == "LTE")
-    return Opcode::LTE;
-  if (name == "COLUMN")
-    return Opcode::COLUMN;
-  if (name == "ROW")
-    return Opcode::ROW;
-  LOG(ERROR) << "Invalid mnemonic: " << name;
-  return std::nullopt;
+  const Mnemonic* mnemonic = FindMnemonic(name);
+  if (!mnemonic) {
+    LOG(ERROR) << "Invalid mnemonic: " << name;
+    return std::nullopt;
+  }
+  return mnemonic->opcode;
 }
 
-std::optional<RunResult> ParseRunResult(std::string_view name) {
+bool IsValidRunResult(int32_t value) {
+  switch (static_cast<RunResult>(value)) {
+    case RunResult::OK:
+    case RunResult::WALL:
+    case RunResult::WORLDUNDERFLOW:
+    case RunResult::BAGUNDERFLOW:
+    case RunResult::STACK:
+    case RunResult::STACKMEMORY:
+    case RunResult::CALLSIZE:
+    case RunResult::INTEGEROVERFLOW:
+    case RunResult::INTEGERUNDERFLOW:
+    case RunResult::WORLDOVERFLOW:
+    case RunResult::BAGOVERFLOW:
+    case RunResult::INSTRUCTION:
+    case RunResult::INSTRUCTION_LEFT:
+    case RunResult::INSTRUCTION_FORWARD:
+    case RunResult::INSTRUCTION_PICK:
+    case RunResult::INSTRUCTION_LEAVE:
+      return true;
+  }
+  return false;
+}
+
+std::optional<RunResult> FindRunResult(std::string_view name) {
   if (name == "OK")
     return RunResult::OK;
   if (name == "INSTRUCTION")
@@ -118,10 +181,16 @@ std::optional<RunResult> ParseRunResult(std::string_view name) {
     return RunResult::BAGUNDERFLOW;
   if (name == "STACK")
     return RunResult::STACK;
-  LOG(ERROR) << "Invalid run result: " << name;
   return std::nullopt;
 }
 
+std::optional<RunResult> ParseRunResult(std::string_view name) {
+  auto result = FindRunResult(name);
+  if (!result)
+    LOG(ERROR) << "Invalid run result: " << name;
+  return result;
+}
+
 std::optional<Instruction> ParseInstruction(const json::ListValue& value) {
   if (value.value().size() == 0) {
     LOG(ERROR) << "Empty instruction " << value;
@@ -239,17 +308,211 @@ std::optional<Instruction> ParseInstruction(const json::ListValue& value) {
       }
       ins.arg = value.value()[1]->AsInt().value();
       return ins;
+
+    case Opcode::CHECKED_FORWARD:
+    case Opcode::CHECKED_PICK:
+    case Opcode::CHECKED_LEAVE:
+    case Opcode::FRONT_CLEAR_JZ:
+    case Opcode::LEFT_CLEAR_JZ:
+    case Opcode::RIGHT_CLEAR_JZ:
+    case Opcode::JNZ:
+    case Opcode::FORWARD_UNTIL_WALL:
+    case Opcode::PICK_ALL:
+      // Superinstructions only come out of FuseInstructions(), and JNZ out of
+      // OptimizeInstructions().
+      LOG(ERROR) << "Invalid opcode " << value;
+      return std::nullopt;
   }
 
   return ins;
 }
 
-struct StackFrame {
-  int32_t pc;
-  size_t param_sp;
-  size_t sp;
+// Gives |name| the next index in |name_indices| if it did not have one yet,
+// and returns its index.
+int32_t InternFunctionName(std::string_view name,
+                           std::map<std::string_view, int32_t>* name_indices,
+                           std::vector<std::string>* function_names) {
+  auto it = name_indices->emplace(name, name_indices->size()).first;
+  if (function_names && function_names->size() < name_indices->size())
+    function_names->emplace_back(name);
+  return it->second;
+}
+
+// An operand of an instruction, as read by ScanInstructions().
+struct ScannedOperand {
+  bool is_string = false;
+  int32_t value = 0;
+  std::string_view string;
 };
 
+void SkipSpaces(const char** ptr, const char* const end) {
+  while (*ptr != end &&
+         (**ptr == ' ' || **ptr == '\t' || **ptr == '\n' || **ptr == '\r')) {
+    (*ptr)++;
+  }
+}
+
+bool ScanOperand(const char** ptr,
+                 const char* const end,
+                 ScannedOperand* operand) {
+  SkipSpaces(ptr, end);
+  if (*ptr == end)
+    return false;
+  if (**ptr == '"') {
+    const char* string_begin = ++(*ptr);
+    for (; *ptr != end; (*ptr)++) {
+      if (**ptr == '"') {
+        operand->is_string = true;
+        operand->string =
+            std::string_view(string_begin, *ptr - string_begin);
+        (*ptr)++;
+        return true;
+      }
+      // Escapes never show up in compiled programs.
+      if (**ptr == '\\')
+        return false;
+    }
+    return false;
+  }
+
+  int64_t sign = 1;
+  if (**ptr == '-') {
+    sign = -1;
+    (*ptr)++;
+  }
+  const char* digits_begin = *ptr;
+  int64_t value = 0;
+  for (; *ptr != end && '0' <= **ptr && **ptr <= '9'; (*ptr)++) {
+    value = 10 * value + (**ptr - '0');
+    if (value > std::numeric_limits<int32_t>::max())
+      return false;
+  }
+  if (*ptr == digits_begin)
+    return false;
+  operand->value = sign * value;
+  return true;
+}
+
+// Reads the instructions in |program| in a single pass, without building the
+// JSON tree. It only takes the programs that the compiler emits, and returns
+// false on anything else, errors included, without logging: ParseInstructions()
+// then gives those to json::Parse(), which accepts the same programs and
+// explains the rejections.
+bool ScanInstructions(std::string_view program,
+                      std::vector<Instruction>* instructions,
+                      std::map<std::string_view, int32_t>* name_indices,
+                      std::vector<std::string>* function_names) {
+  const char* ptr = program.data();
+  const char* const end = ptr + program.size();
+
+  SkipSpaces(&ptr, end);
+  if (ptr == end || *ptr != '[')
+    return false;
+  ptr++;
+  while (true) {
+    SkipSpaces(&ptr, end);
+    if (ptr == end || *ptr != '[')
+      return false;
+    ptr++;
+
+    // The mnemonic and up to two arguments.
+    ScannedOperand operands[3];
+    size_t operand_count = 0;
+    while (true) {
+      if (operand_count == std::size(operands) ||
+          !ScanOperand(&ptr, end, &operands[operand_count++]) || ptr == end) {
+        return false;
+      }
+      if (*ptr == ']')
+        break;
+      if (*ptr != ',')
+        return false;
+      ptr++;
+    }
+    ptr++;
+
+    if (!operands[0].is_string)
+      return false;
+    const Mnemonic* mnemonic = FindMnemonic(operands[0].string);
+    if (!mnemonic)
+      return false;
+    Instruction ins{mnemonic->opcode, 0};
+    switch (mnemonic->operands) {
+      case Operands::NONE:
+        if (operand_count != 1)
+          return false;
+        break;
+
+      case Operands::INT:
+        if (operand_count != 2 || operands[1].is_string)
+          return false;
+        ins.arg = operands[1].value;
+        break;
+
+      case Operands::LINE:
+        if (operand_count != 3 || operands[1].is_string ||
+            operands[2].is_string) {
+          return false;
+        }
+        // Same as ParseInstruction().
+        ins.arg = operands[1].value;
+        ins.arg2 = operands[1].value;
+        break;
+
+      case Operands::RESULT: {
+        if (operand_count != 2 || !operands[1].is_string)
+          return false;
+        auto result = FindRunResult(operands[1].string);
+        if (!result)
+          return false;
+        ins.arg = static_cast<int32_t>(result.value());
+        break;
+      }
+
+      case Operands::CALL:
+        if (operand_count != 3 || operands[1].is_string)
+          return false;
+        ins.arg = operands[1].value;
+        if (operands[2].is_string) {
+          ins.arg2 = InternFunctionName(operands[2].string, name_indices,
+                                        function_names);
+        }
+        break;
+    }
+    instructions->push_back(ins);
+
+    if (ptr == end)
+      return false;
+    if (*ptr == ']')
+      break;
+    if (*ptr != ',')
+      return false;
+    ptr++;
+  }
+  return ++ptr == end;
+}
+
+// Length of the idioms replaced by each superinstruction. The branching ones
+// have two forms, so their length is kept in arg2 instead.
+constexpr int32_t kCheckedForwardLength = 7;
+constexpr int32_t kCheckedPickLength = 3;
+constexpr int32_t kCheckedLeaveLength = 3;
+
+// Longest chain of JMPs that OptimizeInstructions() folds into one.
+constexpr int32_t kMaxJumpChain = 64;
+
+// Instructions counted by each iteration of the FORWARD_UNTIL_WALL and
+// PICK_ALL loops: the branch in the head, the command and the JMP back.
+constexpr size_t kLoopInstructions = 3;
+
+// Upper bounds for the preallocation done by Stacks::Reset(). Limits above
+// these are still honored, the stacks just grow on demand past them.
+constexpr size_t kMaxPreallocatedFrames = 1 << 20;
+constexpr size_t kMaxPreallocatedExpressions = 1 << 22;
+// Room for the temporaries that are not accounted by any limit, like the
+// counter of a repeat loop or the operands of a comparison.
+constexpr size_t kExpressionHeadroom = 1024;
+
 /**
  * Checks if value is valid, if it is it returns RunResult::OK, otherwise it returns the error
  */
@@ -263,10 +526,239 @@ struct StackFrame {
   return karel::RunResult::OK;
 }
 
+/**
+ * Accessors that forward to |Cells| and also record every cell whose buzzers
+ * change in a DirtyCells. The engines only run on these when Runtime::dirty
+ * is set, so runs without it do not pay for the tracking at all.
+ */
+template <typename Cells>
+class TrackedCells {
+ public:
+  TrackedCells(Cells cells, DirtyCells* dirty) : cells_(cells), dirty_(dirty) {}
+
+  uint8_t walls(size_t x, size_t y) const { return cells_.walls(x, y); }
+  void set_walls(size_t x, size_t y, uint8_t walls) {
+    cells_.set_walls(x, y, walls);
+  }
+  uint32_t buzzers(size_t x, size_t y) const { return cells_.buzzers(x, y); }
+  void set_buzzers(size_t x, size_t y, uint32_t count) {
+    dirty_->Mark(x, y);
+    cells_.set_buzzers(x, y, count);
+  }
+
+ private:
+  Cells cells_;
+  DirtyCells* dirty_;
+};
+
+/** Whether the walls of |Cells| are the FLAT array in Runtime::walls. */
+template <typename Cells>
+constexpr bool kFlatWalls = std::is_same_v<Cells, FlatCells>;
+template <typename Cells>
+constexpr bool kFlatWalls<TrackedCells<Cells>> = kFlatWalls<Cells>;
+
+/**
+ * Like VisitCells(), but wraps the accessors in TrackedCells when |runtime|
+ * tracks the cells it changes.
+ */
+template <typename Visitor>
+auto VisitRunCells(const Runtime& runtime, Visitor&& visitor) {
+  return VisitCells(runtime, [&](auto cells) {
+    if (runtime.dirty)
+      return visitor(TrackedCells<decltype(cells)>(cells, runtime.dirty));
+    return visitor(cells);
+  });
+}
+
+/**
+ * Returns whether there is a wall in the direction that is |rotation| quarter
+ * turns clockwise from where Karel is facing.
+ */
+template <typename Cells>
+[[gnu::always_inline]] inline bool Blocked(const Runtime* runtime,
+                                           const Cells& cells,
+                                           size_t rotation) {
+  return cells.walls(runtime->x, runtime->y) &
+         (1 << ((runtime->orientation + rotation) & 3));
+}
+
+/** Adds |count| buzzers to the cell where Karel is, unless it has infinite. */
+template <typename Cells>
+[[gnu::always_inline]] inline void AddBuzzers(const Runtime* runtime,
+                                              Cells& cells,
+                                              int32_t count) {
+  const uint32_t buzzers = cells.buzzers(runtime->x, runtime->y);
+  if (buzzers == kInfinity)
+    return;
+  cells.set_buzzers(runtime->x, runtime->y, buzzers + count);
+}
+
+/**
+ * The FORWARD, PICKBUZZER and LEAVEBUZZER commands as used by the
+ * superinstructions and the budgeted mode. The caller is responsible for
+ * counting the instruction. |kCheckLimit| is false when the caller already
+ * knows that the command limit will not be exceeded.
+ */
+template <bool kCheckLimit = true>
+[[gnu::always_inline]] inline RunResult Forward(Runtime* runtime) {
+  constexpr int32_t dx[] = {-1, 0, 1, 0};
+  constexpr int32_t dy[] = {0, 1, 0, -1};
+  runtime->x += dx[runtime->orientation];
+  runtime->y += dy[runtime->orientation];
+  if (++runtime->forward_count > runtime->forward_limit && kCheckLimit)
+    return RunResult::INSTRUCTION_FORWARD;
+  return RunResult::OK;
+}
+
+template <bool kCheckLimit = true, typename Cells>
+[[gnu::always_inline]] inline RunResult PickBuzzer(Runtime* runtime,
+                                                   Cells& cells) {
+  AddBuzzers(runtime, cells, -1);
+  if (runtime->bag != kInfinity) {
+    if (runtime->bag + 1 > kMaxInt)
+      return RunResult::BAGOVERFLOW;
+    runtime->bag++;
+  }
+  if (++runtime->pickbuzzer_count > runtime->pickbuzzer_limit && kCheckLimit)
+    return RunResult::INSTRUCTION_PICK;
+  return RunResult::OK;
+}
+
+template <bool kCheckLimit = true, typename Cells>
+[[gnu::always_inline]] inline RunResult LeaveBuzzer(Runtime* runtime,
+                                                    Cells& cells) {
+  if (cells.buzzers(runtime->x, runtime->y) != kInfinity &&
+      cells.buzzers(runtime->x, runtime->y) + 1 > kMaxInt) {
+    return RunResult::WORLDOVERFLOW;
+  }
+  AddBuzzers(runtime, cells, 1);
+  if (runtime->bag != kInfinity)
+    runtime->bag--;
+  if (++runtime->leavebuzzer_count > runtime->leavebuzzer_limit &&
+      kCheckLimit) {
+    return RunResult::INSTRUCTION_LEAVE;
+  }
+  return RunResult::OK;
+}
+
+/**
+ * The bulk of FORWARD_UNTIL_WALL and PICK_ALL. Runs at most |iterations|
+ * whole iterations of the loop, stopping before the one that would leave it
+ * or hit a limit, and returns how many ran. The caller accounts for their
+ * instructions and then runs the head of the loop as usual.
+ */
+template <typename Cells>
+size_t ForwardUntilWall(Runtime* runtime,
+                        const Cells& cells,
+                        size_t iterations) {
+  constexpr int32_t dx[] = {-1, 0, 1, 0};
+  constexpr int32_t dy[] = {0, 1, 0, -1};
+  iterations =
+      std::min(iterations, runtime->forward_limit - runtime->forward_count);
+  const size_t orientation = runtime->orientation;
+  const uint8_t wall = 1 << orientation;
+  size_t steps = 0;
+  if constexpr (kFlatWalls<Cells>) {
+    // Walks the row or column of walls instead of moving one cell at a time.
+    const ptrdiff_t stride =
+        dy[orientation] * static_cast<ptrdiff_t>(runtime->width) +
+        dx[orientation];
+    const uint8_t* cell =
+        runtime->walls + runtime->coordinates(runtime->x, runtime->y);
+    while (steps < iterations && !(*cell & wall)) {
+      cell += stride;
+      ++steps;
+    }
+  } else {
+    size_t x = runtime->x, y = runtime->y;
+    while (steps < iterations && !(cells.walls(x, y) & wall)) {
+      x += dx[orientation];
+      y += dy[orientation];
+      ++steps;
+    }
+  }
+  runtime->x += steps * dx[orientation];
+  runtime->y += steps * dy[orientation];
+  runtime->forward_count += steps;
+  return steps;
+}
+
+template <typename Cells>
+size_t PickAll(Runtime* runtime, Cells& cells, size_t iterations) {
+  iterations = std::min(iterations,
+                        runtime->pickbuzzer_limit - runtime->pickbuzzer_count);
+  const uint32_t buzzers = cells.buzzers(runtime->x, runtime->y);
+  if (buzzers != kInfinity)
+    iterations = std::min<size_t>(iterations, buzzers);
+  if (runtime->bag != kInfinity) {
+    iterations = std::min<size_t>(
+        iterations, runtime->bag < kMaxInt ? kMaxInt - runtime->bag : 0);
+    runtime->bag += iterations;
+  }
+  // A cell that keeps its buzzers must not be marked as changed.
+  if (buzzers != kInfinity && iterations)
+    cells.set_buzzers(runtime->x, runtime->y, buzzers - iterations);
+  runtime->pickbuzzer_count += iterations;
+  return iterations;
+}
+
 }  // namespace
 
+std::string_view RunResultMessage(RunResult result) {
+  switch (result) {
+    case RunResult::OK:
+      return "FIN PROGRAMA";
+    case RunResult::WALL:
+      return "MOVIMIENTO INVALIDO";
+    case RunResult::WORLDUNDERFLOW:
+      return "ZUMBADOR INVALIDO MUNDO";
+    case RunResult::BAGUNDERFLOW:
+      return "ZUMBADOR INVALIDO MOCHILA";
+    case RunResult::STACK:
+      return "STACK OVERFLOW";
+    case RunResult::STACKMEMORY:
+      return "LIMITE DE MEMORIA DEL STACK";
+    case RunResult::CALLSIZE:
+      return "LIMITE DE LONGITUD DE LLAMADA";
+    case RunResult::INTEGEROVERFLOW:
+      return "INTEGER OVERFLOW";
+    case RunResult::INTEGERUNDERFLOW:
+      return "INTEGER UNDERFLOW";
+    case RunResult::WORLDOVERFLOW:
+      return "DEMASIADOS ZUMBADORES (MUNDO)";
+    case RunResult::BAGOVERFLOW:
+      return "DEMASIADOS ZUMBADORES (MOCHILA)";
+    case RunResult::INSTRUCTION:
+      return "LIMITE DE INSTRUCCIONES GENERAL";
+    case RunResult::INSTRUCTION_LEFT:
+      return "LIMITE DE INSTRUCCIONES IZQUIERDA";
+    case RunResult::INSTRUCTION_FORWARD:
+      return "LIMITE DE INSTRUCCIONES AVANZA";
+    case RunResult::INSTRUCTION_PICK:
+      return "LIMITE DE INSTRUCCIONES COGE_ZUMBADOR";
+    case RunResult::INSTRUCTION_LEAVE:
+      return "LIMITE DE INSTRUCCIONES DEJA_ZUMBADOR";
+  }
+  return "";
+}
+
 std::optional<std::vector<Instruction>> ParseInstructions(
-    std::string_view program) {
+    std::string_view program,
+    std::vector<std::string>* function_names) {
+  std::vector<Instruction> instructions;
+  std::map<std::string_view, int32_t> name_indices;
+  const size_t function_name_count =
+      function_names ? function_names->size() : 0;
+  if (ScanInstructions(program, &instructions, &name_indices, function_names))
+    return instructions;
+
+  // Start over with the JSON parser, which either takes what the scanner did
+  // not or reports what is wrong with it.
+  instructions.clear();
+  name_indices.clear();
+  if (function_names)
+    function_names->resize(function_name_count);
+
   auto parsed_json = json::Parse(program);
   if (!parsed_json) {
     LOG(ERROR) << "Invalid JSON";
@@ -278,7 +770,6 @@ std::optional<std::vector<Instruction>> ParseInstructions(
   }
   const json::ListValue& list_value = (*parsed_json)->AsList();
 
-  std::vector<Instruction> instructions;
   for (const auto& entry : list_value.value()) {
     if (entry->GetType() != json::Type::LIST) {
       LOG(ERROR) << "Invalid instruction " << *entry;
@@ -287,17 +778,576 @@ std::optional<std::vector<Instruction>> ParseInstructions(
     auto instruction = ParseInstruction(entry->AsList());
     if (!instruction)
       return std::nullopt;
+    if (instruction->opcode == Opcode::CALL &&
+        entry->AsList().value()[2]->GetType() == json::Type::STRING) {
+      instruction->arg2 =
+          InternFunctionName(entry->AsList().value()[2]->AsString().value(),
+                             &name_indices, function_names);
+    }
     instructions.emplace_back(std::move(instruction.value()));
   }
 
   return instructions;
 }
 
-RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
+std::optional<ProgramInfo> VerifyInstructions(ProgramView program) {
+  // The fused instructions can only be followed once they are known to fit.
+  if (!ValidateInstructions(program))
+    return std::nullopt;
+
+  const int64_t end = program.size();
+  ProgramInfo info;
+  // Index in info.functions of the function that starts at each instruction.
+  std::map<int32_t, size_t> function_index;
+  info.functions.push_back(FunctionInfo{0, 0, 0});
+  function_index.emplace(0, 0);
+
+  // What is known about the expression stack before each instruction of the
+  // function being verified. The value on top is only tracked when it is a
+  // constant, which is all CALL needs.
+  constexpr int32_t kUnvisited = -1;
+  std::vector<int32_t> heights(end, kUnvisited);
+  std::vector<std::optional<int32_t>> tops(end);
+  std::vector<int32_t> visited;
+  std::vector<int32_t> pending;
+
+  for (size_t f = 0; f < info.functions.size() && end > 0; ++f) {
+    for (int32_t pc : visited)
+      heights[pc] = kUnvisited;
+    visited.clear();
+
+    const int32_t entry = info.functions[f].entry;
+    const int32_t arity = info.functions[f].arity;
+    uint32_t max_stack_depth = arity;
+    heights[entry] = arity;
+    tops[entry] = std::nullopt;
+    visited.push_back(entry);
+    pending.push_back(entry);
+
+    while (!pending.empty()) {
+      const int32_t pc = pending.back();
+      pending.pop_back();
+      const Instruction& curr = program[pc];
+      int32_t height = heights[pc];
+      std::optional<int32_t> top = tops[pc];
+
+      auto pop = [&](int32_t count) {
+        if (height - count < arity) {
+          LOG(ERROR) << "Stack underflow at " << pc;
+          return false;
+        }
+        height -= count;
+        top = std::nullopt;
+        return true;
+      };
+      auto push = [&](std::optional<int32_t> value) {
+        height++;
+        top = value;
+        max_stack_depth =
+            std::max(max_stack_depth, static_cast<uint32_t>(height));
+      };
+      auto flow = [&](int64_t target) {
+        if (target < 0 || target >= end)
+          return true;
+        if (heights[target] == kUnvisited) {
+          heights[target] = height;
+          tops[target] = top;
+          visited.push_back(target);
+          pending.push_back(target);
+        } else if (heights[target] != height) {
+          LOG(ERROR) << "Stack height mismatch at " << target << ": "
+                     << heights[target] << " and " << height;
+          return false;
+        } else if (tops[target] && tops[target] != top) {
+          tops[target] = std::nullopt;
+          pending.push_back(target);
+        }
+        return true;
+      };
+
+      switch (curr.opcode) {
+        case Opcode::HALT:
+        case Opcode::RET:
+          continue;
+
+        case Opcode::LINE:
+        case Opcode::LEFT:
+        case Opcode::FORWARD:
+        case Opcode::PICKBUZZER:
+        case Opcode::LEAVEBUZZER:
+          break;
+
+        case Opcode::WORLDWALLS:
+        case Opcode::ORIENTATION:
+        case Opcode::WORLDBUZZERS:
+        case Opcode::BAGBUZZERS:
+        case Opcode::LRET:
+        case Opcode::COLUMN:
+        case Opcode::ROW:
+          push(std::nullopt);
+          break;
+
+        case Opcode::LOAD:
+          push(curr.arg);
+          break;
+
+        case Opcode::ROTL:
+        case Opcode::ROTR:
+        case Opcode::MASK:
+        case Opcode::NOT:
+        case Opcode::DEC:
+        case Opcode::INC:
+          if (!pop(1))
+            return std::nullopt;
+          push(std::nullopt);
+          break;
+
+        case Opcode::AND:
+        case Opcode::OR:
+        case Opcode::EQ:
+        case Opcode::LT:
+        case Opcode::LTE:
+          if (!pop(2))
+            return std::nullopt;
+          push(std::nullopt);
+          break;
+
+        case Opcode::DUP: {
+          std::optional<int32_t> value = top;
+          if (!pop(1))
+            return std::nullopt;
+          push(value);
+          push(value);
+          break;
+        }
+
+        case Opcode::POP:
+        case Opcode::SRET:
+          if (!pop(1))
+            return std::nullopt;
+          break;
+
+        case Opcode::EZ:
+          if (!IsValidRunResult(curr.arg)) {
+            LOG(ERROR) << "Invalid run result " << curr.arg << " at " << pc;
+            return std::nullopt;
+          }
+          if (!pop(1))
+            return std::nullopt;
+          break;
+
+        case Opcode::JZ:
+        case Opcode::JNZ:
+          if (!pop(1) || !flow(static_cast<int64_t>(pc) + curr.arg + 1))
+            return std::nullopt;
+          break;
+
+        case Opcode::JMP:
+          if (!flow(static_cast<int64_t>(pc) + curr.arg + 1))
+            return std::nullopt;
+          continue;
+
+        // The superinstructions leave the stack as it was, and skip over the
+        // idiom that they replaced.
+        case Opcode::CHECKED_FORWARD:
+        case Opcode::CHECKED_PICK:
+        case Opcode::CHECKED_LEAVE: {
+          const int32_t length =
+              curr.opcode == Opcode::CHECKED_FORWARD ? kCheckedForwardLength
+              : curr.opcode == Opcode::CHECKED_PICK  ? kCheckedPickLength
+                                                     : kCheckedLeaveLength;
+          if (!flow(static_cast<int64_t>(pc) + length))
+            return std::nullopt;
+          continue;
+        }
+
+        case Opcode::FRONT_CLEAR_JZ:
+        case Opcode::LEFT_CLEAR_JZ:
+        case Opcode::RIGHT_CLEAR_JZ:
+        case Opcode::FORWARD_UNTIL_WALL:
+        case Opcode::PICK_ALL:
+          if (!flow(static_cast<int64_t>(pc) + curr.arg + 1) ||
+              !flow(static_cast<int64_t>(pc) + curr.arg2)) {
+            return std::nullopt;
+          }
+          continue;
+
+        case Opcode::PARAM:
+          if (curr.arg < 0 || curr.arg >= arity) {
+            LOG(ERROR) << "Invalid parameter " << curr.arg << " at " << pc
+                       << " in a function with " << arity << " parameters";
+            return std::nullopt;
+          }
+          push(std::nullopt);
+          break;
+
+        case Opcode::CALL: {
+          if (!top) {
+            LOG(ERROR) << "CALL at " << pc
+                       << " does not take a constant parameter count";
+            return std::nullopt;
+          }
+          const int32_t param_count = top.value();
+          if (!pop(1))
+            return std::nullopt;
+          // A negative count always fails the call size limit.
+          if (param_count < 0)
+            continue;
+          if (!pop(param_count))
+            return std::nullopt;
+          // Calls that leave the program end it.
+          if (curr.arg < 0 || curr.arg >= end)
+            continue;
+          auto it = function_index.find(curr.arg);
+          if (it == function_index.end()) {
+            function_index.emplace(curr.arg, info.functions.size());
+            info.functions.push_back(FunctionInfo{curr.arg, param_count, 0});
+          } else if (info.functions[it->second].arity != param_count) {
+            LOG(ERROR) << "Function at " << curr.arg << " is called with "
+                       << info.functions[it->second].arity << " and "
+                       << param_count << " parameters";
+            return std::nullopt;
+          }
+          break;
+        }
+
+        default:
+          LOG(ERROR) << "Invalid opcode "
+                     << static_cast<uint32_t>(curr.opcode) << " at " << pc;
+          return std::nullopt;
+      }
+      if (!flow(pc + 1))
+        return std::nullopt;
+    }
+    info.functions[f].max_stack_depth = max_stack_depth;
+  }
+  return info;
+}
+
+std::vector<Instruction> OptimizeInstructions(
+    const std::vector<Instruction>& program,
+    size_t* removed) {
+  const int32_t end = program.size();
+  auto in_range = [end](int64_t pc) { return pc >= 0 && pc < end; };
+  // Branches are tracked by their absolute target while the program is being
+  // rewritten, and turned back into relative offsets at the end.
+  std::vector<Instruction> code(program);
+  std::vector<int64_t> targets(end);
+  // Whether control can get to each instruction other than by falling
+  // through from the previous one.
+  std::vector<bool> entered(end, false);
+  if (end > 0)
+    entered[0] = true;
+  for (int32_t pc = 0; pc < end; ++pc) {
+    switch (code[pc].opcode) {
+      case Opcode::JZ:
+      case Opcode::JMP:
+        targets[pc] = pc + static_cast<int64_t>(code[pc].arg) + 1;
+        break;
+      case Opcode::CALL:
+        targets[pc] = code[pc].arg;
+        if (pc + 1 < end)
+          entered[pc + 1] = true;
+        break;
+      default:
+        continue;
+    }
+    if (in_range(targets[pc]))
+      entered[targets[pc]] = true;
+  }
+
+  // JMPs that land on another JMP go to the end of the chain directly, which
+  // can leave the JMPs in between unreachable. The JMPs that are skipped are
+  // still counted, through arg2. Chains that leave the program are not
+  // followed, since the limit is not checked on the way out of it.
+  for (int32_t pc = 0; pc < end; ++pc) {
+    if (code[pc].opcode != Opcode::JMP)
+      continue;
+    int64_t target = targets[pc];
+    int32_t skipped = 0;
+    for (int32_t hops = 0; hops < kMaxJumpChain; ++hops) {
+      if (!in_range(target) || target == pc ||
+          code[target].opcode != Opcode::JMP) {
+        break;
+      }
+      const int64_t next = targets[target];
+      if (!in_range(next))
+        break;
+      skipped += 1 + code[target].arg2;
+      target = next;
+    }
+    // Cycles and overly long chains are left alone.
+    if (skipped == 0 || code[target].opcode == Opcode::JMP)
+      continue;
+    targets[pc] = target;
+    code[pc].arg2 += skipped;
+  }
+
+  // Only the instructions that can be reached from the start are kept.
+  std::vector<bool> dead(end, true);
+  std::vector<int32_t> pending;
+  if (end > 0) {
+    dead[0] = false;
+    pending.push_back(0);
+  }
+  while (!pending.empty()) {
+    const int32_t pc = pending.back();
+    pending.pop_back();
+    auto flow = [&](int64_t target) {
+      if (in_range(target) && dead[target]) {
+        dead[target] = false;
+        pending.push_back(target);
+      }
+    };
+    switch (code[pc].opcode) {
+      case Opcode::HALT:
+      case Opcode::RET:
+        break;
+      case Opcode::JMP:
+        flow(targets[pc]);
+        break;
+      case Opcode::JZ:
+      case Opcode::CALL:
+        flow(targets[pc]);
+        flow(pc + 1);
+        break;
+      default:
+        flow(pc + 1);
+        break;
+    }
+  }
+
+  // The first kept instruction at or after |pc|, or |end|.
+  auto next_kept = [&](int64_t pc) {
+    while (in_range(pc) && dead[pc])
+      ++pc;
+    return pc;
+  };
+  // Whether the instructions in (from, to] can only be reached by falling
+  // through from |from|, so that they can be merged with it.
+  auto straight = [&](int32_t from, int32_t to) {
+    for (int32_t pc = from + 1; pc <= to; ++pc) {
+      if (entered[pc])
+        return false;
+    }
+    return true;
+  };
+
+  for (int32_t pc = 0; pc < end; ++pc) {
+    if (dead[pc])
+      continue;
+    Instruction& curr = code[pc];
+    switch (curr.opcode) {
+      case Opcode::LINE:
+        // The position is overwritten before anything can look at it.
+        if (pc + 1 < end && code[pc + 1].opcode == Opcode::LINE)
+          dead[pc] = true;
+        break;
+
+      case Opcode::LOAD:
+        for (int32_t next = pc + 1; next < end && !dead[next]; ++next) {
+          const Instruction& ins = code[next];
+          if ((ins.opcode != Opcode::INC && ins.opcode != Opcode::DEC) ||
+              !straight(pc, next)) {
+            break;
+          }
+          // Same arithmetic as Run(), including its wraparound. Values that
+          // would fail at runtime are left for the runtime to report.
+          int32_t value = curr.arg;
+          if (value <= kMaxInt) {
+            const uint32_t delta = static_cast<uint32_t>(ins.arg);
+            value = static_cast<int32_t>(
+                ins.opcode == Opcode::INC
+                    ? static_cast<uint32_t>(value) + delta
+                    : static_cast<uint32_t>(value) - delta);
+            if (validateNumber(value) != RunResult::OK)
+              break;
+          }
+          curr.arg = value;
+          dead[next] = true;
+        }
+        break;
+
+      case Opcode::NOT: {
+        const int32_t next = next_kept(pc + 1);
+        if (next < end && code[next].opcode == Opcode::JZ &&
+            straight(pc, next)) {
+          code[next].opcode = Opcode::JNZ;
+          dead[pc] = true;
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  // Relink everything to the new positions. A branch to a removed
+  // instruction goes to whatever replaced it, and a branch out of the program
+  // still leaves it.
+  std::vector<int32_t> positions(end + 1);
+  int32_t size = 0;
+  for (int32_t pc = 0; pc < end; ++pc) {
+    positions[pc] = size;
+    if (!dead[pc])
+      ++size;
+  }
+  positions[end] = size;
+  auto relink = [&](int64_t target) {
+    return in_range(target) ? positions[target] : size;
+  };
+
+  std::vector<Instruction> optimized;
+  optimized.reserve(size);
+  for (int32_t pc = 0; pc < end; ++pc) {
+    if (dead[pc])
+      continue;
+    Instruction ins = code[pc];
+    switch (ins.opcode) {
+      case Opcode::JZ:
+      case Opcode::JNZ:
+      case Opcode::JMP:
+        ins.arg = relink(targets[pc]) - static_cast<int32_t>(optimized.size()) -
+                  1;
+        break;
+      case Opcode::CALL:
+        ins.arg = relink(targets[pc]);
+        break;
+      default:
+        break;
+    }
+    optimized.push_back(ins);
+  }
+
+  if (removed)
+    *removed = end - size;
+  return optimized;
+}
+
+std::vector<Instruction> FuseInstructions(
+    const std::vector<Instruction>& program) {
+  auto matches = [&program](size_t pc, std::initializer_list<Opcode> idiom) {
+    if (pc + idiom.size() > program.size())
+      return false;
+    for (Opcode opcode : idiom) {
+      if (program[pc++].opcode != opcode)
+        return false;
+    }
+    return true;
+  };
+
+  // Matches a loop at |pc| made of |head|, an optional LINE, |body| and a JMP
+  // back to |pc|. Returns the length of the head, or 0.
+  auto loop = [&program, &matches](size_t pc,
+                                   std::initializer_list<Opcode> head,
+                                   std::initializer_list<Opcode> body) {
+    if (!matches(pc, head))
+      return int32_t{0};
+    size_t next = pc + head.size();
+    if (matches(next, {Opcode::LINE}))
+      ++next;
+    if (!matches(next, body))
+      return int32_t{0};
+    next += body.size();
+    if (!matches(next, {Opcode::JMP}) || program[next].arg2 != 0 ||
+        static_cast<int64_t>(next) + program[next].arg + 1 !=
+            static_cast<int64_t>(pc)) {
+      return int32_t{0};
+    }
+    return static_cast<int32_t>(head.size());
+  };
+
+  // Idioms are matched against the original program, so a superinstruction
+  // never swallows another one. Loops only replace their head, and their
+  // body is fused as usual.
+  std::vector<Instruction> fused(program);
+  for (size_t pc = 0; pc < program.size(); ++pc) {
+    // The branch at the end of the idiom, relative to its first instruction.
+    auto branch = [&program, pc](Opcode opcode, int32_t length) {
+      return Instruction{opcode, program[pc + length - 1].arg + length - 1,
+                         length};
+    };
+    const std::initializer_list<Opcode> forward_body = {
+        Opcode::WORLDWALLS, Opcode::ORIENTATION, Opcode::MASK, Opcode::AND,
+        Opcode::NOT,        Opcode::EZ,          Opcode::FORWARD};
+    int32_t head = 0;
+    if ((head = loop(pc,
+                     {Opcode::WORLDWALLS, Opcode::ORIENTATION, Opcode::MASK,
+                      Opcode::AND, Opcode::NOT, Opcode::JZ},
+                     forward_body)) ||
+        (head = loop(pc,
+                     {Opcode::WORLDWALLS, Opcode::ORIENTATION, Opcode::MASK,
+                      Opcode::AND, Opcode::JNZ},
+                     forward_body))) {
+      fused[pc] = branch(Opcode::FORWARD_UNTIL_WALL, head);
+    } else if ((head = loop(pc, {Opcode::WORLDBUZZERS, Opcode::JZ},
+                            {Opcode::WORLDBUZZERS, Opcode::EZ,
+                             Opcode::PICKBUZZER}))) {
+      fused[pc] = branch(Opcode::PICK_ALL, head);
+    } else if (matches(pc, {Opcode::WORLDWALLS, Opcode::ORIENTATION, Opcode::MASK,
+                     Opcode::AND, Opcode::NOT, Opcode::EZ, Opcode::FORWARD})) {
+      fused[pc] = {Opcode::CHECKED_FORWARD, program[pc + 5].arg};
+    } else if (matches(pc, {Opcode::WORLDWALLS, Opcode::ORIENTATION,
+                            Opcode::MASK, Opcode::AND, Opcode::NOT,
+                            Opcode::JZ})) {
+      fused[pc] = branch(Opcode::FRONT_CLEAR_JZ, 6);
+    } else if (matches(pc, {Opcode::WORLDWALLS, Opcode::ORIENTATION,
+                            Opcode::MASK, Opcode::AND, Opcode::JNZ})) {
+      fused[pc] = branch(Opcode::FRONT_CLEAR_JZ, 5);
+    } else if (matches(pc, {Opcode::WORLDWALLS, Opcode::ORIENTATION,
+                            Opcode::ROTL, Opcode::MASK, Opcode::AND,
+                            Opcode::NOT, Opcode::JZ})) {
+      fused[pc] = branch(Opcode::LEFT_CLEAR_JZ, 7);
+    } else if (matches(pc, {Opcode::WORLDWALLS, Opcode::ORIENTATION,
+                            Opcode::ROTL, Opcode::MASK, Opcode::AND,
+                            Opcode::JNZ})) {
+      fused[pc] = branch(Opcode::LEFT_CLEAR_JZ, 6);
+    } else if (matches(pc, {Opcode::WORLDWALLS, Opcode::ORIENTATION,
+                            Opcode::ROTR, Opcode::MASK, Opcode::AND,
+                            Opcode::NOT, Opcode::JZ})) {
+      fused[pc] = branch(Opcode::RIGHT_CLEAR_JZ, 7);
+    } else if (matches(pc, {Opcode::WORLDWALLS, Opcode::ORIENTATION,
+                            Opcode::ROTR, Opcode::MASK, Opcode::AND,
+                            Opcode::JNZ})) {
+      fused[pc] = branch(Opcode::RIGHT_CLEAR_JZ, 6);
+    } else if (matches(pc, {Opcode::WORLDBUZZERS, Opcode::EZ,
+                            Opcode::PICKBUZZER})) {
+      fused[pc] = {Opcode::CHECKED_PICK, program[pc + 1].arg};
+    } else if (matches(pc, {Opcode::BAGBUZZERS, Opcode::EZ,
+                            Opcode::LEAVEBUZZER})) {
+      fused[pc] = {Opcode::CHECKED_LEAVE, program[pc + 1].arg};
+    }
+  }
+  return fused;
+}
+
+void Stacks::Reset(const Runtime& runtime) {
+  frames.clear();
+  expression.clear();
+  frames.reserve(std::min(runtime.stack_limit, kMaxPreallocatedFrames));
+  expression.reserve(std::min(runtime.stack_memory_limit +
+                                  runtime.call_param_limit + kExpressionHeadroom,
+                              kMaxPreallocatedExpressions));
+}
+
+RunResult Run(ProgramView program, Runtime* runtime) {
+  Stacks stacks;
+  return Run(program, runtime, &stacks);
+}
+
+namespace {
+
+template <typename Cells>
+RunResult RunWithCells(ProgramView program,
+                       Runtime* runtime,
+                       Stacks* stacks,
+                       Cells cells) {
   int32_t pc = 0;
   size_t ic = 0;
-  std::stack<StackFrame> function_stack;
-  std::vector<int32_t> expression_stack;
+  stacks->Reset(*runtime);
+  FlatStack<Stacks::Frame>& function_stack = stacks->frames;
+  FlatStack<int32_t>& expression_stack = stacks->expression;
 
   while (static_cast<size_t>(pc) < program.size()) {
     if (ic >= runtime->instruction_limit)
@@ -327,7 +1377,7 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         break;
 
       case Opcode::LOAD:
-        expression_stack.emplace_back(curr.arg);
+        expression_stack.push_back(curr.arg);
         break;
 
       case Opcode::CALL: {
@@ -338,11 +1388,11 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         }
         expression_stack.pop_back();
 
-        function_stack.emplace(
-          StackFrame{
-            pc, 
-            expression_stack.size() - 1,
-            expression_stack.size() - param_count
+        function_stack.push_back(
+          Stacks::Frame{
+            pc,
+            static_cast<uint32_t>(expression_stack.size() - 1),
+            static_cast<uint32_t>(expression_stack.size() - param_count)
             }
         );
         pc = curr.arg - 1;
@@ -359,23 +1409,22 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
       case Opcode::RET: {
         if (function_stack.empty())
           return RunResult::OK;
-        StackFrame& frame = function_stack.top();
+        Stacks::Frame& frame = function_stack.back();
         pc = frame.pc;
-        size_t param_count = (frame.param_sp + 1) - frame.sp;
+        uint32_t param_count = (frame.param_sp + 1) - frame.sp;
         runtime->stack_memory -= param_count == 0 ? 1 : param_count;
-        if (expression_stack.size() > frame.sp)
-          expression_stack.resize(frame.sp);
-        function_stack.pop();
+        expression_stack.truncate(frame.sp);
+        function_stack.pop_back();
 
         break;
       }
 
       case Opcode::WORLDWALLS:
-        expression_stack.emplace_back(runtime->get_walls());
+        expression_stack.push_back(cells.walls(runtime->x, runtime->y));
         break;
 
       case Opcode::ORIENTATION:
-        expression_stack.emplace_back(runtime->orientation);
+        expression_stack.push_back(runtime->orientation);
         break;
 
       case Opcode::ROTL: {
@@ -433,8 +1482,15 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         expression_stack.pop_back();
         break;
 
+      case Opcode::JNZ:
+        ic++;
+        if (expression_stack.back() != 0)
+          pc += curr.arg;
+        expression_stack.pop_back();
+        break;
+
       case Opcode::WORLDBUZZERS:
-        expression_stack.emplace_back(runtime->get_buzzers());
+        expression_stack.push_back(cells.buzzers(runtime->x, runtime->y));
         break;
 
       case Opcode::FORWARD: {
@@ -449,17 +1505,18 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
       }
 
       case Opcode::BAGBUZZERS:
-        expression_stack.emplace_back(runtime->bag);
+        expression_stack.push_back(runtime->bag);
         break;
 
       case Opcode::JMP:
-        ic++;
+        // arg2 counts the JMPs that OptimizeInstructions() jumped over.
+        ic += 1 + curr.arg2;
         pc += curr.arg;
         break;
 
       case Opcode::PICKBUZZER:
         ic++;
-        runtime->inc_buzzers(-1);
+        AddBuzzers(runtime, cells, -1);
         if (runtime->bag != kInfinity) {
           if (runtime->bag + 1 > kMaxInt) {
             return RunResult::BAGOVERFLOW;
@@ -472,10 +1529,11 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
 
       case Opcode::LEAVEBUZZER:
         ic++;
-        if (runtime->get_buzzers() != kInfinity && runtime->get_buzzers() + 1 > kMaxInt) {
+        if (cells.buzzers(runtime->x, runtime->y) != kInfinity &&
+            cells.buzzers(runtime->x, runtime->y) + 1 > kMaxInt) {
           return RunResult::WORLDOVERFLOW;
         }
-        runtime->inc_buzzers(1);
+        AddBuzzers(runtime, cells, 1);
         if (runtime->bag != kInfinity)
           runtime->bag--;
         if (++runtime->leavebuzzer_count > runtime->leavebuzzer_limit)
@@ -494,7 +1552,7 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         break;
 
       case Opcode::DUP:
-        expression_stack.emplace_back(expression_stack.back());
+        expression_stack.push_back(expression_stack.back());
         break;
 
       case Opcode::DEC:
@@ -516,9 +1574,9 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         break;
 
       case Opcode::PARAM:
-        expression_stack.emplace_back(
+        expression_stack.push_back(
           expression_stack[          
-            function_stack.top().param_sp - curr.arg
+            function_stack.back().param_sp - curr.arg
           ]
         );
         break;
@@ -527,7 +1585,7 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         expression_stack.pop_back();
         break;
       case Opcode::LRET:
-        expression_stack.emplace_back(runtime->ret);
+        expression_stack.push_back(runtime->ret);
         break;
       case Opcode::LT: {
         int32_t op2 = expression_stack.back();
@@ -544,11 +1602,87 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
         break;
       }
       case Opcode::COLUMN:
-        expression_stack.emplace_back(runtime->x+1);
+        expression_stack.push_back(runtime->x+1);
         break;
       case Opcode::ROW:
-        expression_stack.emplace_back(runtime->y+1);
+        expression_stack.push_back(runtime->y+1);
         break;
+
+      case Opcode::CHECKED_FORWARD: {
+        if (Blocked(runtime, cells, 0))
+          return static_cast<RunResult>(curr.arg);
+        ic++;
+        RunResult result = Forward(runtime);
+        if (result != RunResult::OK)
+          return result;
+        pc += kCheckedForwardLength - 1;
+        break;
+      }
+
+      case Opcode::CHECKED_PICK: {
+        if (cells.buzzers(runtime->x, runtime->y) == 0)
+          return static_cast<RunResult>(curr.arg);
+        ic++;
+        RunResult result = PickBuzzer(runtime, cells);
+        if (result != RunResult::OK)
+          return result;
+        pc += kCheckedPickLength - 1;
+        break;
+      }
+
+      case Opcode::CHECKED_LEAVE: {
+        if (runtime->bag == 0)
+          return static_cast<RunResult>(curr.arg);
+        ic++;
+        RunResult result = LeaveBuzzer(runtime, cells);
+        if (result != RunResult::OK)
+          return result;
+        pc += kCheckedLeaveLength - 1;
+        break;
+      }
+
+      case Opcode::FRONT_CLEAR_JZ:
+        ic++;
+        pc += Blocked(runtime, cells, 0) ? curr.arg : curr.arg2 - 1;
+        break;
+
+      case Opcode::LEFT_CLEAR_JZ:
+        ic++;
+        pc += Blocked(runtime, cells, 3) ? curr.arg : curr.arg2 - 1;
+        break;
+
+      case Opcode::RIGHT_CLEAR_JZ:
+        ic++;
+        pc += Blocked(runtime, cells, 1) ? curr.arg : curr.arg2 - 1;
+        break;
+
+      case Opcode::FORWARD_UNTIL_WALL:
+      case Opcode::PICK_ALL: {
+        const size_t iterations =
+            curr.opcode == Opcode::FORWARD_UNTIL_WALL
+                ? ForwardUntilWall(
+                      runtime, cells,
+                      (runtime->instruction_limit - ic) / kLoopInstructions)
+                : PickAll(
+                      runtime, cells,
+                      (runtime->instruction_limit - ic) / kLoopInstructions);
+        if (iterations != 0) {
+          ic += iterations * kLoopInstructions;
+          const Instruction& body = program[pc + curr.arg2];
+          if (body.opcode == Opcode::LINE) {
+            runtime->line = body.arg;
+            runtime->column = body.arg2;
+          }
+          if (ic >= runtime->instruction_limit)
+            return RunResult::INSTRUCTION;
+        }
+        ic++;
+        const bool leaving = curr.opcode == Opcode::FORWARD_UNTIL_WALL
+                              ? Blocked(runtime, cells, 0)
+                              : cells.buzzers(runtime->x, runtime->y) == 0;
+        pc += leaving ? curr.arg : curr.arg2 - 1;
+        break;
+      }
     }
 
     pc++;
@@ -568,4 +1702,782 @@ RunResult Run(const std::vector<Instruction>& program, Runtime* runtime) {
   return RunResult::OK;
 }
 
+}  // namespace
+
+RunResult Run(ProgramView program, Runtime* runtime, Stacks* stacks) {
+  return VisitRunCells(*runtime, [&](auto cells) {
+    return RunWithCells(program, runtime, stacks, cells);
+  });
+}
+
+bool ValidateInstructions(ProgramView program) {
+  const size_t end = program.size();
+  for (size_t pc = 0; pc < end; ++pc) {
+    const Instruction& ins = program[pc];
+    if (static_cast<uint32_t>(ins.opcode) >= kDecodedEnd) {
+      LOG(ERROR) << "Invalid opcode " << static_cast<uint32_t>(ins.opcode)
+                 << " at " << pc;
+      return false;
+    }
+    switch (ins.opcode) {
+      case Opcode::EZ:
+      case Opcode::CHECKED_FORWARD:
+      case Opcode::CHECKED_PICK:
+      case Opcode::CHECKED_LEAVE: {
+        if (!IsValidRunResult(ins.arg)) {
+          LOG(ERROR) << "Invalid run result " << ins.arg << " at " << pc;
+          return false;
+        }
+        // The fused instructions skip over the ones that they replaced.
+        const size_t length =
+            ins.opcode == Opcode::CHECKED_FORWARD ? kCheckedForwardLength
+            : ins.opcode == Opcode::CHECKED_PICK  ? kCheckedPickLength
+            : ins.opcode == Opcode::CHECKED_LEAVE ? kCheckedLeaveLength
+                                                  : 1;
+        if (pc + length > end) {
+          LOG(ERROR) << "Truncated instruction at " << pc;
+          return false;
+        }
+        break;
+      }
+      case Opcode::FRONT_CLEAR_JZ:
+      case Opcode::LEFT_CLEAR_JZ:
+      case Opcode::RIGHT_CLEAR_JZ:
+      case Opcode::FORWARD_UNTIL_WALL:
+      case Opcode::PICK_ALL: {
+        // The loops also look at the instruction after their head.
+        const bool loop = ins.opcode == Opcode::FORWARD_UNTIL_WALL ||
+                          ins.opcode == Opcode::PICK_ALL;
+        if (ins.arg2 <= 0 || pc + ins.arg2 + (loop ? 1 : 0) > end) {
+          LOG(ERROR) << "Invalid idiom length " << ins.arg2 << " at " << pc;
+          return false;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+std::optional<DecodedProgram> DecodeInstructions(ProgramView program) {
+  const int64_t end = program.size();
+  auto resolve = [end](int64_t target) -> int32_t {
+    return (target < 0 || target >= end) ? end : target;
+  };
+
+  DecodedProgram decoded;
+  decoded.opcodes.resize(end + 1, kDecodedEnd);
+  decoded.args.resize(end + 1);
+  decoded.args2.resize(end + 1);
+  for (int64_t i = 0; i < end; ++i) {
+    const Instruction& ins = program[i];
+    if (static_cast<uint32_t>(ins.opcode) >= kDecodedEnd) {
+      LOG(ERROR) << "Invalid opcode " << static_cast<uint32_t>(ins.opcode)
+                 << " at " << i;
+      return std::nullopt;
+    }
+    decoded.opcodes[i] = static_cast<uint8_t>(ins.opcode);
+    decoded.args[i] = ins.arg;
+    decoded.args2[i] = ins.arg2;
+    switch (ins.opcode) {
+      case Opcode::JZ:
+      case Opcode::JNZ:
+      case Opcode::JMP:
+      case Opcode::FRONT_CLEAR_JZ:
+      case Opcode::LEFT_CLEAR_JZ:
+      case Opcode::RIGHT_CLEAR_JZ:
+      case Opcode::FORWARD_UNTIL_WALL:
+      case Opcode::PICK_ALL:
+        decoded.args[i] = resolve(i + ins.arg + 1);
+        break;
+      case Opcode::CALL:
+        decoded.args[i] = resolve(ins.arg);
+        break;
+      case Opcode::EZ:
+      case Opcode::CHECKED_FORWARD:
+      case Opcode::CHECKED_PICK:
+      case Opcode::CHECKED_LEAVE:
+        if (!IsValidRunResult(ins.arg)) {
+          LOG(ERROR) << "Invalid run result " << ins.arg << " at " << i;
+          return std::nullopt;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return decoded;
+}
+
+void ComputeBlockCosts(DecodedProgram* program) {
+  const size_t end = program->size();
+  program->costs.assign(end + 1, BlockCost());
+  // Walk backwards so that the cost of whatever follows each instruction is
+  // already known.
+  for (size_t i = end; i-- > 0;) {
+    BlockCost& cost = program->costs[i];
+    size_t next = i + 1;
+    switch (static_cast<Opcode>(program->opcodes[i])) {
+      case Opcode::HALT:
+      case Opcode::RET:
+        continue;
+      case Opcode::JZ:
+      case Opcode::JNZ:
+      case Opcode::CALL:
+      case Opcode::FRONT_CLEAR_JZ:
+      case Opcode::LEFT_CLEAR_JZ:
+      case Opcode::RIGHT_CLEAR_JZ:
+        cost.instructions = 1;
+        continue;
+      case Opcode::JMP:
+        cost.instructions = 1 + program->args2[i];
+        continue;
+      case Opcode::FORWARD_UNTIL_WALL:
+      case Opcode::PICK_ALL:
+        // They count their own instructions and commands.
+        continue;
+      case Opcode::LEFT:
+      case Opcode::FORWARD:
+      case Opcode::PICKBUZZER:
+      case Opcode::LEAVEBUZZER:
+        cost.instructions = 1;
+        cost.commands = 1;
+        break;
+      case Opcode::CHECKED_FORWARD:
+        cost.instructions = 1;
+        cost.commands = 1;
+        next = i + kCheckedForwardLength;
+        break;
+      case Opcode::CHECKED_PICK:
+        cost.instructions = 1;
+        cost.commands = 1;
+        next = i + kCheckedPickLength;
+        break;
+      case Opcode::CHECKED_LEAVE:
+        cost.instructions = 1;
+        cost.commands = 1;
+        next = i + kCheckedLeaveLength;
+        break;
+      default:
+        break;
+    }
+    const BlockCost& rest = program->costs[std::min(next, end)];
+    cost.instructions += rest.instructions;
+    cost.commands += rest.commands;
+  }
+}
+
+RunResult RunThreaded(ProgramView program, Runtime* runtime) {
+  auto decoded = DecodeInstructions(program);
+  if (!decoded) {
+    LOG(ERROR) << "Failed to decode the program, running it with the switch "
+                  "loop instead";
+    return Run(program, runtime);
+  }
+  return RunThreaded(decoded.value(), runtime);
+}
+
+RunResult RunThreaded(const DecodedProgram& program, Runtime* runtime) {
+  Stacks stacks;
+  return RunThreaded(program, runtime, &stacks);
+}
+
+#if defined(__GNUC__)
+
+namespace {
+
+size_t CommandHeadroom(const Runtime* runtime) {
+  return std::min({runtime->forward_limit - runtime->forward_count,
+                   runtime->left_limit - runtime->left_count,
+                   runtime->pickbuzzer_limit - runtime->pickbuzzer_count,
+                   runtime->leavebuzzer_limit - runtime->leavebuzzer_count});
+}
+
+template <typename Cells>
+RunResult RunThreadedWithCells(const DecodedProgram& program,
+                               Runtime* runtime,
+                               Stacks* stacks,
+                               Cells cells) {
+  // Must be kept in the same order as Opcode, followed by the end marker.
+  static const void* const kHandlers[] = {
+      &&op_HALT, &&op_LINE, &&op_LEFT, &&op_WORLDWALLS, &&op_ORIENTATION,
+      &&op_ROTL, &&op_ROTR, &&op_MASK, &&op_NOT, &&op_AND, &&op_OR, &&op_EQ,
+      &&op_EZ, &&op_JZ, &&op_JMP, &&op_FORWARD, &&op_WORLDBUZZERS,
+      &&op_BAGBUZZERS, &&op_PICKBUZZER, &&op_LEAVEBUZZER, &&op_LOAD, &&op_POP,
+      &&op_DUP, &&op_DEC, &&op_INC, &&op_CALL, &&op_RET, &&op_PARAM, &&op_SRET,
+      &&op_LRET, &&op_LT, &&op_LTE, &&op_COLUMN, &&op_ROW,
+      &&op_CHECKED_FORWARD, &&op_CHECKED_PICK, &&op_CHECKED_LEAVE,
+      &&op_FRONT_CLEAR_JZ, &&op_LEFT_CLEAR_JZ, &&op_RIGHT_CLEAR_JZ, &&op_JNZ,
+      &&op_FORWARD_UNTIL_WALL, &&op_PICK_ALL, &&op_END,
+  };
+  static_assert(array_length(kHandlers) == kDecodedEnd + 1,
+                "kHandlers is out of sync with Opcode");
+  // Used while running a stretch whose cost fits in the remaining budget.
+  // The counted instructions skip the limit checks, which were done for the
+  // whole stretch when entering it, and the branches go back to enter_block.
+  static const void* const kBudgetedHandlers[] = {
+      &&op_HALT, &&op_LINE, &&budgeted_LEFT, &&op_WORLDWALLS,
+      &&op_ORIENTATION, &&op_ROTL, &&op_ROTR, &&op_MASK, &&op_NOT, &&op_AND,
+      &&op_OR, &&op_EQ, &&op_EZ, &&budgeted_JZ, &&budgeted_JMP,
+      &&budgeted_FORWARD, &&op_WORLDBUZZERS, &&op_BAGBUZZERS,
+      &&budgeted_PICKBUZZER, &&budgeted_LEAVEBUZZER, &&op_LOAD, &&op_POP,
+      &&op_DUP, &&op_DEC, &&op_INC, &&budgeted_CALL, &&op_RET, &&op_PARAM,
+      &&op_SRET, &&op_LRET, &&op_LT, &&op_LTE, &&op_COLUMN, &&op_ROW,
+      &&budgeted_CHECKED_FORWARD, &&budgeted_CHECKED_PICK,
+      &&budgeted_CHECKED_LEAVE, &&budgeted_FRONT_CLEAR_JZ,
+      &&budgeted_LEFT_CLEAR_JZ, &&budgeted_RIGHT_CLEAR_JZ, &&budgeted_JNZ,
+      &&op_FORWARD_UNTIL_WALL, &&op_PICK_ALL, &&op_END,
+  };
+  static_assert(array_length(kBudgetedHandlers) == kDecodedEnd + 1,
+                "kBudgetedHandlers is out of sync with Opcode");
+
+  const uint8_t* const opcodes = program.opcodes.data();
+  const int32_t* const args = program.args.data();
+  const int32_t* const args2 = program.args2.data();
+  const BlockCost* const costs = program.costs.data();
+  const bool budgeted = !program.costs.empty();
+  // How many more FORWARD, LEFT, PICKBUZZER or LEAVEBUZZER commands can run
+  // before any of them could hit its limit.
+  size_t command_headroom = 0;
+  const void* const* handlers = kHandlers;
+  const size_t end = program.size();
+  size_t pc = 0;
+  const size_t instruction_limit = runtime->instruction_limit;
+  size_t ic = 0;
+  stacks->Reset(*runtime);
+  FlatStack<Stacks::Frame>& function_stack = stacks->frames;
+  FlatStack<int32_t>& expression_stack = stacks->expression;
+
+// ic only changes in the counted instructions, so the instruction limit only
+// needs to be checked after those instead of before every instruction.
+#define DISPATCH() goto* handlers[opcodes[pc]]
+#define CHECKED_DISPATCH()             \
+  do {                                 \
+    if (ic >= instruction_limit)       \
+      goto instruction_limit_exceeded; \
+    DISPATCH();                        \
+  } while (0)
+// Continues after a change of control flow, where a new stretch starts.
+#define BRANCH_DISPATCH() \
+  do {                    \
+    if (budgeted)         \
+      goto enter_block;   \
+    CHECKED_DISPATCH();   \
+  } while (0)
+
+  BRANCH_DISPATCH();
+
+enter_block: {
+  // The command counters move while single-stepping, so the headroom has to
+  // be computed again when coming back from it.
+  if (handlers == kHandlers)
+    command_headroom = CommandHeadroom(runtime);
+  const BlockCost& cost = costs[pc];
+  if (ic + cost.instructions < instruction_limit &&
+      cost.commands <= command_headroom) {
+    ic += cost.instructions;
+    command_headroom -= cost.commands;
+    handlers = kBudgetedHandlers;
+    DISPATCH();
+  }
+  handlers = kHandlers;
+  CHECKED_DISPATCH();
+}
+
+op_HALT:
+  return RunResult::OK;
+
+op_END:
+  return RunResult::OK;
+
+instruction_limit_exceeded:
+  if (pc == end)
+    return RunResult::OK;
+  return RunResult::INSTRUCTION;
+
+op_LINE:
+  runtime->line = args[pc];
+  runtime->column = args2[pc];
+  ++pc;
+  DISPATCH();
+
+op_LEFT:
+  ic++;
+  runtime->orientation = (runtime->orientation + 3) & 3;
+  if (++runtime->left_count > runtime->left_limit)
+    return RunResult::INSTRUCTION_LEFT;
+  ++pc;
+  CHECKED_DISPATCH();
+
+op_LOAD:
+  expression_stack.push_back(args[pc]);
+  ++pc;
+  DISPATCH();
+
+op_CALL: {
+  ic++;
+  size_t param_count = expression_stack.back();
+  if (param_count > runtime->call_param_limit)
+    return RunResult::CALLSIZE;
+  expression_stack.pop_back();
+
+  function_stack.push_back(Stacks::Frame{
+      static_cast<int32_t>(pc + 1),
+      static_cast<uint32_t>(expression_stack.size() - 1),
+      static_cast<uint32_t>(expression_stack.size() - param_count)});
+  pc = args[pc];
+  runtime->stack_memory += param_count == 0 ? 1 : param_count;
+  if (runtime->stack_memory > runtime->stack_memory_limit)
+    return RunResult::STACKMEMORY;
+  if (function_stack.size() >= runtime->stack_limit)
+    return RunResult::STACK;
+  BRANCH_DISPATCH();
+}
+
+op_RET: {
+  if (function_stack.empty())
+    return RunResult::OK;
+  Stacks::Frame& frame = function_stack.back();
+  pc = frame.pc;
+  uint32_t param_count = (frame.param_sp + 1) - frame.sp;
+  runtime->stack_memory -= param_count == 0 ? 1 : param_count;
+  expression_stack.truncate(frame.sp);
+  function_stack.pop_back();
+  if (budgeted)
+    goto enter_block;
+  DISPATCH();
+}
+
+op_WORLDWALLS:
+  expression_stack.push_back(cells.walls(runtime->x, runtime->y));
+  ++pc;
+  DISPATCH();
+
+op_ORIENTATION:
+  expression_stack.push_back(runtime->orientation);
+  ++pc;
+  DISPATCH();
+
+op_ROTL:
+  expression_stack.back() = (expression_stack.back() + 3) & 3;
+  ++pc;
+  DISPATCH();
+
+op_ROTR:
+  expression_stack.back() = (expression_stack.back() + 1) & 3;
+  ++pc;
+  DISPATCH();
+
+op_MASK:
+  expression_stack.back() = 1 << expression_stack.back();
+  ++pc;
+  DISPATCH();
+
+op_NOT:
+  expression_stack.back() = (expression_stack.back() == 0) ? 1 : 0;
+  ++pc;
+  DISPATCH();
+
+op_AND: {
+  int32_t op2 = expression_stack.back();
+  expression_stack.pop_back();
+  expression_stack.back() = (expression_stack.back() & op2) ? 1 : 0;
+  ++pc;
+  DISPATCH();
+}
+
+op_OR: {
+  int32_t op2 = expression_stack.back();
+  expression_stack.pop_back();
+  expression_stack.back() = (expression_stack.back() | op2) ? 1 : 0;
+  ++pc;
+  DISPATCH();
+}
+
+op_EQ: {
+  int32_t op2 = expression_stack.back();
+  expression_stack.pop_back();
+  expression_stack.back() = (expression_stack.back() == op2) ? 1 : 0;
+  ++pc;
+  DISPATCH();
+}
+
+op_LT: {
+  int32_t op2 = expression_stack.back();
+  expression_stack.pop_back();
+  expression_stack.back() = (expression_stack.back() < op2) ? 1 : 0;
+  ++pc;
+  DISPATCH();
+}
+
+op_LTE: {
+  int32_t op2 = expression_stack.back();
+  expression_stack.pop_back();
+  expression_stack.back() = (expression_stack.back() <= op2) ? 1 : 0;
+  ++pc;
+  DISPATCH();
+}
+
+op_JZ:
+  ic++;
+  if (expression_stack.back() == 0)
+    pc = args[pc];
+  else
+    ++pc;
+  expression_stack.pop_back();
+  BRANCH_DISPATCH();
+
+op_JNZ:
+  ic++;
+  if (expression_stack.back() != 0)
+    pc = args[pc];
+  else
+    ++pc;
+  expression_stack.pop_back();
+  BRANCH_DISPATCH();
+
+op_JMP:
+  ic += 1 + args2[pc];
+  pc = args[pc];
+  BRANCH_DISPATCH();
+
+op_WORLDBUZZERS:
+  expression_stack.push_back(cells.buzzers(runtime->x, runtime->y));
+  ++pc;
+  DISPATCH();
+
+op_FORWARD: {
+  ic++;
+  constexpr int32_t dx[] = {-1, 0, 1, 0};
+  constexpr int32_t dy[] = {0, 1, 0, -1};
+  runtime->x += dx[runtime->orientation];
+  runtime->y += dy[runtime->orientation];
+  if (++runtime->forward_count > runtime->forward_limit)
+    return RunResult::INSTRUCTION_FORWARD;
+  ++pc;
+  CHECKED_DISPATCH();
+}
+
+op_BAGBUZZERS:
+  expression_stack.push_back(runtime->bag);
+  ++pc;
+  DISPATCH();
+
+op_PICKBUZZER:
+  ic++;
+  AddBuzzers(runtime, cells, -1);
+  if (runtime->bag != kInfinity) {
+    if (runtime->bag + 1 > kMaxInt)
+      return RunResult::BAGOVERFLOW;
+    runtime->bag++;
+  }
+  if (++runtime->pickbuzzer_count > runtime->pickbuzzer_limit)
+    return RunResult::INSTRUCTION_PICK;
+  ++pc;
+  CHECKED_DISPATCH();
+
+op_LEAVEBUZZER:
+  ic++;
+  if (cells.buzzers(runtime->x, runtime->y) != kInfinity &&
+      cells.buzzers(runtime->x, runtime->y) + 1 > kMaxInt) {
+    return RunResult::WORLDOVERFLOW;
+  }
+  AddBuzzers(runtime, cells, 1);
+  if (runtime->bag != kInfinity)
+    runtime->bag--;
+  if (++runtime->leavebuzzer_count > runtime->leavebuzzer_limit)
+    return RunResult::INSTRUCTION_LEAVE;
+  ++pc;
+  CHECKED_DISPATCH();
+
+op_EZ:
+  if (expression_stack.back() == 0)
+    return static_cast<RunResult>(args[pc]);
+  expression_stack.pop_back();
+  ++pc;
+  DISPATCH();
+
+op_POP:
+  expression_stack.pop_back();
+  ++pc;
+  DISPATCH();
+
+op_DUP:
+  expression_stack.push_back(expression_stack.back());
+  ++pc;
+  DISPATCH();
+
+op_DEC:
+  if (expression_stack.back() <= kMaxInt) {
+    expression_stack.back() -= args[pc];
+    RunResult result = validateNumber(expression_stack.back());
+    if (result != RunResult::OK)
+      return result;
+  }
+  ++pc;
+  DISPATCH();
+
+op_INC:
+  if (expression_stack.back() <= kMaxInt) {
+    expression_stack.back() += args[pc];
+    RunResult result = validateNumber(expression_stack.back());
+    if (result != RunResult::OK)
+      return result;
+  }
+  ++pc;
+  DISPATCH();
+
+op_PARAM:
+  expression_stack.push_back(
+      expression_stack[function_stack.back().param_sp - args[pc]]);
+  ++pc;
+  DISPATCH();
+
+op_SRET:
+  runtime->ret = expression_stack.back();
+  expression_stack.pop_back();
+  ++pc;
+  DISPATCH();
+
+op_LRET:
+  expression_stack.push_back(runtime->ret);
+  ++pc;
+  DISPATCH();
+
+op_COLUMN:
+  expression_stack.push_back(runtime->x + 1);
+  ++pc;
+  DISPATCH();
+
+op_ROW:
+  expression_stack.push_back(runtime->y + 1);
+  ++pc;
+  DISPATCH();
+
+op_CHECKED_FORWARD: {
+  if (Blocked(runtime, cells, 0))
+    return static_cast<RunResult>(args[pc]);
+  ic++;
+  RunResult result = Forward(runtime);
+  if (result != RunResult::OK)
+    return result;
+  pc += kCheckedForwardLength;
+  CHECKED_DISPATCH();
+}
+
+op_CHECKED_PICK: {
+  if (cells.buzzers(runtime->x, runtime->y) == 0)
+    return static_cast<RunResult>(args[pc]);
+  ic++;
+  RunResult result = PickBuzzer(runtime, cells);
+  if (result != RunResult::OK)
+    return result;
+  pc += kCheckedPickLength;
+  CHECKED_DISPATCH();
+}
+
+op_CHECKED_LEAVE: {
+  if (runtime->bag == 0)
+    return static_cast<RunResult>(args[pc]);
+  ic++;
+  RunResult result = LeaveBuzzer(runtime, cells);
+  if (result != RunResult::OK)
+    return result;
+  pc += kCheckedLeaveLength;
+  CHECKED_DISPATCH();
+}
+
+op_FRONT_CLEAR_JZ:
+  ic++;
+  pc = Blocked(runtime, cells, 0) ? args[pc] : pc + args2[pc];
+  BRANCH_DISPATCH();
+
+op_LEFT_CLEAR_JZ:
+  ic++;
+  pc = Blocked(runtime, cells, 3) ? args[pc] : pc + args2[pc];
+  BRANCH_DISPATCH();
+
+op_RIGHT_CLEAR_JZ:
+  ic++;
+  pc = Blocked(runtime, cells, 1) ? args[pc] : pc + args2[pc];
+  BRANCH_DISPATCH();
+
+// The loops are the same in the budgeted mode, where they cost nothing to
+// enter. They move the command counters, so the headroom has to be computed
+// again afterwards.
+op_FORWARD_UNTIL_WALL:
+op_PICK_ALL: {
+  const bool forward = opcodes[pc] == static_cast<uint8_t>(
+                                          Opcode::FORWARD_UNTIL_WALL);
+  const size_t iterations =
+      forward
+          ? ForwardUntilWall(runtime, cells,
+                             (instruction_limit - ic) / kLoopInstructions)
+          : PickAll(runtime, cells,
+                    (instruction_limit - ic) / kLoopInstructions);
+  handlers = kHandlers;
+  if (iterations != 0) {
+    ic += iterations * kLoopInstructions;
+    const size_t body = pc + args2[pc];
+    if (opcodes[body] == static_cast<uint8_t>(Opcode::LINE)) {
+      runtime->line = args[body];
+      runtime->column = args2[body];
+    }
+    if (ic >= instruction_limit)
+      goto instruction_limit_exceeded;
+  }
+  ic++;
+  const bool leaving = forward ? Blocked(runtime, cells, 0)
+                               : cells.buzzers(runtime->x, runtime->y) == 0;
+  pc = leaving ? args[pc] : pc + args2[pc];
+  BRANCH_DISPATCH();
+}
+
+budgeted_LEFT:
+  runtime->orientation = (runtime->orientation + 3) & 3;
+  ++runtime->left_count;
+  ++pc;
+  DISPATCH();
+
+budgeted_CALL: {
+  size_t param_count = expression_stack.back();
+  if (param_count > runtime->call_param_limit)
+    return RunResult::CALLSIZE;
+  expression_stack.pop_back();
+
+  function_stack.push_back(Stacks::Frame{
+      static_cast<int32_t>(pc + 1),
+      static_cast<uint32_t>(expression_stack.size() - 1),
+      static_cast<uint32_t>(expression_stack.size() - param_count)});
+  pc = args[pc];
+  runtime->stack_memory += param_count == 0 ? 1 : param_count;
+  if (runtime->stack_memory > runtime->stack_memory_limit)
+    return RunResult::STACKMEMORY;
+  if (function_stack.size() >= runtime->stack_limit)
+    return RunResult::STACK;
+  goto enter_block;
+}
+
+budgeted_JZ:
+  if (expression_stack.back() == 0)
+    pc = args[pc];
+  else
+    ++pc;
+  expression_stack.pop_back();
+  goto enter_block;
+
+budgeted_JNZ:
+  if (expression_stack.back() != 0)
+    pc = args[pc];
+  else
+    ++pc;
+  expression_stack.pop_back();
+  goto enter_block;
+
+budgeted_JMP:
+  pc = args[pc];
+  goto enter_block;
+
+budgeted_FORWARD:
+  Forward<false>(runtime);
+  ++pc;
+  DISPATCH();
+
+budgeted_PICKBUZZER:
+  if (PickBuzzer<false>(runtime, cells) != RunResult::OK)
+    return RunResult::BAGOVERFLOW;
+  ++pc;
+  DISPATCH();
+
+budgeted_LEAVEBUZZER:
+  if (LeaveBuzzer<false>(runtime, cells) != RunResult::OK)
+    return RunResult::WORLDOVERFLOW;
+  ++pc;
+  DISPATCH();
+
+budgeted_CHECKED_FORWARD:
+  if (Blocked(runtime, cells, 0))
+    return static_cast<RunResult>(args[pc]);
+  Forward<false>(runtime);
+  pc += kCheckedForwardLength;
+  DISPATCH();
+
+budgeted_CHECKED_PICK:
+  if (cells.buzzers(runtime->x, runtime->y) == 0)
+    return static_cast<RunResult>(args[pc]);
+  if (PickBuzzer<false>(runtime, cells) != RunResult::OK)
+    return RunResult::BAGOVERFLOW;
+  pc += kCheckedPickLength;
+  DISPATCH();
+
+budgeted_CHECKED_LEAVE:
+  if (runtime->bag == 0)
+    return static_cast<RunResult>(args[pc]);
+  if (LeaveBuzzer<false>(runtime, cells) != RunResult::OK)
+    return RunResult::WORLDOVERFLOW;
+  pc += kCheckedLeaveLength;
+  DISPATCH();
+
+budgeted_FRONT_CLEAR_JZ:
+  pc = Blocked(runtime, cells, 0) ? args[pc] : pc + args2[pc];
+  goto enter_block;
+
+budgeted_LEFT_CLEAR_JZ:
+  pc = Blocked(runtime, cells, 3) ? args[pc] : pc + args2[pc];
+  goto enter_block;
+
+budgeted_RIGHT_CLEAR_JZ:
+  pc = Blocked(runtime, cells, 1) ? args[pc] : pc + args2[pc];
+  goto enter_block;
+
+#undef BRANCH_DISPATCH
+#undef CHECKED_DISPATCH
+#undef DISPATCH
+}
+
+}  // namespace
+
+RunResult RunThreaded(const DecodedProgram& program,
+                      Runtime* runtime,
+                      Stacks* stacks) {
+  return VisitRunCells(*runtime, [&](auto cells) {
+    return RunThreadedWithCells(program, runtime, stacks, cells);
+  });
+}
+
+#else  // defined(__GNUC__)
+
+RunResult RunThreaded(const DecodedProgram& program,
+                      Runtime* runtime,
+                      Stacks* stacks) {
+  // Computed gotos are a GNU extension, so turn the branch targets back into
+  // offsets and use the portable loop instead.
+  std::vector<Instruction> instructions(program.size());
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    Instruction& ins = instructions[i];
+    ins.opcode = static_cast<Opcode>(program.opcodes[i]);
+    ins.arg = program.args[i];
+    ins.arg2 = program.args2[i];
+    switch (ins.opcode) {
+      case Opcode::JZ:
+      case Opcode::JNZ:
+      case Opcode::JMP:
+      case Opcode::FRONT_CLEAR_JZ:
+      case Opcode::LEFT_CLEAR_JZ:
+      case Opcode::RIGHT_CLEAR_JZ:
+      case Opcode::FORWARD_UNTIL_WALL:
+      case Opcode::PICK_ALL:
+        ins.arg -= static_cast<int32_t>(i) + 1;
+        break;
+      default:
+        break;
+    }
+  }
+  return Run(instructions, runtime, stacks);
+}
+
+#endif  // defined(__GNUC__)
+
 }  // namespace karel
@@ -1,11 +1,18 @@
 #ifndef KAREL_H
 #define KAREL_H
 
+#include <algorithm>
 #include <limits>
+#include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <vector>
 #include <cstdint>
+#include <cstring>
+
+#include "grid.h"
+#include "macros.h"
 
 namespace karel {
 
@@ -48,7 +55,43 @@ enum class Opcode : uint32_t {
   LT,
   LTE,
   COLUMN,
-  ROW
+  ROW,
+
+  // Superinstructions. These are never read from a program file, they are
+  // only produced by FuseInstructions(). Each one replaces the first
+  // instruction of the idiom it stands for and skips the rest of it, which
+  // is left in place so that jumps into the middle of the idiom still work.
+
+  // WORLDWALLS, ORIENTATION, MASK, AND, NOT, EZ arg, FORWARD
+  CHECKED_FORWARD,
+  // WORLDBUZZERS, EZ arg, PICKBUZZER
+  CHECKED_PICK,
+  // BAGBUZZERS, EZ arg, LEAVEBUZZER
+  CHECKED_LEAVE,
+  // WORLDWALLS, ORIENTATION, MASK, AND, NOT, JZ, or the same idiom ending in
+  // JNZ instead of NOT, JZ. arg is relative to the superinstruction and arg2
+  // is the length of the idiom.
+  FRONT_CLEAR_JZ,
+  // WORLDWALLS, ORIENTATION, ROTL, MASK, AND, NOT, JZ, or ending in JNZ. arg
+  // is relative to the superinstruction and arg2 is the length of the idiom.
+  LEFT_CLEAR_JZ,
+  // WORLDWALLS, ORIENTATION, ROTR, MASK, AND, NOT, JZ, or ending in JNZ. arg
+  // is relative to the superinstruction and arg2 is the length of the idiom.
+  RIGHT_CLEAR_JZ,
+
+  // Never read from a program file, only produced by OptimizeInstructions()
+  // out of NOT, JZ. Jumps like JZ, but when the value is not zero.
+  JNZ,
+
+  // Loops recognized by FuseInstructions(). They run as many iterations as
+  // they can at once, and then the head of the loop, which is arg2
+  // instructions long. arg is the exit of the loop, relative to the
+  // superinstruction.
+  //
+  // while (front is clear) { [LINE] CHECKED_FORWARD idiom }
+  FORWARD_UNTIL_WALL,
+  // while (there are buzzers) { [LINE] CHECKED_PICK idiom }
+  PICK_ALL,
 };
 
 constexpr const char* kOpcodeNames[] = {
@@ -58,15 +101,51 @@ constexpr const char* kOpcodeNames[] = {
     "FORWARD", "WORLDBUZZERS", "BAGBUZZERS", "PICKBUZZER", "LEAVEBUZZER",
     "LOAD",    "POP",          "DUP",        "DEC",        "INC",
     "CALL",    "RET",          "PARAM",      "SRET",       "LRET",
-    "LT",      "LTE"
+    "LT",      "LTE",          "COLUMN",     "ROW",
+
+    "CHECKED_FORWARD", "CHECKED_PICK", "CHECKED_LEAVE", "FRONT_CLEAR_JZ",
+    "LEFT_CLEAR_JZ",   "RIGHT_CLEAR_JZ",
+
+    "JNZ",
+
+    "FORWARD_UNTIL_WALL", "PICK_ALL",
   };
 
+/** Marks the end of a DecodedProgram. It is not a valid Opcode. */
+constexpr uint8_t kDecodedEnd = static_cast<uint8_t>(Opcode::PICK_ALL) + 1;
+
 struct Instruction {
   Opcode opcode = Opcode::HALT;
   int32_t arg = 0;
+  // For CALL, the index of the function name in the table filled in by
+  // ParseInstructions().
   int32_t arg2 = 0;
 };
 
+/**
+ * A read-only view of a program, which can live in a std::vector or in a
+ * mapped .kxb file.
+ */
+class ProgramView {
+ public:
+  ProgramView() = default;
+  ProgramView(const Instruction* data, size_t size)
+      : data_(data), size_(size) {}
+  // Implicit, so that a std::vector can be passed wherever a view is taken.
+  ProgramView(const std::vector<Instruction>& program)
+      : data_(program.data()), size_(program.size()) {}
+
+  const Instruction* begin() const { return data_; }
+  const Instruction* end() const { return data_ + size_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const Instruction& operator[](size_t index) const { return data_[index]; }
+
+ private:
+  const Instruction* data_ = nullptr;
+  size_t size_ = 0;
+};
+
 enum class RunResult : uint32_t {
   OK,
   WALL = 16,
@@ -86,6 +165,99 @@ enum class RunResult : uint32_t {
   INSTRUCTION_LEAVE
 };
 
+/**
+ * What running a straight-line stretch of a program costs: the counted
+ * instructions, and how many of them are commands with their own limit
+ * (FORWARD, LEFT, PICKBUZZER and LEAVEBUZZER). The stretch starts at some
+ * instruction and ends at the next JZ, JMP, CALL, RET, HALT or fused branch
+ * (included), or at the end of the program.
+ */
+struct BlockCost {
+  uint32_t instructions = 0;
+  uint32_t commands = 0;
+};
+
+/**
+ * A program decoded for the threaded engine. Opcodes take a single byte and
+ * operands live in their own arrays, so the hot path only touches one byte
+ * and one int per instruction. JZ, JMP, CALL and the fused branches carry
+ * absolute targets, and every target that would leave the program points to
+ * the trailing kDecodedEnd entry.
+ */
+struct DecodedProgram {
+  std::vector<uint8_t> opcodes;
+  std::vector<int32_t> args;
+  std::vector<int32_t> args2;
+  /**
+   * Cost of the stretch that starts at each instruction, filled in by
+   * ComputeBlockCosts() to enable the budgeted mode. Empty otherwise.
+   */
+  std::vector<BlockCost> costs;
+
+  /** Number of instructions, not counting the end marker. */
+  size_t size() const { return opcodes.size() - 1; }
+};
+
+/**
+ * Returns the message that describes |result|, as printed to stderr and in
+ * the resultadoEjecucion attribute of the results, or an empty string for
+ * values that are not a RunResult.
+ */
+std::string_view RunResultMessage(RunResult result);
+
+/**
+ * The cells whose buzzers a run has changed, as a bitmap and as a list in
+ * the order in which they were first changed. Walls never change at run
+ * time, so these are the only cells in which a world can differ from how it
+ * was before the run. Once more than |max_cells| have changed, going through
+ * them is no faster than through the whole world, and it gives up as with
+ * MarkAll().
+ */
+class DirtyCells {
+ public:
+  DirtyCells(size_t width, size_t height, size_t max_cells)
+      : width_(width),
+        max_cells_(max_cells),
+        bits_((width * height + 63) / 64) {}
+
+  void Mark(size_t x, size_t y) {
+    if (all_)
+      return;
+    const size_t i = y * width_ + x;
+    uint64_t& word = bits_[i >> 6];
+    const uint64_t bit = uint64_t{1} << (i & 63);
+    if (word & bit)
+      return;
+    word |= bit;
+    cells_.push_back(i);
+    if (cells_.size() > max_cells_)
+      MarkAll();
+  }
+
+  /**
+   * Gives up on tracking single cells, for engines that cannot do it. Any
+   * cell may have changed after this.
+   */
+  void MarkAll() {
+    all_ = true;
+    bits_ = std::vector<uint64_t>();
+    cells_ = std::vector<size_t>();
+  }
+  bool all() const { return all_; }
+
+  /** The y * width + x of the changed cells, unless all() is true. */
+  const std::vector<size_t>& cells() const { return cells_; }
+
+ private:
+  const size_t width_;
+  const size_t max_cells_;
+  std::vector<uint64_t> bits_;
+  std::vector<size_t> cells_;
+  bool all_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(DirtyCells);
+};
+
 struct Runtime {
   size_t orientation = 1;
   size_t x = 0;
@@ -112,24 +284,230 @@ struct Runtime {
   int32_t ret = 0;
   uint32_t* buzzers = nullptr;
   uint8_t* walls = nullptr;
+  // The cells of worlds in any other layout than FLAT. When set, |buzzers|
+  // and |walls| are not used.
+  Grid* grid = nullptr;
+  // When set, the engines record in it every cell whose buzzers they change.
+  DirtyCells* dirty = nullptr;
 
+  /** Index of a cell in |buzzers| and |walls|. */
   size_t coordinates(size_t x, size_t y) const { return y * width + x; }
+};
+
+/**
+ * Calls |visitor| with the accessors for the cells of |runtime| in their
+ * layout, a FlatCells or the Cells of one of the Grid classes, and returns
+ * what it returns.
+ */
+template <typename Visitor>
+auto VisitCells(const Runtime& runtime, Visitor&& visitor) {
+  if (runtime.grid) {
+    switch (runtime.grid->layout) {
+      case WorldLayout::TILED:
+        return visitor(static_cast<TiledGrid*>(runtime.grid)->cells());
+      case WorldLayout::SPARSE:
+        return visitor(static_cast<SparseGrid*>(runtime.grid)->cells());
+      case WorldLayout::PACKED:
+        return visitor(static_cast<PackedGrid*>(runtime.grid)->cells());
+      case WorldLayout::FLAT:
+        break;
+    }
+  }
+  return visitor(FlatCells(runtime.buzzers, runtime.walls, runtime.width));
+}
 
-  void inc_buzzers(int32_t count) {
-    if (buzzers[coordinates(x, y)] == kInfinity)
+/**
+ * A stack backed by a single flat array. push_back() only allocates when the
+ * array is full, which does not happen as long as it was reserved with enough
+ * room up front. Popping never releases memory, so the array can be reused.
+ */
+template <typename T>
+class FlatStack {
+ public:
+  FlatStack() = default;
+
+  void reserve(size_t capacity) {
+    if (capacity <= capacity_)
       return;
-    buzzers[coordinates(x, y)] += count;
+    // Not value-initialized: every entry is written before it is read.
+    std::unique_ptr<T[]> data(new T[capacity]);
+    if (size_)
+      memcpy(data.get(), data_.get(), size_ * sizeof(T));
+    data_ = std::move(data);
+    capacity_ = capacity;
+  }
+
+  void clear() { size_ = 0; }
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  const T* begin() const { return data_.get(); }
+  const T* end() const { return data_.get() + size_; }
+
+  void push_back(T value) {
+    if (__builtin_expect(size_ == capacity_, 0))
+      reserve(std::max<size_t>(16, 2 * capacity_));
+    data_[size_++] = value;
   }
+  void pop_back() { --size_; }
+  T& back() { return data_[size_ - 1]; }
+  T& operator[](size_t index) { return data_[index]; }
+
+  /** Drops the entries above |size|. Never grows the stack. */
+  void truncate(size_t size) {
+    if (size_ > size)
+      size_ = size;
+  }
+
+ private:
+  std::unique_ptr<T[]> data_;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(FlatStack);
+};
+
+/**
+ * The call and expression stacks of a run. Keeping an instance around and
+ * passing it to every Run() lets batch runs allocate the stacks only once.
+ */
+struct Stacks {
+  struct Frame {
+    int32_t pc;
+    uint32_t param_sp;
+    uint32_t sp;
+  };
 
-  uint32_t get_buzzers() const { return buzzers[coordinates(x, y)]; }
+  /**
+   * Empties both stacks and preallocates them for the limits in |runtime|,
+   * so that no allocation happens while running. Programs that keep more
+   * temporaries per call than the limits account for still work, the
+   * expression stack just grows on demand.
+   */
+  void Reset(const Runtime& runtime);
 
-  uint8_t get_walls() const { return walls[coordinates(x, y)]; }
+  FlatStack<Frame> frames;
+  FlatStack<int32_t> expression;
 };
 
+/**
+ * Parses a program in the JSON format emitted by the compiler, in a single
+ * pass over the text for the programs that the compiler emits. If
+ * |function_names| is not null, it gets the names that the CALLs carry, in
+ * the order of their first appearance.
+ */
 std::optional<std::vector<Instruction>> ParseInstructions(
-    std::string_view program);
+    std::string_view program,
+    std::vector<std::string>* function_names = nullptr);
+
+/** What VerifyInstructions() proved about one function of a program. */
+struct FunctionInfo {
+  /** Index of the first instruction. The main program starts at 0. */
+  int32_t entry;
+  /** Number of parameters, which are part of the function's frame. */
+  int32_t arity;
+  /**
+   * Largest height the expression stack reaches above the start of the
+   * frame, parameters included.
+   */
+  uint32_t max_stack_depth;
+};
+
+struct ProgramInfo {
+  /** Every function reachable from the main program, main first. */
+  std::vector<FunctionInfo> functions;
+};
+
+/**
+ * Checks that |program| can run without reading outside of its stacks. Every
+ * reachable instruction must see the same expression stack height on all the
+ * paths that reach it, no instruction may pop below the parameters of its
+ * frame, every CALL must take its parameter count from a constant that is the
+ * same for all the calls to a function, PARAM must name one of those
+ * parameters, and EZ must carry a valid RunResult. Branches and calls that
+ * leave the program are allowed, since they just end it.
+ *
+ * Meant to be called right after ParseInstructions(), and again on programs
+ * that are read back from storage, so it also takes the superinstructions of
+ * OptimizeInstructions() and FuseInstructions(). Programs that pass can run
+ * on the engines, none of which check the stacks.
+ */
+std::optional<ProgramInfo> VerifyInstructions(ProgramView program);
+
+/**
+ * Removes redundant work from |program|: code that cannot be reached,
+ * LINE markers that are immediately overwritten by another LINE, INC and DEC
+ * applied to a LOAD constant, and NOT followed by JZ, which becomes a JNZ.
+ * JMPs that land on another JMP jump straight to the final target, and
+ * account for the skipped JMPs in arg2 so that the instruction count stays
+ * the same. Branches are relinked to the new positions.
+ *
+ * The optimized program has the same results, final Runtime state and
+ * instruction counting as the original. If |removed| is not null, it is set
+ * to the number of instructions that were removed. Meant to be called after
+ * VerifyInstructions() and before FuseInstructions().
+ */
+std::vector<Instruction> OptimizeInstructions(
+    const std::vector<Instruction>& program,
+    size_t* removed = nullptr);
+
+/**
+ * Replaces the guard idioms emitted by the compiler for every Karel command
+ * and wall condition with superinstructions, so that each of them costs a
+ * single dispatch. Loops that move until a wall or pick all the buzzers
+ * become superinstructions that run them in closed form. The program keeps
+ * its length and all its jump offsets, and runs with the exact same
+ * instruction counting and results.
+ */
+std::vector<Instruction> FuseInstructions(
+    const std::vector<Instruction>& program);
+
+RunResult Run(ProgramView program, Runtime* runtime);
+
+RunResult Run(ProgramView program, Runtime* runtime, Stacks* stacks);
+
+/**
+ * Checks the shape of |program|, which VerifyInstructions() does before it
+ * follows its flow: that opcodes and result codes are valid and that fused
+ * idioms fit in the program.
+ */
+bool ValidateInstructions(ProgramView program);
+
+/**
+ * Builds the DecodedProgram for |program|, resolving branch targets and
+ * validating opcodes and EZ result codes. Meant to be called once right after
+ * ParseInstructions() (and FuseInstructions()).
+ */
+std::optional<DecodedProgram> DecodeInstructions(ProgramView program);
+
+/**
+ * Fills in |program|->costs. With them, RunThreaded() checks the instruction
+ * and command limits once when it enters a stretch instead of after every
+ * counted instruction.
+ */
+void ComputeBlockCosts(DecodedProgram* program);
+
+/**
+ * Same as Run(), but dispatches from handler to handler with computed gotos
+ * instead of going through a central switch. The RunResult and the final
+ * Runtime state are identical to Run().
+ *
+ * If |program| has costs, every stretch whose cost fits in the remaining
+ * budget runs without any limit checks. The ones that do not fit are
+ * single-stepped with exact checks, so the INSTRUCTION* results still happen
+ * on the same instruction as in Run().
+ */
+RunResult RunThreaded(const DecodedProgram& program, Runtime* runtime);
+
+RunResult RunThreaded(const DecodedProgram& program,
+                      Runtime* runtime,
+                      Stacks* stacks);
 
-RunResult Run(const std::vector<Instruction>& program, Runtime* runtime);
+/**
+ * Convenience overload that decodes |program| on every call. Programs that
+ * fail to decode are logged and run with Run().
+ */
+RunResult RunThreaded(ProgramView program, Runtime* runtime);
 
 }  // namespace karel
 
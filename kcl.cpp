@@ -1,5 +1,21 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
 #include <llvm/ADT/APFloat.h>
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
@@ -9,6 +25,1196 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "karel.h"
+#include "logging.h"
+#include "util.h"
+#include "world.h"
+
+namespace {
+
+constexpr const char kEntryPointName[] = "karel_run";
+
+// A call frame of the JIT-compiled code. |ret| is the index of the
+// instruction to return to, |param_sp| is the caller's param_sp, restored on
+// return, and |sp| is the base of the callee's frame in the expression stack.
+struct JitFrame {
+  int64_t ret;
+  int64_t param_sp;
+  int64_t sp;
+};
+
+// Stacks shared between the compiled code and the helpers below. The compiled
+// code only grows them through the helpers, and the buffers are kept between
+// runs.
+struct JitState {
+  int32_t* expression = nullptr;
+  int64_t expression_capacity = 0;
+  JitFrame* frames = nullptr;
+  int64_t frame_capacity = 0;
+};
+
+template <typename T>
+T* Grow(T* buffer, int64_t* capacity, int64_t needed) {
+  int64_t new_capacity = std::max<int64_t>(*capacity * 2, 1024);
+  while (new_capacity < needed)
+    new_capacity *= 2;
+  buffer = static_cast<T*>(realloc(buffer, new_capacity * sizeof(T)));
+  if (!buffer)
+    LOG(FATAL) << "Failed to grow the JIT stacks to " << new_capacity;
+  *capacity = new_capacity;
+  return buffer;
+}
+
+int32_t* GrowExpressionStack(JitState* state, int64_t needed) {
+  state->expression =
+      Grow(state->expression, &state->expression_capacity, needed);
+  return state->expression;
+}
+
+JitFrame* GrowFrames(JitState* state) {
+  state->frames =
+      Grow(state->frames, &state->frame_capacity, state->frame_capacity + 1);
+  return state->frames;
+}
+
+// Lowers a Karel program into a single LLVM function
+//
+//   i32 karel_run(i8* runtime, i8* state)
+//
+// that returns the RunResult. Every basic block of the bytecode becomes a
+// basic block of the function. Within a block the expression stack lives in
+// SSA values and is only spilled to memory at block boundaries, and the
+// Runtime fields the program touches are cached in locals that are written
+// back once when the run ends.
+class Compiler {
+ public:
+  Compiler(const std::vector<karel::Instruction>& program,
+           llvm::LLVMContext* context,
+           llvm::Module* module)
+      : program_(program),
+        end_(program.size()),
+        context_(*context),
+        module_(module),
+        builder_(*context) {}
+
+  llvm::Function* Compile();
+
+ private:
+  // A Runtime field that is kept in a local for the duration of the run.
+  struct CachedField {
+    size_t offset;
+    llvm::Type* type;
+    llvm::AllocaInst* local;
+  };
+
+  // The part of the expression stack that is still in SSA values.
+  struct VirtualStack {
+    // Memory stack pointer when the block started.
+    llvm::Value* sp = nullptr;
+    // Base of the memory stack, loaded after the capacity check.
+    llvm::Value* base = nullptr;
+    // Values pushed by this block that have not been spilled.
+    std::vector<llvm::Value*> values;
+    // Number of memory entries this block has popped.
+    int64_t consumed = 0;
+    // Largest number of entries this block adds on top of |sp|.
+    int64_t max_growth = 0;
+  };
+
+  void ComputeLeaders();
+  llvm::BasicBlock* BlockFor(int64_t pc);
+  void EmitBlock(int64_t leader);
+  // Emits the instruction at |pc| and returns the pc of the next one, or
+  // std::nullopt if the instruction ends the block.
+  std::optional<int64_t> EmitInstruction(int64_t pc);
+  void EmitReturnDispatch();
+
+  // Successor of the instruction at |pc| when it does not branch.
+  int64_t Next(int64_t pc) const;
+  int64_t Resolve(int64_t target) const {
+    return (target < 0 || target >= end_) ? end_ : target;
+  }
+
+  void Push(llvm::Value* value);
+  llvm::Value* Pop();
+  llvm::Value* Top();
+  void Flush();
+
+  void Exit(karel::RunResult result) { Exit(Int32(static_cast<int32_t>(result))); }
+  void Exit(llvm::Value* result);
+  void ExitIf(llvm::Value* condition, karel::RunResult result) {
+    ExitIf(condition, Int32(static_cast<int32_t>(result)));
+  }
+  void ExitIf(llvm::Value* condition, llvm::Value* result);
+  // Jumps to |target|. For counted instructions this also checks the
+  // instruction limit on behalf of the target, the same way Run() does at the
+  // top of its loop.
+  void BranchTo(int64_t target, bool counted);
+  void CheckInstructionLimit(int64_t next);
+  void CountInstruction(int64_t count = 1);
+
+  llvm::Value* FieldPointer(llvm::Value* base, size_t offset, llvm::Type* type);
+  llvm::Value* LoadConstant(size_t offset, llvm::Type* type);
+  CachedField* Cache(size_t offset, llvm::Type* type);
+  llvm::Value* Load(CachedField* field);
+  void Store(CachedField* field, llvm::Value* value);
+  llvm::Value* Load(llvm::AllocaInst* local);
+  llvm::AllocaInst* Local(llvm::Type* type, llvm::Value* initial_value);
+
+  llvm::Value* Int32(int32_t value) { return builder_.getInt32(value); }
+  llvm::Value* Int64(int64_t value) { return builder_.getInt64(value); }
+
+  llvm::Value* CellIndex();
+  llvm::Value* Blocked(int32_t rotation);
+  void EmitForward();
+  void EmitPickBuzzer();
+  void EmitLeaveBuzzer();
+
+  const std::vector<karel::Instruction>& program_;
+  const int64_t end_;
+  llvm::LLVMContext& context_;
+  llvm::Module* module_;
+  llvm::IRBuilder<> builder_;
+
+  llvm::Function* function_ = nullptr;
+  llvm::BasicBlock* entry_block_ = nullptr;
+  llvm::BasicBlock* exit_block_ = nullptr;
+  llvm::PHINode* exit_result_ = nullptr;
+  llvm::BasicBlock* return_block_ = nullptr;
+  llvm::Value* runtime_ = nullptr;
+  llvm::Value* state_ = nullptr;
+
+  std::set<int64_t> leaders_;
+  std::map<int64_t, llvm::BasicBlock*> blocks_;
+  std::map<int64_t, llvm::BasicBlock*> return_sites_;
+  std::vector<int64_t> pending_;
+  VirtualStack stack_;
+
+  std::vector<std::unique_ptr<CachedField>> cached_fields_;
+  CachedField* orientation_ = nullptr;
+  CachedField* x_ = nullptr;
+  CachedField* y_ = nullptr;
+  CachedField* bag_ = nullptr;
+  CachedField* line_ = nullptr;
+  CachedField* column_ = nullptr;
+  CachedField* forward_count_ = nullptr;
+  CachedField* left_count_ = nullptr;
+  CachedField* leavebuzzer_count_ = nullptr;
+  CachedField* pickbuzzer_count_ = nullptr;
+  CachedField* stack_memory_ = nullptr;
+  CachedField* ret_ = nullptr;
+
+  llvm::Value* instruction_limit_ = nullptr;
+  llvm::Value* stack_limit_ = nullptr;
+  llvm::Value* stack_memory_limit_ = nullptr;
+  llvm::Value* call_param_limit_ = nullptr;
+  llvm::Value* forward_limit_ = nullptr;
+  llvm::Value* left_limit_ = nullptr;
+  llvm::Value* pickbuzzer_limit_ = nullptr;
+  llvm::Value* leavebuzzer_limit_ = nullptr;
+  llvm::Value* width_ = nullptr;
+  llvm::Value* buzzers_ = nullptr;
+  llvm::Value* walls_ = nullptr;
+
+  llvm::AllocaInst* ic_ = nullptr;
+  llvm::AllocaInst* sp_ = nullptr;
+  llvm::AllocaInst* depth_ = nullptr;
+  llvm::AllocaInst* param_sp_ = nullptr;
+  llvm::AllocaInst* expression_ = nullptr;
+  llvm::AllocaInst* expression_capacity_ = nullptr;
+  llvm::AllocaInst* frames_ = nullptr;
+  llvm::AllocaInst* frame_capacity_ = nullptr;
+
+  llvm::StructType* frame_type_ = nullptr;
+
+  DISALLOW_COPY_AND_ASSIGN(Compiler);
+};
+
+int64_t Compiler::Next(int64_t pc) const {
+  switch (program_[pc].opcode) {
+    case karel::Opcode::CHECKED_FORWARD:
+      return pc + 7;
+    case karel::Opcode::FRONT_CLEAR_JZ:
+    case karel::Opcode::LEFT_CLEAR_JZ:
+    case karel::Opcode::RIGHT_CLEAR_JZ:
+    case karel::Opcode::FORWARD_UNTIL_WALL:
+    case karel::Opcode::PICK_ALL:
+      return pc + program_[pc].arg2;
+    case karel::Opcode::CHECKED_PICK:
+    case karel::Opcode::CHECKED_LEAVE:
+      return pc + 3;
+    default:
+      return pc + 1;
+  }
+}
+
+void Compiler::ComputeLeaders() {
+  leaders_.insert(0);
+  for (int64_t pc = 0; pc < end_; ++pc) {
+    const karel::Instruction& ins = program_[pc];
+    switch (ins.opcode) {
+      case karel::Opcode::JZ:
+      case karel::Opcode::JNZ:
+      case karel::Opcode::JMP:
+      case karel::Opcode::FRONT_CLEAR_JZ:
+      case karel::Opcode::LEFT_CLEAR_JZ:
+      case karel::Opcode::RIGHT_CLEAR_JZ:
+      case karel::Opcode::FORWARD_UNTIL_WALL:
+      case karel::Opcode::PICK_ALL:
+        leaders_.insert(Resolve(pc + ins.arg + 1));
+        leaders_.insert(Next(pc));
+        break;
+      case karel::Opcode::CALL:
+        leaders_.insert(Resolve(ins.arg));
+        leaders_.insert(Next(pc));
+        break;
+      case karel::Opcode::HALT:
+      case karel::Opcode::RET:
+      case karel::Opcode::CHECKED_FORWARD:
+      case karel::Opcode::CHECKED_PICK:
+      case karel::Opcode::CHECKED_LEAVE:
+        leaders_.insert(Next(pc));
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+llvm::BasicBlock* Compiler::BlockFor(int64_t pc) {
+  auto it = blocks_.find(pc);
+  if (it != blocks_.end())
+    return it->second;
+  llvm::BasicBlock* block = llvm::BasicBlock::Create(
+      context_, "pc" + std::to_string(pc), function_);
+  blocks_.emplace(pc, block);
+  pending_.push_back(pc);
+  return block;
+}
+
+llvm::Value* Compiler::FieldPointer(llvm::Value* base,
+                                    size_t offset,
+                                    llvm::Type* type) {
+  llvm::Value* address =
+      builder_.CreateConstInBoundsGEP1_64(builder_.getInt8Ty(), base, offset);
+  return builder_.CreateBitCast(address, type->getPointerTo());
+}
+
+llvm::Value* Compiler::LoadConstant(size_t offset, llvm::Type* type) {
+  return builder_.CreateLoad(type, FieldPointer(runtime_, offset, type));
+}
+
+llvm::AllocaInst* Compiler::Local(llvm::Type* type,
+                                  llvm::Value* initial_value) {
+  llvm::AllocaInst* local = builder_.CreateAlloca(type);
+  builder_.CreateStore(initial_value, local);
+  return local;
+}
+
+Compiler::CachedField* Compiler::Cache(size_t offset, llvm::Type* type) {
+  cached_fields_.emplace_back(std::make_unique<CachedField>(
+      CachedField{offset, type, Local(type, LoadConstant(offset, type))}));
+  return cached_fields_.back().get();
+}
+
+llvm::Value* Compiler::Load(CachedField* field) {
+  return builder_.CreateLoad(field->type, field->local);
+}
+
+void Compiler::Store(CachedField* field, llvm::Value* value) {
+  builder_.CreateStore(value, field->local);
+}
+
+llvm::Value* Compiler::Load(llvm::AllocaInst* local) {
+  return builder_.CreateLoad(local->getAllocatedType(), local);
+}
+
+void Compiler::Push(llvm::Value* value) {
+  stack_.values.push_back(value);
+  stack_.max_growth =
+      std::max(stack_.max_growth,
+               static_cast<int64_t>(stack_.values.size()) - stack_.consumed);
+}
+
+llvm::Value* Compiler::Top() {
+  if (!stack_.values.empty())
+    return stack_.values.back();
+  llvm::Value* index =
+      builder_.CreateSub(stack_.sp, Int64(stack_.consumed + 1));
+  return builder_.CreateLoad(
+      builder_.getInt32Ty(),
+      builder_.CreateInBoundsGEP(builder_.getInt32Ty(), stack_.base, index));
+}
+
+llvm::Value* Compiler::Pop() {
+  llvm::Value* value = Top();
+  if (!stack_.values.empty())
+    stack_.values.pop_back();
+  else
+    stack_.consumed++;
+  return value;
+}
+
+void Compiler::Flush() {
+  llvm::Value* base = builder_.CreateSub(stack_.sp, Int64(stack_.consumed));
+  for (size_t i = 0; i < stack_.values.size(); ++i) {
+    llvm::Value* index = builder_.CreateAdd(base, Int64(i));
+    builder_.CreateStore(stack_.values[i],
+                         builder_.CreateInBoundsGEP(builder_.getInt32Ty(),
+                                                    stack_.base, index));
+  }
+  stack_.sp = builder_.CreateAdd(base, Int64(stack_.values.size()));
+  builder_.CreateStore(stack_.sp, sp_);
+  stack_.values.clear();
+  stack_.consumed = 0;
+}
+
+void Compiler::Exit(llvm::Value* result) {
+  exit_result_->addIncoming(result, builder_.GetInsertBlock());
+  builder_.CreateBr(exit_block_);
+}
+
+void Compiler::ExitIf(llvm::Value* condition, llvm::Value* result) {
+  llvm::BasicBlock* next =
+      llvm::BasicBlock::Create(context_, "", function_);
+  exit_result_->addIncoming(result, builder_.GetInsertBlock());
+  builder_.CreateCondBr(condition, exit_block_, next);
+  builder_.SetInsertPoint(next);
+}
+
+void Compiler::CountInstruction(int64_t count) {
+  builder_.CreateStore(builder_.CreateAdd(Load(ic_), Int64(count)), ic_);
+}
+
+void Compiler::CheckInstructionLimit(int64_t next) {
+  // Running off the end of the program ends the run before the limit is
+  // checked again.
+  if (next >= end_)
+    return;
+  ExitIf(builder_.CreateICmpUGE(Load(ic_), instruction_limit_),
+         karel::RunResult::INSTRUCTION);
+}
+
+void Compiler::BranchTo(int64_t target, bool counted) {
+  if (target >= end_) {
+    Exit(karel::RunResult::OK);
+    return;
+  }
+  if (counted)
+    CheckInstructionLimit(target);
+  builder_.CreateBr(BlockFor(target));
+}
+
+llvm::Value* Compiler::CellIndex() {
+  return builder_.CreateAdd(builder_.CreateMul(Load(y_), width_), Load(x_));
+}
+
+llvm::Value* Compiler::Blocked(int32_t rotation) {
+  llvm::Value* walls = builder_.CreateZExt(
+      builder_.CreateLoad(builder_.getInt8Ty(),
+                          builder_.CreateInBoundsGEP(builder_.getInt8Ty(),
+                                                     walls_, CellIndex())),
+      builder_.getInt32Ty());
+  llvm::Value* direction = builder_.CreateAnd(
+      builder_.CreateAdd(
+          builder_.CreateTrunc(Load(orientation_), builder_.getInt32Ty()),
+          Int32(rotation)),
+      Int32(3));
+  return builder_.CreateICmpNE(
+      builder_.CreateAnd(walls, builder_.CreateShl(Int32(1), direction)),
+      Int32(0));
+}
+
+void Compiler::EmitForward() {
+  llvm::Value* orientation = Load(orientation_);
+  llvm::Value* dx = builder_.CreateSelect(
+      builder_.CreateICmpEQ(orientation, Int64(0)), Int64(-1),
+      builder_.CreateSelect(builder_.CreateICmpEQ(orientation, Int64(2)),
+                            Int64(1), Int64(0)));
+  llvm::Value* dy = builder_.CreateSelect(
+      builder_.CreateICmpEQ(orientation, Int64(1)), Int64(1),
+      builder_.CreateSelect(builder_.CreateICmpEQ(orientation, Int64(3)),
+                            Int64(-1), Int64(0)));
+  Store(x_, builder_.CreateAdd(Load(x_), dx));
+  Store(y_, builder_.CreateAdd(Load(y_), dy));
+  llvm::Value* count = builder_.CreateAdd(Load(forward_count_), Int64(1));
+  Store(forward_count_, count);
+  ExitIf(builder_.CreateICmpUGT(count, forward_limit_),
+         karel::RunResult::INSTRUCTION_FORWARD);
+}
+
+void Compiler::EmitPickBuzzer() {
+  llvm::Value* cell = builder_.CreateInBoundsGEP(builder_.getInt32Ty(),
+                                                 buzzers_, CellIndex());
+  llvm::Value* buzzers = builder_.CreateLoad(builder_.getInt32Ty(), cell);
+  builder_.CreateStore(
+      builder_.CreateSelect(
+          builder_.CreateICmpEQ(buzzers, Int32(karel::kInfinity)), buzzers,
+          builder_.CreateSub(buzzers, Int32(1))),
+      cell);
+  llvm::Value* bag = Load(bag_);
+  llvm::Value* finite_bag =
+      builder_.CreateICmpNE(bag, Int64(karel::kInfinity));
+  llvm::Value* next_bag = builder_.CreateAdd(bag, Int64(1));
+  ExitIf(builder_.CreateAnd(finite_bag, builder_.CreateICmpUGT(
+                                            next_bag, Int64(karel::kMaxInt))),
+         karel::RunResult::BAGOVERFLOW);
+  Store(bag_, builder_.CreateSelect(finite_bag, next_bag, bag));
+  llvm::Value* count = builder_.CreateAdd(Load(pickbuzzer_count_), Int64(1));
+  Store(pickbuzzer_count_, count);
+  ExitIf(builder_.CreateICmpUGT(count, pickbuzzer_limit_),
+         karel::RunResult::INSTRUCTION_PICK);
+}
+
+void Compiler::EmitLeaveBuzzer() {
+  llvm::Value* cell = builder_.CreateInBoundsGEP(builder_.getInt32Ty(),
+                                                 buzzers_, CellIndex());
+  llvm::Value* buzzers = builder_.CreateLoad(builder_.getInt32Ty(), cell);
+  llvm::Value* finite_buzzers =
+      builder_.CreateICmpNE(buzzers, Int32(karel::kInfinity));
+  llvm::Value* next_buzzers = builder_.CreateAdd(buzzers, Int32(1));
+  ExitIf(builder_.CreateAnd(finite_buzzers,
+                            builder_.CreateICmpUGT(next_buzzers,
+                                                   Int32(karel::kMaxInt))),
+         karel::RunResult::WORLDOVERFLOW);
+  builder_.CreateStore(
+      builder_.CreateSelect(finite_buzzers, next_buzzers, buzzers), cell);
+  llvm::Value* bag = Load(bag_);
+  Store(bag_, builder_.CreateSelect(
+                  builder_.CreateICmpNE(bag, Int64(karel::kInfinity)),
+                  builder_.CreateSub(bag, Int64(1)), bag));
+  llvm::Value* count = builder_.CreateAdd(Load(leavebuzzer_count_), Int64(1));
+  Store(leavebuzzer_count_, count);
+  ExitIf(builder_.CreateICmpUGT(count, leavebuzzer_limit_),
+         karel::RunResult::INSTRUCTION_LEAVE);
+}
+
+std::optional<int64_t> Compiler::EmitInstruction(int64_t pc) {
+  const karel::Instruction& ins = program_[pc];
+  llvm::Type* i32 = builder_.getInt32Ty();
+  llvm::Type* i64 = builder_.getInt64Ty();
+
+  switch (ins.opcode) {
+    case karel::Opcode::HALT:
+      Exit(karel::RunResult::OK);
+      return std::nullopt;
+
+    case karel::Opcode::LINE:
+      Store(line_, Int64(ins.arg));
+      Store(column_, Int64(ins.arg2));
+      break;
+
+    case karel::Opcode::LEFT: {
+      CountInstruction();
+      Store(orientation_,
+            builder_.CreateAnd(builder_.CreateAdd(Load(orientation_), Int64(3)),
+                               Int64(3)));
+      llvm::Value* count = builder_.CreateAdd(Load(left_count_), Int64(1));
+      Store(left_count_, count);
+      ExitIf(builder_.CreateICmpUGT(count, left_limit_),
+             karel::RunResult::INSTRUCTION_LEFT);
+      CheckInstructionLimit(Next(pc));
+      break;
+    }
+
+    case karel::Opcode::WORLDWALLS:
+      Push(builder_.CreateZExt(
+          builder_.CreateLoad(builder_.getInt8Ty(),
+                              builder_.CreateInBoundsGEP(
+                                  builder_.getInt8Ty(), walls_, CellIndex())),
+          i32));
+      break;
+
+    case karel::Opcode::ORIENTATION:
+      Push(builder_.CreateTrunc(Load(orientation_), i32));
+      break;
+
+    case karel::Opcode::ROTL:
+      Push(builder_.CreateAnd(builder_.CreateAdd(Pop(), Int32(3)), Int32(3)));
+      break;
+
+    case karel::Opcode::ROTR:
+      Push(builder_.CreateAnd(builder_.CreateAdd(Pop(), Int32(1)), Int32(3)));
+      break;
+
+    case karel::Opcode::MASK:
+      Push(builder_.CreateShl(Int32(1), builder_.CreateAnd(Pop(), Int32(31))));
+      break;
+
+    case karel::Opcode::NOT:
+      Push(builder_.CreateZExt(builder_.CreateICmpEQ(Pop(), Int32(0)), i32));
+      break;
+
+    case karel::Opcode::AND: {
+      llvm::Value* op2 = Pop();
+      llvm::Value* op1 = Pop();
+      Push(builder_.CreateZExt(
+          builder_.CreateICmpNE(builder_.CreateAnd(op1, op2), Int32(0)), i32));
+      break;
+    }
+
+    case karel::Opcode::OR: {
+      llvm::Value* op2 = Pop();
+      llvm::Value* op1 = Pop();
+      Push(builder_.CreateZExt(
+          builder_.CreateICmpNE(builder_.CreateOr(op1, op2), Int32(0)), i32));
+      break;
+    }
+
+    case karel::Opcode::EQ: {
+      llvm::Value* op2 = Pop();
+      llvm::Value* op1 = Pop();
+      Push(builder_.CreateZExt(builder_.CreateICmpEQ(op1, op2), i32));
+      break;
+    }
+
+    case karel::Opcode::LT: {
+      llvm::Value* op2 = Pop();
+      llvm::Value* op1 = Pop();
+      Push(builder_.CreateZExt(builder_.CreateICmpSLT(op1, op2), i32));
+      break;
+    }
+
+    case karel::Opcode::LTE: {
+      llvm::Value* op2 = Pop();
+      llvm::Value* op1 = Pop();
+      Push(builder_.CreateZExt(builder_.CreateICmpSLE(op1, op2), i32));
+      break;
+    }
+
+    case karel::Opcode::EZ:
+      ExitIf(builder_.CreateICmpEQ(Top(), Int32(0)), Int32(ins.arg));
+      Pop();
+      break;
+
+    case karel::Opcode::JZ:
+    case karel::Opcode::JNZ: {
+      llvm::Value* condition =
+          ins.opcode == karel::Opcode::JZ
+              ? builder_.CreateICmpEQ(Pop(), Int32(0))
+              : builder_.CreateICmpNE(Pop(), Int32(0));
+      Flush();
+      CountInstruction();
+      llvm::BasicBlock* taken = llvm::BasicBlock::Create(context_, "", function_);
+      llvm::BasicBlock* not_taken =
+          llvm::BasicBlock::Create(context_, "", function_);
+      builder_.CreateCondBr(condition, taken, not_taken);
+      builder_.SetInsertPoint(taken);
+      BranchTo(Resolve(pc + ins.arg + 1), true);
+      builder_.SetInsertPoint(not_taken);
+      BranchTo(Next(pc), true);
+      return std::nullopt;
+    }
+
+    case karel::Opcode::JMP:
+      Flush();
+      CountInstruction(1 + ins.arg2);
+      BranchTo(Resolve(pc + ins.arg + 1), true);
+      return std::nullopt;
+
+    case karel::Opcode::FORWARD:
+      CountInstruction();
+      EmitForward();
+      CheckInstructionLimit(Next(pc));
+      break;
+
+    case karel::Opcode::WORLDBUZZERS:
+      Push(builder_.CreateLoad(
+          i32, builder_.CreateInBoundsGEP(i32, buzzers_, CellIndex())));
+      break;
+
+    case karel::Opcode::BAGBUZZERS:
+      Push(builder_.CreateTrunc(Load(bag_), i32));
+      break;
+
+    case karel::Opcode::PICKBUZZER:
+      CountInstruction();
+      EmitPickBuzzer();
+      CheckInstructionLimit(Next(pc));
+      break;
+
+    case karel::Opcode::LEAVEBUZZER:
+      CountInstruction();
+      EmitLeaveBuzzer();
+      CheckInstructionLimit(Next(pc));
+      break;
+
+    case karel::Opcode::LOAD:
+      Push(Int32(ins.arg));
+      break;
+
+    case karel::Opcode::POP:
+      Pop();
+      break;
+
+    case karel::Opcode::DUP:
+      Push(Top());
+      break;
+
+    case karel::Opcode::DEC:
+    case karel::Opcode::INC: {
+      llvm::Value* value = Pop();
+      llvm::Value* finite = builder_.CreateICmpSLE(value, Int32(karel::kMaxInt));
+      llvm::Value* result = ins.opcode == karel::Opcode::INC
+                                ? builder_.CreateAdd(value, Int32(ins.arg))
+                                : builder_.CreateSub(value, Int32(ins.arg));
+      ExitIf(builder_.CreateAnd(finite, builder_.CreateICmpSGT(
+                                            result, Int32(karel::kMaxInt))),
+             karel::RunResult::INTEGEROVERFLOW);
+      ExitIf(builder_.CreateAnd(finite, builder_.CreateICmpSLT(
+                                            result, Int32(karel::kMinInt))),
+             karel::RunResult::INTEGERUNDERFLOW);
+      Push(builder_.CreateSelect(finite, result, value));
+      break;
+    }
+
+    case karel::Opcode::CALL: {
+      CountInstruction();
+      llvm::Value* param_count = builder_.CreateSExt(Pop(), i64);
+      ExitIf(builder_.CreateICmpUGT(param_count, call_param_limit_),
+             karel::RunResult::CALLSIZE);
+      Flush();
+
+      llvm::Value* depth = Load(depth_);
+      llvm::BasicBlock* grow = llvm::BasicBlock::Create(context_, "", function_);
+      llvm::BasicBlock* push = llvm::BasicBlock::Create(context_, "", function_);
+      builder_.CreateCondBr(
+          builder_.CreateICmpEQ(depth, Load(frame_capacity_)), grow, push);
+      builder_.SetInsertPoint(grow);
+      llvm::FunctionType* grow_type = llvm::FunctionType::get(
+          frame_type_->getPointerTo(), {builder_.getInt8PtrTy()}, false);
+      llvm::Value* grown = builder_.CreateCall(
+          grow_type,
+          builder_.CreateIntToPtr(
+              Int64(reinterpret_cast<intptr_t>(&GrowFrames)),
+              grow_type->getPointerTo()),
+          {state_});
+      builder_.CreateStore(grown, frames_);
+      builder_.CreateStore(
+          builder_.CreateLoad(
+              i64, FieldPointer(state_, offsetof(JitState, frame_capacity), i64)),
+          frame_capacity_);
+      builder_.CreateBr(push);
+      builder_.SetInsertPoint(push);
+
+      llvm::Value* frame =
+          builder_.CreateInBoundsGEP(frame_type_, Load(frames_), depth);
+      builder_.CreateStore(Int64(Next(pc)),
+                           builder_.CreateStructGEP(frame_type_, frame, 0));
+      builder_.CreateStore(Load(param_sp_),
+                           builder_.CreateStructGEP(frame_type_, frame, 1));
+      builder_.CreateStore(builder_.CreateSub(stack_.sp, param_count),
+                           builder_.CreateStructGEP(frame_type_, frame, 2));
+      llvm::Value* new_depth = builder_.CreateAdd(depth, Int64(1));
+      builder_.CreateStore(new_depth, depth_);
+      builder_.CreateStore(builder_.CreateSub(stack_.sp, Int64(1)), param_sp_);
+
+      llvm::Value* stack_memory = builder_.CreateAdd(
+          Load(stack_memory_),
+          builder_.CreateSelect(builder_.CreateICmpEQ(param_count, Int64(0)),
+                                Int64(1), param_count));
+      Store(stack_memory_, stack_memory);
+      ExitIf(builder_.CreateICmpUGT(stack_memory, stack_memory_limit_),
+             karel::RunResult::STACKMEMORY);
+      ExitIf(builder_.CreateICmpUGE(new_depth, stack_limit_),
+             karel::RunResult::STACK);
+
+      if (Next(pc) < end_)
+        return_sites_.emplace(Next(pc), BlockFor(Next(pc)));
+      BranchTo(Resolve(ins.arg), true);
+      return std::nullopt;
+    }
+
+    case karel::Opcode::RET:
+      Flush();
+      if (!return_block_)
+        return_block_ = llvm::BasicBlock::Create(context_, "ret", function_);
+      builder_.CreateBr(return_block_);
+      return std::nullopt;
+
+    case karel::Opcode::PARAM: {
+      llvm::Value* index = builder_.CreateSub(Load(param_sp_), Int64(ins.arg));
+      Push(builder_.CreateLoad(
+          i32, builder_.CreateInBoundsGEP(i32, Load(expression_), index)));
+      break;
+    }
+
+    case karel::Opcode::SRET:
+      Store(ret_, Pop());
+      break;
+
+    case karel::Opcode::LRET:
+      Push(Load(ret_));
+      break;
+
+    case karel::Opcode::COLUMN:
+      Push(builder_.CreateTrunc(builder_.CreateAdd(Load(x_), Int64(1)), i32));
+      break;
+
+    case karel::Opcode::ROW:
+      Push(builder_.CreateTrunc(builder_.CreateAdd(Load(y_), Int64(1)), i32));
+      break;
+
+    case karel::Opcode::CHECKED_FORWARD:
+      ExitIf(Blocked(0), Int32(ins.arg));
+      CountInstruction();
+      EmitForward();
+      CheckInstructionLimit(Next(pc));
+      break;
+
+    case karel::Opcode::CHECKED_PICK:
+      ExitIf(builder_.CreateICmpEQ(
+                 builder_.CreateLoad(i32, builder_.CreateInBoundsGEP(
+                                              i32, buzzers_, CellIndex())),
+                 Int32(0)),
+             Int32(ins.arg));
+      CountInstruction();
+      EmitPickBuzzer();
+      CheckInstructionLimit(Next(pc));
+      break;
+
+    case karel::Opcode::CHECKED_LEAVE:
+      ExitIf(builder_.CreateICmpEQ(Load(bag_), Int64(0)), Int32(ins.arg));
+      CountInstruction();
+      EmitLeaveBuzzer();
+      CheckInstructionLimit(Next(pc));
+      break;
+
+    case karel::Opcode::FRONT_CLEAR_JZ:
+    case karel::Opcode::LEFT_CLEAR_JZ:
+    case karel::Opcode::RIGHT_CLEAR_JZ:
+    // The loops are only produced by FuseInstructions(), which kcl does not
+    // use. LLVM sees the whole loop anyway, so they run one iteration at a
+    // time, starting with their head.
+    case karel::Opcode::FORWARD_UNTIL_WALL:
+    case karel::Opcode::PICK_ALL: {
+      llvm::Value* blocked = nullptr;
+      if (ins.opcode == karel::Opcode::PICK_ALL) {
+        blocked = builder_.CreateICmpEQ(
+            builder_.CreateLoad(
+                i32, builder_.CreateInBoundsGEP(i32, buzzers_, CellIndex())),
+            Int32(0));
+      } else {
+        int32_t rotation = ins.opcode == karel::Opcode::LEFT_CLEAR_JZ    ? 3
+                           : ins.opcode == karel::Opcode::RIGHT_CLEAR_JZ ? 1
+                                                                         : 0;
+        blocked = Blocked(rotation);
+      }
+      Flush();
+      CountInstruction();
+      llvm::BasicBlock* taken = llvm::BasicBlock::Create(context_, "", function_);
+      llvm::BasicBlock* not_taken =
+          llvm::BasicBlock::Create(context_, "", function_);
+      builder_.CreateCondBr(blocked, taken, not_taken);
+      builder_.SetInsertPoint(taken);
+      BranchTo(Resolve(pc + ins.arg + 1), true);
+      builder_.SetInsertPoint(not_taken);
+      BranchTo(Next(pc), true);
+      return std::nullopt;
+    }
+  }
+
+  return Next(pc);
+}
+
+void Compiler::EmitBlock(int64_t leader) {
+  llvm::BasicBlock* check = blocks_[leader];
+  llvm::BasicBlock* body = llvm::BasicBlock::Create(context_, "", function_);
+
+  builder_.SetInsertPoint(check);
+  stack_ = VirtualStack();
+  llvm::Value* entry_sp = Load(sp_);
+  stack_.sp = entry_sp;
+
+  builder_.SetInsertPoint(body);
+  stack_.base = Load(expression_);
+
+  for (int64_t pc = leader;;) {
+    std::optional<int64_t> next = EmitInstruction(pc);
+    if (!next)
+      break;
+    if (next.value() >= end_) {
+      Exit(karel::RunResult::OK);
+      break;
+    }
+    if (leaders_.count(next.value())) {
+      Flush();
+      builder_.CreateBr(BlockFor(next.value()));
+      break;
+    }
+    pc = next.value();
+  }
+
+  // Now that the block is known, make sure the expression stack has room
+  // for everything it pushes before running it.
+  builder_.SetInsertPoint(check);
+  if (stack_.max_growth == 0) {
+    builder_.CreateBr(body);
+    return;
+  }
+  llvm::Value* needed = builder_.CreateAdd(entry_sp, Int64(stack_.max_growth));
+  llvm::BasicBlock* grow = llvm::BasicBlock::Create(context_, "", function_);
+  builder_.CreateCondBr(
+      builder_.CreateICmpUGT(needed, Load(expression_capacity_)), grow, body);
+  builder_.SetInsertPoint(grow);
+  llvm::FunctionType* grow_type = llvm::FunctionType::get(
+      builder_.getInt32Ty()->getPointerTo(),
+      {builder_.getInt8PtrTy(), builder_.getInt64Ty()}, false);
+  llvm::Value* grown = builder_.CreateCall(
+      grow_type,
+      builder_.CreateIntToPtr(
+          Int64(reinterpret_cast<intptr_t>(&GrowExpressionStack)),
+          grow_type->getPointerTo()),
+      {state_, needed});
+  builder_.CreateStore(grown, expression_);
+  builder_.CreateStore(
+      builder_.CreateLoad(builder_.getInt64Ty(),
+                          FieldPointer(state_,
+                                       offsetof(JitState, expression_capacity),
+                                       builder_.getInt64Ty())),
+      expression_capacity_);
+  builder_.CreateBr(body);
+}
+
+void Compiler::EmitReturnDispatch() {
+  if (!return_block_)
+    return;
+  builder_.SetInsertPoint(return_block_);
+  llvm::Value* depth = Load(depth_);
+  ExitIf(builder_.CreateICmpEQ(depth, Int64(0)), karel::RunResult::OK);
+
+  depth = builder_.CreateSub(depth, Int64(1));
+  builder_.CreateStore(depth, depth_);
+  llvm::Value* frame =
+      builder_.CreateInBoundsGEP(frame_type_, Load(frames_), depth);
+  llvm::Value* ret = builder_.CreateLoad(
+      builder_.getInt64Ty(), builder_.CreateStructGEP(frame_type_, frame, 0));
+  llvm::Value* caller_param_sp = builder_.CreateLoad(
+      builder_.getInt64Ty(), builder_.CreateStructGEP(frame_type_, frame, 1));
+  llvm::Value* frame_sp = builder_.CreateLoad(
+      builder_.getInt64Ty(), builder_.CreateStructGEP(frame_type_, frame, 2));
+
+  llvm::Value* param_count = builder_.CreateSub(
+      builder_.CreateAdd(Load(param_sp_), Int64(1)), frame_sp);
+  Store(stack_memory_,
+        builder_.CreateSub(
+            Load(stack_memory_),
+            builder_.CreateSelect(builder_.CreateICmpEQ(param_count, Int64(0)),
+                                  Int64(1), param_count)));
+  llvm::Value* sp = Load(sp_);
+  builder_.CreateStore(
+      builder_.CreateSelect(builder_.CreateICmpUGT(sp, frame_sp), frame_sp, sp),
+      sp_);
+  builder_.CreateStore(caller_param_sp, param_sp_);
+
+  llvm::BasicBlock* fell_off =
+      llvm::BasicBlock::Create(context_, "", function_);
+  llvm::SwitchInst* dispatch =
+      builder_.CreateSwitch(ret, fell_off, return_sites_.size());
+  for (const auto& site : return_sites_)
+    dispatch->addCase(builder_.getInt64(site.first), site.second);
+  builder_.SetInsertPoint(fell_off);
+  Exit(karel::RunResult::OK);
+}
+
+llvm::Function* Compiler::Compile() {
+  llvm::Type* i8ptr = builder_.getInt8PtrTy();
+  llvm::Type* i32 = builder_.getInt32Ty();
+  llvm::Type* i64 = builder_.getInt64Ty();
+  frame_type_ = llvm::StructType::create(context_, {i64, i64, i64}, "frame");
+
+  function_ = llvm::Function::Create(
+      llvm::FunctionType::get(i32, {i8ptr, i8ptr}, false),
+      llvm::Function::ExternalLinkage, kEntryPointName, module_);
+  runtime_ = function_->getArg(0);
+  state_ = function_->getArg(1);
+  entry_block_ = llvm::BasicBlock::Create(context_, "entry", function_);
+  exit_block_ = llvm::BasicBlock::Create(context_, "exit", function_);
+
+  builder_.SetInsertPoint(exit_block_);
+  exit_result_ = builder_.CreatePHI(i32, 0, "result");
+
+  builder_.SetInsertPoint(entry_block_);
+  using karel::Runtime;
+  orientation_ = Cache(offsetof(Runtime, orientation), i64);
+  x_ = Cache(offsetof(Runtime, x), i64);
+  y_ = Cache(offsetof(Runtime, y), i64);
+  bag_ = Cache(offsetof(Runtime, bag), i64);
+  line_ = Cache(offsetof(Runtime, line), i64);
+  column_ = Cache(offsetof(Runtime, column), i64);
+  forward_count_ = Cache(offsetof(Runtime, forward_count), i64);
+  left_count_ = Cache(offsetof(Runtime, left_count), i64);
+  leavebuzzer_count_ = Cache(offsetof(Runtime, leavebuzzer_count), i64);
+  pickbuzzer_count_ = Cache(offsetof(Runtime, pickbuzzer_count), i64);
+  stack_memory_ = Cache(offsetof(Runtime, stack_memory), i64);
+  ret_ = Cache(offsetof(Runtime, ret), i32);
+
+  instruction_limit_ = LoadConstant(offsetof(Runtime, instruction_limit), i64);
+  stack_limit_ = LoadConstant(offsetof(Runtime, stack_limit), i64);
+  stack_memory_limit_ =
+      LoadConstant(offsetof(Runtime, stack_memory_limit), i64);
+  call_param_limit_ = LoadConstant(offsetof(Runtime, call_param_limit), i64);
+  forward_limit_ = LoadConstant(offsetof(Runtime, forward_limit), i64);
+  left_limit_ = LoadConstant(offsetof(Runtime, left_limit), i64);
+  pickbuzzer_limit_ = LoadConstant(offsetof(Runtime, pickbuzzer_limit), i64);
+  leavebuzzer_limit_ =
+      LoadConstant(offsetof(Runtime, leavebuzzer_limit), i64);
+  width_ = LoadConstant(offsetof(Runtime, width), i64);
+  buzzers_ = LoadConstant(offsetof(Runtime, buzzers), i32->getPointerTo());
+  walls_ = LoadConstant(offsetof(Runtime, walls), builder_.getInt8PtrTy());
+
+  ic_ = Local(i64, Int64(0));
+  sp_ = Local(i64, Int64(0));
+  depth_ = Local(i64, Int64(0));
+  param_sp_ = Local(i64, Int64(-1));
+  expression_ = Local(
+      i32->getPointerTo(),
+      builder_.CreateLoad(i32->getPointerTo(),
+                          FieldPointer(state_, offsetof(JitState, expression),
+                                       i32->getPointerTo())));
+  expression_capacity_ = Local(
+      i64, builder_.CreateLoad(
+               i64, FieldPointer(state_,
+                                 offsetof(JitState, expression_capacity), i64)));
+  frames_ = Local(
+      frame_type_->getPointerTo(),
+      builder_.CreateLoad(frame_type_->getPointerTo(),
+                          FieldPointer(state_, offsetof(JitState, frames),
+                                       frame_type_->getPointerTo())));
+  frame_capacity_ = Local(
+      i64, builder_.CreateLoad(
+               i64, FieldPointer(state_, offsetof(JitState, frame_capacity),
+                                 i64)));
+
+  if (end_ == 0) {
+    Exit(karel::RunResult::OK);
+  } else {
+    ExitIf(builder_.CreateICmpEQ(instruction_limit_, Int64(0)),
+           karel::RunResult::INSTRUCTION);
+    ComputeLeaders();
+    builder_.CreateBr(BlockFor(0));
+    while (!pending_.empty()) {
+      int64_t leader = pending_.back();
+      pending_.pop_back();
+      EmitBlock(leader);
+    }
+    EmitReturnDispatch();
+  }
+
+  // Write the cached Runtime fields back.
+  builder_.SetInsertPoint(exit_block_);
+  for (const auto& field : cached_fields_) {
+    builder_.CreateStore(Load(field.get()),
+                         FieldPointer(runtime_, field->offset, field->type));
+  }
+  builder_.CreateRet(exit_result_);
+
+  return function_;
+}
+
+// A Karel program compiled to native code.
+class JitProgram {
+ public:
+  ~JitProgram();
+
+  static std::unique_ptr<JitProgram> Compile(
+      const std::vector<karel::Instruction>& program);
+
+  karel::RunResult Run(karel::Runtime* runtime);
+
+ private:
+  using EntryPoint = uint32_t (*)(karel::Runtime*, JitState*);
+
+  JitProgram() = default;
+
+  std::unique_ptr<llvm::orc::LLJIT> jit_;
+  EntryPoint entry_point_ = nullptr;
+  JitState state_;
+
+  DISALLOW_COPY_AND_ASSIGN(JitProgram);
+};
+
+JitProgram::~JitProgram() {
+  free(state_.expression);
+  free(state_.frames);
+}
+
+// static
+std::unique_ptr<JitProgram> JitProgram::Compile(
+    const std::vector<karel::Instruction>& program) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  auto jit = llvm::orc::LLJITBuilder().create();
+  if (!jit) {
+    LOG(ERROR) << "Failed to create the JIT: "
+               << llvm::toString(jit.takeError());
+    return nullptr;
+  }
+
+  auto context = std::make_unique<llvm::LLVMContext>();
+  auto module = std::make_unique<llvm::Module>("karel", *context);
+  module->setDataLayout((*jit)->getDataLayout());
+  module->setTargetTriple((*jit)->getTargetTriple().str());
+
+  llvm::Function* function =
+      Compiler(program, context.get(), module.get()).Compile();
+  std::string errors;
+  llvm::raw_string_ostream error_stream(errors);
+  if (llvm::verifyFunction(*function, &error_stream)) {
+    LOG(ERROR) << "Invalid generated code: " << error_stream.str();
+    return nullptr;
+  }
+
+  {
+    llvm::LoopAnalysisManager loop_analysis;
+    llvm::FunctionAnalysisManager function_analysis;
+    llvm::CGSCCAnalysisManager cgscc_analysis;
+    llvm::ModuleAnalysisManager module_analysis;
+    llvm::PassBuilder pass_builder;
+    pass_builder.registerModuleAnalyses(module_analysis);
+    pass_builder.registerCGSCCAnalyses(cgscc_analysis);
+    pass_builder.registerFunctionAnalyses(function_analysis);
+    pass_builder.registerLoopAnalyses(loop_analysis);
+    pass_builder.crossRegisterProxies(loop_analysis, function_analysis,
+                                      cgscc_analysis, module_analysis);
+    pass_builder
+        .buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2)
+        .run(*module, module_analysis);
+  }
+
+  if (auto error = (*jit)->addIRModule(llvm::orc::ThreadSafeModule(
+          std::move(module), std::move(context)))) {
+    LOG(ERROR) << "Failed to add the module: "
+               << llvm::toString(std::move(error));
+    return nullptr;
+  }
+  auto symbol = (*jit)->lookup(kEntryPointName);
+  if (!symbol) {
+    LOG(ERROR) << "Failed to find the entry point: "
+               << llvm::toString(symbol.takeError());
+    return nullptr;
+  }
+
+  std::unique_ptr<JitProgram> jit_program(new JitProgram());
+  jit_program->entry_point_ =
+      reinterpret_cast<EntryPoint>(symbol->getAddress());
+  jit_program->jit_ = std::move(jit.get());
+  return jit_program;
+}
+
+karel::RunResult JitProgram::Run(karel::Runtime* runtime) {
+  // The compiled code writes the buzzers directly.
+  if (runtime->dirty)
+    runtime->dirty->MarkAll();
+  return static_cast<karel::RunResult>(entry_point_(runtime, &state_));
+}
+
+[[noreturn]] void Usage(const std::string_view program_name) {
+  LOG(ERROR)
+    << "Usage: " << program_name << " <bytecode-file> [options]\n"
+    << "Compiles the Karel bytecode to native code and runs it.\n"
+    << "Options:\n"
+    << "  -i, --input <input-path>    Specify a file to read the world input from. If not provided, the program reads from stdin.\n"
+    << "  -o, --output <output-path>  Specify a file to write the world output to. If not provided, the program writes to stdout.\n"
+    << "  -d, --dump {world|result}   Set the output type (default: result).\n";
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  bool dump_result = true;
+  struct option long_options[] = {
+      {"help", no_argument, nullptr, 'h'},
+      {"dump", required_argument, nullptr, 'd'},
+      {"input", required_argument, nullptr, 'i'},
+      {"output", required_argument, nullptr, 'o'},
+      {nullptr, 0, nullptr, 0}  // End of options
+  };
+  std::optional<std::string> output_file;
+  std::optional<std::string> input_file;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hd:i:o:", long_options, nullptr)) !=
+         -1) {
+    switch (opt) {
+      case 'd':
+        if (std::string_view(optarg) != "world" &&
+            std::string_view(optarg) != "result") {
+          LOG(ERROR) << "Error: Invalid dump option. Use 'world' or 'result'.\n";
+          Usage(argv[0]);
+        }
+        dump_result = std::string_view(optarg) == "result";
+        break;
+      case 'i':
+        input_file = optarg;
+        break;
+      case 'o':
+        output_file = optarg;
+        break;
+      default:
+        Usage(argv[0]);
+    }
+  }
+  if (optind >= argc)
+    Usage(argv[0]);
+
+  ScopedFD program_fd(open(argv[optind], O_RDONLY));
+  if (!program_fd) {
+    PLOG(ERROR) << "Failed to open " << argv[optind];
+    return -1;
+  }
+  auto program_str = ReadFully(program_fd.get());
+  auto program = karel::ParseInstructions(std::string_view(
+      reinterpret_cast<const char*>(program_str.data()), program_str.size()));
+  if (!program)
+    return -1;
+  if (!karel::VerifyInstructions(program.value()))
+    return -1;
+  program = karel::OptimizeInstructions(program.value());
+  auto jit_program = JitProgram::Compile(program.value());
+  if (!jit_program)
+    return -1;
+
+  ScopedFD input_fd;
+  if (input_file) {
+    input_fd.reset(open(input_file->c_str(), O_RDONLY));
+    if (!input_fd) {
+      PLOG(ERROR) << "Failed to open " << input_file.value();
+      return 1;
+    }
+  }
+  // The compiled program reads the buzzers and the walls of the runtime
+  // directly, so the world has to be flat no matter how big it is.
+  karel::WorldOptions world_options;
+  world_options.layout = karel::WorldLayout::FLAT;
+  auto world = karel::World::Parse(
+      input_file ? input_fd.get() : STDIN_FILENO, world_options);
+  if (!world)
+    return -1;
+
+  auto result = jit_program->Run(world->runtime());
+  if (result != karel::RunResult::OK)
+    WriteFileDescriptor(STDERR_FILENO, karel::RunResultMessage(result));
+
+  ScopedFD output_fd;
+  if (output_file) {
+    output_fd.reset(
+        open(output_file->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (!output_fd) {
+      PLOG(ERROR) << "Failed to open " << output_file.value();
+      return 1;
+    }
+  }
+  int fd = output_file ? output_fd.get() : STDOUT_FILENO;
+  if (dump_result)
+    world->DumpResult(result, fd);
+  else
+    world->Dump(fd);
 
-int main() {
+  return static_cast<int32_t>(result);
 }
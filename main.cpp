@@ -4,12 +4,17 @@
 #include <getopt.h>
 
 #include <algorithm>
+#include <cstdlib>
 #include <memory>
 #include <optional>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include "aot.h"
+#include "batch.h"
+#include "bytecode.h"
+#include "expect.h"
 #include "karel.h"
 #include "logging.h"
 #include "world.h"
@@ -20,45 +25,55 @@ namespace {
 constexpr const std::string_view kFlagPrefix("--");
 constexpr const std::string_view kDumpFlagPrefix("dump=");
 
-std::vector<uint8_t> ReadFully(int fd) {
-  constexpr size_t kChunkSize = 4096;
-  std::vector<std::unique_ptr<uint8_t[]>> chunks;
-  size_t total_bytes = 0;
-  while (true) {
-    chunks.emplace_back(std::make_unique<uint8_t[]>(kChunkSize));
-    ssize_t bytes_read = read(fd, chunks.back().get(), kChunkSize);
-    if (bytes_read == -1) {
-      PLOG(ERROR) << "Failed to read file";
-      return {};
-    }
-    if (bytes_read == 0)
-      break;
-    total_bytes += bytes_read;
-  }
-  std::vector<uint8_t> result(total_bytes + 1);
-  uint8_t* ptr = result.data();
-  for (const auto& chunk : chunks) {
-    size_t chunk_bytes = std::min(kChunkSize, total_bytes);
-    memcpy(ptr, chunk.get(), chunk_bytes);
-    total_bytes -= chunk_bytes;
-    ptr += chunk_bytes;
-  }
-  result.pop_back();
-  return result;
-}
-
-
 [[noreturn]] void Usage(const std::string_view program_name) {  
   LOG(ERROR) 
     << "Usage: " <<program_name << "<bytecode-file> [options]\n"
     << "Arguments:\n"
-    << "  <bytecode-file>             The Karel bytecode file to execute. This is a required argument.\n"
+    << "  <bytecode-file>             The Karel bytecode file to execute, either .kx or .kxb. This is a required argument.\n"
     << "Options:\n"
     << "  -i, --input <input-path>    Specify a file to read the world input from. If not provided, the program reads from stdin.\n"
     << "  -o, --output <output-path>  Specify a file to write the world output to. If not provided, the program writes to stdout.\n"
     << "  -d, --dump {world|result}   Set the output type:\n"
     << "    - result:   (default) Outputs the program's result.\n"
     << "    - world:    Outputs the world input.\n"
+    << "  --engine {switch|threaded|budgeted|aot}  Select the interpreter loop:\n"
+    << "    - switch:   (default) Portable switch-based loop.\n"
+    << "    - threaded: Direct-threaded dispatch.\n"
+    << "    - budgeted: Direct-threaded dispatch that checks the limits once per basic block.\n"
+    << "    - aot:      Compile the program into a shared object and run it natively.\n"
+    << "                Only available in the dynamic build (make karel-dynamic).\n"
+    << "  --aot-cache <dir>           Directory for the compiled programs (default: ~/.cache/karel,\n"
+    << "                              or the --cache directory when that is set).\n"
+    << "  --cache <dir>               Keep the parsed and optimized form of .kx programs, and the\n"
+    << "                              binary form of world files, in <dir>, so later runs with the\n"
+    << "                              same program or world just map it. Can also be set through\n"
+    << "                              $KAREL_CACHE_DIR.\n"
+    << "  --read-buffer <bytes>       Size of the reads of a world that comes from a pipe or stdin\n"
+    << "                              (default: 1048576). World files given with -i are mapped.\n"
+    << "  --world-layout {auto|flat|tiled|sparse|packed}  Select how the cells of the world are kept in memory:\n"
+    << "    - auto:     (default) sparse for huge worlds with few buzzers and walls, flat otherwise.\n"
+    << "    - flat:     Separate row-major arrays of buzzers and walls.\n"
+    << "    - tiled:    One record per cell in 8x8 tiles, so that walks in any\n"
+    << "                direction stay within a few cache lines.\n"
+    << "    - sparse:   Only the cells with buzzers or inner walls, in hash maps.\n"
+    << "    - packed:   4-bit walls and mostly 1-byte buzzers, for many large worlds at once.\n"
+    << "                Only flat is available with aot.\n"
+    << "  -c, --compile <output-path> Convert the program into the binary .kxb format and exit.\n"
+    << "  --compile-world <output-path>\n"
+    << "                              Convert the world input into the binary .kxw format and exit.\n"
+    << "                              .kxw files can be given as the world input instead of XML.\n"
+    << "  --expect <output-path>      Compare the output against the expected one in <output-path> instead of\n"
+    << "                              writing it, ignoring whitespace and blank lines like diff -w\n"
+    << "                              --ignore-blank-lines, along with the message and the exit code of the run\n"
+    << "                              against the .stderr and .signal files next to it, when they exist. Prints\n"
+    << "                              the verdict as one line of JSON, with the first line and cell that differ,\n"
+    << "                              and exits with 0 if everything matches and 1 if not.\n"
+    << "  --batch <dir|list>          Run the program, loaded only once, on many worlds: the .in files in <dir>,\n"
+    << "                              or the ones listed in <list>, one per line. Prints one line of JSON per\n"
+    << "                              world with its exit code, its verdict against the .out file next to it,\n"
+    << "                              when there is one, as with --expect, and timings. With -o, the output of\n"
+    << "                              each world goes to <output-path>/<name>.out. Exits with 0 if all the\n"
+    << "                              worlds ran and matched, 1 if any did not match and 2 on errors.\n"
     << "  -e, --expect-version <major.minor>\n"
     << "    Specify the required version of the program (major.minor).\n"
     << "    If the version does not match, the program exits with an error.\n"
@@ -91,6 +106,9 @@ bool CheckVersion(const std::string& expected_version) {
 
 int main(int argc, char* argv[]) {
   bool dump_result = true;  
+  bool threaded = false;
+  bool budgeted = false;
+  bool aot = false;
   struct option long_options[] = {
       {"help", no_argument, nullptr, 'h'},
       {"version", no_argument, nullptr, 'v'},
@@ -98,13 +116,32 @@ int main(int argc, char* argv[]) {
       {"input", required_argument, nullptr, 'i'},
       {"output", required_argument, nullptr, 'o'},
       {"expect-version", required_argument, nullptr, 'e'},
+      {"engine", required_argument, nullptr, 'E'},
+      {"aot-cache", required_argument, nullptr, 'C'},
+      {"compile", required_argument, nullptr, 'c'},
+      {"cache", required_argument, nullptr, 'K'},
+      {"read-buffer", required_argument, nullptr, 'B'},
+      {"compile-world", required_argument, nullptr, 'W'},
+      {"world-layout", required_argument, nullptr, 'L'},
+      {"expect", required_argument, nullptr, 'X'},
+      {"batch", required_argument, nullptr, 'b'},
       {nullptr, 0, nullptr, 0} // End of options
   };
   std::string expected_version = "";
   std::optional<std::string> output_file;
   std::optional<std::string> input_file;
+  std::optional<std::string> compile_file;
+  std::optional<std::string> compile_world_file;
+  std::optional<std::string> aot_cache_dir;
+  std::optional<std::string> expect_file;
+  std::optional<std::string> batch_path;
+  std::string cache_dir;
+  size_t read_buffer_size = xml::Reader::kDefaultReadBufferSize;
+  std::optional<karel::WorldLayout> world_layout;
+  if (const char* cache_dir_env = getenv("KAREL_CACHE_DIR"))
+    cache_dir = cache_dir_env;
   int opt;
-  while ((opt = getopt_long(argc, argv, "hvd:i:o:e:", long_options, nullptr)) != -1) {
+  while ((opt = getopt_long(argc, argv, "hvd:i:o:e:E:C:c:K:B:W:L:X:b:", long_options, nullptr)) != -1) {
       switch (opt) {
           case 'v':
               WriteFileDescriptor(STDOUT_FILENO, std::string(PROGRAM_VERSION) + "\n");
@@ -131,6 +168,59 @@ int main(int argc, char* argv[]) {
                   return 2;
               }
               break;
+          case 'E':
+              if (std::string_view(optarg) != "switch" && std::string_view(optarg) != "threaded" &&
+                  std::string_view(optarg) != "budgeted" && std::string_view(optarg) != "aot") {
+                  LOG(ERROR) << "Error: Invalid engine option. Use 'switch', 'threaded', 'budgeted' or 'aot'.\n";
+                  Usage(argv[0]);
+              }
+              budgeted = std::string_view(optarg) == "budgeted";
+              threaded = std::string_view(optarg) == "threaded" || budgeted;
+              aot = std::string_view(optarg) == "aot";
+              break;
+          case 'C':
+              aot_cache_dir = optarg;
+              break;
+          case 'c':
+              compile_file = optarg;
+              break;
+          case 'K':
+              cache_dir = optarg;
+              break;
+          case 'W':
+              compile_world_file = optarg;
+              break;
+          case 'X':
+              expect_file = optarg;
+              break;
+          case 'b':
+              batch_path = optarg;
+              break;
+          case 'L':
+              if (std::string_view(optarg) == "auto") {
+                  world_layout.reset();
+              } else if (std::string_view(optarg) == "flat") {
+                  world_layout = karel::WorldLayout::FLAT;
+              } else if (std::string_view(optarg) == "tiled") {
+                  world_layout = karel::WorldLayout::TILED;
+              } else if (std::string_view(optarg) == "sparse") {
+                  world_layout = karel::WorldLayout::SPARSE;
+              } else if (std::string_view(optarg) == "packed") {
+                  world_layout = karel::WorldLayout::PACKED;
+              } else {
+                  LOG(ERROR) << "Error: Invalid world layout. Use 'auto', 'flat', 'tiled', 'sparse' or 'packed'.\n";
+                  Usage(argv[0]);
+              }
+              break;
+          case 'B': {
+              auto size = ParseDecimal<size_t>(optarg);
+              if (!size || size.value() == 0) {
+                  LOG(ERROR) << "Error: Invalid read buffer size " << optarg << ".\n";
+                  Usage(argv[0]);
+              }
+              read_buffer_size = size.value();
+              break;
+          }
           case 'h':
               Usage(argv[0]);
               break;
@@ -142,16 +232,152 @@ int main(int argc, char* argv[]) {
   if (optind >= argc || argc < 2) {
     Usage(argv[0]);
   }
+  if (aot) {
+    if (world_layout.value_or(karel::WorldLayout::FLAT) !=
+        karel::WorldLayout::FLAT) {
+      LOG(ERROR) << "Error: The aot engine only supports the flat world layout.\n";
+      Usage(argv[0]);
+    }
+    world_layout = karel::WorldLayout::FLAT;
+  }
+  if (batch_path && (input_file || expect_file || compile_world_file)) {
+    LOG(ERROR) << "Error: --batch reads the worlds and the expected outputs by itself.\n";
+    Usage(argv[0]);
+  }
   ScopedFD program_fd(open(argv[optind], O_RDONLY));
   if (!program_fd) {
     PLOG(ERROR) << "Failed to open " << argv[optind];
     return -1;
   }
-  auto program_str = ReadFully(program_fd.get());
-  auto program = karel::ParseInstructions(std::string_view(
-      reinterpret_cast<const char*>(program_str.data()), program_str.size()));
-  if (!program)
-    return -1;
+  // Regular files are mapped instead of read, so that .kxb programs can run
+  // straight from the mapping.
+  ScopedMmap program_mapping = MapFile(program_fd.get());
+  std::vector<uint8_t> program_bytes;
+  std::string_view program_str;
+  if (program_mapping) {
+    program_str = std::string_view(
+        static_cast<const char*>(program_mapping.get()), program_mapping.size());
+  } else {
+    program_bytes = ReadFully(program_fd.get());
+    program_str = std::string_view(
+        reinterpret_cast<const char*>(program_bytes.data()), program_bytes.size());
+  }
+
+  std::unique_ptr<karel::BytecodeFile> bytecode_file;
+  std::vector<karel::Instruction> parsed_program;
+  std::vector<std::string> function_names;
+  karel::ProgramView program;
+  if (karel::IsBytecode(program_str)) {
+    if (!program_mapping) {
+      LOG(ERROR) << "Failed to map " << argv[optind];
+      return -1;
+    }
+    bytecode_file = karel::BytecodeFile::Load(std::move(program_mapping));
+    if (!bytecode_file)
+      return -1;
+  } else {
+    std::string cache_path;
+    if (!cache_dir.empty()) {
+      cache_path =
+          karel::BytecodeCachePath(cache_dir, program_str, PROGRAM_VERSION);
+      ScopedFD cache_fd(open(cache_path.c_str(), O_RDONLY));
+      if (cache_fd)
+        bytecode_file = karel::BytecodeFile::Load(MapFile(cache_fd.get()));
+    }
+    if (!bytecode_file) {
+      auto parsed = karel::ParseInstructions(program_str, &function_names);
+      if (!parsed)
+        return -1;
+      if (!karel::VerifyInstructions(parsed.value()))
+        return -1;
+      size_t removed = 0;
+      parsed = karel::OptimizeInstructions(parsed.value(), &removed);
+      LOG(DEBUG) << "Optimization removed " << removed << " instructions";
+      parsed_program = karel::FuseInstructions(parsed.value());
+      program = parsed_program;
+      // A cache that cannot be written only costs the next run some time.
+      if (!cache_path.empty() && MakeDirectories(cache_dir)) {
+        WriteFileAtomically(
+            cache_path, karel::SerializeBytecode(program, function_names));
+      }
+    }
+  }
+  if (bytecode_file) {
+    program = bytecode_file->bytecode().program;
+    for (std::string_view name : bytecode_file->bytecode().function_names)
+      function_names.emplace_back(name);
+  }
+
+  if (compile_file) {
+    ScopedFD compile_fd(
+        open(compile_file->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (!compile_fd) {
+      PLOG(ERROR) << "Failed to open " << compile_file.value();
+      return -1;
+    }
+    if (!WriteFileDescriptor(compile_fd.get(),
+                             karel::SerializeBytecode(program, function_names))) {
+      PLOG(ERROR) << "Failed to write " << compile_file.value();
+      return -1;
+    }
+    return 0;
+  }
+
+  std::optional<karel::DecodedProgram> decoded;
+  if (threaded) {
+    decoded = karel::DecodeInstructions(program);
+    if (!decoded)
+      return -1;
+    if (budgeted)
+      karel::ComputeBlockCosts(&decoded.value());
+  }
+  std::unique_ptr<karel::NativeProgram> native_program;
+  if (aot) {
+    if (!aot_cache_dir) {
+      aot_cache_dir =
+          cache_dir.empty() ? karel::DefaultNativeCacheDir() : cache_dir;
+    }
+    native_program =
+        karel::NativeProgram::Load(program, aot_cache_dir.value());
+    if (!native_program)
+      return -1;
+  }
+  karel::NativeStacks native_stacks;
+  auto run = [&native_program, &native_stacks, &decoded,
+              program](karel::Runtime* runtime) {
+    if (native_program)
+      return native_program->Run(runtime, &native_stacks);
+    if (decoded)
+      return karel::RunThreaded(decoded.value(), runtime);
+    return karel::Run(program, runtime);
+  };
+  karel::WorldOptions world_options;
+  world_options.read_buffer_size = read_buffer_size;
+  world_options.cache_dir = cache_dir;
+  world_options.layout = world_layout;
+
+  if (batch_path) {
+    auto cases = karel::ListBatchCases(batch_path.value());
+    if (!cases)
+      return 2;
+    karel::BatchOptions batch_options;
+    batch_options.world_options = world_options;
+    batch_options.dump_result = dump_result;
+    if (output_file) {
+      if (!MakeDirectories(output_file.value()))
+        return 2;
+      batch_options.output_dir = output_file.value();
+    }
+    return karel::RunBatch(cases.value(), batch_options, run, STDOUT_FILENO);
+  }
+
+  std::optional<karel::Expectation> expectation;
+  if (expect_file) {
+    expectation = karel::Expectation::Load(expect_file.value());
+    if (!expectation)
+      return 2;
+  }
+
   int input_fd = STDIN_FILENO;
   if (input_file) {
         input_fd = open(input_file->c_str(), O_RDONLY);
@@ -161,61 +387,42 @@ int main(int argc, char* argv[]) {
         }
     }
 
-  auto world = karel::World::Parse(input_fd);
+  auto world = karel::World::Parse(input_fd, world_options);
   if (!world)
     return -1;
 
-  auto result = karel::Run(program.value(), world->runtime());
-  switch (result) {
-    case karel::RunResult::OK:
-      // No STDERR
-      break;
-    case karel::RunResult::WALL:
-      WriteFileDescriptor(STDERR_FILENO, "MOVIMIENTO INVALIDO");
-      break;
-    case karel::RunResult::WORLDUNDERFLOW:
-      WriteFileDescriptor(STDERR_FILENO, "ZUMBADOR INVALIDO MUNDO");
-      break;
-    case karel::RunResult::BAGUNDERFLOW:
-      WriteFileDescriptor(STDERR_FILENO, "ZUMBADOR INVALIDO MOCHILA");
-      break;
-    case karel::RunResult::STACK:
-      WriteFileDescriptor(STDERR_FILENO, "STACK OVERFLOW");
-      break;
-    case karel::RunResult::STACKMEMORY:
-      WriteFileDescriptor(STDERR_FILENO, "LIMITE DE MEMORIA DEL STACK");
-      break;
-    case karel::RunResult::CALLSIZE:
-      WriteFileDescriptor(STDERR_FILENO, "LIMITE DE LONGITUD DE LLAMADA");
-      break;
-    case karel::RunResult::INTEGEROVERFLOW:
-      WriteFileDescriptor(STDERR_FILENO, "INTEGER OVERFLOW");
-      break;
-    case karel::RunResult::INTEGERUNDERFLOW:
-      WriteFileDescriptor(STDERR_FILENO, "INTEGER UNDERFLOW");
-      break;
-    case karel::RunResult::WORLDOVERFLOW:
-      WriteFileDescriptor(STDERR_FILENO, "DEMASIADOS ZUMBADORES (MUNDO)");
-      break;
-    case karel::RunResult::BAGOVERFLOW:
-      WriteFileDescriptor(STDERR_FILENO, "DEMASIADOS ZUMBADORES (MOCHILA)");
-      break;
-    case karel::RunResult::INSTRUCTION:
-      WriteFileDescriptor(STDERR_FILENO, "LIMITE DE INSTRUCCIONES GENERAL");
-      break;
-    case karel::RunResult::INSTRUCTION_LEFT:
-      WriteFileDescriptor(STDERR_FILENO, "LIMITE DE INSTRUCCIONES IZQUIERDA");
-      break;
-    case karel::RunResult::INSTRUCTION_FORWARD:
-      WriteFileDescriptor(STDERR_FILENO, "LIMITE DE INSTRUCCIONES AVANZA");
-      break;
-    case karel::RunResult::INSTRUCTION_PICK:
-      WriteFileDescriptor(STDERR_FILENO, "LIMITE DE INSTRUCCIONES COGE_ZUMBADOR");
-      break;
-    case karel::RunResult::INSTRUCTION_LEAVE:
-      WriteFileDescriptor(STDERR_FILENO, "LIMITE DE INSTRUCCIONES DEJA_ZUMBADOR");
-      break;
+  if (compile_world_file) {
+    ScopedFD compile_fd(
+        open(compile_world_file->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (!compile_fd) {
+      PLOG(ERROR) << "Failed to open " << compile_world_file.value();
+      return -1;
+    }
+    if (!WriteFileDescriptor(compile_fd.get(), world->SerializeSnapshot())) {
+      PLOG(ERROR) << "Failed to write " << compile_world_file.value();
+      return -1;
+    }
+    return 0;
+  }
+
+  const karel::RunResult result = run(world->runtime());
+
+  if (expectation) {
+    karel::OutputComparator comparator(expectation->output());
+    if (dump_result)
+      world->DumpResult(result, &comparator);
+    else
+      world->Dump(&comparator);
+    karel::Mismatch mismatch;
+    const karel::Verdict verdict =
+        expectation->Judge(result, &comparator, &mismatch);
+    WriteFileDescriptor(STDOUT_FILENO,
+                        "{" + karel::VerdictJson(verdict, mismatch) + "}\n");
+    return verdict == karel::Verdict::OK ? 0 : 1;
   }
+
+  if (result != karel::RunResult::OK)
+    WriteFileDescriptor(STDERR_FILENO, karel::RunResultMessage(result));
   int output_fd = STDOUT_FILENO;
   if (output_file) {
       output_fd = open(output_file->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
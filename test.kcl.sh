@@ -0,0 +1,65 @@
+#!/bin/bash
+# Checks that kcl gives the same results as karel on a world with more than
+# 4M cells, which karel would otherwise keep sparse.
+#
+# Usage: ./test.kcl.sh [path/to/kcl] [path/to/karel]
+echo ====== TEST KCL ======
+
+ROOT="$(git rev-parse --show-toplevel)"
+KCL="${1:-${ROOT}/bin/kcl}"
+KAREL="${2:-${ROOT}/bin/karel}"
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "${work_dir}"' EXIT
+
+# MUNDO only dumps the cells in posicionDump, while UNIVERSO dumps every cell
+# that has buzzers, including the ones that only got them during the run.
+for dump in MUNDO UNIVERSO; do
+    awk -v dump="${dump}" 'BEGIN {
+        print "<ejecucion>"
+        print "\t<condiciones instruccionesMaximasAEjecutar=\"10000000\" longitudStack=\"65000\"/>"
+        print "\t<mundos>"
+        print "\t\t<mundo nombre=\"mundo_0\" ancho=\"3000\" alto=\"2000\">"
+        for (i = 1; i <= 100; ++i)
+            printf "\t\t\t<monton x=\"1\" y=\"%d\" zumbadores=\"%d\"/>\n", i * 10, i
+        print "\t\t\t<pared x1=\"0\" y1=\"1500\" x2=\"1\"/>"
+        print "\t\t\t<posicionDump x=\"1\" y=\"10\"/>"
+        print "\t\t\t<posicionDump x=\"1\" y=\"1500\"/>"
+        print "\t\t</mundo>"
+        print "\t</mundos>"
+        print "\t<programas tipoEjecucion=\"CONTINUA\" intruccionesCambioContexto=\"1\" milisegundosParaPasoAutomatico=\"0\">"
+        print "\t\t<programa nombre=\"p1\" ruta=\"{$2$}\" mundoDeEjecucion=\"mundo_0\" xKarel=\"1\" yKarel=\"1\" direccionKarel=\"NORTE\" mochilaKarel=\"0\">"
+        printf "\t\t\t<despliega tipo=\"%s\"/>\n", dump
+        print "\t\t\t<despliega tipo=\"ORIENTACION\"/>"
+        print "\t\t\t<despliega tipo=\"MOCHILA\"/>"
+        print "\t\t\t<despliega tipo=\"POSICION\"/>"
+        print "\t\t</programa>"
+        print "\t</programas>"
+        print "</ejecucion>"
+    }' >"${work_dir}/big-${dump}.in"
+done
+
+# Walks north until the wall, picking up every buzzer on the way, then leaves
+# them all on the last cell.
+printf '%s' \
+    '[["LINE",1,0],["WORLDWALLS"],["ORIENTATION"],["MASK"],["AND"],["NOT"],' \
+    '["JZ",6],["WORLDBUZZERS"],["JZ",2],["PICKBUZZER"],["JMP",-4],["FORWARD"],' \
+    '["JMP",-12],["BAGBUZZERS"],["JZ",2],["LEAVEBUZZER"],["JMP",-4],["HALT"]]' \
+    >"${work_dir}/walk.kx"
+
+status=0
+for program in "${work_dir}"/*.kx; do
+    for world in "${work_dir}"/*.in; do
+        program_name="$(basename "${program}") on $(basename "${world}")"
+        for mode in "-i ${world}" "<${world}"; do
+            expected=$(eval "'${KAREL}' '${program}' ${mode}" 2>&1; echo "rc=$?")
+            actual=$(eval "'${KCL}' '${program}' ${mode}" 2>&1; echo "rc=$?")
+            if [ "${expected}" != "${actual}" ]; then
+                echo "> ${program_name} (${mode%% *}) does not match !!!!"
+                diff <(echo "${expected}") <(echo "${actual}") | head -20
+                status=1
+            fi
+        done
+    done
+done
+exit ${status}
@@ -1,7 +1,20 @@
 #include <gtest/gtest.h>
+#include "../aot.h"
+#include "../batch.h"
+#include "../bytecode.h"
+#include "../expect.h"
 #include "../karel.h"
+#include "../util.h"
+#include "../world.h"
+#include "../xml.h"
 #include<vector>
 
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
 struct TestKarel : public ::testing::Test {
 
   karel::Runtime * runtime;
@@ -19,6 +32,73 @@ struct TestKarel : public ::testing::Test {
   }
 };
 
+namespace {
+
+// A directory in /tmp that is removed along with everything in it when it
+// goes out of scope. Its path is empty if it could not be created.
+class ScopedTempDir {
+ public:
+  ScopedTempDir() {
+    char path[] = "/tmp/karel-test-XXXXXX";
+    if (mkdtemp(path))
+      path_ = path;
+  }
+  ~ScopedTempDir() {
+    if (path_.empty())
+      return;
+    nftw(path_.c_str(),
+         [](const char* path, const struct stat*, int, struct FTW*) {
+           return remove(path);
+         },
+         16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  const std::string& path() const { return path_; }
+
+  // Writes |contents| into |name|, which is relative to the directory.
+  bool Write(const std::string& name, std::string_view contents) const {
+    return WriteFileAtomically(path_ + "/" + name, contents);
+  }
+
+ private:
+  std::string path_;
+};
+
+// Returns an unlinked temporary file with |contents|, positioned at its start.
+ScopedFD TempFile(std::string_view contents = std::string_view()) {
+  char path[] = "/tmp/karel-test-XXXXXX";
+  ScopedFD fd(mkstemp(path));
+  if (!fd)
+    return fd;
+  unlink(path);
+  if (!WriteFileDescriptor(fd.get(), contents))
+    return ScopedFD();
+  lseek(fd.get(), 0, SEEK_SET);
+  return fd;
+}
+
+// Returns everything that was written into the file behind |fd|.
+std::string ReadBack(int fd) {
+  lseek(fd, 0, SEEK_SET);
+  const std::vector<uint8_t> written = ReadFully(fd);
+  return std::string(written.begin(), written.end());
+}
+
+// Parses the world in the file behind |fd| from its start.
+std::optional<karel::World> ParseWorld(int fd, const karel::WorldOptions& options = karel::WorldOptions()) {
+  lseek(fd, 0, SEEK_SET);
+  return karel::World::Parse(fd, options);
+}
+
+std::optional<karel::World> ParseWorld(const std::string& path, const karel::WorldOptions& options = karel::WorldOptions()) {
+  ScopedFD fd(open(path.c_str(), O_RDONLY));
+  if (!fd)
+    return std::nullopt;
+  return karel::World::Parse(fd.get(), options);
+}
+
+}  // namespace
+
 
 TEST_F(TestKarel, HALT) {
   std::vector<karel::Instruction> program = {
@@ -320,6 +400,29 @@ TEST_F(TestKarel, CODE_PARSE) {
 
 }
 
+TEST_F(TestKarel, CODE_PARSE_OUTSIDE_OF_FAST_PATH) {
+  std::vector<std::string> names;
+  // The escaped name and the operand without digits are only understood by
+  // the JSON parser.
+  auto program = karel::ParseInstructions(
+      " [[ \"CALL\", 1, \"a\\\"b\"],\n[\"LOAD\",-],[\"CALL\",0,\"c\"],"
+      "[\"CALL\",0,\"a\\\"b\"]]",
+      &names);
+  ASSERT_TRUE(program) << "Program failed to parse";
+  ASSERT_EQ(program->size(), 4) << "Wrong program size";
+  EXPECT_EQ((*program)[1].arg, 0) << "Wrong LOAD argument";
+  EXPECT_EQ((*program)[2].arg2, 1) << "Wrong function name index";
+  EXPECT_EQ((*program)[3].arg2, 0) << "Wrong function name index";
+  ASSERT_EQ(names.size(), 2) << "Wrong number of function names";
+  EXPECT_EQ(names[1], "c") << "Wrong function name";
+
+  EXPECT_FALSE(karel::ParseInstructions("[[\"HALT\"]]\n")) << "Trailing state should be rejected";
+  EXPECT_FALSE(karel::ParseInstructions("[[\"HALT\" ]]")) << "Space before the separator should be rejected";
+  EXPECT_FALSE(karel::ParseInstructions("[[\"LEFT\",1]]")) << "Nullary with argument should be rejected";
+  EXPECT_FALSE(karel::ParseInstructions("[[\"JNZ\",1]]")) << "Internal opcode should be rejected";
+  EXPECT_FALSE(karel::ParseInstructions("[[\"EZ\",\"NOPE\"]]")) << "Invalid run result should be rejected";
+}
+
 
 
 TEST_F(TestKarel, STACK_MEMORY_IS_ZERO) {
@@ -458,4 +561,1146 @@ TEST_F(TestKarel, INFINITE_INMUTABILITY) {
   auto result = karel::Run(program,runtime);
   EXPECT_EQ(result, karel::RunResult::OK) << "Run did not end in an OK status";  
   ASSERT_EQ(karel::kInfinity, runtime->ret) << "RET should be unchanged to the value loaded";
-}
\ No newline at end of file
+}
+
+TEST_F(TestKarel, THREADED_STACK_RESTORATION_AFTER_RETURN) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LOAD, 10},
+    {karel::Opcode::LOAD, 0},
+    {karel::Opcode::LOAD, 1},
+    {karel::Opcode::LOAD, 2},
+    {karel::Opcode::LOAD, 3},
+    {karel::Opcode::CALL, 8},
+    {karel::Opcode::SRET},
+    {karel::Opcode::HALT},
+    {karel::Opcode::PARAM, 0},
+    {karel::Opcode::PARAM, 1},
+    {karel::Opcode::PARAM, 1},
+    {karel::Opcode::PARAM, 2},
+    {karel::Opcode::RET}
+  };
+  auto result = karel::RunThreaded(program,runtime);
+  EXPECT_EQ(result, karel::RunResult::OK) << "Run did not end in OK status";
+  EXPECT_EQ(runtime->ret, 10) << "RET was not set correctly";
+  EXPECT_EQ(runtime->stack_memory, 0) << "STACK memory did not returned to zero";
+}
+
+TEST_F(TestKarel, THREADED_INSTRUCTION_LIMIT) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LEFT},//0
+    {karel::Opcode::JMP, -2},//1
+  };
+  runtime->instruction_limit = 7;
+  auto result = karel::RunThreaded(program,runtime);
+  EXPECT_EQ(result, karel::RunResult::INSTRUCTION) << "Run should have ended in INSTRUCTION";
+  EXPECT_EQ(runtime->left_count, 4) << "LEFT ran the wrong number of times";
+}
+
+TEST_F(TestKarel, THREADED_LIMIT_AT_END_OF_PROGRAM) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LEFT},//0
+    {karel::Opcode::LEFT},//1
+  };
+  runtime->instruction_limit = 2;
+  karel::Runtime fresh = *runtime;
+  auto result = karel::RunThreaded(program,runtime);
+  EXPECT_EQ(result, karel::RunResult::OK) << "Falling off the program should end in OK";
+  EXPECT_EQ(result, karel::Run(program,&fresh)) << "Engines disagree";
+  EXPECT_EQ(runtime->orientation, fresh.orientation) << "Engines disagree on the orientation";
+  EXPECT_EQ(runtime->left_count, fresh.left_count) << "Engines disagree on the LEFT count";
+}
+
+TEST_F(TestKarel, FUSED_FORWARD_INTO_WALL) {
+  std::vector<karel::Instruction> program = karel::FuseInstructions({
+    {karel::Opcode::WORLDWALLS},//0
+    {karel::Opcode::ORIENTATION},//1
+    {karel::Opcode::MASK},//2
+    {karel::Opcode::AND},//3
+    {karel::Opcode::NOT},//4
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WALL)},//5
+    {karel::Opcode::FORWARD},//6
+    {karel::Opcode::JMP, -8},//7
+  });
+  ASSERT_EQ(program.size(), 8) << "Fusion should not change the program length";
+  ASSERT_EQ(program[0].opcode, karel::Opcode::CHECKED_FORWARD) << "Guarded FORWARD was not fused";
+  runtime->walls[runtime->coordinates(0, 3)] = 1 << 1;
+  auto result = karel::Run(program,runtime);
+  EXPECT_EQ(result, karel::RunResult::WALL) << "Run should have ended in WALL";
+  EXPECT_EQ(runtime->y, 3) << "Y is wrong";
+  EXPECT_EQ(runtime->forward_count, 3) << "FORWARD ran the wrong number of times";
+}
+
+TEST_F(TestKarel, FUSED_PICK_INSTRUCTION_LIMIT) {
+  std::vector<karel::Instruction> program = karel::FuseInstructions({
+    {karel::Opcode::WORLDBUZZERS},//0
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WORLDUNDERFLOW)},//1
+    {karel::Opcode::PICKBUZZER},//2
+    {karel::Opcode::JMP, -4},//3
+  });
+  ASSERT_EQ(program[0].opcode, karel::Opcode::CHECKED_PICK) << "Guarded PICKBUZZER was not fused";
+  runtime->buzzers[runtime->coordinates(0, 0)] = 100;
+  runtime->instruction_limit = 9;
+  auto result = karel::RunThreaded(program,runtime);
+  EXPECT_EQ(result, karel::RunResult::INSTRUCTION) << "Run should have ended in INSTRUCTION";
+  EXPECT_EQ(runtime->pickbuzzer_count, 5) << "PICKBUZZER ran the wrong number of times";
+  EXPECT_EQ(runtime->bag, 5) << "Bag is wrong";
+}
+
+TEST_F(TestKarel, FUSED_JUMP_INTO_IDIOM) {
+  std::vector<karel::Instruction> program = karel::FuseInstructions({
+    {karel::Opcode::JMP, 1},//0
+    {karel::Opcode::WORLDBUZZERS},//1
+    {karel::Opcode::LOAD, 1},//2
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WORLDUNDERFLOW)},//3
+    {karel::Opcode::LEFT},//4
+    {karel::Opcode::WORLDWALLS},//5
+    {karel::Opcode::ORIENTATION},//6
+    {karel::Opcode::ROTL},//7
+    {karel::Opcode::MASK},//8
+    {karel::Opcode::AND},//9
+    {karel::Opcode::NOT},//10
+    {karel::Opcode::JZ, 1},//11
+    {karel::Opcode::LEFT},//12
+    {karel::Opcode::HALT},//13
+  });
+  ASSERT_EQ(program[5].opcode, karel::Opcode::LEFT_CLEAR_JZ) << "Wall check was not fused";
+  runtime->walls[runtime->coordinates(0, 0)] = 1 << 3;
+  auto result = karel::Run(program,runtime);
+  EXPECT_EQ(result, karel::RunResult::OK) << "Run did not end in OK status";
+  EXPECT_EQ(runtime->left_count, 1) << "LEFT ran the wrong number of times";
+}
+
+TEST_F(TestKarel, DECODE_ABSOLUTE_TARGETS) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LOAD, 0},//0
+    {karel::Opcode::CALL, 5},//1
+    {karel::Opcode::JZ, -3},//2
+    {karel::Opcode::JMP, 10},//3
+    {karel::Opcode::HALT},//4
+    {karel::Opcode::RET},//5
+  };
+  auto decoded = karel::DecodeInstructions(program);
+  ASSERT_TRUE(decoded) << "Program should decode";
+  ASSERT_EQ(decoded->size(), program.size()) << "Decoded size is wrong";
+  EXPECT_EQ(decoded->args[1], 5) << "CALL target is wrong";
+  EXPECT_EQ(decoded->args[2], 0) << "JZ target is wrong";
+  EXPECT_EQ(decoded->args[3], 6) << "Out of range JMP should point to the end";
+  EXPECT_EQ(decoded->opcodes[6], karel::kDecodedEnd) << "End marker is missing";
+}
+
+TEST_F(TestKarel, DECODE_INVALID_EZ) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LOAD, 0},
+    {karel::Opcode::EZ, 1234},
+  };
+  EXPECT_FALSE(karel::DecodeInstructions(program)) << "Invalid EZ code should be rejected";
+}
+
+TEST_F(TestKarel, STACKS_REUSED_ACROSS_RUNS) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LOAD, 0},//0
+    {karel::Opcode::CALL, 3},//1
+    {karel::Opcode::HALT},//2
+    {karel::Opcode::LOAD, 0},//3
+    {karel::Opcode::CALL, 3},//4
+    {karel::Opcode::RET},//5
+  };
+  runtime->stack_limit = 100;
+  karel::Stacks stacks;
+  for (int i = 0; i < 2; i++) {
+    runtime->stack_memory = 0;
+    auto result = karel::Run(program,runtime,&stacks);
+    EXPECT_EQ(result, karel::RunResult::STACK) << "Run should have ended in STACK at " << i;
+    EXPECT_EQ(stacks.frames.size(), 100) << "Wrong number of frames at " << i;
+    EXPECT_EQ(stacks.frames.capacity(), 100) << "Frames should have been preallocated at " << i;
+  }
+}
+
+TEST_F(TestKarel, FLAT_STACK_GROWS) {
+  karel::FlatStack<int32_t> stack;
+  stack.reserve(2);
+  for (int32_t i = 0; i < 100; i++)
+    stack.push_back(i);
+  ASSERT_EQ(stack.size(), 100) << "Wrong size";
+  EXPECT_EQ(stack[37], 37) << "Values were not preserved while growing";
+  stack.truncate(10);
+  EXPECT_EQ(stack.back(), 9) << "Wrong top after truncate";
+}
+
+TEST_F(TestKarel, BUDGETED_INSTRUCTION_LIMIT_INSIDE_BLOCK) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LEFT},//0
+    {karel::Opcode::LEFT},//1
+    {karel::Opcode::LEFT},//2
+    {karel::Opcode::JMP, -4},//3
+  };
+  auto decoded = karel::DecodeInstructions(program);
+  ASSERT_TRUE(decoded) << "Failed to decode";
+  karel::ComputeBlockCosts(&decoded.value());
+  EXPECT_EQ(decoded->costs[0].instructions, 4) << "Wrong block cost";
+  EXPECT_EQ(decoded->costs[0].commands, 3) << "Wrong block cost";
+  runtime->instruction_limit = 10;
+  auto result = karel::RunThreaded(decoded.value(), runtime);
+  EXPECT_EQ(result, karel::RunResult::INSTRUCTION) << "Run should have ended in INSTRUCTION";
+  EXPECT_EQ(runtime->left_count, 8) << "The limit was not hit on the same instruction as Run";
+}
+
+TEST_F(TestKarel, BUDGETED_COMMAND_LIMIT_INSIDE_BLOCK) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LEFT},//0
+    {karel::Opcode::FORWARD},//1
+    {karel::Opcode::LEFT},//2
+    {karel::Opcode::JMP, -4},//3
+  };
+  auto decoded = karel::DecodeInstructions(program);
+  ASSERT_TRUE(decoded) << "Failed to decode";
+  karel::ComputeBlockCosts(&decoded.value());
+  runtime->x = 50;
+  runtime->y = 50;
+  runtime->left_limit = 5;
+  auto result = karel::RunThreaded(decoded.value(), runtime);
+  EXPECT_EQ(result, karel::RunResult::INSTRUCTION_LEFT) << "Run should have ended in INSTRUCTION_LEFT";
+  EXPECT_EQ(runtime->left_count, 6) << "Wrong number of lefts";
+  EXPECT_EQ(runtime->forward_count, 3) << "Wrong number of forwards";
+}
+
+TEST_F(TestKarel, VERIFY_FUNCTIONS) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LOAD, 7},//0
+    {karel::Opcode::LOAD, 1},//1
+    {karel::Opcode::CALL, 4},//2
+    {karel::Opcode::HALT},//3
+    {karel::Opcode::PARAM, 0},//4
+    {karel::Opcode::DUP},//5
+    {karel::Opcode::JZ, 3},//6
+    {karel::Opcode::DEC, 1},//7
+    {karel::Opcode::JMP, -4},//8
+    {karel::Opcode::POP},//9
+    {karel::Opcode::RET},//10
+  };
+  auto info = karel::VerifyInstructions(program);
+  ASSERT_TRUE(info) << "Program should verify";
+  ASSERT_EQ(info->functions.size(), 2) << "Wrong number of functions";
+  EXPECT_EQ(info->functions[0].max_stack_depth, 2) << "Wrong depth for main";
+  EXPECT_EQ(info->functions[1].entry, 4) << "Wrong function entry";
+  EXPECT_EQ(info->functions[1].arity, 1) << "Wrong function arity";
+  EXPECT_EQ(info->functions[1].max_stack_depth, 3) << "Wrong function depth";
+
+  // Jumps that leave the program end it, however far they go.
+  std::vector<karel::Instruction> far_jumps = {
+    {karel::Opcode::WORLDBUZZERS},
+    {karel::Opcode::JZ, std::numeric_limits<int32_t>::max()},
+    {karel::Opcode::JMP, std::numeric_limits<int32_t>::max()},
+  };
+  EXPECT_TRUE(karel::VerifyInstructions(far_jumps)) << "Jumps out of the program should verify";
+}
+
+TEST_F(TestKarel, VERIFY_REJECTS_UNSAFE_PROGRAMS) {
+  std::vector<std::vector<karel::Instruction>> programs = {
+    // Stack underflow.
+    {{karel::Opcode::LOAD, 1}, {karel::Opcode::AND}},
+    // Different heights on the two paths into the HALT.
+    {{karel::Opcode::WORLDBUZZERS}, {karel::Opcode::JZ, 1},
+     {karel::Opcode::LOAD, 1}, {karel::Opcode::HALT}},
+    // PARAM outside of a function.
+    {{karel::Opcode::PARAM, 0}, {karel::Opcode::POP}},
+    // PARAM past the arity.
+    {{karel::Opcode::LOAD, 0}, {karel::Opcode::CALL, 3}, {karel::Opcode::HALT},
+     {karel::Opcode::PARAM, 0}, {karel::Opcode::RET}},
+    // Parameter count that is not a constant.
+    {{karel::Opcode::BAGBUZZERS}, {karel::Opcode::CALL, 2},
+     {karel::Opcode::RET}},
+    // Invalid EZ code.
+    {{karel::Opcode::LOAD, 0}, {karel::Opcode::EZ, 1234}},
+    // Stack underflow right after a superinstruction, which skips the idiom
+    // that would have balanced it.
+    {{karel::Opcode::CHECKED_PICK, static_cast<int32_t>(karel::RunResult::WORLDUNDERFLOW)},
+     {karel::Opcode::LOAD, 1}, {karel::Opcode::LOAD, 1}, {karel::Opcode::POP}},
+    // Superinstruction that does not fit in the program.
+    {{karel::Opcode::LEFT}, {karel::Opcode::FRONT_CLEAR_JZ, 0, 7}},
+  };
+  for (size_t i = 0; i < programs.size(); i++)
+    EXPECT_FALSE(karel::VerifyInstructions(programs[i])) << "Program " << i << " should not verify";
+}
+
+TEST_F(TestKarel, OPTIMIZE_REWRITES) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LINE, 1, 1},//0
+    {karel::Opcode::LINE, 2, 2},//1
+    {karel::Opcode::LOAD, 5},//2
+    {karel::Opcode::INC, 2},//3
+    {karel::Opcode::DEC, 1},//4
+    {karel::Opcode::NOT},//5
+    {karel::Opcode::JZ, 1},//6
+    {karel::Opcode::LEFT},//7
+    {karel::Opcode::JMP, 1},//8
+    {karel::Opcode::HALT},//9
+    {karel::Opcode::JMP, 1},//10
+    {karel::Opcode::LEFT},//11
+    {karel::Opcode::LEFT},//12
+    {karel::Opcode::HALT},//13
+    {karel::Opcode::LEFT},//14
+  };
+  size_t removed = 0;
+  auto optimized = karel::OptimizeInstructions(program, &removed);
+  EXPECT_EQ(removed, 8) << "Wrong number of removed instructions";
+  ASSERT_EQ(optimized.size(), 7) << "Wrong program size";
+  EXPECT_EQ(optimized[0].arg, 2) << "The last LINE should have been kept";
+  EXPECT_EQ(optimized[1].opcode, karel::Opcode::LOAD) << "Wrong opcode";
+  EXPECT_EQ(optimized[1].arg, 6) << "INC and DEC were not folded";
+  EXPECT_EQ(optimized[2].opcode, karel::Opcode::JNZ) << "NOT, JZ was not inverted";
+  EXPECT_EQ(optimized[2].arg, 1) << "JNZ was not relinked";
+  EXPECT_EQ(optimized[4].opcode, karel::Opcode::JMP) << "Wrong opcode";
+  EXPECT_EQ(optimized[4].arg, 0) << "JMP was not threaded";
+  EXPECT_EQ(optimized[4].arg2, 1) << "The skipped JMP is not counted";
+  EXPECT_TRUE(karel::VerifyInstructions(optimized)) << "Optimized program should verify";
+}
+
+TEST_F(TestKarel, OPTIMIZE_KEEPS_INSTRUCTION_COUNT) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LOAD, 3},//0
+    {karel::Opcode::LEFT},//1
+    {karel::Opcode::JMP, 0},//2
+    {karel::Opcode::JMP, 0},//3
+    {karel::Opcode::DEC, 1},//4
+    {karel::Opcode::DUP},//5
+    {karel::Opcode::NOT},//6
+    {karel::Opcode::JZ, -7},//7
+    {karel::Opcode::POP},//8
+  };
+  auto optimized = karel::OptimizeInstructions(program);
+  for (size_t limit = 1; limit < 20; limit++) {
+    runtime->instruction_limit = limit;
+    runtime->orientation = 0;
+    runtime->left_count = 0;
+    auto expected = karel::Run(program, runtime);
+    size_t expected_lefts = runtime->left_count;
+    runtime->orientation = 0;
+    runtime->left_count = 0;
+    EXPECT_EQ(karel::Run(optimized, runtime), expected) << "Wrong result with limit " << limit;
+    EXPECT_EQ(runtime->left_count, expected_lefts) << "Wrong number of lefts with limit " << limit;
+  }
+}
+
+TEST_F(TestKarel, FUSE_FORWARD_UNTIL_WALL) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::WORLDWALLS},//0
+    {karel::Opcode::ORIENTATION},//1
+    {karel::Opcode::MASK},//2
+    {karel::Opcode::AND},//3
+    {karel::Opcode::JNZ, 9},//4
+    {karel::Opcode::LINE, 3, 4},//5
+    {karel::Opcode::WORLDWALLS},//6
+    {karel::Opcode::ORIENTATION},//7
+    {karel::Opcode::MASK},//8
+    {karel::Opcode::AND},//9
+    {karel::Opcode::NOT},//10
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WALL)},//11
+    {karel::Opcode::FORWARD},//12
+    {karel::Opcode::JMP, -14},//13
+    {karel::Opcode::LEFT},//14
+  };
+  auto fused = karel::FuseInstructions(program);
+  ASSERT_EQ(fused[0].opcode, karel::Opcode::FORWARD_UNTIL_WALL) << "The loop was not recognized";
+  EXPECT_TRUE(karel::VerifyInstructions(fused)) << "Fused program should verify";
+  auto decoded = karel::DecodeInstructions(fused);
+  ASSERT_TRUE(decoded) << "Failed to decode";
+  karel::ComputeBlockCosts(&decoded.value());
+  runtime->walls[runtime->coordinates(0, 20)] = 1 << 1;
+  for (size_t forward_limit : {size_t{7}, std::numeric_limits<size_t>::max()}) {
+    for (size_t limit = 1; limit < 70; limit++) {
+      std::vector<size_t> states[3];
+      for (int engine = 0; engine < 3; engine++) {
+        runtime->y = 0;
+        runtime->orientation = 1;
+        runtime->line = 0;
+        runtime->forward_count = 0;
+        runtime->left_count = 0;
+        runtime->forward_limit = forward_limit;
+        runtime->instruction_limit = limit;
+        auto result = engine == 0 ? karel::Run(program, runtime)
+                    : engine == 1 ? karel::Run(fused, runtime)
+                                  : karel::RunThreaded(decoded.value(), runtime);
+        states[engine] = {static_cast<size_t>(result), runtime->y, runtime->line,
+                          runtime->forward_count, runtime->left_count};
+      }
+      EXPECT_EQ(states[1], states[0]) << "Run differs with limits " << limit << ", " << forward_limit;
+      EXPECT_EQ(states[2], states[0]) << "RunThreaded differs with limits " << limit << ", " << forward_limit;
+    }
+  }
+}
+
+TEST_F(TestKarel, FUSE_PICK_ALL) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::WORLDBUZZERS},//0
+    {karel::Opcode::JZ, 5},//1
+    {karel::Opcode::WORLDBUZZERS},//2
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WORLDUNDERFLOW)},//3
+    {karel::Opcode::PICKBUZZER},//4
+    {karel::Opcode::JMP, -6},//5
+    {karel::Opcode::LEFT},//6
+  };
+  auto fused = karel::FuseInstructions(program);
+  ASSERT_EQ(fused[0].opcode, karel::Opcode::PICK_ALL) << "The loop was not recognized";
+  auto decoded = karel::DecodeInstructions(fused);
+  ASSERT_TRUE(decoded) << "Failed to decode";
+  karel::ComputeBlockCosts(&decoded.value());
+  struct Setup {
+    uint32_t buzzers;
+    size_t bag;
+    size_t pickbuzzer_limit;
+  };
+  for (const Setup& setup : {Setup{10, 0, std::numeric_limits<size_t>::max()},
+                             Setup{10, 0, 4},
+                             Setup{karel::kInfinity, 0, std::numeric_limits<size_t>::max()},
+                             Setup{10, karel::kMaxInt - 3, std::numeric_limits<size_t>::max()},
+                             Setup{10, karel::kInfinity, std::numeric_limits<size_t>::max()}}) {
+    for (size_t limit = 1; limit < 40; limit++) {
+      std::vector<size_t> states[3];
+      for (int engine = 0; engine < 3; engine++) {
+        runtime->buzzers[0] = setup.buzzers;
+        runtime->bag = setup.bag;
+        runtime->pickbuzzer_count = 0;
+        runtime->left_count = 0;
+        runtime->pickbuzzer_limit = setup.pickbuzzer_limit;
+        runtime->instruction_limit = limit;
+        auto result = engine == 0 ? karel::Run(program, runtime)
+                    : engine == 1 ? karel::Run(fused, runtime)
+                                  : karel::RunThreaded(decoded.value(), runtime);
+        states[engine] = {static_cast<size_t>(result), runtime->buzzers[0], runtime->bag,
+                          runtime->pickbuzzer_count, runtime->left_count};
+      }
+      EXPECT_EQ(states[1], states[0]) << "Run differs with limit " << limit << " and " << setup.buzzers << " buzzers";
+      EXPECT_EQ(states[2], states[0]) << "RunThreaded differs with limit " << limit << " and " << setup.buzzers << " buzzers";
+    }
+  }
+}
+
+TEST_F(TestKarel, GRID_LAYOUTS_MATCH_FLAT) {
+  std::vector<karel::Instruction> walk = {
+    {karel::Opcode::LEAVEBUZZER},//0
+    {karel::Opcode::WORLDWALLS},//1
+    {karel::Opcode::ORIENTATION},//2
+    {karel::Opcode::MASK},//3
+    {karel::Opcode::AND},//4
+    {karel::Opcode::NOT},//5
+    {karel::Opcode::JZ, 2},//6
+    {karel::Opcode::FORWARD},//7
+    {karel::Opcode::JMP, -9},//8
+    {karel::Opcode::LEFT},//9
+    {karel::Opcode::JMP, -11},//10
+  };
+  std::vector<karel::Instruction> until_wall = {
+    {karel::Opcode::WORLDWALLS},//0
+    {karel::Opcode::ORIENTATION},//1
+    {karel::Opcode::MASK},//2
+    {karel::Opcode::AND},//3
+    {karel::Opcode::JNZ, 9},//4
+    {karel::Opcode::LINE, 3, 4},//5
+    {karel::Opcode::WORLDWALLS},//6
+    {karel::Opcode::ORIENTATION},//7
+    {karel::Opcode::MASK},//8
+    {karel::Opcode::AND},//9
+    {karel::Opcode::NOT},//10
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WALL)},//11
+    {karel::Opcode::FORWARD},//12
+    {karel::Opcode::JMP, -14},//13
+    {karel::Opcode::LEFT},//14
+    {karel::Opcode::LEAVEBUZZER},//15
+    {karel::Opcode::JMP, -17},//16
+  };
+  until_wall = karel::FuseInstructions(until_wall);
+  ASSERT_EQ(until_wall[0].opcode, karel::Opcode::FORWARD_UNTIL_WALL) << "The loop was not recognized";
+
+  for (const auto* program : {&walk, &until_wall}) {
+    auto decoded = karel::DecodeInstructions(*program);
+    ASSERT_TRUE(decoded) << "Failed to decode";
+    for (size_t limit : {size_t{50}, size_t{3000}}) {
+      std::vector<size_t> states[8];
+      std::vector<uint32_t> cells[8];
+      for (int run = 0; run < 8; run++) {
+        // Runs 0 and 1 use the flat arrays of the fixture, the rest a grid.
+        karel::TiledGrid tiled(runtime->width, runtime->height);
+        karel::SparseGrid sparse(runtime->width, runtime->height);
+        karel::PackedGrid packed(runtime->width, runtime->height);
+        std::fill_n(runtime->buzzers, runtime->width * runtime->height, 0);
+        std::fill_n(runtime->walls, runtime->width * runtime->height, 0);
+        runtime->grid = run < 2 ? nullptr
+                      : run < 4 ? static_cast<karel::Grid*>(&tiled)
+                      : run < 6 ? static_cast<karel::Grid*>(&sparse)
+                                : &packed;
+        karel::VisitCells(*runtime, [&](auto cells) {
+          for (size_t i = 0; i < runtime->width; i++) {
+            cells.set_walls(i, 0, cells.walls(i, 0) | 1 << 3);
+            cells.set_walls(i, runtime->height - 1, cells.walls(i, runtime->height - 1) | 1 << 1);
+            cells.set_walls(0, i, cells.walls(0, i) | 1 << 0);
+            cells.set_walls(runtime->width - 1, i, cells.walls(runtime->width - 1, i) | 1 << 2);
+          }
+          cells.set_walls(0, 20, cells.walls(0, 20) | 1 << 1);
+          cells.set_walls(37, 99, cells.walls(37, 99) | 1 << 2);
+        });
+        runtime->x = 0;
+        runtime->y = 0;
+        runtime->orientation = 1;
+        runtime->bag = 1000;
+        runtime->line = 0;
+        runtime->forward_count = 0;
+        runtime->left_count = 0;
+        runtime->leavebuzzer_count = 0;
+        runtime->instruction_limit = limit;
+        auto result = run % 2 == 0 ? karel::Run(*program, runtime)
+                                   : karel::RunThreaded(decoded.value(), runtime);
+        states[run] = {static_cast<size_t>(result), runtime->x, runtime->y,
+                       runtime->orientation, runtime->bag, runtime->line};
+        karel::VisitCells(*runtime, [&](auto grid_cells) {
+          for (size_t y = 0; y < runtime->height; y++) {
+            for (size_t x = 0; x < runtime->width; x++)
+              cells[run].push_back(grid_cells.buzzers(x, y) << 8 | grid_cells.walls(x, y));
+          }
+        });
+        runtime->grid = nullptr;
+      }
+      for (int run = 1; run < 8; run++) {
+        EXPECT_EQ(states[run], states[0]) << "Run " << run << " differs with limit " << limit;
+        EXPECT_EQ(cells[run], cells[0]) << "Run " << run << " left other cells with limit " << limit;
+      }
+    }
+  }
+}
+
+TEST_F(TestKarel, SPARSE_WORLD) {
+  ScopedFD fd(TempFile(
+      "<ejecucion><condiciones instruccionesMaximasAEjecutar=\"100\" longitudStack=\"10\"/>"
+      "<mundos><mundo nombre=\"mundo_0\" ancho=\"3000\" alto=\"2000\">"
+      "<monton x=\"2\" y=\"3\" zumbadores=\"INFINITO\"/><monton x=\"3000\" y=\"2000\" zumbadores=\"5\"/>"
+      "<pared x1=\"1\" y1=\"0\" y2=\"1\"/><pared x1=\"0\" y1=\"1999\" x2=\"1\"/>"
+      "<posicionDump x=\"2\" y=\"3\"/></mundo></mundos><programas><programa nombre=\"p1\" "
+      "xKarel=\"1\" yKarel=\"1\" direccionKarel=\"NORTE\" mochilaKarel=\"0\">"
+      "<despliega tipo=\"MUNDO\"/></programa></programas></ejecucion>"));
+  ASSERT_TRUE(fd) << "Failed to create the test world";
+
+  auto parse = [&fd](std::optional<karel::WorldLayout> layout) {
+    karel::WorldOptions options;
+    options.layout = layout;
+    return ParseWorld(fd.get(), options);
+  };
+  auto flat = parse(karel::WorldLayout::FLAT);
+  auto sparse = parse(std::nullopt);
+  ASSERT_TRUE(flat && sparse) << "Failed to parse the world";
+  EXPECT_EQ(sparse->layout(), karel::WorldLayout::SPARSE) << "Huge empty worlds should be sparse";
+  EXPECT_EQ(sparse->get_walls(0, 0), (1 << 0) | (1 << 2) | (1 << 3)) << "Wrong walls";
+  EXPECT_EQ(sparse->get_walls(2999, 1), 1 << 2) << "Wrong outer walls";
+  EXPECT_EQ(sparse->get_buzzers(2999, 1999), 5) << "Wrong buzzers";
+  EXPECT_EQ(sparse->SerializeSnapshot(), flat->SerializeSnapshot()) << "The sparse world is different";
+
+  sparse->SetLayout(karel::WorldLayout::TILED);
+  EXPECT_EQ(sparse->SerializeSnapshot(), flat->SerializeSnapshot()) << "The world changed with the layout";
+  flat->SetLayout(karel::WorldLayout::SPARSE);
+  EXPECT_EQ(flat->SerializeSnapshot(), sparse->SerializeSnapshot()) << "The world changed with the layout";
+  flat->SetLayout(karel::WorldLayout::PACKED);
+  EXPECT_EQ(flat->SerializeSnapshot(), sparse->SerializeSnapshot()) << "The world changed with the layout";
+}
+
+TEST_F(TestKarel, REJECTED_ELEMENTS_ARE_SKIPPED) {
+  const std::string_view elements =
+      "<ejecucion><condiciones instruccionesMaximasAEjecutar=\"100\" longitudStack=\"10\"/>"
+      "<mundos><mundo nombre=\"mundo_0\" ancho=\"5\" alto=\"5\">"
+      "<monton x=\"1\" y=\"1\" zumbadores=\"abc\"/><pared x1=\"1\"/>"
+      "<monton x=\"2\" y=\"3\" zumbadores=\"4\"/><pared x1=\"1\" y1=\"0\" y2=\"1\"/>"
+      "</mundo></mundos><programas><programa nombre=\"p1\" "
+      "xKarel=\"3\" yKarel=\"2\" direccionKarel=\"NORTE\" mochilaKarel=\"7\">"
+      "<despliega tipo=\"MUNDO\"/></programa></programas></ejecucion>";
+  auto check = [](std::optional<karel::World> world, const char* source) {
+    ASSERT_TRUE(world) << "Failed to parse the world from " << source;
+    EXPECT_EQ(world->get_buzzers(0, 0), 0) << "Rejected buzzers were set from " << source;
+    EXPECT_EQ(world->get_buzzers(1, 2), 4) << "Buzzers after a rejected element were lost from " << source;
+    EXPECT_EQ(world->get_walls(1, 0), (1 << 0) | (1 << 3)) << "Walls after a rejected element were lost from " << source;
+    EXPECT_EQ(world->runtime()->x, 2) << "Karel after a rejected element was lost from " << source;
+    EXPECT_EQ(world->runtime()->bag, 7) << "Karel after a rejected element was lost from " << source;
+  };
+
+  // Plain worlds are scanned, and the ones with a declaration go through
+  // expat, whether they are mapped or read from a pipe.
+  for (const std::string& document :
+       {std::string(elements), "<?xml version=\"1.0\"?>" + std::string(elements)}) {
+    ScopedFD fd(TempFile(document));
+    ASSERT_TRUE(fd) << "Failed to create the test world";
+    check(ParseWorld(fd.get()), "a file");
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    ScopedFD read_fd(fds[0]);
+    EXPECT_TRUE(WriteFileDescriptor(fds[1], document));
+    close(fds[1]);
+    check(karel::World::Parse(read_fd.get()), "a pipe");
+  }
+}
+
+TEST_F(TestKarel, DUMP_INDEX) {
+  // The dump positions are out of order and repeated.
+  ScopedFD fd(TempFile(
+      "<ejecucion><mundos><mundo nombre=\"mundo_0\" ancho=\"5\" alto=\"3\">"
+      "<monton x=\"1\" y=\"1\" zumbadores=\"2\"/><monton x=\"2\" y=\"1\" zumbadores=\"3\"/>"
+      "<monton x=\"4\" y=\"1\" zumbadores=\"5\"/><monton x=\"2\" y=\"3\" zumbadores=\"1\"/>"
+      "<monton x=\"5\" y=\"2\" zumbadores=\"7\"/><pared x1=\"1\" y1=\"0\" y2=\"1\"/>"
+      "<posicionDump x=\"4\" y=\"1\"/><posicionDump x=\"2\" y=\"3\"/><posicionDump x=\"1\" y=\"1\"/>"
+      "<posicionDump x=\"2\" y=\"1\"/><posicionDump x=\"4\" y=\"1\"/></mundo></mundos>"
+      "<programas><programa nombre=\"p1\" xKarel=\"1\" yKarel=\"1\" direccionKarel=\"NORTE\" "
+      "mochilaKarel=\"0\"><despliega tipo=\"MUNDO\"/></programa></programas></ejecucion>"));
+  ASSERT_TRUE(fd) << "Failed to create the test world";
+
+  auto dump = [&fd](karel::WorldLayout layout, bool result) {
+    karel::WorldOptions options;
+    options.layout = layout;
+    auto world = ParseWorld(fd.get(), options);
+    ScopedFD output(TempFile());
+    if (!world || !output)
+      return std::string();
+    if (result)
+      world->DumpResult(karel::RunResult::OK, output.get());
+    else
+      world->Dump(output.get());
+    return ReadBack(output.get());
+  };
+  const std::string result = dump(karel::WorldLayout::FLAT, true);
+  EXPECT_NE(result.find("<linea fila=\"3\" compresionDeCeros=\"true\">(2) 1 </linea>\n"
+                        "\t\t\t<linea fila=\"1\" compresionDeCeros=\"true\">(1) 2 3 5 </linea>"),
+            std::string::npos) << "Wrong dumped cells: " << result;
+  const std::string world = dump(karel::WorldLayout::FLAT, false);
+  EXPECT_NE(world.find("<posicionDump x=\"1\" y=\"1\"/>\n\t\t\t<posicionDump x=\"2\" y=\"1\"/>\n"
+                       "\t\t\t<posicionDump x=\"2\" y=\"3\"/>\n\t\t\t<posicionDump x=\"4\" y=\"1\"/>\n"
+                       "\t\t</mundo>"),
+            std::string::npos) << "Wrong dump positions: " << world;
+  for (auto layout : {karel::WorldLayout::TILED, karel::WorldLayout::SPARSE, karel::WorldLayout::PACKED}) {
+    EXPECT_EQ(dump(layout, true), result) << "Wrong result in layout " << static_cast<int>(layout);
+    EXPECT_EQ(dump(layout, false), world) << "Wrong world in layout " << static_cast<int>(layout);
+  }
+}
+
+TEST_F(TestKarel, DIRTY_CELLS) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LEAVEBUZZER},
+    {karel::Opcode::FORWARD},
+    {karel::Opcode::LEAVEBUZZER},
+    {karel::Opcode::LEAVEBUZZER},
+    {karel::Opcode::PICKBUZZER},
+    {karel::Opcode::FORWARD},
+    {karel::Opcode::HALT},
+  };
+  auto decoded = karel::DecodeInstructions(program);
+  ASSERT_TRUE(decoded) << "Failed to decode";
+  for (bool threaded : {false, true}) {
+    karel::DirtyCells dirty(runtime->width, runtime->height, 10);
+    std::fill_n(runtime->buzzers, runtime->width * runtime->height, 0);
+    runtime->x = runtime->y = 0;
+    runtime->orientation = 1;
+    runtime->bag = karel::kInfinity;
+    runtime->dirty = &dirty;
+    auto result = threaded ? karel::RunThreaded(decoded.value(), runtime) : karel::Run(program, runtime);
+    runtime->dirty = nullptr;
+    ASSERT_EQ(result, karel::RunResult::OK) << "Run did not end in OK status";
+    EXPECT_FALSE(dirty.all()) << "The engine gave up on tracking";
+    EXPECT_EQ(dirty.cells(), (std::vector<size_t>{runtime->coordinates(0, 0), runtime->coordinates(0, 1)}))
+        << "Wrong dirty cells, threaded " << threaded;
+  }
+
+  // A fused pick that cannot take any buzzer leaves its cell alone.
+  auto pick_all = karel::FuseInstructions({
+    {karel::Opcode::WORLDBUZZERS},
+    {karel::Opcode::JZ, 5},
+    {karel::Opcode::WORLDBUZZERS},
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WORLDUNDERFLOW)},
+    {karel::Opcode::PICKBUZZER},
+    {karel::Opcode::JMP, -6},
+  });
+  ASSERT_EQ(pick_all[0].opcode, karel::Opcode::PICK_ALL) << "The loop was not recognized";
+  auto decoded_pick_all = karel::DecodeInstructions(pick_all);
+  ASSERT_TRUE(decoded_pick_all) << "Failed to decode";
+  const auto instruction_limit = runtime->instruction_limit;
+  for (bool threaded : {false, true}) {
+    karel::DirtyCells dirty(runtime->width, runtime->height, 10);
+    runtime->buzzers[0] = 5;
+    runtime->x = runtime->y = 0;
+    runtime->bag = 0;
+    runtime->instruction_limit = 1;
+    runtime->dirty = &dirty;
+    auto result = threaded ? karel::RunThreaded(decoded_pick_all.value(), runtime) : karel::Run(pick_all, runtime);
+    runtime->dirty = nullptr;
+    EXPECT_EQ(result, karel::RunResult::INSTRUCTION) << "Wrong result, threaded " << threaded;
+    EXPECT_EQ(runtime->buzzers[0], 5) << "Buzzers were picked, threaded " << threaded;
+    EXPECT_TRUE(dirty.cells().empty()) << "An unchanged cell was marked, threaded " << threaded;
+  }
+  runtime->instruction_limit = instruction_limit;
+
+  karel::DirtyCells dirty(runtime->width, runtime->height, 1);
+  dirty.Mark(5, 5);
+  dirty.Mark(5, 5);
+  EXPECT_FALSE(dirty.all()) << "Gave up too soon";
+  dirty.Mark(6, 5);
+  EXPECT_TRUE(dirty.all()) << "Did not give up past the limit";
+}
+
+TEST_F(TestKarel, PACKED_GRID_WIDENS) {
+  // 100x1 cells: the second tile is shorter than the rest.
+  karel::PackedGrid grid(100, 1);
+  auto cells = grid.cells();
+  for (size_t x = 0; x < 100; x++) {
+    cells.set_buzzers(x, 0, x + 1);
+    cells.set_walls(x, 0, x & 0xF);
+  }
+  cells.set_buzzers(3, 0, 256);
+  cells.set_buzzers(70, 0, karel::kInfinity);
+  for (size_t x = 0; x < 100; x++) {
+    const uint32_t expected = x == 3 ? 256 : x == 70 ? karel::kInfinity : x + 1;
+    EXPECT_EQ(cells.buzzers(x, 0), expected) << "Wrong buzzers at " << x;
+    EXPECT_EQ(cells.walls(x, 0), x & 0xF) << "Wrong walls at " << x;
+  }
+}
+
+TEST_F(TestKarel, BYTECODE_ROUND_TRIP) {
+  std::vector<std::string> function_names;
+  auto program = karel::ParseInstructions(
+      "[[\"LOAD\",0],[\"CALL\",4,\"gira\"],[\"LOAD\",0],[\"CALL\",4,\"gira\"],"
+      "[\"LEFT\"],[\"RET\"]]",
+      &function_names);
+  ASSERT_TRUE(program) << "Failed to parse";
+  ASSERT_EQ(function_names, std::vector<std::string>{"gira"}) << "Wrong function names";
+  EXPECT_EQ((*program)[3].arg2, 0) << "CALL does not refer to its name";
+  std::string image = karel::SerializeBytecode(program.value(), function_names);
+  auto bytecode = karel::ParseBytecode(image);
+  ASSERT_TRUE(bytecode) << "Failed to load the serialized program";
+  ASSERT_EQ(bytecode->program.size(), program->size()) << "Wrong program size";
+  EXPECT_EQ(static_cast<const void*>(bytecode->program.begin()),
+            static_cast<const void*>(image.data() + sizeof(karel::BytecodeHeader)))
+      << "The instructions were copied";
+  for (size_t i = 0; i < program->size(); i++) {
+    EXPECT_EQ(bytecode->program[i].opcode, (*program)[i].opcode) << "Wrong opcode at " << i;
+    EXPECT_EQ(bytecode->program[i].arg, (*program)[i].arg) << "Wrong argument at " << i;
+  }
+  ASSERT_EQ(bytecode->function_names.size(), 1) << "Wrong number of function names";
+  EXPECT_EQ(bytecode->function_names[0], "gira") << "Wrong function name";
+  auto result = karel::Run(bytecode->program, runtime);
+  EXPECT_EQ(result, karel::RunResult::OK) << "Run did not end in OK status";
+  EXPECT_EQ(runtime->orientation, 2) << "Wrong orientation";
+}
+
+TEST_F(TestKarel, BYTECODE_REJECTS_CORRUPTION) {
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LEFT},
+    {karel::Opcode::HALT},
+  };
+  const std::string image = karel::SerializeBytecode(program, {});
+  ASSERT_TRUE(karel::ParseBytecode(image)) << "Failed to load the serialized program";
+  std::string corrupted = image;
+  corrupted[sizeof(karel::BytecodeHeader) + 4] ^= 1;
+  EXPECT_FALSE(karel::ParseBytecode(corrupted)) << "The checksum was not checked";
+  std::string truncated = image.substr(0, image.size() - 1);
+  EXPECT_FALSE(karel::ParseBytecode(truncated)) << "The size was not checked";
+  std::string newer = image;
+  newer[offsetof(karel::BytecodeHeader, version)]++;
+  EXPECT_FALSE(karel::ParseBytecode(newer)) << "The version was not checked";
+  EXPECT_FALSE(karel::IsBytecode("[[\"HALT\"]]")) << "JSON was taken for a .kxb file";
+
+  // A valid checksum does not make the stacks safe.
+  const std::vector<karel::Instruction> underflow = {
+    {karel::Opcode::LOAD, 1},
+    {karel::Opcode::AND},
+  };
+  EXPECT_FALSE(karel::ParseBytecode(karel::SerializeBytecode(underflow, {})))
+      << "An unverified program was accepted";
+
+  // The fused instructions must be followed by the ones that they replaced.
+  const int32_t wall = static_cast<int32_t>(karel::RunResult::WALL);
+  for (karel::Opcode opcode : {karel::Opcode::CHECKED_FORWARD,
+                               karel::Opcode::CHECKED_PICK,
+                               karel::Opcode::CHECKED_LEAVE}) {
+    const std::vector<karel::Instruction> short_program = {
+      {karel::Opcode::LEFT},
+      {opcode, wall},
+      {karel::Opcode::HALT},
+    };
+    EXPECT_FALSE(karel::ParseBytecode(karel::SerializeBytecode(short_program, {})))
+        << "A truncated opcode " << static_cast<uint32_t>(opcode) << " was accepted";
+  }
+}
+
+TEST_F(TestKarel, BYTECODE_CACHE_PATH) {
+  const std::string path = karel::BytecodeCachePath("/cache", "[[\"HALT\"]]", "1.0.0");
+  EXPECT_EQ(path.rfind("/cache/", 0), 0) << "The entry is not inside the cache";
+  EXPECT_EQ(path, karel::BytecodeCachePath("/cache", "[[\"HALT\"]]", "1.0.0")) << "The path is not stable";
+  EXPECT_NE(path, karel::BytecodeCachePath("/cache", "[[\"LEFT\"]]", "1.0.0")) << "The program is not part of the key";
+  EXPECT_NE(path, karel::BytecodeCachePath("/cache", "[[\"HALT\"]]", "1.0.1")) << "The version is not part of the key";
+}
+
+TEST_F(TestKarel, PARSE_STRING) {
+  EXPECT_EQ(ParseString<uint32_t>(std::string_view("42")), 42u) << "Plain number";
+  EXPECT_EQ(ParseString<uint32_t>(std::string_view("INFINITO")), karel::kInfinity) << "Infinity";
+  EXPECT_EQ(ParseString<uint32_t>(std::string_view("4294967296")), std::nullopt) << "Overflow";
+  EXPECT_EQ(ParseString<uint32_t>(std::string_view("")), std::nullopt) << "Empty";
+  // The stream fallback keeps taking whatever operator>> takes.
+  EXPECT_EQ(ParseString<size_t>(std::string_view(" 7")), 7u) << "Leading space";
+  EXPECT_EQ(ParseString<size_t>(std::string_view("+5")), 5u) << "Sign";
+  EXPECT_EQ(ParseString<size_t>(std::string_view("3x")), 3u) << "Trailing garbage";
+  EXPECT_EQ(ParseString<size_t>(std::string_view("-1")), std::numeric_limits<size_t>::max()) << "Negative";
+}
+
+TEST_F(TestKarel, XML_READER_BUFFER_SIZES) {
+  const std::string_view document =
+      "<ejecucion><mundos><mundo ancho=\"3\"/><mundo ancho=\"100\"/>"
+      "</mundos></ejecucion>";
+  auto parse = [&document](size_t read_buffer_size, bool from_pipe) {
+    std::vector<std::string> elements;
+    auto callback = [&elements](const auto& element) {
+      elements.emplace_back(element.GetName());
+      if (auto ancho = element.GetAttribute("ancho"))
+        elements.back() += "=" + std::string(ancho.value());
+      return true;
+    };
+    xml::Reader reader(read_buffer_size);
+    if (!from_pipe) {
+      reader.Parse(document, callback);
+      return elements;
+    }
+    int fds[2];
+    EXPECT_EQ(pipe(fds), 0);
+    EXPECT_TRUE(WriteFileDescriptor(fds[1], document));
+    close(fds[1]);
+    reader.Parse(fds[0], callback);
+    close(fds[0]);
+    return elements;
+  };
+  const std::vector<std::string> expected = {"ejecucion", "mundos", "mundo=3", "mundo=100"};
+  for (size_t size : {size_t{1}, size_t{7}, xml::Reader::kDefaultReadBufferSize}) {
+    EXPECT_EQ(parse(size, false), expected) << "Wrong elements from memory, buffer size " << size;
+    EXPECT_EQ(parse(size, true), expected) << "Wrong elements from a pipe, buffer size " << size;
+  }
+}
+
+TEST_F(TestKarel, XML_SCANNER) {
+  std::vector<std::string> names;
+  std::vector<std::optional<std::string_view>> values;
+  auto callback = [&](const xml::Scanner::Element& element) {
+    names.emplace_back(element.GetName());
+    auto [x, y] = element.GetAttributes({"x", "y"});
+    values.push_back(x);
+    values.push_back(y);
+    return true;
+  };
+  ASSERT_TRUE(xml::Scanner::Scan(
+      "<mundo ancho=\"3\">\r\n\t<monton x = '1' y=\"2\"/>"
+      "<monton y=\"padded to take the vector path\"></monton></mundo >\n",
+      callback)) << "Plain document was not scanned";
+  EXPECT_EQ(names, (std::vector<std::string>{"mundo", "monton", "monton"})) << "Wrong elements";
+  EXPECT_EQ(values[2], "1") << "Wrong attribute";
+  EXPECT_EQ(values[3], "2") << "Wrong attribute";
+  EXPECT_EQ(values[4], std::nullopt) << "Missing attribute was found";
+  EXPECT_EQ(values[5], "padded to take the vector path") << "Wrong attribute";
+
+  int calls = 0;
+  EXPECT_TRUE(xml::Scanner::Scan("<a><b/><c/></a>", [&calls](const auto&) { return ++calls < 2; })) << "Stopping is not an error";
+  EXPECT_EQ(calls, 2) << "Scanning did not stop";
+
+  const char* unsupported[] = {
+    "<?xml version=\"1.0\"?><a/>",
+    "<a><!-- comment --></a>",
+    "<a x=\"&amp;\"/>",
+    "<a x=\"1\" x=\"2\"/>",
+    "<a x=\"1\"y=\"2\"/>",
+    "<a x=\"\t\"/>",
+    "<a x=\"<\"/>",
+    "<a>text</a>",
+    "<a></b>",
+    "<a>",
+    "<a/><b/>",
+    "<a x=\"\xc3\xb1\"/>",
+    "",
+  };
+  for (const char* document : unsupported)
+    EXPECT_FALSE(xml::Scanner::Scan(document, callback)) << "Scanned " << document;
+}
+
+TEST_F(TestKarel, XML_WRITER) {
+  ScopedFD fd(TempFile());
+  ASSERT_TRUE(fd) << "Failed to create the output file";
+
+  // Lines shorter than the buffer, about as long and much longer than it.
+  std::vector<std::string> lines;
+  for (size_t size : {size_t{10}, xml::Buffer::kCapacity - 3, 3 * xml::Buffer::kCapacity})
+    lines.emplace_back(size, 'z');
+  std::string expected = "<mundo ancho=\"-3\" alto=\"18446744073709551615\">\n";
+  {
+    xml::Writer writer(fd.get());
+    auto mundo = writer.CreateElement("mundo");
+    mundo.AddAttribute("ancho", -3);
+    mundo.AddAttribute("alto", std::numeric_limits<uint64_t>::max());
+    for (size_t i = 0; i < lines.size(); ++i) {
+      auto linea = mundo.CreateElement("linea", lines[i]);
+      linea.AddAttribute("fila", i + 1);
+      expected += "\t<linea fila=\"" + std::to_string(i + 1) + "\">" + lines[i] + "</linea>\n";
+    }
+  }
+  expected += "</mundo>\n";
+
+  EXPECT_EQ(ReadBack(fd.get()), expected) << "Wrong output";
+}
+
+TEST_F(TestKarel, EXPECTED_OUTPUT) {
+  ScopedTempDir dir;
+  ASSERT_FALSE(dir.path().empty()) << "Failed to create the test directory";
+  const std::string base = dir.path() + "/case";
+  ASSERT_TRUE(dir.Write("case.in",
+      "<ejecucion><mundos><mundo nombre=\"mundo_0\" ancho=\"5\" alto=\"3\">"
+      "<monton x=\"2\" y=\"1\" zumbadores=\"3\"/><monton x=\"4\" y=\"3\" zumbadores=\"1\"/></mundo></mundos>"
+      "<programas><programa nombre=\"p1\" xKarel=\"1\" yKarel=\"1\" direccionKarel=\"NORTE\" "
+      "mochilaKarel=\"0\"><despliega tipo=\"UNIVERSO\"/></programa></programas></ejecucion>"));
+  auto world = ParseWorld(base + ".in");
+  ASSERT_TRUE(world) << "Failed to parse the world";
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::WORLDBUZZERS},
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WORLDUNDERFLOW)},
+    {karel::Opcode::PICKBUZZER},
+    {karel::Opcode::HALT},
+  };
+  const karel::RunResult result = karel::Run(program, world->runtime());
+  ASSERT_EQ(result, karel::RunResult::WORLDUNDERFLOW) << "Wrong result";
+
+  ScopedFD output_fd(TempFile());
+  ASSERT_TRUE(output_fd) << "Failed to create the output file";
+  world->DumpResult(result, output_fd.get());
+  const std::string output = ReadBack(output_fd.get());
+
+  auto judge = [&](const std::string& expected, karel::Mismatch* mismatch) {
+    EXPECT_TRUE(WriteFileAtomically(base + ".out", expected));
+    auto expectation = karel::Expectation::Load(base + ".out");
+    EXPECT_TRUE(expectation) << "Failed to load the expected output";
+    karel::OutputComparator comparator(expectation->output());
+    world->DumpResult(result, &comparator);
+    return expectation->Judge(result, &comparator, mismatch);
+  };
+
+  // Different indentation, line endings and blank lines still match.
+  std::string reformatted;
+  for (char c : output) {
+    if (c == '\t')
+      reformatted += "  ";
+    else if (c == '\n')
+      reformatted += "\r\n\n";
+    else
+      reformatted += c;
+  }
+  karel::Mismatch mismatch;
+  EXPECT_EQ(judge(reformatted, &mismatch), karel::Verdict::OK) << "Wrong verdict for " << reformatted;
+
+  std::string wrong_cell = output;
+  ASSERT_NE(wrong_cell.find("(2) 3 "), std::string::npos) << "Unexpected output: " << output;
+  wrong_cell.replace(wrong_cell.find("(2) 3 "), 6, "(2) 3 4 ");
+  EXPECT_EQ(judge(wrong_cell, &mismatch), karel::Verdict::WRONG_OUTPUT) << "Wrong verdict";
+  EXPECT_EQ(mismatch.fila, 1) << "Wrong fila";
+  EXPECT_EQ(mismatch.columna, 3) << "Wrong columna";
+  EXPECT_EQ(mismatch.expected_buzzers, 4) << "Wrong expected buzzers";
+  EXPECT_EQ(mismatch.actual_buzzers, 0) << "Wrong actual buzzers";
+  EXPECT_EQ(mismatch.expected_line, mismatch.actual_line) << "Wrong lines";
+
+  // The message and the exit code are only checked when their files exist.
+  ASSERT_TRUE(WriteFileAtomically(base + ".stderr", "ZUMBADOR INVALIDO MUNDO\n"));
+  ASSERT_TRUE(WriteFileAtomically(base + ".signal", "18\n"));
+  EXPECT_EQ(judge(output, &mismatch), karel::Verdict::WRONG_SIGNAL) << "Wrong verdict";
+  EXPECT_EQ(mismatch.expected, "18") << "Wrong expected signal";
+  EXPECT_EQ(mismatch.actual, "17") << "Wrong actual signal";
+  ASSERT_TRUE(WriteFileAtomically(base + ".signal", "17\n"));
+  EXPECT_EQ(judge(output, &mismatch), karel::Verdict::OK) << "Wrong verdict";
+  ASSERT_TRUE(WriteFileAtomically(base + ".stderr", "MOVIMIENTO INVALIDO"));
+  EXPECT_EQ(judge(output, &mismatch), karel::Verdict::WRONG_STDERR) << "Wrong verdict";
+
+  // Output that arrives a byte at a time, without its last newline.
+  karel::OutputComparator comparator("<a>\n\n  <b x=\"1\"/>\n</a>\n");
+  for (char c : std::string_view("<a>\n<b x=\"1\"/>\r\n</a>"))
+    comparator.Write(std::string_view(&c, 1));
+  EXPECT_FALSE(comparator.Finish()) << "Wrong verdict for split output";
+}
+
+TEST_F(TestKarel, BATCH) {
+  ScopedTempDir dir;
+  ASSERT_FALSE(dir.path().empty()) << "Failed to create the test directory";
+  const std::string cases_dir = dir.path() + "/cases";
+  ASSERT_TRUE(MakeDirectories(cases_dir));
+  auto world = [](int buzzers) {
+    return "<ejecucion><mundos><mundo nombre=\"mundo_0\" ancho=\"3\" alto=\"2\">"
+           "<monton x=\"1\" y=\"1\" zumbadores=\"" + std::to_string(buzzers) + "\"/></mundo></mundos>"
+           "<programas><programa nombre=\"p1\" xKarel=\"1\" yKarel=\"1\" direccionKarel=\"NORTE\" "
+           "mochilaKarel=\"0\"><despliega tipo=\"UNIVERSO\"/></programa></programas></ejecucion>";
+  };
+  ASSERT_TRUE(dir.Write("cases/b.in", world(0)));
+  ASSERT_TRUE(dir.Write("cases/a.in", world(2)));
+  ASSERT_TRUE(dir.Write("cases/a.out",
+      "<resultados>\n<mundos>\n<mundo nombre=\"mundo_0\">\n"
+      "<linea fila=\"1\" compresionDeCeros=\"true\">(1) 1 </linea>\n"
+      "</mundo>\n</mundos>\n<programas>\n<programa nombre=\"p1\" resultadoEjecucion=\"FIN PROGRAMA\"/>\n</programas>\n</resultados>\n"));
+  ASSERT_TRUE(dir.Write("cases/notes.txt", ""));
+  ASSERT_TRUE(dir.Write("list", "# b first\ncases/b.in\n\n cases/a.in \n"));
+
+  auto cases = karel::ListBatchCases(cases_dir);
+  ASSERT_TRUE(cases) << "Failed to list the directory";
+  EXPECT_EQ(cases.value(), (std::vector<std::string>{cases_dir + "/a.in", cases_dir + "/b.in"}))
+      << "Wrong cases in the directory";
+  auto listed = karel::ListBatchCases(dir.path() + "/list");
+  ASSERT_TRUE(listed) << "Failed to read the list";
+  EXPECT_EQ(listed.value(), (std::vector<std::string>{cases_dir + "/b.in", cases_dir + "/a.in"}))
+      << "Wrong cases in the list";
+
+  // Picks one buzzer, if there are any.
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::WORLDBUZZERS},
+    {karel::Opcode::EZ, static_cast<int32_t>(karel::RunResult::WORLDUNDERFLOW)},
+    {karel::Opcode::PICKBUZZER},
+    {karel::Opcode::HALT},
+  };
+  size_t runs = 0;
+  auto run = [&program, &runs](karel::Runtime* runtime) {
+    ++runs;
+    return karel::Run(program, runtime);
+  };
+  ScopedFD report_fd(TempFile());
+  ASSERT_TRUE(report_fd) << "Failed to create the report";
+  karel::BatchOptions options;
+  options.output_dir = dir.path() + "/outputs";
+  ASSERT_TRUE(MakeDirectories(options.output_dir));
+  EXPECT_EQ(karel::RunBatch(cases.value(), options, run, report_fd.get()), 0) << "Wrong status";
+  EXPECT_EQ(runs, 2) << "Wrong number of runs";
+
+  const std::string report = ReadBack(report_fd.get());
+  EXPECT_EQ(std::count(report.begin(), report.end(), '\n'), 2) << "Wrong report: " << report;
+  EXPECT_NE(report.find("{\"case\":\"" + cases_dir + "/a.in\",\"exit_code\":0,\"verdict\":\"OK\",\"load_us\":"),
+            std::string::npos) << "Wrong report: " << report;
+  EXPECT_NE(report.find("{\"case\":\"" + cases_dir + "/b.in\",\"exit_code\":17,\"load_us\":"),
+            std::string::npos) << "Wrong report: " << report;
+  EXPECT_EQ(access((options.output_dir + "/a.out").c_str(), F_OK), 0) << "Missing output";
+  EXPECT_EQ(access((options.output_dir + "/b.out").c_str(), F_OK), 0) << "Missing output";
+
+  // A wrong expected output, and a world that is not there.
+  ASSERT_TRUE(dir.Write("cases/b.out", "<resultados/>"));
+  cases->push_back(cases_dir + "/c.in");
+  options.output_dir.clear();
+  EXPECT_EQ(karel::RunBatch(cases.value(), options, run, report_fd.get()), 2) << "Wrong status";
+  cases->pop_back();
+  EXPECT_EQ(karel::RunBatch(cases.value(), options, run, report_fd.get()), 1) << "Wrong status";
+}
+
+TEST_F(TestKarel, WORLD_SNAPSHOT_CACHE) {
+  ScopedTempDir dir;
+  ASSERT_FALSE(dir.path().empty()) << "Failed to create the test directory";
+  const std::string world_path = dir.path() + "/world.in";
+  const std::string cache_dir = dir.path() + "/cache";
+  ASSERT_TRUE(dir.Write("world.in",
+      "<ejecucion version=\"1.1\"><condiciones instruccionesMaximasAEjecutar=\"100\" longitudStack=\"10\">"
+      "<comando nombre=\"AVANZA\" maximoNumeroDeEjecuciones=\"3\"/></condiciones>"
+      "<mundos><mundo nombre=\"mundo_0\" ancho=\"4\" alto=\"3\">"
+      "<monton x=\"2\" y=\"3\" zumbadores=\"INFINITO\"/><pared x1=\"1\" y1=\"0\" y2=\"1\"/>"
+      "<posicionDump x=\"1\" y=\"1\"/></mundo></mundos><programas><programa nombre=\"p1\" "
+      "xKarel=\"3\" yKarel=\"2\" direccionKarel=\"SUR\" mochilaKarel=\"7\">"
+      "<despliega tipo=\"POSICION\"/><despliega tipo=\"COGE_ZUMBADOR\"/></programa></programas></ejecucion>"));
+
+  auto parse = [&world_path, &cache_dir]() {
+    karel::WorldOptions options;
+    options.cache_dir = cache_dir;
+    return ParseWorld(world_path, options);
+  };
+  auto parsed = parse();
+  ASSERT_TRUE(parsed) << "Failed to parse the world";
+  const std::string snapshot = parsed->SerializeSnapshot();
+  EXPECT_TRUE(karel::World::IsSnapshot(snapshot)) << "Wrong snapshot magic";
+
+  auto cached = parse();
+  ASSERT_TRUE(cached) << "Failed to load the cached world";
+  EXPECT_EQ(cached->SerializeSnapshot(), snapshot) << "The cached world is different";
+  karel::Runtime* runtime = cached->runtime();
+  EXPECT_EQ(runtime->forward_limit, 3) << "Wrong limit";
+  EXPECT_EQ(runtime->orientation, 3) << "Wrong orientation";
+  EXPECT_EQ(runtime->bag, 7) << "Wrong bag";
+  EXPECT_EQ(cached->get_buzzers(1, 2), karel::kInfinity) << "Wrong buzzers";
+  EXPECT_EQ(cached->get_walls(0, 0), (1 << 0) | (1 << 2) | (1 << 3)) << "Wrong walls";
+
+  // Changes to a mapped snapshot stay in memory.
+  runtime->buzzers[0] = 42;
+  EXPECT_EQ(parse()->SerializeSnapshot(), snapshot) << "The cached snapshot was modified";
+
+  std::string broken = snapshot;
+  broken[sizeof(karel::WorldSnapshotHeader) + 12 * sizeof(uint32_t)] = 0;
+  ASSERT_TRUE(dir.Write("broken.kxw", broken));
+  EXPECT_FALSE(ParseWorld(dir.path() + "/broken.kxw")) << "Accepted a world without outer walls";
+
+  // 6 bytes per cell of this world wrap around to 12 more bytes than the
+  // snapshot has cells for, which the name makes up for.
+  karel::WorldSnapshotHeader header;
+  memcpy(&header, snapshot.data(), sizeof(header));
+  header.width = 4294836226;
+  header.height = 2147549185;
+  header.name_size += 60;
+  std::string overflowing = snapshot;
+  memcpy(overflowing.data(), &header, sizeof(header));
+  ASSERT_TRUE(dir.Write("overflowing.kxw", overflowing));
+  EXPECT_FALSE(ParseWorld(dir.path() + "/overflowing.kxw")) << "Accepted a world larger than its snapshot";
+}
+
+#if defined(KAREL_AOT)
+// Whether the compiler that NativeProgram runs, $CXX or c++, can be found.
+bool HasCompiler() {
+  const char* compiler = getenv("CXX");
+  if (!compiler || !*compiler)
+    compiler = "c++";
+  if (strchr(compiler, '/'))
+    return access(compiler, X_OK) == 0;
+  const char* path = getenv("PATH");
+  std::string_view dirs(path ? path : "/usr/local/bin:/usr/bin:/bin");
+  while (true) {
+    const size_t colon = dirs.find(':');
+    const std::string dir(dirs.substr(0, colon));
+    if (access(((dir.empty() ? "." : dir) + "/" + compiler).c_str(), X_OK) == 0)
+      return true;
+    if (colon == std::string_view::npos)
+      return false;
+    dirs.remove_prefix(colon + 1);
+  }
+}
+
+TEST_F(TestKarel, AOT_MATCHES_INTERPRETER) {
+  if (!HasCompiler())
+    GTEST_SKIP() << "No C++ compiler to build the program with";
+  std::vector<karel::Instruction> program = {
+    {karel::Opcode::LOAD, 3},//0
+    {karel::Opcode::LOAD, 1},//1
+    {karel::Opcode::CALL, 4},//2
+    {karel::Opcode::HALT},//3
+    {karel::Opcode::PARAM, 0},//4
+    {karel::Opcode::DUP},//5
+    {karel::Opcode::JZ, 5},//6
+    {karel::Opcode::DEC, 1},//7
+    {karel::Opcode::LOAD, 1},//8
+    {karel::Opcode::CALL, 4},//9
+    {karel::Opcode::LEFT},//10
+    {karel::Opcode::LEAVEBUZZER},//11
+    {karel::Opcode::RET},//12
+  };
+  runtime->bag = karel::kInfinity;
+  ScopedTempDir cache_dir;
+  ASSERT_FALSE(cache_dir.path().empty()) << "Failed to create the cache directory";
+  auto native_program = karel::NativeProgram::Load(program, cache_dir.path());
+  ASSERT_TRUE(native_program) << "Failed to compile the program";
+  auto result = native_program->Run(runtime);
+  EXPECT_EQ(result, karel::RunResult::OK) << "Run did not end in OK status";
+  EXPECT_EQ(runtime->orientation, 2) << "Wrong orientation";
+  EXPECT_EQ(runtime->buzzers[0], 3) << "Wrong number of buzzers";
+  EXPECT_EQ(runtime->stack_memory, 0) << "Stack memory was not released";
+  auto cached_program = karel::NativeProgram::Load(program, cache_dir.path());
+  ASSERT_TRUE(cached_program) << "Failed to load the cached program";
+
+  // Stacks that are shared between runs, and outlive the program.
+  karel::NativeStacks stacks;
+  for (int run = 0; run < 2; ++run) {
+    EXPECT_EQ(cached_program->Run(runtime, &stacks), karel::RunResult::OK) << "Run " << run << " did not end in OK status";
+    EXPECT_EQ(runtime->stack_memory, 0) << "Stack memory was not released in run " << run;
+  }
+  EXPECT_EQ(runtime->buzzers[0], 9) << "Wrong number of buzzers";
+  cached_program.reset();
+}
+#endif
@@ -1,8 +1,15 @@
 #include "util.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <utility>
 
@@ -48,6 +55,18 @@ ScopedMmap::~ScopedMmap() {
   reset();
 }
 
+ScopedMmap::ScopedMmap(ScopedMmap&& mmap) : ptr_(MAP_FAILED), size_(0) {
+  std::swap(ptr_, mmap.ptr_);
+  std::swap(size_, mmap.size_);
+}
+
+ScopedMmap& ScopedMmap::operator=(ScopedMmap&& mmap) {
+  reset();
+  std::swap(ptr_, mmap.ptr_);
+  std::swap(size_, mmap.size_);
+  return *this;
+}
+
 void* ScopedMmap::get() {
   return ptr_;
 }
@@ -76,6 +95,21 @@ std::string StringPrintf(const char* format, ...) {
   return std::string(path, ret);
 }
 
+void AppendJsonString(std::string* json, std::string_view str) {
+  json->push_back('"');
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      json->push_back('\\');
+      json->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      json->append(StringPrintf("\\u%04x", c));
+    } else {
+      json->push_back(c);
+    }
+  }
+  json->push_back('"');
+}
+
 bool WriteFileDescriptor(int fd, std::string_view str) {
   const char* ptr = str.data();
   size_t remaining = str.size();
@@ -89,13 +123,114 @@ bool WriteFileDescriptor(int fd, std::string_view str) {
   return remaining == 0;
 }
 
+bool WriteFileDescriptor(int fd, std::string_view first, std::string_view second) {
+  struct iovec iov[2] = {
+      {const_cast<char*>(first.data()), first.size()},
+      {const_cast<char*>(second.data()), second.size()},
+  };
+  const ssize_t bytes_written = writev(fd, iov, 2);
+  if (bytes_written < 0)
+    return false;
+  // Whatever did not fit goes out with plain writes.
+  const size_t written = bytes_written;
+  if (written < first.size()) {
+    return WriteFileDescriptor(fd, first.substr(written)) &&
+           WriteFileDescriptor(fd, second);
+  }
+  return WriteFileDescriptor(fd, second.substr(written - first.size()));
+}
+
+std::vector<uint8_t> ReadFully(int fd) {
+  constexpr size_t kChunkSize = 4096;
+  std::vector<std::unique_ptr<uint8_t[]>> chunks;
+  size_t total_bytes = 0;
+  while (true) {
+    chunks.emplace_back(std::make_unique<uint8_t[]>(kChunkSize));
+    ssize_t bytes_read = read(fd, chunks.back().get(), kChunkSize);
+    if (bytes_read == -1) {
+      PLOG(ERROR) << "Failed to read file";
+      return {};
+    }
+    if (bytes_read == 0)
+      break;
+    total_bytes += bytes_read;
+  }
+  std::vector<uint8_t> result(total_bytes + 1);
+  uint8_t* ptr = result.data();
+  for (const auto& chunk : chunks) {
+    size_t chunk_bytes = std::min(kChunkSize, total_bytes);
+    memcpy(ptr, chunk.get(), chunk_bytes);
+    total_bytes -= chunk_bytes;
+    ptr += chunk_bytes;
+  }
+  result.pop_back();
+  return result;
+}
+
+bool MakeDirectories(const std::string& path) {
+  for (size_t pos = path.find('/', 1);; pos = path.find('/', pos + 1)) {
+    std::string prefix = path.substr(0, pos);
+    if (mkdir(prefix.c_str(), 0755) == -1 && errno != EEXIST) {
+      PLOG(ERROR) << "Failed to create " << prefix;
+      return false;
+    }
+    if (pos == std::string::npos)
+      return true;
+  }
+}
+
+bool WriteFileAtomically(const std::string& path, std::string_view contents) {
+  std::string temp_path = path + ".XXXXXX";
+  {
+    ScopedFD fd(mkstemp(&temp_path[0]));
+    if (!fd) {
+      PLOG(DEBUG) << "Failed to create " << temp_path;
+      return false;
+    }
+    // mkstemp() only lets the owner read the file.
+    if (fchmod(fd.get(), 0644) == -1 ||
+        !WriteFileDescriptor(fd.get(), contents)) {
+      PLOG(DEBUG) << "Failed to write " << temp_path;
+      unlink(temp_path.c_str());
+      return false;
+    }
+  }
+  if (rename(temp_path.c_str(), path.c_str()) == -1) {
+    PLOG(DEBUG) << "Failed to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+ScopedMmap MapFile(int fd, bool copy_on_write) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return ScopedMmap();
+  void* ptr = mmap(nullptr, st.st_size,
+                   copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_PRIVATE, fd, 0);
+  if (ptr == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map file";
+    return ScopedMmap();
+  }
+  return ScopedMmap(ptr, st.st_size);
+}
+
+uint64_t Fingerprint(std::string_view data, uint64_t seed) {
+  uint64_t hash = seed;
+  for (char c : data) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
 template <>
 std::optional<uint32_t> ParseString(std::string_view str) {
+  if (auto value = ParseDecimal<uint32_t>(str))
+    return value;
   if (str == "INFINITO")
     return karel::kInfinity;
-  uint32_t value;
-  std::istringstream is{std::string(str)};
-  if (!is || !(is >> value))
-    return std::nullopt;
-  return value;
+  return ParseStringWithStream<uint32_t>(str);
 }
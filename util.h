@@ -3,11 +3,15 @@
 
 #include <sys/mman.h>
 
+#include <charconv>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <vector>
 
 #include "macros.h"
 
@@ -35,10 +39,13 @@ class ScopedMmap {
  public:
   ScopedMmap(void* ptr = MAP_FAILED, size_t size = 0);
   ~ScopedMmap();
+  ScopedMmap(ScopedMmap&& mmap);
+  ScopedMmap& operator=(ScopedMmap&& mmap);
 
   operator bool() const { return ptr_ != MAP_FAILED; }
   void* get();
   const void* get() const;
+  size_t size() const { return size_; }
   void reset(void* ptr = MAP_FAILED, size_t size = 0);
 
  private:
@@ -50,10 +57,53 @@ class ScopedMmap {
 
 std::string StringPrintf(const char* format, ...);
 
+// Appends |str| to |json| as a quoted and escaped JSON string.
+void AppendJsonString(std::string* json, std::string_view str);
+
 bool WriteFileDescriptor(int fd, std::string_view str);
 
+// Writes all of |first| followed by all of |second| to |fd|, with a single
+// writev() when the descriptor takes everything at once.
+bool WriteFileDescriptor(int fd, std::string_view first, std::string_view second);
+
+std::vector<uint8_t> ReadFully(int fd);
+
+// Creates |path| and any missing parents, like mkdir -p.
+bool MakeDirectories(const std::string& path);
+
+// Writes |contents| into |path| through a temporary file in the same
+// directory that is then renamed into place, so that readers never see a
+// partially written file, even with many concurrent writers. Failures are
+// only logged at DEBUG: the callers are caches, which do fine without the
+// file, and their output must not change when it cannot be written.
+bool WriteFileAtomically(const std::string& path, std::string_view contents);
+
+// Maps the whole file behind |fd| read-only, or copy-on-write if
+// |copy_on_write| is set: the pages can then be written, and the changes are
+// only seen by this process. Fails for empty files and for descriptors that
+// cannot be mapped, like pipes.
+ScopedMmap MapFile(int fd, bool copy_on_write = false);
+
+// 64-bit FNV-1a hash of |data|. Suitable for cache keys, not for security.
+uint64_t Fingerprint(std::string_view data, uint64_t seed = 0xcbf29ce484222325);
+
+// Parses |str| as a plain decimal integer: digits only, plus a leading '-'
+// for signed types. This is what virtually every number in the inputs looks
+// like, and it needs neither a copy nor a stream.
 template <typename T>
-std::optional<T> ParseString(std::string_view str) {
+std::optional<T> ParseDecimal(std::string_view str) {
+  T value;
+  const char* const end = str.data() + str.size();
+  auto result = std::from_chars(str.data(), end, value);
+  if (result.ec != std::errc() || result.ptr != end)
+    return std::nullopt;
+  return value;
+}
+
+// Parses |str| with operator>>, which also takes whitespace, signs and
+// trailing garbage.
+template <typename T>
+std::optional<T> ParseStringWithStream(std::string_view str) {
   T value;
   std::istringstream is{std::string(str)};
   if (!is || !(is >> value))
@@ -61,6 +111,15 @@ std::optional<T> ParseString(std::string_view str) {
   return value;
 }
 
+template <typename T>
+std::optional<T> ParseString(std::string_view str) {
+  if constexpr (std::is_integral<T>::value && !std::is_same<T, bool>::value) {
+    if (auto value = ParseDecimal<T>(str))
+      return value;
+  }
+  return ParseStringWithStream<T>(str);
+}
+
 template <>
 std::optional<uint32_t> ParseString(std::string_view str);
 
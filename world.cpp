@@ -3,7 +3,11 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <charconv>
+#include <cinttypes>
+#include <iterator>
 #include <memory>
+#include <numeric>
 #include <optional>
 #include <string_view>
 #include <utility>
@@ -15,7 +19,75 @@
 #include "util.h"
 
 namespace karel {
-    
+
+namespace {
+
+constexpr char kWorldSnapshotMagic[4] = {'K', 'X', 'W', '\0'};
+
+// Bump whenever the layout changes, or the way XML worlds are read, since
+// cached snapshots are keyed by the XML they came from.
+constexpr uint32_t kWorldSnapshotVersion = 1;
+
+// Worlds with at least this many cells are read into the SPARSE layout when
+// the layout is picked automatically, and kept there as long as no more than
+// one in kSparseMaxDensity cells has buzzers, inner walls or is dumped. A
+// cell there takes a few dozen bytes instead of the six of FLAT.
+constexpr size_t kSparseMinCells = size_t{1} << 22;
+constexpr size_t kSparseMaxDensity = 64;
+
+// The cells with buzzers, and those that a run changes, are only indexed
+// while no more than one in kMaxIndexedDensity cells is among them. Past
+// that, scanning the whole world is about as fast as going through them.
+constexpr size_t kMaxIndexedDensity = 16;
+
+static_assert(sizeof(WorldSnapshotHeader) % alignof(uint32_t) == 0,
+              "The buzzers must stay aligned after the header");
+
+// Returns the path of the .kxw file that caches the XML world in |document|
+// inside |cache_dir|.
+std::string SnapshotCachePath(const std::string& cache_dir,
+                              std::string_view document) {
+  const uint64_t key = Fingerprint(
+      document,
+      Fingerprint(StringPrintf("kxw %" PRIu32, kWorldSnapshotVersion)));
+  return StringPrintf("%s/%016" PRIx64 ".kxw", cache_dir.c_str(), key);
+}
+
+// Sorts the |keys| of cells, y * width + x, by x and then by y, the order in
+// which World::Dump() writes them.
+std::vector<uint64_t> SortColumnMajor(std::vector<uint64_t> keys,
+                                      size_t width) {
+  std::sort(keys.begin(), keys.end(), [width](uint64_t a, uint64_t b) {
+    return std::make_pair(a % width, a / width) <
+           std::make_pair(b % width, b / width);
+  });
+  return keys;
+}
+
+// Reorders |cells|, which are in row-major order, into the column-major
+// order of World::Dump(). |key| gives the y * width + x of a cell. This is a
+// counting sort on x, so each column stays sorted by y.
+template <typename T, typename Key>
+std::vector<T> RowMajorToColumnMajor(const std::vector<T>& cells,
+                                     size_t width,
+                                     Key key) {
+  std::vector<size_t> offsets(width + 1);
+  for (const T& cell : cells)
+    ++offsets[key(cell) % width + 1];
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  std::vector<T> sorted(cells.size());
+  for (const T& cell : cells)
+    sorted[offsets[key(cell) % width]++] = cell;
+  return sorted;
+}
+
+// Appends |value| in decimal to |str|.
+void AppendNumber(std::string* str, uint64_t value) {
+  char digits[20];
+  str->append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+}  // namespace
 
 World::World(World&& other)
       : width_(other.width_),
@@ -23,9 +95,21 @@ World::World(World&& other)
         name_(std::move(other.name_)),
         program_name_(std::move(other.program_name_)),
         target_version(std::move(other.target_version)),
-        buzzers_(std::move(other.buzzers_)),
-        walls_(std::move(other.walls_)),
-        buzzer_dump_(std::move(other.buzzer_dump_)),
+        layout_(other.layout_),
+        automatic_layout_(other.automatic_layout_),
+        buzzers_(other.buzzers_),
+        walls_(other.walls_),
+        buzzer_dump_(other.buzzer_dump_),
+        buzzers_storage_(std::move(other.buzzers_storage_)),
+        walls_storage_(std::move(other.walls_storage_)),
+        buzzer_dump_storage_(std::move(other.buzzer_dump_storage_)),
+        snapshot_(std::move(other.snapshot_)),
+        grid_(std::move(other.grid_)),
+        dump_bits_(std::move(other.dump_bits_)),
+        dump_index_(std::move(other.dump_index_)),
+        initial_buzzers_(std::move(other.initial_buzzers_)),
+        buzzers_indexed_(other.buzzers_indexed_),
+        dirty_(std::move(other.dirty_)),
         dump_world_(other.dump_world_),
         dump_universe_(other.dump_universe_),
         dump_position_(other.dump_position_),
@@ -36,275 +120,466 @@ World::World(World&& other)
         dump_leavebuzzer_(other.dump_leavebuzzer_),
         dump_pickbuzzer_(other.dump_pickbuzzer_) {
     runtime_ = other.runtime_;
-    runtime_.buzzers = buzzers_.get();
-    runtime_.walls = walls_.get();
+    runtime_.buzzers = buzzers_;
+    runtime_.walls = walls_;
+    runtime_.grid = grid_.get();
+    runtime_.dirty = dirty_.get();
 }
 
 size_t World::coordinates(size_t x, size_t y) const { return y * width_ + x; }
 
 void World::set_buzzers(size_t x, size_t y, uint32_t count) {
-    buzzers_[coordinates(x, y)] = count;
+    if (dirty_)
+      dirty_->Mark(x, y);
+    VisitCells(runtime_,
+               [=](auto cells) { cells.set_buzzers(x, y, count); });
 }
 
 uint32_t World::get_buzzers(size_t x, size_t y) const {
-    return buzzers_[coordinates(x, y)];
+    return VisitCells(runtime_,
+                      [=](auto cells) { return cells.buzzers(x, y); });
 }
 
 uint8_t World::get_walls(size_t x, size_t y) const {
-    return walls_[coordinates(x, y)];
+    return VisitCells(runtime_, [=](auto cells) { return cells.walls(x, y); });
 }
 
-std::optional<World> World::Parse(int fd) {
-    World world;
-    if (!xml::Reader().Parse(fd, [&world](xml::Reader::Element node) -> bool {
-          const std::string_view name = node.GetName();
-          if (name == "ejecucion") {
-              auto version = node.GetAttribute("version");
-              world.target_version = std::string(version.value_or("1.0"));
-          } else if (name == "mundo") {
-            auto width = ParseString<uint32_t>(node.GetAttribute("ancho")),
-                 height = ParseString<uint32_t>(node.GetAttribute("alto"));
-            if (!width || !height)
-              return false;
-
-            world.Init(width.value(), height.value(),
-                       node.GetAttribute("nombre").value_or("mundo_0"));
-          } else if (name == "condiciones") {
-            auto instruction_limit = ParseString<size_t>(
-                     node.GetAttribute("instruccionesMaximasAEjecutar")),
-                 stack_limit =
-                     ParseString<size_t>(node.GetAttribute("longitudStack")),
-                 call_param_limit = 
-                     ParseString<size_t>(node.GetAttribute("llamadaMaxima")),
-                 stack_memory_limit = 
-                     ParseString<size_t>(node.GetAttribute("memoriaStack"));
-            if (instruction_limit)
-              world.runtime_.instruction_limit = instruction_limit.value();
-            if (stack_limit)
-              world.runtime_.stack_limit = stack_limit.value();
-            if (call_param_limit)
-              world.runtime_.call_param_limit = call_param_limit.value();
-            if (stack_memory_limit)
-              world.runtime_.stack_memory_limit = stack_memory_limit.value();
-          } else if (name == "comando") {
-            auto nombre = node.GetAttribute("nombre");
-            auto maximoNumeroDeEjecuciones = ParseString<size_t>(
-                node.GetAttribute("maximoNumeroDeEjecuciones"));
-            if (!maximoNumeroDeEjecuciones)
-              return false;
-            if (nombre.value() == "AVANZA")
-              world.runtime_.forward_limit = maximoNumeroDeEjecuciones.value();
-            else if (nombre.value() == "GIRA_IZQUIERDA")
-              world.runtime_.left_limit = maximoNumeroDeEjecuciones.value();
-            else if (nombre.value() == "COGE_ZUMBADOR")
-              world.runtime_.pickbuzzer_limit =
-                  maximoNumeroDeEjecuciones.value();
-            else if (nombre.value() == "DEJA_ZUMBADOR")
-              world.runtime_.leavebuzzer_limit =
-                  maximoNumeroDeEjecuciones.value();
-            else {
-              LOG(ERROR) << "Invalid limit name " << nombre.value();
-              return false;
-            }
-          } else if (name == "monton") {
-            auto x = ParseString<size_t>(node.GetAttribute("x")),
-                 y = ParseString<size_t>(node.GetAttribute("y"));
-            auto count = ParseString<uint32_t>(node.GetAttribute("zumbadores"));
-            if (!x || !y || !count)
-              return false;
-            (*x)--;
-            (*y)--;
-            if (x.value() >= world.width_ || y.value() >= world.height_)
-              return true;
-            world.set_buzzers(*x, *y, *count);
-          } else if (name == "pared") {
-            auto x1 = ParseString<size_t>(node.GetAttribute("x1", false)),
-                 y1 = ParseString<size_t>(node.GetAttribute("y1", false)),
-                 x2 = ParseString<size_t>(node.GetAttribute("x2", false)),
-                 y2 = ParseString<size_t>(node.GetAttribute("y2", false));
-            if (x1 && x2 && y1 && !y2) {
-              // Horizontal
-              size_t x = std::min(*x1, *x2);
-              size_t y = *y1;
-              if (x >= world.width_ || y >= world.height_)
-                return true;
-              world.walls_[world.coordinates(x, y)] |= 1 << 3;
-              if (y)
-                world.walls_[world.coordinates(x, y - 1)] |= 1 << 1;
-            } else if (y1 && y2 && x1 && !x2) {
-              // Vertical
-              size_t x = *x1;
-              size_t y = std::min(*y1, *y2);
-              if (x >= world.width_ || y >= world.height_)
-                return true;
-              world.walls_[world.coordinates(x, y)] |= 1 << 0;
-              if (x)
-                world.walls_[world.coordinates(x - 1, y)] |= 1 << 2;
-            } else {
-              LOG(ERROR) << "Invalid pared";
-              return false;
-            }
-          } else if (name == "posicionDump") {
-            auto x = ParseString<size_t>(node.GetAttribute("x")),
-                 y = ParseString<size_t>(node.GetAttribute("y"));
-            if (!x || !y)
-              return false;
-            (*x)--;
-            (*y)--;
-            if (x.value() >= world.width_ || y.value() >= world.height_)
-              return true;
-            world.buzzer_dump_[world.coordinates(x.value(), y.value())] = true;
-          } else if (name == "programa") {
-            auto karel_x = ParseString<size_t>(node.GetAttribute("xKarel")),
-                 karel_y = ParseString<size_t>(node.GetAttribute("yKarel"));
-            auto direccion_karel = node.GetAttribute("direccionKarel");
-            auto karel_bag =
-                ParseString<uint32_t>(node.GetAttribute("mochilaKarel"));
-            auto nombre = node.GetAttribute("nombre");
-            if (karel_x)
-              world.runtime_.x = karel_x.value() - 1;
-            if (karel_y)
-              world.runtime_.y = karel_y.value() - 1;
-            if (karel_bag)
-              world.runtime_.bag = karel_bag.value();
-            if (nombre)
-              world.program_name_ = std::string(nombre.value());
-            if (direccion_karel) {
-              if (direccion_karel.value() == "OESTE")
-                world.runtime_.orientation = 0;
-              else if (direccion_karel.value() == "NORTE")
-                world.runtime_.orientation = 1;
-              else if (direccion_karel.value() == "ESTE")
-                world.runtime_.orientation = 2;
-              else if (direccion_karel.value() == "SUR")
-                world.runtime_.orientation = 3;
-              else {
-                LOG(ERROR) << "Invalid orientation " << direccion_karel.value();
-                return false;
-              }
-            }
-          } else if (name == "despliega") {
-            auto tipo = node.GetAttribute("tipo");
-            if (!tipo) {
-              LOG(ERROR) << "Invalid despliega";
-              return false;
-            }
-            if (*tipo == "MUNDO") {
-              world.dump_world_ = true;
-            } else if (*tipo == "UNIVERSO") {
-              world.dump_universe_ = true;
-            } else if (*tipo == "ORIENTACION") {
-              world.dump_orientation_ = true;
-            } else if (*tipo == "POSICION") {
-              world.dump_position_ = true;
-            } else if (*tipo == "MOCHILA") {
-              world.dump_bag_ = true;
-            } else if (*tipo == "AVANZA") {
-              world.dump_forward_ = true;
-            } else if (*tipo == "GIRA_IZQUIERDA") {
-              world.dump_left_ = true;
-            } else if (*tipo == "DEJA_ZUMBADOR") {
-              world.dump_leavebuzzer_ = true;
-            } else if (*tipo == "COGE_ZUMBADOR") {
-              world.dump_pickbuzzer_ = true;
-            } else {
-              LOG(ERROR) << "Invalid dump type " << *tipo;
-              return false;
-            }
+void World::add_walls(size_t x, size_t y, uint8_t walls) {
+    VisitCells(runtime_, [=](auto cells) {
+      cells.set_walls(x, y, cells.walls(x, y) | walls);
+    });
+}
+
+const SparseGrid* World::sparse_grid() const {
+    if (!grid_ || grid_->layout != WorldLayout::SPARSE)
+      return nullptr;
+    return static_cast<const SparseGrid*>(grid_.get());
+}
+
+void World::set_dumped(size_t x, size_t y) {
+    const size_t i = coordinates(x, y);
+    if (buzzer_dump_)
+      buzzer_dump_[i] = true;
+    else if (!dump_bits_.empty())
+      dump_bits_[i >> 6] |= uint64_t{1} << (i & 63);
+    else
+      dump_index_.push_back(i);
+}
+
+void World::TrackDirtyCells() {
+    if (!dump_universe_ || !buzzers_indexed_ || layout_ == WorldLayout::SPARSE)
+      return;
+    std::sort(initial_buzzers_.begin(), initial_buzzers_.end());
+    initial_buzzers_.erase(
+        std::unique(initial_buzzers_.begin(), initial_buzzers_.end()),
+        initial_buzzers_.end());
+    dirty_ = std::make_unique<karel::DirtyCells>(
+        width_, height_, width_ * height_ / kMaxIndexedDensity);
+    runtime_.dirty = dirty_.get();
+}
+
+void World::IndexDumpedCells() {
+    if (buzzer_dump_) {
+      dump_index_.clear();
+      for (size_t i = 0; i < width_ * height_; ++i) {
+        if (buzzer_dump_[i])
+          dump_index_.push_back(i);
+      }
+    } else if (!dump_bits_.empty()) {
+      dump_index_.clear();
+      for (size_t word = 0; word < dump_bits_.size(); ++word) {
+        for (uint64_t bits = dump_bits_[word]; bits; bits &= bits - 1)
+          dump_index_.push_back(word * 64 + __builtin_ctzll(bits));
+      }
+    } else {
+      std::sort(dump_index_.begin(), dump_index_.end());
+      dump_index_.erase(std::unique(dump_index_.begin(), dump_index_.end()),
+                        dump_index_.end());
+    }
+}
+
+std::optional<World> World::Parse(int fd, const WorldOptions& options) {
+    // Regular files are mapped and go through the scanner, which takes
+    // virtually every world. Whatever it does not take, and pipes, go
+    // through expat.
+    ScopedMmap mapping = MapFile(fd, /*copy_on_write=*/true);
+    std::string_view document;
+    std::string cache_path;
+    if (mapping) {
+      document = std::string_view(static_cast<const char*>(mapping.get()),
+                                  mapping.size());
+      if (IsSnapshot(document)) {
+        auto snapshot = LoadSnapshot(std::move(mapping));
+        if (snapshot)
+          snapshot->SetLayout(options.layout.value_or(WorldLayout::FLAT));
+        return snapshot;
+      } else if (!options.cache_dir.empty()) {
+        cache_path = SnapshotCachePath(options.cache_dir, document);
+        ScopedFD cache_fd(open(cache_path.c_str(), O_RDONLY));
+        if (cache_fd) {
+          if (auto cached = LoadSnapshot(
+                  MapFile(cache_fd.get(), /*copy_on_write=*/true))) {
+            cached->SetLayout(options.layout.value_or(WorldLayout::FLAT));
+            return cached;
           }
+        }
+      }
+    }
+
+    // An element that is rejected is logged and skipped, and the ones after
+    // it still apply. Only worlds that were read without any complaint are
+    // cached, so that later runs log exactly the same.
+    bool clean = true;
+    auto callback = [&clean](World* world) {
+      return [world, &clean](const auto& node) {
+        if (!world->ParseElement(node))
+          clean = false;
+        return true;
+      };
+    };
+    std::optional<World> world;
+    if (mapping) {
+      World scanned;
+      scanned.layout_ = options.layout.value_or(WorldLayout::FLAT);
+      scanned.automatic_layout_ = !options.layout;
+      if (xml::Scanner::Scan(document, callback(&scanned)))
+        world.emplace(std::move(scanned));
+      else
+        LOG(DEBUG) << "The world needs the full XML parser";
+    }
+    if (!world) {
+      clean = true;
+      World parsed;
+      parsed.layout_ = options.layout.value_or(WorldLayout::FLAT);
+      parsed.automatic_layout_ = !options.layout;
+      xml::Reader reader(options.read_buffer_size);
+      if (!(mapping ? reader.Parse(document, callback(&parsed))
+                    : reader.Parse(fd, callback(&parsed)))) {
+        return std::nullopt;
+      }
+      clean = clean && !reader.failed();
+      world.emplace(std::move(parsed));
+    }
+
+    world->IndexDumpedCells();
+    if (world->automatic_layout_)
+      world->SetLayout(world->AutomaticLayout());
+    world->TrackDirtyCells();
+
+    // A cache that cannot be written only costs the next run some time.
+    // SPARSE worlds are not cached: their snapshot would be much larger
+    // than the XML.
+    if (!cache_path.empty() && clean && world->width_ &&
+        world->layout_ != WorldLayout::SPARSE &&
+        MakeDirectories(options.cache_dir)) {
+      WriteFileAtomically(cache_path, world->SerializeSnapshot());
+    }
+    return world;
+  }
+
+  template <typename Element>
+  bool World::ParseElement(const Element& node) {
+    const std::string_view name = node.GetName();
+    if (name == "ejecucion") {
+        auto version = node.GetAttribute("version");
+        target_version = std::string(version.value_or("1.0"));
+    } else if (name == "mundo") {
+      auto [ancho, alto, nombre] =
+          node.GetAttributes({"ancho", "alto", "nombre"});
+      auto width = ParseString<uint32_t>(ancho),
+           height = ParseString<uint32_t>(alto);
+      if (!width || !height)
+        return false;
 
+      Init(width.value(), height.value(), nombre.value_or("mundo_0"));
+    } else if (name == "condiciones") {
+      auto [instrucciones, longitud, llamada, memoria] =
+          node.GetAttributes({"instruccionesMaximasAEjecutar",
+                              "longitudStack", "llamadaMaxima",
+                              "memoriaStack"});
+      auto instruction_limit = ParseString<size_t>(instrucciones),
+           stack_limit = ParseString<size_t>(longitud),
+           call_param_limit = ParseString<size_t>(llamada),
+           stack_memory_limit = ParseString<size_t>(memoria);
+      if (instruction_limit)
+        runtime_.instruction_limit = instruction_limit.value();
+      if (stack_limit)
+        runtime_.stack_limit = stack_limit.value();
+      if (call_param_limit)
+        runtime_.call_param_limit = call_param_limit.value();
+      if (stack_memory_limit)
+        runtime_.stack_memory_limit = stack_memory_limit.value();
+    } else if (name == "comando") {
+      auto [nombre, maximo] =
+          node.GetAttributes({"nombre", "maximoNumeroDeEjecuciones"});
+      auto maximoNumeroDeEjecuciones = ParseString<size_t>(maximo);
+      if (!maximoNumeroDeEjecuciones)
+        return false;
+      if (nombre.value() == "AVANZA")
+        runtime_.forward_limit = maximoNumeroDeEjecuciones.value();
+      else if (nombre.value() == "GIRA_IZQUIERDA")
+        runtime_.left_limit = maximoNumeroDeEjecuciones.value();
+      else if (nombre.value() == "COGE_ZUMBADOR")
+        runtime_.pickbuzzer_limit = maximoNumeroDeEjecuciones.value();
+      else if (nombre.value() == "DEJA_ZUMBADOR")
+        runtime_.leavebuzzer_limit = maximoNumeroDeEjecuciones.value();
+      else {
+        LOG(ERROR) << "Invalid limit name " << nombre.value();
+        return false;
+      }
+    } else if (name == "monton") {
+      auto [x_attribute, y_attribute, zumbadores] =
+          node.GetAttributes({"x", "y", "zumbadores"});
+      auto x = ParseString<size_t>(x_attribute),
+           y = ParseString<size_t>(y_attribute);
+      auto count = ParseString<uint32_t>(zumbadores);
+      if (!x || !y || !count)
+        return false;
+      (*x)--;
+      (*y)--;
+      if (x.value() >= width_ || y.value() >= height_)
+        return true;
+      set_buzzers(*x, *y, *count);
+      if (buzzers_indexed_ && *count) {
+        initial_buzzers_.push_back(coordinates(*x, *y));
+        if (initial_buzzers_.size() * kMaxIndexedDensity > width_ * height_) {
+          buzzers_indexed_ = false;
+          initial_buzzers_ = std::vector<size_t>();
+        }
+      }
+    } else if (name == "pared") {
+      auto [x1_attribute, y1_attribute, x2_attribute, y2_attribute] =
+          node.GetAttributes({"x1", "y1", "x2", "y2"});
+      auto x1 = ParseString<size_t>(x1_attribute),
+           y1 = ParseString<size_t>(y1_attribute),
+           x2 = ParseString<size_t>(x2_attribute),
+           y2 = ParseString<size_t>(y2_attribute);
+      if (x1 && x2 && y1 && !y2) {
+        // Horizontal
+        size_t x = std::min(*x1, *x2);
+        size_t y = *y1;
+        if (x >= width_ || y >= height_)
           return true;
-        })) {
-      return std::nullopt;
+        add_walls(x, y, 1 << 3);
+        if (y)
+          add_walls(x, y - 1, 1 << 1);
+      } else if (y1 && y2 && x1 && !x2) {
+        // Vertical
+        size_t x = *x1;
+        size_t y = std::min(*y1, *y2);
+        if (x >= width_ || y >= height_)
+          return true;
+        add_walls(x, y, 1 << 0);
+        if (x)
+          add_walls(x - 1, y, 1 << 2);
+      } else {
+        LOG(ERROR) << "Invalid pared";
+        return false;
+      }
+    } else if (name == "posicionDump") {
+      auto [x_attribute, y_attribute] = node.GetAttributes({"x", "y"});
+      auto x = ParseString<size_t>(x_attribute),
+           y = ParseString<size_t>(y_attribute);
+      if (!x || !y)
+        return false;
+      (*x)--;
+      (*y)--;
+      if (x.value() >= width_ || y.value() >= height_)
+        return true;
+      set_dumped(x.value(), y.value());
+    } else if (name == "programa") {
+      auto [x_karel, y_karel, direccion_karel, mochila_karel, nombre] =
+          node.GetAttributes({"xKarel", "yKarel", "direccionKarel",
+                              "mochilaKarel", "nombre"});
+      auto karel_x = ParseString<size_t>(x_karel),
+           karel_y = ParseString<size_t>(y_karel);
+      auto karel_bag = ParseString<uint32_t>(mochila_karel);
+      if (karel_x)
+        runtime_.x = karel_x.value() - 1;
+      if (karel_y)
+        runtime_.y = karel_y.value() - 1;
+      if (karel_bag)
+        runtime_.bag = karel_bag.value();
+      if (nombre)
+        program_name_ = std::string(nombre.value());
+      if (direccion_karel) {
+        if (direccion_karel.value() == "OESTE")
+          runtime_.orientation = 0;
+        else if (direccion_karel.value() == "NORTE")
+          runtime_.orientation = 1;
+        else if (direccion_karel.value() == "ESTE")
+          runtime_.orientation = 2;
+        else if (direccion_karel.value() == "SUR")
+          runtime_.orientation = 3;
+        else {
+          LOG(ERROR) << "Invalid orientation " << direccion_karel.value();
+          return false;
+        }
+      }
+    } else if (name == "despliega") {
+      auto tipo = node.GetAttribute("tipo");
+      if (!tipo) {
+        LOG(ERROR) << "Invalid despliega";
+        return false;
+      }
+      if (*tipo == "MUNDO") {
+        dump_world_ = true;
+      } else if (*tipo == "UNIVERSO") {
+        dump_universe_ = true;
+      } else if (*tipo == "ORIENTACION") {
+        dump_orientation_ = true;
+      } else if (*tipo == "POSICION") {
+        dump_position_ = true;
+      } else if (*tipo == "MOCHILA") {
+        dump_bag_ = true;
+      } else if (*tipo == "AVANZA") {
+        dump_forward_ = true;
+      } else if (*tipo == "GIRA_IZQUIERDA") {
+        dump_left_ = true;
+      } else if (*tipo == "DEJA_ZUMBADOR") {
+        dump_leavebuzzer_ = true;
+      } else if (*tipo == "COGE_ZUMBADOR") {
+        dump_pickbuzzer_ = true;
+      } else {
+        LOG(ERROR) << "Invalid dump type " << *tipo;
+        return false;
+      }
     }
 
-    return std::make_optional<World>(std::move(world));
+    return true;
   }
 
   void World::Dump(int fd) const {
     xml::Writer writer(fd);
+    WriteWorld(&writer);
+  }
 
-    auto ejecucion = writer.CreateElement("ejecucion");
+  void World::Dump(xml::Sink* sink) const {
+    xml::Writer writer(sink);
+    WriteWorld(&writer);
+  }
+
+  void World::WriteWorld(xml::Writer* writer) const {
+    auto ejecucion = writer->CreateElement("ejecucion");
     {
       auto condiciones = ejecucion.CreateElement("condiciones");
-      condiciones.AddAttribute("instruccionesMaximasAEjecutar",
-                               StringPrintf("%zd", runtime_.instruction_limit));
+      condiciones.AddAttribute(
+          "instruccionesMaximasAEjecutar",
+          static_cast<ssize_t>(runtime_.instruction_limit));
       condiciones.AddAttribute("longitudStack",
-                               StringPrintf("%zd", runtime_.stack_limit));
+                               static_cast<ssize_t>(runtime_.stack_limit));
 
       if (runtime_.forward_limit != std::numeric_limits<size_t>::max()) {
         auto comando = condiciones.CreateElement("comando");
         comando.AddAttribute("nombre", "AVANZA");
         comando.AddAttribute("maximoNumeroDeEjecuciones",
-                             StringPrintf("%zu", runtime_.forward_limit));
+                             runtime_.forward_limit);
       }
       if (runtime_.left_limit != std::numeric_limits<size_t>::max()) {
         auto comando = condiciones.CreateElement("comando");
         comando.AddAttribute("nombre", "GIRA_IZQUIERDA");
         comando.AddAttribute("maximoNumeroDeEjecuciones",
-                             StringPrintf("%zu", runtime_.left_limit));
+                             runtime_.left_limit);
       }
       if (runtime_.pickbuzzer_limit != std::numeric_limits<size_t>::max()) {
         auto comando = condiciones.CreateElement("comando");
         comando.AddAttribute("nombre", "COGE_ZUMBADOR");
         comando.AddAttribute("maximoNumeroDeEjecuciones",
-                             StringPrintf("%zu", runtime_.pickbuzzer_limit));
+                             runtime_.pickbuzzer_limit);
       }
       if (runtime_.leavebuzzer_limit != std::numeric_limits<size_t>::max()) {
         auto comando = condiciones.CreateElement("comando");
         comando.AddAttribute("nombre", "DEJA_ZUMBADOR");
         comando.AddAttribute("maximoNumeroDeEjecuciones",
-                             StringPrintf("%zu", runtime_.leavebuzzer_limit));
+                             runtime_.leavebuzzer_limit);
       }
     }
     {
       auto mundos = ejecucion.CreateElement("mundos");
       auto mundo = mundos.CreateElement("mundo");
       mundo.AddAttribute("nombre", "mundo_0");
-      mundo.AddAttribute("ancho", StringPrintf("%zd", runtime_.width));
-      mundo.AddAttribute("alto", StringPrintf("%zd", runtime_.height));
+      mundo.AddAttribute("ancho", runtime_.width);
+      mundo.AddAttribute("alto", runtime_.height);
 
-      for (size_t x = 0; x < width_; ++x) {
-        for (size_t y = 0; y < height_; ++y) {
-          if (!runtime_.buzzers[coordinates(x, y)])
-            continue;
-          auto monton = mundo.CreateElement("monton");
-          monton.AddAttribute("x", StringPrintf("%zd", x + 1));
-          monton.AddAttribute("y", StringPrintf("%zd", y + 1));
-          if (runtime_.buzzers[coordinates(x, y)] == karel::kInfinity) {
-            monton.AddAttribute("zumbadores", "INFINITO");
-          } else {
-            monton.AddAttribute(
-                "zumbadores",
-                StringPrintf("%u", runtime_.buzzers[coordinates(x, y)]));
-          }
+      auto add_monton = [&mundo](size_t x, size_t y, uint32_t buzzers) {
+        auto monton = mundo.CreateElement("monton");
+        monton.AddAttribute("x", x + 1);
+        monton.AddAttribute("y", y + 1);
+        if (buzzers == karel::kInfinity) {
+          monton.AddAttribute("zumbadores", "INFINITO");
+        } else {
+          monton.AddAttribute("zumbadores", buzzers);
         }
-      }
+      };
+      auto add_paredes = [this, &mundo](size_t x, size_t y, uint8_t walls) {
+        if (y + 1 < height_ && walls & (1 << 1)) {
+          auto pared = mundo.CreateElement("pared");
+          pared.AddAttribute("x1", x);
+          pared.AddAttribute("y1", y + 1);
+          pared.AddAttribute("x2", x + 1);
+        }
+        if (x + 1 < width_ && walls & (1 << 2)) {
+          auto pared = mundo.CreateElement("pared");
+          pared.AddAttribute("x1", x + 1);
+          pared.AddAttribute("y1", y);
+          pared.AddAttribute("y2", y + 1);
+        }
+      };
+      auto add_posicion_dump = [&mundo](size_t x, size_t y) {
+        auto posicionDump = mundo.CreateElement("posicionDump");
+        posicionDump.AddAttribute("x", x + 1);
+        posicionDump.AddAttribute("y", y + 1);
+      };
 
-      for (size_t x = 0; x < width_; ++x) {
-        for (size_t y = 0; y < height_; ++y) {
-          if (y + 1 < height_ && walls_[coordinates(x, y)] & (1 << 1)) {
-            auto pared = mundo.CreateElement("pared");
-            pared.AddAttribute("x1", StringPrintf("%zu", x));
-            pared.AddAttribute("y1", StringPrintf("%zu", y + 1));
-            pared.AddAttribute("x2", StringPrintf("%zu", x + 1));
-          }
-          if (x + 1 < width_ && walls_[coordinates(x, y)] & (1 << 2)) {
-            auto pared = mundo.CreateElement("pared");
-            pared.AddAttribute("x1", StringPrintf("%zu", x + 1));
-            pared.AddAttribute("y1", StringPrintf("%zu", y));
-            pared.AddAttribute("y2", StringPrintf("%zu", y + 1));
+      if (const SparseGrid* sparse = sparse_grid()) {
+        // Only the populated cells, in the same order as the full scans.
+        std::vector<uint64_t> keys;
+        for (const auto& cell : sparse->buzzers())
+          keys.push_back(cell.first);
+        for (uint64_t key : SortColumnMajor(std::move(keys), width_)) {
+          add_monton(sparse->x(key), sparse->y(key),
+                     sparse->buzzers().at(key));
+        }
+        keys.clear();
+        for (const auto& cell : sparse->walls())
+          keys.push_back(cell.first);
+        for (uint64_t key : SortColumnMajor(std::move(keys), width_)) {
+          add_paredes(sparse->x(key), sparse->y(key),
+                      sparse->walls().at(key));
+        }
+        keys.assign(dump_index_.begin(), dump_index_.end());
+        for (uint64_t key : SortColumnMajor(std::move(keys), width_))
+          add_posicion_dump(sparse->x(key), sparse->y(key));
+      } else {
+        // A single row-major pass picks the cells with buzzers or inner
+        // walls, which then go out column by column.
+        std::vector<std::pair<size_t, uint32_t>> buzzer_cells;
+        std::vector<std::pair<size_t, uint8_t>> wall_cells;
+        VisitCells(runtime_, [&](auto cells) {
+          for (size_t y = 0; y < height_; ++y) {
+            for (size_t x = 0; x < width_; ++x) {
+              if (const uint32_t buzzers = cells.buzzers(x, y))
+                buzzer_cells.emplace_back(coordinates(x, y), buzzers);
+              const uint8_t walls = cells.walls(x, y);
+              if ((y + 1 < height_ && walls & (1 << 1)) ||
+                  (x + 1 < width_ && walls & (1 << 2))) {
+                wall_cells.emplace_back(coordinates(x, y), walls);
+              }
+            }
           }
+        });
+        auto cell_key = [](const auto& cell) { return cell.first; };
+        for (const auto& [i, buzzers] :
+             RowMajorToColumnMajor(buzzer_cells, width_, cell_key)) {
+          add_monton(i % width_, i / width_, buzzers);
         }
-      }
-
-      for (size_t x = 0; x < width_; ++x) {
-        for (size_t y = 0; y < height_; ++y) {
-          if (!buzzer_dump_[coordinates(x, y)])
-            continue;
-          auto posicionDump = mundo.CreateElement("posicionDump");
-          posicionDump.AddAttribute("x", StringPrintf("%zd", x + 1));
-          posicionDump.AddAttribute("y", StringPrintf("%zd", y + 1));
+        for (const auto& [i, walls] :
+             RowMajorToColumnMajor(wall_cells, width_, cell_key)) {
+          add_paredes(i % width_, i / width_, walls);
+        }
+        for (size_t i : RowMajorToColumnMajor(dump_index_, width_,
+                                              [](size_t i) { return i; })) {
+          add_posicion_dump(i % width_, i / width_);
         }
       }
     }
@@ -318,8 +593,8 @@ std::optional<World> World::Parse(int fd) {
       programa.AddAttribute("nombre", "p1");
       programa.AddAttribute("ruta", "{$2$}");
       programa.AddAttribute("mundoDeEjecucion", "mundo_0");
-      programa.AddAttribute("xKarel", StringPrintf("%zd", runtime_.x + 1));
-      programa.AddAttribute("yKarel", StringPrintf("%zd", runtime_.y + 1));
+      programa.AddAttribute("xKarel", runtime_.x + 1);
+      programa.AddAttribute("yKarel", runtime_.y + 1);
       switch (runtime_.orientation) {
         case 0:
           programa.AddAttribute("direccionKarel", "OESTE");
@@ -337,8 +612,7 @@ std::optional<World> World::Parse(int fd) {
       if (runtime_.bag == karel::kInfinity)
         programa.AddAttribute("mochilaKarel", "INFINITO");
       else
-        programa.AddAttribute("mochilaKarel",
-                              StringPrintf("%zu", runtime_.bag));
+        programa.AddAttribute("mochilaKarel", runtime_.bag);
 
       if (dump_world_) {
         auto despliega = programa.CreateElement("despliega");
@@ -382,154 +656,170 @@ std::optional<World> World::Parse(int fd) {
   void World::DumpResult(karel::RunResult result, int fd) const {
     {
       xml::Writer writer(fd);
+      WriteResult(result, &writer);
+    }
+    ignore_result(write(STDOUT_FILENO, "\n", 1));
+  }
 
-      auto resultados = writer.CreateElement("resultados");
-
-      if (dump_world_ || dump_universe_) {
-        auto mundos = resultados.CreateElement("mundos");
-        auto mundo = mundos.CreateElement("mundo");
-        mundo.AddAttribute("nombre", name_);
-        for (ssize_t y = static_cast<ssize_t>(height_) - 1; y >= 0; y--) {
-          bool printCoordinate = true;
-          std::ostringstream line;
-          for (size_t x = 0; x < width_; x++) {
-            if (!dump_universe_ && !buzzer_dump_[coordinates(x, y)])
-              continue;
-            if (get_buzzers(x, y) != 0) {
-              if (printCoordinate) {
-                line << '(' << (x + 1) << ") ";
-              }
-              uint32_t dump_buzzers= get_buzzers(x, y);
-              if (dump_buzzers == karel::kInfinity) {
-                dump_buzzers = 0xFFFF; // Handle infinite as 2^16-1
-              }
-              if (target_version == "1.0") {
-                dump_buzzers = dump_buzzers & 0xFFFF; //Version 1.0 has a 16-bit output precision on beepers
-              }
-              line << (dump_buzzers) << ' ';
-            }
-            printCoordinate = get_buzzers(x, y) == 0;
-          }
+  void World::DumpResult(karel::RunResult result, xml::Sink* sink) const {
+    xml::Writer writer(sink);
+    WriteResult(result, &writer);
+  }
 
-          if (line.tellp() == 0)
-            continue;
+  void World::WriteResult(karel::RunResult result,
+                          xml::Writer* writer) const {
+    auto resultados = writer->CreateElement("resultados");
 
-          auto linea =
-              mundo.CreateElement("linea", std::string_view(line.str()));
-          linea.AddAttribute("fila", StringPrintf("%zd", y + 1));
-          linea.AddAttribute("compresionDeCeros", "true");
+    if (dump_world_ || dump_universe_) {
+      auto mundos = resultados.CreateElement("mundos");
+      auto mundo = mundos.CreateElement("mundo");
+      mundo.AddAttribute("nombre", name_);
+      auto append_buzzers = [this](std::string* line, size_t x,
+                                   uint32_t buzzers, bool print_coordinate) {
+        if (print_coordinate) {
+          line->push_back('(');
+          AppendNumber(line, x + 1);
+          line->append(") ");
         }
-      }
-
-      auto programas = resultados.CreateElement("programas");
-      auto programa = programas.CreateElement("programa");
-      programa.AddAttribute("nombre", program_name_);
-      switch (result) {
-        case karel::RunResult::OK:
-          programa.AddAttribute("resultadoEjecucion", "FIN PROGRAMA");
-          break;
-        case karel::RunResult::WALL:
-          programa.AddAttribute("resultadoEjecucion", "MOVIMIENTO INVALIDO");
-          break;
-        case karel::RunResult::WORLDUNDERFLOW:
-          programa.AddAttribute("resultadoEjecucion", "ZUMBADOR INVALIDO MUNDO");
-          break;
-        case karel::RunResult::BAGUNDERFLOW:
-          programa.AddAttribute("resultadoEjecucion", "ZUMBADOR INVALIDO MOCHILA");
-          break;
-        case karel::RunResult::INTEGEROVERFLOW:
-          programa.AddAttribute("resultadoEjecucion", "INTEGER OVERFLOW");
-          break;
-        case karel::RunResult::INTEGERUNDERFLOW:
-          programa.AddAttribute("resultadoEjecucion", "INTEGER UNDERFLOW");
-          break;
-        case karel::RunResult::WORLDOVERFLOW:
-          programa.AddAttribute("resultadoEjecucion", "DEMASIADOS ZUMBADORES (MUNDO)");
-          break;
-        case karel::RunResult::BAGOVERFLOW:
-          programa.AddAttribute("resultadoEjecucion", "DEMASIADOS ZUMBADORES (MOCHILA)");
-          break;
-        case karel::RunResult::INSTRUCTION:
-          programa.AddAttribute("resultadoEjecucion",
-                                "LIMITE DE INSTRUCCIONES GENERAL");
-          break;
-        case karel::RunResult::INSTRUCTION_FORWARD:
-          programa.AddAttribute("resultadoEjecucion",
-                                "LIMITE DE INSTRUCCIONES AVANZA");
-          break;
-        case karel::RunResult::INSTRUCTION_LEFT:
-          programa.AddAttribute("resultadoEjecucion",
-                                "LIMITE DE INSTRUCCIONES IZQUIERDA");
-          break;
-        case karel::RunResult::INSTRUCTION_PICK:
-          programa.AddAttribute("resultadoEjecucion",
-                                "LIMITE DE INSTRUCCIONES COGE_ZUMBADOR");
-          break;
-        case karel::RunResult::INSTRUCTION_LEAVE:
-          programa.AddAttribute("resultadoEjecucion",
-                                "LIMITE DE INSTRUCCIONES DEJA_ZUMBADOR");
-          break;
-        case karel::RunResult::STACK:
-          programa.AddAttribute("resultadoEjecucion", "STACK OVERFLOW");
-          break;
-        case karel::RunResult::STACKMEMORY:
-          programa.AddAttribute("resultadoEjecucion", "LIMITE DE MEMORIA DEL STACK");
-          break;
-        case karel::RunResult::CALLSIZE:
-          programa.AddAttribute("resultadoEjecucion", "LIMITE DE LONGITUD DE LLAMADA");
-          break;
-      }
-      if (dump_position_ || dump_orientation_ || dump_bag_) {
-        auto karel = programa.CreateElement("karel");
-        if (dump_position_) {
-          karel.AddAttribute("x", StringPrintf("%zu", runtime_.x + 1));
-          karel.AddAttribute("y", StringPrintf("%zu", runtime_.y + 1));
+        uint32_t dump_buzzers= buzzers;
+        if (dump_buzzers == karel::kInfinity) {
+          dump_buzzers = 0xFFFF; // Handle infinite as 2^16-1
         }
-        if (dump_orientation_) {
-          switch (runtime_.orientation) {
-            case 0:
-              karel.AddAttribute("direccion", "OESTE");
-              break;
-            case 1:
-              karel.AddAttribute("direccion", "NORTE");
-              break;
-            case 2:
-              karel.AddAttribute("direccion", "ESTE");
-              break;
-            case 3:
-              karel.AddAttribute("direccion", "SUR");
-              break;
-          }
+        if (target_version == "1.0") {
+          dump_buzzers = dump_buzzers & 0xFFFF; //Version 1.0 has a 16-bit output precision on beepers
         }
-        if (dump_bag_) {
-          if (runtime_.bag == karel::kInfinity)
-            karel.AddAttribute("mochila", "INFINITO");
-          else
-            karel.AddAttribute("mochila", StringPrintf("%zu", runtime_.bag));
+        AppendNumber(line, dump_buzzers);
+        line->push_back(' ');
+      };
+      auto add_linea = [&mundo](size_t y, const std::string& line) {
+        auto linea = mundo.CreateElement("linea", line);
+        linea.AddAttribute("fila", y + 1);
+        linea.AddAttribute("compresionDeCeros", "true");
+      };
+
+      // Reused across rows, so that it only grows to fit the longest.
+      std::string line;
+      // Writes the cells in |index|, which is in row-major order, row by
+      // row from the top down. The coordinate is left out right after a
+      // cell with buzzers: the previous dumped cell, or the one to the
+      // left for the whole universe.
+      auto add_lineas = [&](auto cells, const std::vector<size_t>& index) {
+        for (size_t end = index.size(); end > 0;) {
+          const size_t y = index[end - 1] / width_;
+          size_t begin = end - 1;
+          while (begin > 0 && index[begin - 1] / width_ == y)
+            --begin;
+          bool print_coordinate = true;
+          line.clear();
+          for (size_t i = begin; i < end; ++i) {
+            const size_t x = index[i] % width_;
+            const uint32_t buzzers = cells.buzzers(x, y);
+            if (dump_universe_)
+              print_coordinate = x == 0 || cells.buzzers(x - 1, y) == 0;
+            if (buzzers != 0)
+              append_buzzers(&line, x, buzzers, print_coordinate);
+            print_coordinate = buzzers == 0;
+          }
+          if (!line.empty())
+            add_linea(y, line);
+          end = begin;
         }
+      };
+
+      if (!dump_universe_) {
+        VisitCells(runtime_,
+                   [&](auto cells) { add_lineas(cells, dump_index_); });
+      } else if (dirty_ && !dirty_->all()) {
+        // Only the cells that had buzzers before the run or that the run
+        // changed can have buzzers now.
+        std::vector<size_t> changed = dirty_->cells();
+        std::sort(changed.begin(), changed.end());
+        std::vector<size_t> candidates;
+        candidates.reserve(initial_buzzers_.size() + changed.size());
+        std::set_union(initial_buzzers_.begin(), initial_buzzers_.end(),
+                       changed.begin(), changed.end(),
+                       std::back_inserter(candidates));
+        VisitCells(runtime_,
+                   [&](auto cells) { add_lineas(cells, candidates); });
+      } else if (const SparseGrid* sparse = sparse_grid()) {
+        std::vector<size_t> keys;
+        for (const auto& cell : sparse->buzzers())
+          keys.push_back(cell.first);
+        std::sort(keys.begin(), keys.end());
+        VisitCells(runtime_, [&](auto cells) { add_lineas(cells, keys); });
+      } else {
+        VisitCells(runtime_, [&](auto cells) {
+          for (ssize_t y = static_cast<ssize_t>(height_) - 1; y >= 0; y--) {
+            bool printCoordinate = true;
+            line.clear();
+            for (size_t x = 0; x < width_; x++) {
+              if (cells.buzzers(x, y) != 0)
+                append_buzzers(&line, x, cells.buzzers(x, y), printCoordinate);
+              printCoordinate = cells.buzzers(x, y) == 0;
+            }
+
+            if (line.empty())
+              continue;
+
+            add_linea(y, line);
+          }
+        });
       }
-      if (dump_forward_ || dump_left_ || dump_leavebuzzer_ ||
-          dump_pickbuzzer_) {
-        auto instrucciones = programa.CreateElement("instrucciones");
-        if (dump_forward_) {
-          instrucciones.AddAttribute(
-              "avanza", StringPrintf("%zu", runtime_.forward_count));
-        }
-        if (dump_left_) {
-          instrucciones.AddAttribute("gira_izquierda",
-                                     StringPrintf("%zu", runtime_.left_count));
-        }
-        if (dump_pickbuzzer_) {
-          instrucciones.AddAttribute(
-              "coge_zumbador", StringPrintf("%zu", runtime_.pickbuzzer_count));
-        }
-        if (dump_leavebuzzer_) {
-          instrucciones.AddAttribute(
-              "deja_zumbador", StringPrintf("%zu", runtime_.leavebuzzer_count));
+    }
+
+    auto programas = resultados.CreateElement("programas");
+    auto programa = programas.CreateElement("programa");
+    programa.AddAttribute("nombre", program_name_);
+    std::string_view message = karel::RunResultMessage(result);
+    if (!message.empty())
+      programa.AddAttribute("resultadoEjecucion", message);
+    if (dump_position_ || dump_orientation_ || dump_bag_) {
+      auto karel = programa.CreateElement("karel");
+      if (dump_position_) {
+        karel.AddAttribute("x", runtime_.x + 1);
+        karel.AddAttribute("y", runtime_.y + 1);
+      }
+      if (dump_orientation_) {
+        switch (runtime_.orientation) {
+          case 0:
+            karel.AddAttribute("direccion", "OESTE");
+            break;
+          case 1:
+            karel.AddAttribute("direccion", "NORTE");
+            break;
+          case 2:
+            karel.AddAttribute("direccion", "ESTE");
+            break;
+          case 3:
+            karel.AddAttribute("direccion", "SUR");
+            break;
         }
       }
+      if (dump_bag_) {
+        if (runtime_.bag == karel::kInfinity)
+          karel.AddAttribute("mochila", "INFINITO");
+        else
+          karel.AddAttribute("mochila", runtime_.bag);
+      }
+    }
+    if (dump_forward_ || dump_left_ || dump_leavebuzzer_ ||
+        dump_pickbuzzer_) {
+      auto instrucciones = programa.CreateElement("instrucciones");
+      if (dump_forward_) {
+        instrucciones.AddAttribute("avanza", runtime_.forward_count);
+      }
+      if (dump_left_) {
+        instrucciones.AddAttribute("gira_izquierda", runtime_.left_count);
+      }
+      if (dump_pickbuzzer_) {
+        instrucciones.AddAttribute("coge_zumbador",
+                                   runtime_.pickbuzzer_count);
+      }
+      if (dump_leavebuzzer_) {
+        instrucciones.AddAttribute("deja_zumbador",
+                                   runtime_.leavebuzzer_count);
+      }
     }
-    ignore_result(write(STDOUT_FILENO, "\n", 1));
   }
 
   karel::Runtime* World::runtime() { return &runtime_; }
@@ -539,21 +829,310 @@ std::optional<World> World::Parse(int fd) {
     height_ = height;
     name_ = std::string(name);
     program_name_ = "p1";
-    buzzers_ = std::make_unique<uint32_t[]>(width_ * height_);
-    walls_ = std::make_unique<uint8_t[]>(width_ * height_);
-    buzzer_dump_ = std::make_unique<bool[]>(width_ * height_);
+    runtime_.width = width_;
+    runtime_.height = height_;
+    if (automatic_layout_ && width_ * height_ >= kSparseMinCells)
+      layout_ = WorldLayout::SPARSE;
+    initial_buzzers_.clear();
+    buzzers_indexed_ = layout_ != WorldLayout::SPARSE;
+    AllocateCells();
+    AddOuterWalls();
+  }
+
+  void World::AllocateCells() {
+    buzzers_storage_.reset();
+    walls_storage_.reset();
+    buzzer_dump_storage_.reset();
+    grid_.reset();
+    dump_bits_.clear();
+    dump_index_.clear();
+    buzzers_ = nullptr;
+    walls_ = nullptr;
+    buzzer_dump_ = nullptr;
+    switch (layout_) {
+      case WorldLayout::FLAT:
+        buzzers_storage_ = std::make_unique<uint32_t[]>(width_ * height_);
+        walls_storage_ = std::make_unique<uint8_t[]>(width_ * height_);
+        buzzers_ = buzzers_storage_.get();
+        walls_ = walls_storage_.get();
+        break;
+      case WorldLayout::TILED:
+        grid_ = std::make_unique<TiledGrid>(width_, height_);
+        break;
+      case WorldLayout::SPARSE:
+        grid_ = std::make_unique<SparseGrid>(width_, height_);
+        break;
+      case WorldLayout::PACKED:
+        grid_ = std::make_unique<PackedGrid>(width_, height_);
+        break;
+    }
+    if (layout_ == WorldLayout::PACKED) {
+      dump_bits_.assign((width_ * height_ + 63) / 64, 0);
+    } else if (layout_ != WorldLayout::SPARSE) {
+      buzzer_dump_storage_ = std::make_unique<bool[]>(width_ * height_);
+      buzzer_dump_ = buzzer_dump_storage_.get();
+    }
+    runtime_.buzzers = buzzers_;
+    runtime_.walls = walls_;
+    runtime_.grid = grid_.get();
+  }
+
+  void World::AddOuterWalls() {
+    // SPARSE worlds have them without asking.
+    if (layout_ == WorldLayout::SPARSE)
+      return;
     for (size_t x = 0; x < width_; x++) {
-      walls_[coordinates(x, 0)] |= 1 << 0x3;
-      walls_[coordinates(x, height_ - 1)] |= 1 << 0x1;
+      add_walls(x, 0, 1 << 0x3);
+      add_walls(x, height_ - 1, 1 << 0x1);
     }
     for (size_t y = 0; y < height_; y++) {
-      walls_[coordinates(0, y)] |= 1 << 0x0;
-      walls_[coordinates(width_ - 1, y)] |= 1 << 0x2;
+      add_walls(0, y, 1 << 0x0);
+      add_walls(width_ - 1, y, 1 << 0x2);
     }
-    runtime_.width = width_;
-    runtime_.height = height_;
-    runtime_.buzzers = buzzers_.get();
-    runtime_.walls = walls_.get();
   }
 
-}
\ No newline at end of file
+  WorldLayout World::AutomaticLayout() const {
+    const SparseGrid* sparse = sparse_grid();
+    if (!sparse)
+      return layout_;
+    const size_t populated = sparse->buzzers().size() +
+                             sparse->walls().size() + dump_index_.size();
+    return populated * kSparseMaxDensity <= width_ * height_
+               ? WorldLayout::SPARSE
+               : WorldLayout::FLAT;
+  }
+
+  void World::SetLayout(WorldLayout layout) {
+    if (layout == layout_)
+      return;
+    // Keep the old cells alive, whether they are in the heap or in the
+    // snapshot, until they have been copied over.
+    karel::Runtime old_cells = runtime_;
+    auto old_buzzers_storage = std::move(buzzers_storage_);
+    auto old_walls_storage = std::move(walls_storage_);
+    auto old_grid = std::move(grid_);
+    std::vector<size_t> dumped_cells = std::move(dump_index_);
+    layout_ = layout;
+    AllocateCells();
+
+    if (old_grid && old_grid->layout == WorldLayout::SPARSE) {
+      // Only the populated cells need to be looked at.
+      const auto* sparse = static_cast<const SparseGrid*>(old_grid.get());
+      AddOuterWalls();
+      VisitCells(runtime_, [&](auto to) {
+        for (const auto& [key, walls] : sparse->walls())
+          to.set_walls(sparse->x(key), sparse->y(key), walls);
+        for (const auto& [key, buzzers] : sparse->buzzers())
+          to.set_buzzers(sparse->x(key), sparse->y(key), buzzers);
+      });
+    } else {
+      VisitCells(old_cells, [&](auto from) {
+        VisitCells(runtime_, [&](auto to) {
+          for (size_t y = 0; y < height_; ++y) {
+            for (size_t x = 0; x < width_; ++x) {
+              to.set_buzzers(x, y, from.buzzers(x, y));
+              to.set_walls(x, y, from.walls(x, y));
+            }
+          }
+        });
+      });
+    }
+
+    if (layout_ != WorldLayout::SPARSE) {
+      for (size_t i : dumped_cells)
+        set_dumped(i % width_, i / width_);
+    }
+    dump_index_ = std::move(dumped_cells);
+  }
+
+  // static
+  bool World::IsSnapshot(std::string_view data) {
+    return data.size() >= sizeof(kWorldSnapshotMagic) &&
+           memcmp(data.data(), kWorldSnapshotMagic,
+                  sizeof(kWorldSnapshotMagic)) == 0;
+  }
+
+  std::string World::SerializeSnapshot() const {
+    WorldSnapshotHeader header = {};
+    memcpy(header.magic, kWorldSnapshotMagic, sizeof(kWorldSnapshotMagic));
+    header.version = kWorldSnapshotVersion;
+    header.width = width_;
+    header.height = height_;
+    header.orientation = runtime_.orientation;
+    header.x = runtime_.x;
+    header.y = runtime_.y;
+    header.bag = runtime_.bag;
+    header.instruction_limit = runtime_.instruction_limit;
+    header.stack_limit = runtime_.stack_limit;
+    header.stack_memory_limit = runtime_.stack_memory_limit;
+    header.call_param_limit = runtime_.call_param_limit;
+    header.forward_limit = runtime_.forward_limit;
+    header.left_limit = runtime_.left_limit;
+    header.pickbuzzer_limit = runtime_.pickbuzzer_limit;
+    header.leavebuzzer_limit = runtime_.leavebuzzer_limit;
+    const bool dump_flags[] = {
+        dump_world_,   dump_universe_, dump_orientation_,
+        dump_position_, dump_bag_,     dump_forward_,
+        dump_left_,    dump_leavebuzzer_, dump_pickbuzzer_,
+    };
+    for (size_t i = 0; i < std::size(dump_flags); ++i)
+      header.dump_flags |= static_cast<uint32_t>(dump_flags[i]) << i;
+    header.name_size = name_.size();
+    header.program_name_size = program_name_.size();
+    header.target_version_size = target_version.size();
+
+    const size_t cells = width_ * height_;
+    std::string image;
+    image.reserve(sizeof(header) + cells * (sizeof(uint32_t) + 2) +
+                  name_.size() + program_name_.size() + target_version.size());
+    image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (buzzers_) {
+      image.append(reinterpret_cast<const char*>(buzzers_),
+                   cells * sizeof(uint32_t));
+      image.append(reinterpret_cast<const char*>(walls_), cells);
+    } else {
+      // Other layouts are written out cell by cell in row-major order.
+      VisitCells(runtime_, [&](auto cells) {
+        for (size_t y = 0; y < height_; ++y) {
+          for (size_t x = 0; x < width_; ++x) {
+            const uint32_t buzzers = cells.buzzers(x, y);
+            image.append(reinterpret_cast<const char*>(&buzzers),
+                         sizeof(buzzers));
+          }
+        }
+        for (size_t y = 0; y < height_; ++y) {
+          for (size_t x = 0; x < width_; ++x)
+            image.push_back(static_cast<char>(cells.walls(x, y)));
+        }
+      });
+    }
+    if (buzzer_dump_) {
+      image.append(reinterpret_cast<const char*>(buzzer_dump_), cells);
+    } else {
+      const size_t dump_offset = image.size();
+      image.append(cells, '\0');
+      for (size_t i : dump_index_)
+        image[dump_offset + i] = true;
+    }
+    image.append(name_);
+    image.append(program_name_);
+    image.append(target_version);
+    return image;
+  }
+
+  // static
+  std::optional<World> World::LoadSnapshot(ScopedMmap mapping) {
+    if (!mapping)
+      return std::nullopt;
+    std::string_view data(static_cast<const char*>(mapping.get()),
+                          mapping.size());
+    WorldSnapshotHeader header;
+    if (!IsSnapshot(data) || data.size() < sizeof(header)) {
+      LOG(ERROR) << "Not a .kxw file";
+      return std::nullopt;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.version != kWorldSnapshotVersion) {
+      LOG(ERROR) << "Unsupported .kxw version " << header.version;
+      return std::nullopt;
+    }
+    if (header.width == 0 || header.height == 0 ||
+        header.width > std::numeric_limits<uint32_t>::max() ||
+        header.height > std::numeric_limits<uint32_t>::max() ||
+        header.orientation > 3) {
+      LOG(ERROR) << "Invalid .kxw world";
+      return std::nullopt;
+    }
+    // The sizes come from the file, so they are checked one at a time
+    // against what is left of it instead of being added up, which could
+    // overflow.
+    constexpr uint64_t kCellSize = sizeof(uint32_t) + 2;
+    const uint64_t cells = header.width * header.height;
+    uint64_t remaining = data.size() - sizeof(header);
+    bool size_matches = cells <= remaining / kCellSize;
+    if (size_matches)
+      remaining -= cells * kCellSize;
+    for (uint64_t string_size : {header.name_size, header.program_name_size,
+                                 header.target_version_size}) {
+      size_matches = size_matches && string_size <= remaining;
+      if (size_matches)
+        remaining -= string_size;
+    }
+    if (!size_matches || remaining != 0) {
+      LOG(ERROR) << "Wrong .kxw size " << data.size() << " for a "
+                 << header.width << "x" << header.height << " world";
+      return std::nullopt;
+    }
+
+    World world;
+    char* cell_data = static_cast<char*>(mapping.get()) + sizeof(header);
+    world.width_ = header.width;
+    world.height_ = header.height;
+    world.buzzers_ = reinterpret_cast<uint32_t*>(cell_data);
+    world.walls_ =
+        reinterpret_cast<uint8_t*>(cell_data + cells * sizeof(uint32_t));
+    world.buzzer_dump_ = reinterpret_cast<bool*>(
+        cell_data + cells * (sizeof(uint32_t) + 1));
+    world.runtime_.width = world.width_;
+    world.runtime_.height = world.height_;
+    world.runtime_.buzzers = world.buzzers_;
+    world.runtime_.walls = world.walls_;
+    // The cells are not checked, so that they are only paged in when they
+    // are used, with the exception of the outer walls: the runtime relies on
+    // them to stay inside the world.
+    for (size_t x = 0; x < world.width_; ++x) {
+      if (!(world.get_walls(x, 0) & (1 << 3)) ||
+          !(world.get_walls(x, world.height_ - 1) & (1 << 1))) {
+        LOG(ERROR) << "Missing outer wall in .kxw world";
+        return std::nullopt;
+      }
+    }
+    for (size_t y = 0; y < world.height_; ++y) {
+      if (!(world.get_walls(0, y) & (1 << 0)) ||
+          !(world.get_walls(world.width_ - 1, y) & (1 << 2))) {
+        LOG(ERROR) << "Missing outer wall in .kxw world";
+        return std::nullopt;
+      }
+    }
+
+    std::string_view strings = data.substr(data.size() - header.name_size -
+                                           header.program_name_size -
+                                           header.target_version_size);
+    world.name_ = std::string(strings.substr(0, header.name_size));
+    strings.remove_prefix(header.name_size);
+    world.program_name_ =
+        std::string(strings.substr(0, header.program_name_size));
+    strings.remove_prefix(header.program_name_size);
+    world.target_version = std::string(strings);
+
+    bool* const dump_flags[] = {
+        &world.dump_world_,   &world.dump_universe_,
+        &world.dump_orientation_, &world.dump_position_,
+        &world.dump_bag_,     &world.dump_forward_,
+        &world.dump_left_,    &world.dump_leavebuzzer_,
+        &world.dump_pickbuzzer_,
+    };
+    for (size_t i = 0; i < std::size(dump_flags); ++i)
+      *dump_flags[i] = (header.dump_flags >> i) & 1;
+
+    karel::Runtime& runtime = world.runtime_;
+    runtime.orientation = header.orientation;
+    runtime.x = header.x;
+    runtime.y = header.y;
+    runtime.bag = header.bag;
+    runtime.instruction_limit = header.instruction_limit;
+    runtime.stack_limit = header.stack_limit;
+    runtime.stack_memory_limit = header.stack_memory_limit;
+    runtime.call_param_limit = header.call_param_limit;
+    runtime.forward_limit = header.forward_limit;
+    runtime.left_limit = header.left_limit;
+    runtime.pickbuzzer_limit = header.pickbuzzer_limit;
+    runtime.leavebuzzer_limit = header.leavebuzzer_limit;
+    // Unlike the other cells, the dump positions are all read right away, a
+    // byte per cell, to index them.
+    world.IndexDumpedCells();
+    world.snapshot_ = std::move(mapping);
+    return std::make_optional<World>(std::move(world));
+  }
+
+}
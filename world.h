@@ -3,11 +3,63 @@
 
 #include<string_view>
 #include<cstdint>
+#include<vector>
 
 #include "karel.h"
 #include "util.h"
+#include "xml.h"
 
 namespace karel {
+
+    /**
+     * Header of the .kxw binary world snapshot format. A file is laid out as
+     *
+     *   WorldSnapshotHeader
+     *   uint32_t buzzers[width * height]
+     *   uint8_t walls[width * height]
+     *   bool buzzer_dump[width * height]
+     *   the world name, the program name and the target version
+     *
+     * The cells are stored row by row exactly as World keeps them in memory,
+     * so a mapped snapshot is used in place. Everything is in the byte order
+     * of the machine that wrote it, like .kxb files.
+     */
+    struct WorldSnapshotHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t width;
+        uint64_t height;
+        uint64_t orientation;
+        uint64_t x;
+        uint64_t y;
+        uint64_t bag;
+        uint64_t instruction_limit;
+        uint64_t stack_limit;
+        uint64_t stack_memory_limit;
+        uint64_t call_param_limit;
+        uint64_t forward_limit;
+        uint64_t left_limit;
+        uint64_t pickbuzzer_limit;
+        uint64_t leavebuzzer_limit;
+        // One bit per <despliega> type, in the order of World::Dump().
+        uint32_t dump_flags;
+        uint32_t name_size;
+        uint32_t program_name_size;
+        uint32_t target_version_size;
+    };
+
+    // How World::Parse() reads a world.
+    struct WorldOptions {
+        // Size of the reads of worlds that cannot be mapped, like pipes.
+        size_t read_buffer_size = xml::Reader::kDefaultReadBufferSize;
+        // If not empty, XML worlds are converted into .kxw snapshots in this
+        // directory the first time they are seen, and later runs with the
+        // same XML map the snapshot instead.
+        std::string cache_dir;
+        // How the cells are kept in memory while running. If not set, huge
+        // XML worlds with few buzzers and walls are SPARSE and the rest FLAT.
+        std::optional<WorldLayout> layout;
+    };
     
     class World {
         public:
@@ -21,11 +73,35 @@ namespace karel {
 
             uint8_t get_walls(size_t x, size_t y) const ;
 
-            static std::optional<World> Parse(int fd);
+            // Reads a world from |fd|, either XML or a .kxw snapshot.
+            // Regular files are mapped, anything else is read.
+            static std::optional<World> Parse(
+                int fd, const WorldOptions& options = WorldOptions());
+
+            // Returns whether |data| starts like a .kxw snapshot.
+            static bool IsSnapshot(std::string_view data);
+
+            // Takes over the |mapping| of a .kxw snapshot, if it is a valid
+            // one. The mapping has to be copy-on-write, since the buzzers
+            // are changed in place while running.
+            static std::optional<World> LoadSnapshot(ScopedMmap mapping);
+
+            // Serializes the world, as it is right now, into a .kxw image.
+            std::string SerializeSnapshot() const;
+
+            WorldLayout layout() const { return layout_; }
+
+            // Moves the cells into |layout|.
+            void SetLayout(WorldLayout layout);
 
             void Dump(int fd) const;
+            // Same as above, into |sink| instead of a file descriptor.
+            void Dump(xml::Sink* sink) const;
 
             void DumpResult(karel::RunResult result, int fd) const;
+            // Same as above, into |sink|, without the trailing newline on
+            // stdout.
+            void DumpResult(karel::RunResult result, xml::Sink* sink) const;
 
             karel::Runtime* runtime();
 
@@ -34,14 +110,69 @@ namespace karel {
 
             void Init(size_t width, size_t height, std::string_view name);
 
-            size_t width_;
-            size_t height_;
+            // Allocates empty cells for the current size in |layout_|.
+            void AllocateCells();
+
+            void AddOuterWalls();
+
+            // Returns the layout that suits the world as it was parsed.
+            WorldLayout AutomaticLayout() const;
+
+            void add_walls(size_t x, size_t y, uint8_t walls);
+
+            // The bodies of Dump() and DumpResult().
+            void WriteWorld(xml::Writer* writer) const;
+            void WriteResult(karel::RunResult result,
+                             xml::Writer* writer) const;
+
+            // The cells of a SPARSE world, or nullptr.
+            const SparseGrid* sparse_grid() const;
+
+            void set_dumped(size_t x, size_t y);
+            // Fills |dump_index_| once all the <posicionDump> cells are set.
+            void IndexDumpedCells();
+            // Tracks the cells that runs change, when that spares
+            // DumpResult() a scan of the whole world.
+            void TrackDirtyCells();
+
+            // Applies one element of the world XML, an xml::Reader::Element or
+            // an xml::Scanner::Element.
+            template <typename Element>
+            bool ParseElement(const Element& node);
+
+            size_t width_ = 0;
+            size_t height_ = 0;
             std::string name_;
             std::string program_name_;
             std::string target_version;
-            std::unique_ptr<uint32_t[]> buzzers_;
-            std::unique_ptr<uint8_t[]> walls_;
-            std::unique_ptr<bool[]> buzzer_dump_;
+            WorldLayout layout_ = WorldLayout::FLAT;
+            bool automatic_layout_ = false;
+            // FLAT cells live either in the storage arrays below or in
+            // |snapshot_|, the rest in |grid_|.
+            uint32_t* buzzers_ = nullptr;
+            uint8_t* walls_ = nullptr;
+            bool* buzzer_dump_ = nullptr;
+            std::unique_ptr<uint32_t[]> buzzers_storage_;
+            std::unique_ptr<uint8_t[]> walls_storage_;
+            std::unique_ptr<bool[]> buzzer_dump_storage_;
+            ScopedMmap snapshot_;
+            std::unique_ptr<Grid> grid_;
+            // The <posicionDump> cells of PACKED worlds, one bit each,
+            // instead of |buzzer_dump_|.
+            std::vector<uint64_t> dump_bits_;
+            // The coordinates() of all the <posicionDump> cells in row-major
+            // order, so that the dumps visit just those, row by row. SPARSE
+            // worlds keep no other record of them, and append them here
+            // while they are read.
+            std::vector<size_t> dump_index_;
+            // The coordinates() of the cells that had buzzers when the world
+            // was read, in row-major order once TrackDirtyCells() has sorted
+            // them. Only kept while
+            // |buzzers_indexed_|, which is not the case for SPARSE worlds,
+            // snapshots, or worlds with too many buzzers for it to pay off.
+            std::vector<size_t> initial_buzzers_;
+            bool buzzers_indexed_ = false;
+            std::unique_ptr<karel::DirtyCells> dirty_;
             bool dump_world_ = false;
             bool dump_universe_ = false;
             bool dump_position_ = false;
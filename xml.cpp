@@ -2,7 +2,13 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include <expat.h>
 
@@ -11,23 +17,218 @@
 
 namespace xml {
 
-Buffer::Buffer(int fd) : fd_(fd), buffer_(std::make_unique<char[]>(8192)) {}
+namespace {
+
+bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool IsNameStartChar(char c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_' ||
+         c == ':';
+}
+
+bool IsNameChar(char c) {
+  return IsNameStartChar(c) || ('0' <= c && c <= '9') || c == '-' || c == '.';
+}
+
+// Whether |c| may appear in a document that Scanner takes: printable ASCII
+// and whitespace, except for '&', since references are not decoded.
+bool IsScannableChar(char c) {
+  return (c >= 0x20 && c != '&' && c != 0x7f) || c == '\t' || c == '\n' ||
+         c == '\r';
+}
+
+// The primitives that Scanner is built on, in each instruction set.
+struct ScanFunctions {
+  const char* instruction_set;
+  // Returns whether every byte in [begin, end) is IsScannableChar().
+  bool (*is_scannable)(const char* begin, const char* end);
+  // Returns the first |a| or |b| in [begin, end), or |end|.
+  const char* (*find)(const char* begin, const char* end, char a, char b);
+};
+
+bool IsScannableScalar(const char* begin, const char* end) {
+  for (; begin != end; ++begin) {
+    if (!IsScannableChar(*begin))
+      return false;
+  }
+  return true;
+}
+
+const char* FindScalar(const char* begin, const char* end, char a, char b) {
+  for (; begin != end; ++begin) {
+    if (*begin == a || *begin == b)
+      break;
+  }
+  return begin;
+}
+
+#if defined(__SSE2__)
+
+bool IsScannableSSE2(const char* begin, const char* end) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i carriage_return = _mm_set1_epi8('\r');
+  const __m128i ampersand = _mm_set1_epi8('&');
+  const __m128i del = _mm_set1_epi8(0x7f);
+  for (; end - begin >= 16; begin += 16) {
+    const __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    // Bytes from 0x80 up are negative, so they are below ' ' too.
+    const __m128i control = _mm_cmplt_epi8(bytes, space);
+    const __m128i whitespace = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, tab),
+                     _mm_cmpeq_epi8(bytes, newline)),
+        _mm_cmpeq_epi8(bytes, carriage_return));
+    const __m128i invalid = _mm_or_si128(
+        _mm_andnot_si128(whitespace, control),
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, ampersand),
+                     _mm_cmpeq_epi8(bytes, del)));
+    if (_mm_movemask_epi8(invalid))
+      return false;
+  }
+  return IsScannableScalar(begin, end);
+}
+
+const char* FindSSE2(const char* begin, const char* end, char a, char b) {
+  const __m128i first = _mm_set1_epi8(a);
+  const __m128i second = _mm_set1_epi8(b);
+  for (; end - begin >= 16; begin += 16) {
+    const __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    const int mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(bytes, first), _mm_cmpeq_epi8(bytes, second)));
+    if (mask)
+      return begin + __builtin_ctz(mask);
+  }
+  return FindScalar(begin, end, a, b);
+}
+
+#endif  // defined(__SSE2__)
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2"))) bool IsScannableAVX2(const char* begin,
+                                                     const char* end) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i carriage_return = _mm256_set1_epi8('\r');
+  const __m256i ampersand = _mm256_set1_epi8('&');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  for (; end - begin >= 32; begin += 32) {
+    const __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    const __m256i control = _mm256_cmpgt_epi8(space, bytes);
+    const __m256i whitespace = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, tab),
+                        _mm256_cmpeq_epi8(bytes, newline)),
+        _mm256_cmpeq_epi8(bytes, carriage_return));
+    const __m256i invalid = _mm256_or_si256(
+        _mm256_andnot_si256(whitespace, control),
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, ampersand),
+                        _mm256_cmpeq_epi8(bytes, del)));
+    if (_mm256_movemask_epi8(invalid))
+      return false;
+  }
+  return IsScannableSSE2(begin, end);
+}
+
+__attribute__((target("avx2"))) const char* FindAVX2(const char* begin,
+                                                    const char* end,
+                                                    char a,
+                                                    char b) {
+  const __m256i first = _mm256_set1_epi8(a);
+  const __m256i second = _mm256_set1_epi8(b);
+  for (; end - begin >= 32; begin += 32) {
+    const __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    const uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(bytes, first), _mm256_cmpeq_epi8(bytes, second)));
+    if (mask)
+      return begin + __builtin_ctz(mask);
+  }
+  return FindSSE2(begin, end, a, b);
+}
+
+#endif  // defined(__x86_64__)
+
+const ScanFunctions& GetScanFunctions() {
+  static const ScanFunctions functions = []() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+      return ScanFunctions{"avx2", &IsScannableAVX2, &FindAVX2};
+#endif
+#if defined(__SSE2__)
+    return ScanFunctions{"sse2", &IsScannableSSE2, &FindSSE2};
+#else
+    return ScanFunctions{"scalar", &IsScannableScalar, &FindScalar};
+#endif
+  }();
+  return functions;
+}
+
+// Returns the XML name at |*ptr| and moves past it, or returns an empty
+// string if there is none.
+std::string_view ScanName(const char** ptr, const char* const end) {
+  const char* name_begin = *ptr;
+  if (*ptr == end || !IsNameStartChar(**ptr))
+    return std::string_view();
+  for (++(*ptr); *ptr != end && IsNameChar(**ptr); ++(*ptr)) {
+  }
+  return std::string_view(name_begin, *ptr - name_begin);
+}
+
+void SkipSpaces(const char** ptr, const char* const end) {
+  while (*ptr != end && IsSpace(**ptr))
+    ++(*ptr);
+}
+
+}  // namespace
+
+Buffer::Buffer(int fd)
+    : fd_(fd), buffer_(std::make_unique<char[]>(kCapacity)) {}
+Buffer::Buffer(Sink* sink)
+    : fd_(-1), sink_(sink), buffer_(std::make_unique<char[]>(kCapacity)) {}
 Buffer::Buffer(Buffer&& other)
     : fd_(-1), buffer_(std::move(other.buffer_)), size_(other.size_) {
   std::swap(fd_, other.fd_);
+  std::swap(sink_, other.sink_);
 }
 Buffer::~Buffer() {
-  if (fd_ == -1)
+  if (fd_ == -1 && !sink_)
     return;
   Flush();
 }
 
 void Buffer::Flush() {
-  WriteFileDescriptor(fd_, std::string_view(buffer_.get(), size_));
+  if (sink_)
+    sink_->Write(std::string_view(buffer_.get(), size_));
+  else
+    WriteFileDescriptor(fd_, std::string_view(buffer_.get(), size_));
+  size_ = 0;
+}
+
+void Buffer::AddLong(std::string_view str) {
+  if (str.size() < kCapacity / 2) {
+    Flush();
+    memcpy(buffer_.get(), str.data(), str.size());
+    size_ = str.size();
+    return;
+  }
+  if (sink_) {
+    sink_->Write(std::string_view(buffer_.get(), size_));
+    sink_->Write(str);
+  } else {
+    WriteFileDescriptor(fd_, std::string_view(buffer_.get(), size_), str);
+  }
   size_ = 0;
 }
 
 Writer::Writer(int fd) : buffer_{fd} {}
+Writer::Writer(Sink* sink) : buffer_{sink} {}
 Writer::~Writer() = default;
 
 Writer::Element Writer::CreateElement(std::string_view name,
@@ -38,19 +239,20 @@ Writer::Element Writer::CreateElement(std::string_view name,
 Writer::Element::Element(Writer* writer,
                          std::string_view name,
                          std::optional<std::string_view> content)
-    : writer_(writer), name_(name), depth_(writer_->PushDepth()) {
-  if (content)
-    content_ = std::string(content.value());
+    : writer_(writer),
+      name_(name),
+      depth_(writer_->PushDepth()),
+      content_(content) {
   for (size_t i = 0; i < depth_; ++i)
     writer_->buffer_.Add('\t');
   writer_->buffer_.Add('<');
   writer_->buffer_.Add(name_);
 }
 Writer::Element::Element(Writer::Element&& other)
-    : name_(std::move(other.name_)),
+    : name_(other.name_),
       depth_(other.depth_),
       open_(other.open_),
-      content_(std::move(other.content_)) {
+      content_(other.content_) {
   std::swap(writer_, other.writer_);
 }
 Writer::Element::~Element() {
@@ -90,11 +292,15 @@ void Writer::Element::AddAttribute(std::string_view name,
                                    std::string_view value) {
   if (!open_)
     return;
+  StartAttribute(name);
+  writer_->buffer_.Add(value);
+  writer_->buffer_.Add('"');
+}
+
+void Writer::Element::StartAttribute(std::string_view name) {
   writer_->buffer_.Add(' ');
   writer_->buffer_.Add(name);
   writer_->buffer_.Add("=\"");
-  writer_->buffer_.Add(value);
-  writer_->buffer_.Add('"');
 }
 
 size_t Writer::PushDepth() {
@@ -104,31 +310,55 @@ void Writer::PopDepth() {
   --depth_;
 }
 
-Reader::Reader() = default;
+Reader::Reader(size_t read_buffer_size)
+    : read_buffer_size_(std::clamp<size_t>(
+          read_buffer_size, 1, std::numeric_limits<int>::max())) {}
 Reader::~Reader() = default;
 
-bool Reader::Parse(int fd, ParseCallback callback) {
-  char buffer[4096];
-  ssize_t bytes_read;
-
-  State state{true, std::move(callback)};
-
+bool Reader::Parse(int fd,
+                   std::string_view document,
+                   StateBase* state,
+                   StartHandler start_handler) {
   XML_Parser parser = XML_ParserCreate(nullptr);
   if (!parser)
     return false;
-  XML_SetUserData(parser, &state);
-  XML_SetElementHandler(parser, &Reader::StartElementHandler,
-                        &Reader::EndElementHandler);
-
-  while (state.success && (bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
-    if (XML_Parse(parser, buffer, bytes_read, false) == XML_STATUS_ERROR) {
-      LOG(ERROR) << "Parse error at line " << XML_GetCurrentLineNumber(parser)
-                 << ": " << XML_ErrorString(XML_GetErrorCode(parser));
+  state->parser = parser;
+  failed_ = false;
+  XML_SetUserData(parser, state);
+  XML_SetElementHandler(parser, start_handler, &Reader::EndElementHandler);
+
+  // The document is read or copied straight into the buffer of expat, one
+  // large piece at a time. Errors are sticky in expat, so parsing ends at the
+  // first one.
+  bool done = false;
+  while (state->success && !done) {
+    void* buffer = XML_GetBuffer(parser, read_buffer_size_);
+    if (!buffer) {
+      failed_ = true;
+      LOG(ERROR) << "Parse error: "
+                 << XML_ErrorString(XML_GetErrorCode(parser));
+      break;
+    }
+    size_t size;
+    if (fd == -1) {
+      size = std::min(document.size(), read_buffer_size_);
+      memcpy(buffer, document.data(), size);
+      document.remove_prefix(size);
+      done = document.empty();
+    } else {
+      ssize_t bytes_read = read(fd, buffer, read_buffer_size_);
+      size = std::max<ssize_t>(bytes_read, 0);
+      done = bytes_read <= 0;
+    }
+    if (XML_ParseBuffer(parser, size, done) == XML_STATUS_ERROR) {
+      if (state->success) {
+        failed_ = true;
+        LOG(ERROR) << "Parse error at line "
+                   << XML_GetCurrentLineNumber(parser) << ": "
+                   << XML_ErrorString(XML_GetErrorCode(parser));
+      }
+      break;
     }
-  }
-  if (state.success && XML_Parse(parser, buffer, 0, true) == XML_STATUS_ERROR) {
-    LOG(ERROR) << "Parse error at line " << XML_GetCurrentLineNumber(parser)
-               << ": " << XML_ErrorString(XML_GetErrorCode(parser));
   }
 
   XML_ParserFree(parser);
@@ -136,28 +366,26 @@ bool Reader::Parse(int fd, ParseCallback callback) {
 }
 
 // static
-void Reader::StartElementHandler(void* user_data,
-                                 const char* name,
-                                 const char** attrs) {
-  State& state = *reinterpret_cast<State*>(user_data);
-  state.success &= state.callback(Element(name, attrs));
-}
+void Reader::EndElementHandler(void* user_data, const char* name) {}
 
 // static
-void Reader::EndElementHandler(void* user_data, const char* name) {}
+void Reader::Stop(StateBase* state) {
+  state->success = false;
+  XML_StopParser(static_cast<XML_Parser>(state->parser), XML_FALSE);
+}
 
 Reader::Element::Element(const char* name, const char** attrs)
     : name_(name), attrs_(attrs) {}
 Reader::Element::Element(Element&&) = default;
 Reader::Element::~Element() = default;
 
-std::string_view Reader::Element::GetName() {
+std::string_view Reader::Element::GetName() const {
   return name_;
 }
 
 std::optional<std::string_view> Reader::Element::GetAttribute(
     std::string_view name,
-    bool required) {
+    bool required) const {
   for (size_t i = 0; attrs_[i]; i += 2) {
     if (name == attrs_[i])
       return std::make_optional<std::string_view>(attrs_[i + 1]);
@@ -167,4 +395,125 @@ std::optional<std::string_view> Reader::Element::GetAttribute(
   return std::nullopt;
 }
 
+std::optional<std::string_view> Scanner::Element::GetAttribute(
+    std::string_view name,
+    bool required) const {
+  for (size_t i = 0; i < attribute_count_; ++i) {
+    if (name == attributes_[i].name)
+      return attributes_[i].value;
+  }
+  if (required)
+    LOG(ERROR) << "Failed to find " << name;
+  return std::nullopt;
+}
+
+// static
+const char* Scanner::InstructionSet() {
+  return GetScanFunctions().instruction_set;
+}
+
+// static
+bool Scanner::Scan(std::string_view document,
+                   void* user_data,
+                   ElementHandler handler) {
+  const ScanFunctions& functions = GetScanFunctions();
+  const char* ptr = document.data();
+  const char* const end = ptr + document.size();
+  if (!functions.is_scannable(ptr, end))
+    return false;
+
+  std::vector<std::string_view> open_elements;
+  bool seen_root = false;
+  Element element;
+  while (true) {
+    // Only whitespace may come before the next tag.
+    const char* tag = functions.find(ptr, end, '<', '<');
+    for (; ptr != tag; ++ptr) {
+      if (!IsSpace(*ptr))
+        return false;
+    }
+    if (ptr == end)
+      break;
+    if (++ptr == end)
+      return false;
+
+    if (*ptr == '/') {
+      ++ptr;
+      std::string_view name = ScanName(&ptr, end);
+      SkipSpaces(&ptr, end);
+      if (ptr == end || *ptr != '>' || open_elements.empty() ||
+          open_elements.back() != name) {
+        return false;
+      }
+      ++ptr;
+      open_elements.pop_back();
+      continue;
+    }
+
+    // Declarations, comments and a second root element are all left to
+    // Reader.
+    if (seen_root && open_elements.empty())
+      return false;
+    element.name_ = ScanName(&ptr, end);
+    if (element.name_.empty())
+      return false;
+    element.attribute_count_ = 0;
+    while (true) {
+      const char* attribute_begin = ptr;
+      SkipSpaces(&ptr, end);
+      if (ptr == end)
+        return false;
+      if (*ptr == '>') {
+        ++ptr;
+        open_elements.push_back(element.name_);
+        break;
+      }
+      if (*ptr == '/') {
+        if (++ptr == end || *ptr != '>')
+          return false;
+        ++ptr;
+        break;
+      }
+      // Attributes must be separated by whitespace.
+      if (ptr == attribute_begin ||
+          element.attribute_count_ == kMaxAttributes) {
+        return false;
+      }
+      Element::Attribute& attribute =
+          element.attributes_[element.attribute_count_];
+      attribute.name = ScanName(&ptr, end);
+      if (attribute.name.empty())
+        return false;
+      SkipSpaces(&ptr, end);
+      if (ptr == end || *ptr != '=')
+        return false;
+      ++ptr;
+      SkipSpaces(&ptr, end);
+      if (ptr == end || (*ptr != '"' && *ptr != '\''))
+        return false;
+      const char quote = *ptr++;
+      const char* value_end = functions.find(ptr, end, quote, '<');
+      if (value_end == end || *value_end != quote)
+        return false;
+      attribute.value = std::string_view(ptr, value_end - ptr);
+      ptr = value_end + 1;
+      // Reader would turn whitespace other than spaces into spaces.
+      for (char c : attribute.value) {
+        if (IsSpace(c) && c != ' ')
+          return false;
+      }
+      for (size_t i = 0; i < element.attribute_count_; ++i) {
+        if (element.attributes_[i].name == attribute.name)
+          return false;
+      }
+      ++element.attribute_count_;
+    }
+
+    seen_root = true;
+    if (!handler(user_data, element))
+      return true;
+  }
+  return seen_root && open_elements.empty();
+}
+
 }  // namespace xml
@@ -1,40 +1,73 @@
 #ifndef XML_H_
 #define XML_H_
 
+#include <array>
+#include <charconv>
 #include <cstring>
-#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <vector>
 
 #include "macros.h"
 
 namespace xml {
 
+/** Takes the output of a Buffer instead of a file descriptor. */
+class Sink {
+ public:
+  virtual ~Sink() = default;
+  virtual void Write(std::string_view data) = 0;
+};
+
+/**
+ * Collects output in a large buffer that is written out when it fills up.
+ * Strings too long to be worth copying go out together with the buffer in a
+ * single writev().
+ */
 class Buffer {
  public:
+  static constexpr size_t kCapacity = 1 << 16;
+
   explicit Buffer(int fd);
+  explicit Buffer(Sink* sink);
   Buffer(Buffer&& other);
   ~Buffer();
 
   void Add(char c) {
-    buffer_[size_++] = c;
-    if (Full())
+    if (size_ == kCapacity)
       Flush();
+    buffer_[size_++] = c;
   }
   void Add(std::string_view str) {
+    if (str.size() > kCapacity - size_) {
+      AddLong(str);
+      return;
+    }
     memcpy(buffer_.get() + size_, str.data(), str.size());
     size_ += str.size();
-    if (Full())
+  }
+  /** Adds |value| in decimal, formatted right into the buffer. */
+  template <typename T>
+  void AddNumber(T value) {
+    static_assert(std::is_integral<T>::value, "Only integers are supported");
+    // Enough for any 64-bit integer and its sign.
+    constexpr size_t kMaxDigits = 20;
+    if (kCapacity - size_ < kMaxDigits)
       Flush();
+    size_ = std::to_chars(buffer_.get() + size_, buffer_.get() + kCapacity,
+                          value).ptr -
+            buffer_.get();
   }
   void Flush();
 
  private:
-  bool Full() const { return size_ > 4096; }
+  void AddLong(std::string_view str);
+
   int fd_;
+  Sink* sink_ = nullptr;
   std::unique_ptr<char[]> buffer_;
   size_t size_ = 0;
   DISALLOW_COPY_AND_ASSIGN(Buffer);
@@ -43,8 +76,13 @@ class Buffer {
 class Writer {
  public:
   Writer(int fd);
+  explicit Writer(Sink* sink);
   ~Writer();
 
+  /**
+   * An element that is written out as it is built. Nothing is copied, so
+   * |name| and |content| must outlive the element.
+   */
   class Element {
    public:
     Element(Element&&);
@@ -54,6 +92,15 @@ class Writer {
         std::string_view name,
         std::optional<std::string_view> content = std::nullopt);
     void AddAttribute(std::string_view name, std::string_view value);
+    template <typename T,
+              typename = std::enable_if_t<std::is_integral<T>::value>>
+    void AddAttribute(std::string_view name, T value) {
+      if (!open_)
+        return;
+      StartAttribute(name);
+      writer_->buffer_.AddNumber(value);
+      writer_->buffer_.Add('"');
+    }
 
    private:
     friend class Writer;
@@ -61,11 +108,13 @@ class Writer {
             std::string_view name,
             std::optional<std::string_view> content);
 
+    void StartAttribute(std::string_view name);
+
     Writer* writer_ = nullptr;
-    std::string name_;
+    std::string_view name_;
     size_t depth_;
     bool open_ = true;
-    std::optional<std::string> content_;
+    std::optional<std::string_view> content_;
     DISALLOW_COPY_AND_ASSIGN(Element);
   };
 
@@ -86,7 +135,12 @@ class Writer {
 
 class Reader {
  public:
-  Reader();
+  // Documents are handed to expat in pieces of this size by default, which
+  // keeps the number of read() calls and expat invocations low without
+  // holding large files in memory twice.
+  static constexpr size_t kDefaultReadBufferSize = 1 << 20;
+
+  explicit Reader(size_t read_buffer_size = kDefaultReadBufferSize);
   ~Reader();
 
   class Element {
@@ -94,9 +148,29 @@ class Reader {
     ~Element();
     Element(Element&&);
 
-    std::string_view GetName();
+    std::string_view GetName() const;
     std::optional<std::string_view> GetAttribute(std::string_view name,
-                                                 bool required = false);
+                                                 bool required = false) const;
+
+    /**
+     * Looks up all of |names| in a single pass over the attributes, and
+     * returns their values in the same order.
+     */
+    template <size_t N>
+    std::array<std::optional<std::string_view>, N> GetAttributes(
+        const std::string_view (&names)[N]) const {
+      std::array<std::optional<std::string_view>, N> values;
+      for (size_t i = 0; attrs_[i]; i += 2) {
+        const std::string_view name(attrs_[i]);
+        for (size_t j = 0; j < N; ++j) {
+          if (names[j] == name) {
+            values[j] = attrs_[i + 1];
+            break;
+          }
+        }
+      }
+      return values;
+    }
 
    private:
     friend class Reader;
@@ -108,23 +182,154 @@ class Reader {
     DISALLOW_COPY_AND_ASSIGN(Element);
   };
 
-  using ParseCallback = std::function<bool(Element element)>;
-  bool Parse(int fd, ParseCallback callback);
+  /**
+   * Calls |callback| with each element of the document in |fd|, as
+   * bool(const Element& element), and stops right away once it returns false.
+   */
+  template <typename Callback>
+  bool Parse(int fd, Callback&& callback) {
+    State<std::remove_reference_t<Callback>> state;
+    state.callback = &callback;
+    return Parse(fd, std::string_view(), &state,
+                 &Reader::StartElementHandler<std::remove_reference_t<Callback>>);
+  }
+
+  /**
+   * Same as above, for a document that is already in memory, such as a
+   * mapped file.
+   */
+  template <typename Callback>
+  bool Parse(std::string_view document, Callback&& callback) {
+    State<std::remove_reference_t<Callback>> state;
+    state.callback = &callback;
+    return Parse(-1, document, &state,
+                 &Reader::StartElementHandler<std::remove_reference_t<Callback>>);
+  }
+
+  /** Returns whether the last Parse() ran into malformed XML. */
+  bool failed() const { return failed_; }
 
  private:
-  struct State {
+  struct StateBase {
     bool success = true;
-    ParseCallback callback;
+    // The XML_Parser, to stop it when the callback fails.
+    void* parser = nullptr;
+  };
+
+  template <typename Callback>
+  struct State : StateBase {
+    Callback* callback;
   };
 
+  using StartHandler = void (*)(void* user_data,
+                                const char* name,
+                                const char** attrs);
+
+  // Parses |document|, or the contents of |fd| if it is not -1. |state| is
+  // the user data that is passed to |start_handler|.
+  bool Parse(int fd,
+             std::string_view document,
+             StateBase* state,
+             StartHandler start_handler);
+
+  template <typename Callback>
   static void StartElementHandler(void* user_data,
                                   const char* name,
-                                  const char** attrs);
+                                  const char** attrs) {
+    auto& state =
+        *static_cast<State<Callback>*>(static_cast<StateBase*>(user_data));
+    if (!(*state.callback)(Element(name, attrs)))
+      Stop(&state);
+  }
   static void EndElementHandler(void* user_data, const char* name);
+  static void Stop(StateBase* state);
+
+  const size_t read_buffer_size_;
+  bool failed_ = false;
 
   DISALLOW_COPY_AND_ASSIGN(Reader);
 };
 
+/**
+ * A fast reader for the subset of XML that world files are written in: ASCII
+ * only, with no declarations, comments, CDATA sections or references, and
+ * nothing but whitespace outside of the tags. The document is checked against
+ * that subset with SSE2 or AVX2, whichever the CPU has, and the tags and
+ * attribute values are then found with the same instructions.
+ *
+ * Scan() returns false as soon as the document strays from the subset, after
+ * having called the callback for some of its elements, so the caller has to
+ * throw away what it built and start over with Reader, which handles all of
+ * XML. Anything that Scan() accepts, Reader reports in the same way.
+ */
+class Scanner {
+ public:
+  // The most attributes that an element may have.
+  static constexpr size_t kMaxAttributes = 16;
+
+  class Element {
+   public:
+    std::string_view GetName() const { return name_; }
+    std::optional<std::string_view> GetAttribute(std::string_view name,
+                                                 bool required = false) const;
+
+    /** Same as Reader::Element::GetAttributes(). */
+    template <size_t N>
+    std::array<std::optional<std::string_view>, N> GetAttributes(
+        const std::string_view (&names)[N]) const {
+      std::array<std::optional<std::string_view>, N> values;
+      for (size_t i = 0; i < attribute_count_; ++i) {
+        for (size_t j = 0; j < N; ++j) {
+          if (names[j] == attributes_[i].name) {
+            values[j] = attributes_[i].value;
+            break;
+          }
+        }
+      }
+      return values;
+    }
+
+   private:
+    friend class Scanner;
+
+    struct Attribute {
+      std::string_view name;
+      std::string_view value;
+    };
+
+    std::string_view name_;
+    std::array<Attribute, kMaxAttributes> attributes_;
+    size_t attribute_count_ = 0;
+  };
+
+  /**
+   * Calls |callback| with each element of |document|, as
+   * bool(const Element& element), and stops right away once it returns
+   * false, just like Reader::Parse(). Returns false if |document| is not
+   * in the subset.
+   */
+  template <typename Callback>
+  static bool Scan(std::string_view document, Callback&& callback) {
+    return Scan(document, &callback,
+                [](void* user_data, const Element& element) {
+                  return (*static_cast<std::remove_reference_t<Callback>*>(
+                      user_data))(element);
+                });
+  }
+
+  /** Returns the instruction set that Scan() uses on this CPU. */
+  static const char* InstructionSet();
+
+ private:
+  using ElementHandler = bool (*)(void* user_data, const Element& element);
+
+  static bool Scan(std::string_view document,
+                   void* user_data,
+                   ElementHandler handler);
+
+  Scanner() = delete;
+};
+
 }  // namespace xml
 
 #endif // XML_H_
\ No newline at end of file